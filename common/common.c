@@ -6,6 +6,7 @@
 
 #include "common.h"
 #include "alloc.h"
+#include "compression.h"
 #include "configvar.h"
 #include "filesystem.h"
 
@@ -67,6 +68,17 @@ static VOID ParseVariables(_In_ PCHAR *Arguments, _In_ UINT ArgumentCount)
 }
 
 static PAS_MUTEX LogMutex;
+static FILE *BinaryLogFile;
+static FILE *JsonLogFile;
+
+// Lets one part of the engine log more or less than the rest, empty means it
+// uses the normal levels
+static PCSTR ChannelLevelVariables[LogChannelCount] = {
+    [LogChannelGeneral] = "log_level_general", [LogChannelPlatform] = "log_level_platform",
+    [LogChannelAsync] = "log_level_async",     [LogChannelVideo] = "log_level_video",
+    [LogChannelConfig] = "log_level_config",   [LogChannelFs] = "log_level_fs",
+    [LogChannelPack] = "log_level_pack",
+};
 
 VOID CmnInitialize(_In_opt_ PCHAR *Arguments, _In_opt_ UINT ArgumentCount)
 {
@@ -95,6 +107,18 @@ VOID CmnInitialize(_In_opt_ PCHAR *Arguments, _In_opt_ UINT ArgumentCount)
     LogSetLock(LogLock, LogMutex);
 
     CONFIGVAR_DEFINE_BOOLEAN("verbose", FALSE, TRUE, ConfigVarSideBoth, FALSE, FALSE);
+    CONFIGVAR_DEFINE_BOOLEAN("fs_trace_packs", FALSE, TRUE, ConfigVarSideBoth, FALSE, FALSE);
+    CONFIGVAR_DEFINE_BOOLEAN("log_async", FALSE, TRUE, ConfigVarSideBoth, FALSE, FALSE);
+    CONFIGVAR_DEFINE_BOOLEAN("log_drop", FALSE, TRUE, ConfigVarSideBoth, FALSE, FALSE);
+    CONFIGVAR_DEFINE_STRING("log_binary", "", TRUE, ConfigVarSideBoth, FALSE, FALSE);
+    CONFIGVAR_DEFINE_BOOLEAN("log_coalesce", TRUE, TRUE, ConfigVarSideBoth, FALSE, FALSE);
+    CONFIGVAR_DEFINE_INT("log_rate_limit", 0, TRUE, ConfigVarSideBoth, FALSE, FALSE);
+    CONFIGVAR_DEFINE_INT("log_rate_burst", 0, TRUE, ConfigVarSideBoth, FALSE, FALSE);
+    CONFIGVAR_DEFINE_STRING("log_json", "", TRUE, ConfigVarSideBoth, FALSE, FALSE);
+    for (UINT32 i = 0; i < LogChannelCount; i++)
+    {
+        CONFIGVAR_DEFINE_STRING(ChannelLevelVariables[i], "", TRUE, ConfigVarSideBoth, FALSE, FALSE);
+    }
 
     if (ArgumentCount > 1 && Arguments)
     {
@@ -118,6 +142,68 @@ VOID CmnInitialize(_In_opt_ PCHAR *Arguments, _In_opt_ UINT ArgumentCount)
 #endif
     LogSetLevel(Level);
 
+    for (UINT32 i = 0; i < LogChannelCount; i++)
+    {
+        PCSTR ChannelLevelName = CONFIGVAR_GET_STRING(ChannelLevelVariables[i]);
+        LOG_LEVEL ChannelLevel;
+        if (!ChannelLevelName || strlen(ChannelLevelName) < 1)
+        {
+            continue;
+        }
+
+        if (LogParseLevel(ChannelLevelName, &ChannelLevel))
+        {
+            LogSetChannelLevel(i, ChannelLevel);
+        }
+        else
+        {
+            LogWarning("Ignoring unknown level %s for log channel %s", ChannelLevelName, LogGetChannelName(i));
+        }
+    }
+
+    // Binary logs skip formatting entirely, devtools/logtool turns them into text
+    PCSTR BinaryLogPath = CONFIGVAR_GET_STRING("log_binary");
+    if (BinaryLogPath && strlen(BinaryLogPath) > 0)
+    {
+        BinaryLogFile = fopen(BinaryLogPath, "wb");
+        if (BinaryLogFile)
+        {
+            LogSetBinaryFile(BinaryLogFile, Level);
+        }
+        else
+        {
+            LogError("Failed to open binary log %s: %s", BinaryLogPath, strerror(errno));
+        }
+    }
+
+    // One JSON object per line, for log pipelines that shouldn't have to parse text
+    PCSTR JsonLogPath = CONFIGVAR_GET_STRING("log_json");
+    if (JsonLogPath && strlen(JsonLogPath) > 0)
+    {
+        JsonLogFile = fopen(JsonLogPath, "wb");
+        if (JsonLogFile)
+        {
+            LogAddJsonFile(JsonLogFile, Level);
+        }
+        else
+        {
+            LogError("Failed to open JSON log %s: %s", JsonLogPath, strerror(errno));
+        }
+    }
+
+    // Keeps a message logged in a loop from drowning out everything else, the
+    // rate limit is per place that logs and the burst defaults to a second's worth
+    LogSetCoalescing(CONFIGVAR_GET_BOOLEAN("log_coalesce"));
+    INT64 RateLimit = PURPL_MAX(CONFIGVAR_GET_INT("log_rate_limit"), 0);
+    INT64 RateBurst = CONFIGVAR_GET_INT("log_rate_burst");
+    LogSetRateLimit((UINT32)RateLimit, (UINT32)(RateBurst > 0 ? RateBurst : RateLimit));
+
+    // Keeps threads that log a lot from waiting on the console, log_drop is for when they shouldn't wait at all
+    if (CONFIGVAR_GET_BOOLEAN("log_async"))
+    {
+        LogStartAsync(CONFIGVAR_GET_BOOLEAN("log_drop") ? LogQueueDropCounted : LogQueueBlock);
+    }
+
     LogInfo("Common library initialized");
 }
 
@@ -134,8 +220,6 @@ static VOID MiMallocStatPrint(PCSTR Message, PVOID Argument)
 PURPL_MAKE_HASHMAP_ENTRY(CONFIGVAR_MAP, PCHAR, struct CONFIGVAR *);
 extern PCONFIGVAR_MAP CfgVariables;
 
-extern struct FILESYSTEM_SOURCE *FsSources;
-
 VOID CmnShutdown(VOID)
 {
     if (CfgVariables)
@@ -143,13 +227,25 @@ VOID CmnShutdown(VOID)
         stbds_shfree(CfgVariables);
     }
 
-    if (FsSources)
-    {
-        stbds_arrfree(FsSources);
-    }
+    FsShutdown();
+
+    CmnFreeCompressionContexts();
 
     PlatShutdown();
 
+    LogStopAsync();
+    if (BinaryLogFile)
+    {
+        LogSetBinaryFile(NULL, LogLevelTrace);
+        fclose(BinaryLogFile);
+        BinaryLogFile = NULL;
+    }
+    if (JsonLogFile)
+    {
+        LogRemoveFile(JsonLogFile);
+        fclose(JsonLogFile);
+        JsonLogFile = NULL;
+    }
     AsDestroyMutex(LogMutex);
 
 #if PURPL_USE_MIMALLOC
@@ -176,7 +272,7 @@ PCSTR CmnFormatTempString(_In_z_ _Printf_format_string_ PCSTR Format, ...)
 
 PCSTR CmnFormatTempStringVarArgs(_In_z_ _Printf_format_string_ PCSTR Format, _In_ va_list Arguments)
 {
-    static CHAR Buffer[1024];
+    static _Thread_local CHAR Buffer[1024];
     va_list _Arguments;
 
     memset(Buffer, 0, PURPL_ARRAYSIZE(Buffer));
@@ -218,7 +314,7 @@ PCHAR CmnFormatString(_In_z_ _Printf_format_string_ PCSTR Format, ...)
 
 PCSTR CmnFormatSize(_In_ DOUBLE Size)
 {
-    static CHAR Buffer[64]; // Not gonna be bigger than this
+    static _Thread_local CHAR Buffer[64]; // Not gonna be bigger than this
     DOUBLE Value;
     UINT8 Prefix;
 
@@ -317,6 +413,9 @@ _Noreturn VOID CmnErrorEx(_In_ BOOLEAN ShutdownFirst, _In_ PCSTR File, _In_ UINT
 
     BOOLEAN Verbose = CONFIGVAR_GET_BOOLEAN("verbose");
 
+    // Whatever led up to the error has to be written before anything else happens
+    LogFlush();
+
     if (ShutdownFirst)
     {
         CmnShutdown();
@@ -100,7 +100,7 @@ extern VOID CmnShutdown(VOID);
 ///                   parameter is not a string literal.
 /// @param[in] Arguments  Arguments to the format string.
 ///
-/// @return A pointer to a static buffer with the formatted string.
+/// @return A pointer to a per-thread static buffer with the formatted string.
 extern PCSTR CmnFormatTempString(_In_z_ _Printf_format_string_ PCSTR Format, ...);
 
 /// @brief This routine formats a printf format string into a static
@@ -110,7 +110,7 @@ extern PCSTR CmnFormatTempString(_In_z_ _Printf_format_string_ PCSTR Format, ...
 ///                parameter is not a string literal.
 /// @param[in] ...     Arguments to the format string.
 ///
-/// @return A pointer to a static buffer with the formatted string.
+/// @return A pointer to a per-thread static buffer with the formatted string.
 extern PCSTR CmnFormatTempStringVarArgs(_In_z_ _Printf_format_string_ PCSTR Format, _In_ va_list Arguments);
 
 /// @brief This routine formats a printf format string into a dynamically
@@ -141,7 +141,7 @@ extern PCHAR CmnFormatStringVarArgs(_In_z_ _Printf_format_string_ PCSTR Format,
 ///
 /// @param[in] Size The size to convert.
 ///
-/// @return The address of a static buffer containing the string.
+/// @return The address of a per-thread static buffer containing the string.
 extern PCSTR CmnFormatSize(_In_ DOUBLE Size);
 
 /// @brief Insert a string in a string
@@ -0,0 +1,87 @@
+/// @file compression.c
+///
+/// @brief This file implements the compression helpers.
+///
+/// @copyright (c) 2024 Randomcode Developers
+
+#include "compression.h"
+
+#include "zstd_errors.h"
+
+static _Thread_local ZSTD_CCtx *CompressionContext;
+static _Thread_local ZSTD_DCtx *DecompressionContext;
+
+ZSTD_CCtx *CmnGetCompressionContext(VOID)
+{
+    if (!CompressionContext)
+    {
+        CompressionContext = ZSTD_createCCtx();
+        if (!CompressionContext)
+        {
+            LogError("Failed to create compression context");
+            return NULL;
+        }
+    }
+    else
+    {
+        // Keeps the tables, but not the parameters of whoever used it last
+        ZSTD_CCtx_reset(CompressionContext, ZSTD_reset_session_and_parameters);
+    }
+
+    return CompressionContext;
+}
+
+ZSTD_DCtx *CmnGetDecompressionContext(VOID)
+{
+    if (!DecompressionContext)
+    {
+        DecompressionContext = ZSTD_createDCtx();
+        if (!DecompressionContext)
+        {
+            LogError("Failed to create decompression context");
+            return NULL;
+        }
+    }
+    else
+    {
+        ZSTD_DCtx_reset(DecompressionContext, ZSTD_reset_session_and_parameters);
+    }
+
+    // Large pack entries can have a window bigger than zstd allows by default
+    ZSTD_DCtx_setParameter(DecompressionContext, ZSTD_d_windowLogMax,
+                           ZSTD_dParam_getBounds(ZSTD_d_windowLogMax).upperBound);
+
+    return DecompressionContext;
+}
+
+VOID CmnFreeCompressionContexts(VOID)
+{
+    ZSTD_freeCCtx(CompressionContext);
+    CompressionContext = NULL;
+    ZSTD_freeDCtx(DecompressionContext);
+    DecompressionContext = NULL;
+}
+
+SIZE_T CmnCompress(_Out_writes_bytes_(DestinationSize) PVOID Destination, _In_ SIZE_T DestinationSize,
+                   _In_reads_bytes_(Size) PVOID Source, _In_ SIZE_T Size, _In_ INT32 Level)
+{
+    ZSTD_CCtx *Context = CmnGetCompressionContext();
+    if (!Context)
+    {
+        return (SIZE_T)-ZSTD_error_memory_allocation;
+    }
+
+    return ZSTD_compressCCtx(Context, Destination, DestinationSize, Source, Size, Level);
+}
+
+SIZE_T CmnDecompress(_Out_writes_bytes_(DestinationSize) PVOID Destination, _In_ SIZE_T DestinationSize,
+                     _In_reads_bytes_(Size) PVOID Source, _In_ SIZE_T Size)
+{
+    ZSTD_DCtx *Context = CmnGetDecompressionContext();
+    if (!Context)
+    {
+        return (SIZE_T)-ZSTD_error_memory_allocation;
+    }
+
+    return ZSTD_decompressDCtx(Context, Destination, DestinationSize, Source, Size);
+}
@@ -0,0 +1,49 @@
+/// @file compression.h
+///
+/// @brief This file contains definitions for the compression helpers. zstd contexts are expensive to set up, so each
+/// thread keeps one of each and reuses it for every call.
+///
+/// @copyright (c) 2024 Randomcode Developers
+
+#pragma once
+
+#include "purpl/purpl.h"
+
+#include "common.h"
+
+/// @brief Get the calling thread's compression context, reset to the default parameters
+///
+/// @return The context, or NULL if it couldn't be created
+extern ZSTD_CCtx *CmnGetCompressionContext(VOID);
+
+/// @brief Get the calling thread's decompression context, reset to the default parameters except for allowing any
+/// window size
+///
+/// @return The context, or NULL if it couldn't be created
+extern ZSTD_DCtx *CmnGetDecompressionContext(VOID);
+
+/// @brief Free the calling thread's contexts, called when threads from AsCreateThread exit and by CmnShutdown
+extern VOID CmnFreeCompressionContexts(VOID);
+
+/// @brief Compress data with the calling thread's compression context
+///
+/// @param[out] Destination The buffer to compress into
+/// @param[in] DestinationSize The size of the buffer, ZSTD_compressBound(Size) always fits
+/// @param[in] Source The data to compress
+/// @param[in] Size The size of the data
+/// @param[in] Level The compression level
+///
+/// @return The compressed size, or a zstd error code
+extern SIZE_T CmnCompress(_Out_writes_bytes_(DestinationSize) PVOID Destination, _In_ SIZE_T DestinationSize,
+                          _In_reads_bytes_(Size) PVOID Source, _In_ SIZE_T Size, _In_ INT32 Level);
+
+/// @brief Decompress data with the calling thread's decompression context
+///
+/// @param[out] Destination The buffer to decompress into
+/// @param[in] DestinationSize The size of the buffer
+/// @param[in] Source The compressed data
+/// @param[in] Size The size of the compressed data
+///
+/// @return The decompressed size, or a zstd error code
+extern SIZE_T CmnDecompress(_Out_writes_bytes_(DestinationSize) PVOID Destination, _In_ SIZE_T DestinationSize,
+                            _In_reads_bytes_(Size) PVOID Source, _In_ SIZE_T Size);
@@ -4,6 +4,8 @@
 ///
 /// @copyright (c) Randomcode Developers 2024
 
+#define LOG_FILE_CHANNEL LogChannelConfig
+
 #include "configvar.h"
 
 static PCSTR GetSideString(_In_ CONFIGVAR_SIDE Side)
@@ -99,7 +99,7 @@ extern PCONFIGVAR CfgGetVariable(_In_z_ PCSTR Name);
 #define CONFIGVAR_GET_FLOAT_EX(Name, DefaultValue)                                                                     \
     (CfgGetVariable(Name) ? CfgGetVariable(Name)->Current.Float : (DefaultValue))
 #define CONFIGVAR_GET_STRING_EX(Name, DefaultValue)                                                                    \
-    (CfgGetVariable(Name) ? CfgGetVariable(Name)->Current.String.Value : (DefaultValue))
+    (CfgGetVariable(Name) ? CfgGetVariable(Name)->Current.String : (DefaultValue))
 
 #define CONFIGVAR_GET_BOOLEAN(Name) CONFIGVAR_GET_BOOLEAN_EX(Name, (BOOLEAN)FALSE)
 #define CONFIGVAR_GET_INT(Name) CONFIGVAR_GET_INT_EX(Name, 0)
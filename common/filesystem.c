@@ -4,6 +4,9 @@
 ///
 /// @copyright (c) Randomcode Developers 2024
 
+#define LOG_FILE_CHANNEL LogChannelFs
+
+#include "configvar.h"
 #include "filesystem.h"
 #include "packfile.h"
 
@@ -19,6 +22,12 @@ PURPL_MAKE_TAG(struct, FILESYSTEM_SOURCE, {
     PVOID(*ReadFile)
     (_In_ PVOID Handle, _In_z_ PCSTR Path, _In_ UINT64 Offset, _In_ UINT64 MaxAmount, _Out_ PUINT64 ReadAmount,
      _In_ UINT64 Extra);
+    // Optional, FsReadFiles uses ReadFile for each file without it
+    BOOLEAN (*ReadFiles)(_In_ PVOID Handle, _Inout_updates_(Count) PFILESYSTEM_READ_REQUEST Requests,
+                         _In_ UINT64 Count);
+    // Optional, FsMapFile uses ReadFile and FsUnmapFile uses CmnFree without them
+    PVOID (*MapFile)(_In_ PVOID Handle, _In_z_ PCSTR Path, _Out_ PUINT64 Size);
+    VOID (*UnmapFile)(_In_ PVOID Handle, _In_opt_ PVOID Data);
 })
 
 PFILESYSTEM_SOURCE FsSources;
@@ -179,6 +188,15 @@ BOOLEAN FsAddPackSource(_In_z_ PCSTR Path)
     Source.HasFile = PackHasFile;
     Source.GetFileSize = PackGetFileSize;
     Source.ReadFile = PackReadFile;
+    Source.ReadFiles = PackReadFiles;
+    Source.MapFile = PackMapFile;
+    Source.UnmapFile = PackUnmapFile;
+
+    // Written by FsShutdown, for packtool reorder
+    if (CONFIGVAR_GET_BOOLEAN("fs_trace_packs"))
+    {
+        PackStartTrace(Source.Handle);
+    }
 
     LogDebug("Adding pack source %s", Source.Path);
 
@@ -187,6 +205,23 @@ BOOLEAN FsAddPackSource(_In_z_ PCSTR Path)
     return TRUE;
 }
 
+VOID FsShutdown(VOID)
+{
+    for (SIZE_T i = 0; i < stbds_arrlenu(FsSources); i++)
+    {
+        if (FsSources[i].Type == FsSourceTypePackFile)
+        {
+            PCHAR TracePath = CmnAppendString(FsSources[i].Path, PACKFILE_TRACE_EXTENSION);
+            PackStopTrace(FsSources[i].Handle, TracePath);
+            CmnFree(TracePath);
+            PackFree(FsSources[i].Handle);
+        }
+        CmnFree(FsSources[i].Path);
+    }
+
+    stbds_arrfree(FsSources);
+}
+
 static PFILESYSTEM_SOURCE FindFile(_In_z_ PCSTR Path)
 {
     // TODO: optimize?
@@ -250,3 +285,100 @@ X(
     FixedFullPath, Offset, MaxAmount, ReadAmount, Extra)
 
 #undef X
+
+// Marks files FsReadFiles has already passed to their source
+#define FS_SOURCE_DONE ((PFILESYSTEM_SOURCE)-1)
+
+BOOLEAN FsReadFiles(_In_ BOOLEAN Raw, _Inout_updates_(Count) PFILESYSTEM_READ_REQUEST Requests, _In_ UINT64 Count)
+{
+    BOOLEAN Success = TRUE;
+
+    // Each source that can read files together gets all of its files at once, in a copy of their requests
+    PFILESYSTEM_SOURCE *Sources = CmnAllocType(Count, PFILESYSTEM_SOURCE);
+    PFILESYSTEM_READ_REQUEST SourceRequests = CmnAllocType(Count, FILESYSTEM_READ_REQUEST);
+    PUINT64 Indices = CmnAllocType(Count, UINT64);
+    if (Count > 0 && (!Sources || !SourceRequests || !Indices))
+    {
+        LogError("Failed to allocate %llu read request(s): %s", Count, strerror(errno));
+        CmnFree(Sources);
+        CmnFree(SourceRequests);
+        CmnFree(Indices);
+        return FALSE;
+    }
+
+    for (UINT64 i = 0; i < Count; i++)
+    {
+        Sources[i] = Raw ? NULL : FindFile(Requests[i].Path);
+    }
+
+    for (UINT64 i = 0; i < Count; i++)
+    {
+        PFILESYSTEM_SOURCE Source = Sources[i];
+        if (Source == FS_SOURCE_DONE)
+        {
+            // Already read with an earlier file from the same source
+            continue;
+        }
+        else if (!Source || !Source->ReadFiles)
+        {
+            Requests[i].Data = FsReadFile(Raw, Requests[i].Path, 0, 0, &Requests[i].Size, Requests[i].Extra);
+            Success = Requests[i].Data && Success;
+            continue;
+        }
+
+        UINT64 SourceCount = 0;
+        for (UINT64 j = i; j < Count; j++)
+        {
+            if (Sources[j] == Source)
+            {
+                SourceRequests[SourceCount] = Requests[j];
+                // Sources get fixed paths, like FsReadFile and FsMapFile give them
+                SourceRequests[SourceCount].Path = PlatFixPath(Requests[j].Path);
+                Indices[SourceCount++] = j;
+                Sources[j] = FS_SOURCE_DONE;
+            }
+        }
+
+        Success = Source->ReadFiles(Source->Handle, SourceRequests, SourceCount) && Success;
+        for (UINT64 j = 0; j < SourceCount; j++)
+        {
+            CmnFree(SourceRequests[j].Path);
+            SourceRequests[j].Path = Requests[Indices[j]].Path;
+            Requests[Indices[j]] = SourceRequests[j];
+        }
+    }
+
+    CmnFree(Sources);
+    CmnFree(SourceRequests);
+    CmnFree(Indices);
+
+    return Success;
+}
+
+PVOID FsMapFile(_In_ BOOLEAN Raw, _In_z_ PCSTR Path, _Out_ PUINT64 Size)
+{
+    PFILESYSTEM_SOURCE Source = Raw ? NULL : FindFile(Path);
+    if (Source && Source->MapFile)
+    {
+        PCHAR FixedPath = PlatFixPath(Path);
+        PVOID Data = Source->MapFile(Source->Handle, FixedPath, Size);
+        CmnFree(FixedPath);
+        return Data;
+    }
+
+    return FsReadFile(Raw, Path, 0, 0, Size, 0);
+}
+
+VOID FsUnmapFile(_In_ BOOLEAN Raw, _In_z_ PCSTR Path, _In_opt_ PVOID Data)
+{
+    // New sources go after the others, so this finds the one the file was mapped from
+    PFILESYSTEM_SOURCE Source = Raw || !Data ? NULL : FindFile(Path);
+    if (Source && Source->UnmapFile)
+    {
+        Source->UnmapFile(Source->Handle, Data);
+    }
+    else
+    {
+        CmnFree(Data);
+    }
+}
@@ -14,6 +14,14 @@
 #include "common.h"
 #include "log.h"
 
+/// @brief A file to read with FsReadFiles
+PURPL_MAKE_TAG(struct, FILESYSTEM_READ_REQUEST, {
+    PCSTR Path;   // The path to the file
+    UINT64 Extra; // Number of extra bytes to allocate
+    PVOID Data;   // Receives the file's contents, or NULL if it couldn't be read
+    UINT64 Size;  // Receives the number of bytes read
+})
+
 /// @brief Adds a directory source to the filesystem
 ///
 /// @param[in] Path The path of the directory
@@ -26,6 +34,9 @@ extern VOID FsAddDirectorySource(_In_z_ PCSTR Path);
 /// @return Whether the pack was added successfully as a source
 extern BOOLEAN FsAddPackSource(_In_z_ PCSTR Path);
 
+/// @brief Removes all the sources, and writes the access traces of pack sources if fs_trace_packs is set
+extern VOID FsShutdown(VOID);
+
 /// @brief Checks if a file exists
 ///
 /// @param[in] Raw Whether to skip source abstraction
@@ -63,6 +74,34 @@ extern BOOLEAN FsCreateDirectory(_In_z_ PCSTR Path);
 extern PVOID FsReadFile(_In_ BOOLEAN Raw, _In_z_ PCSTR Path, _In_ UINT64 Offset, _In_ UINT64 MaxAmount,
                         _Out_ PUINT64 ReadAmount, _In_ UINT64 Extra);
 
+/// @brief Reads several whole files at once. Files in the same pack are read together, so nearby files share reads and
+/// are decompressed in parallel.
+///
+/// @param[in] Raw Whether to skip the source abstraction
+/// @param[in,out] Requests The files to read
+/// @param[in] Count The number of files
+///
+/// @return Whether every file was read
+extern BOOLEAN FsReadFiles(_In_ BOOLEAN Raw, _Inout_updates_(Count) PFILESYSTEM_READ_REQUEST Requests,
+                           _In_ UINT64 Count);
+
+/// @brief Maps a whole file into memory. Big files in packs are filled in as they're touched where the platform can do
+/// that (see PackMapFile), anything else is just read.
+///
+/// @param[in] Raw Whether to skip the source abstraction
+/// @param[in] Path The path to the file
+/// @param[out] Size Receives the size of the file
+///
+/// @return The file's contents, which have to be given to FsUnmapFile, or NULL
+extern PVOID FsMapFile(_In_ BOOLEAN Raw, _In_z_ PCSTR Path, _Out_ PUINT64 Size);
+
+/// @brief Unmaps a file mapped with FsMapFile
+///
+/// @param[in] Raw Whether the file was mapped with Raw set
+/// @param[in] Path The path the file was mapped from
+/// @param[in] Data What FsMapFile returned
+extern VOID FsUnmapFile(_In_ BOOLEAN Raw, _In_z_ PCSTR Path, _In_opt_ PVOID Data);
+
 /// @brief Write to a file
 ///
 /// @param[in] Path The path to the file
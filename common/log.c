@@ -23,10 +23,27 @@
  */
 
 #include "log.h"
+#include "alloc.h"
 #include "platform/async.h"
 
 #define LOG_MAX_CALLBACKS 32
 
+// Number of messages the async queue holds, has to be a power of 2
+#define LOG_QUEUE_SIZE 1024
+
+#define LOG_WRITER_STACK_SIZE 0x100000
+
+// Format strings and file names already in the binary file, has to be a power of 2
+#define LOG_BINARY_STRING_TABLE_SIZE 4096
+
+// Places that log which are rate limited, has to be a power of 2. Past this,
+// new places aren't limited.
+#define LOG_RATE_LIMIT_SLOTS 1024
+
+// How long the writer thread waits for a message to stop repeating before it
+// writes how many times it did
+#define LOG_REPEAT_FLUSH_DELAY 1000000000ull
+
 typedef struct LOG_CALLBACK
 {
     PFN_LOG_LOG Log;
@@ -34,17 +51,127 @@ typedef struct LOG_CALLBACK
     LOG_LEVEL Level;
 } LOG_CALLBACK;
 
+typedef struct LOG_RECORD
+{
+    UINT64 Sequence; // Position + 1 once it's written, position + LOG_QUEUE_SIZE once it's been read
+    time_t WallTime;
+    UINT64 Nanoseconds;
+    PCSTR Format;
+    PCSTR File;
+    INT64 Line;
+    BOOLEAN HexLine;
+    LOG_LEVEL Level;
+    LOG_CHANNEL Channel;
+    CHAR ThreadName[32];
+    UINT16 ArgumentsSize;
+    BYTE Arguments[LOG_MAX_PACKED_ARGUMENTS];
+} LOG_RECORD;
+
+// A bounded multi-producer queue, producers claim records by advancing Head
+// and the reader follows behind them with Tail
+typedef struct LOG_QUEUE
+{
+    LOG_RECORD *Records; // NULL if messages are written right away
+    UINT64 Head;
+    UINT64 Tail;
+    UINT64 DroppedCount;
+    LOG_QUEUE_POLICY Policy;
+    PAS_MUTEX ReadLock; // Held by whoever is reading, the writer thread or LogFlush
+    PAS_THREAD Thread;
+    UINT8 Stop;
+} LOG_QUEUE;
+
+// A token bucket for one place that logs, done as a generic cell rate
+// algorithm so it's a single value that can be updated atomically
+typedef struct LOG_RATE_LIMIT_SLOT
+{
+    UINT64 Key;            // Mix of the file and line, 0 if the slot is free
+    UINT64 NextTime;       // When the bucket would be full again if no more messages were logged
+    UINT64 SuppressedCount;
+} LOG_RATE_LIMIT_SLOT;
+
+// The last message written, for counting repeats of it
+typedef struct LOG_REPEAT
+{
+    BOOLEAN Valid;
+    PCSTR Format;
+    PCSTR File;
+    INT64 Line;
+    BOOLEAN HexLine;
+    LOG_LEVEL Level;
+    LOG_CHANNEL Channel;
+    CHAR ThreadName[32];
+    UINT16 ArgumentsSize;
+    BYTE Arguments[LOG_MAX_PACKED_ARGUMENTS];
+    UINT64 Count;
+    time_t WallTime; // Of the last repeat
+    UINT64 Nanoseconds;
+    UINT64 PendingTime; // Nanoseconds while Count isn't 0, atomic so the writer thread can check it without the lock
+} LOG_REPEAT;
+
 static struct LOG_STATE
 {
     PVOID Data;
     PFN_LOG_LOCK Lock;
     LOG_LEVEL Level;
     BOOLEAN Quiet;
+    LOG_LEVEL ChannelLevels[LogChannelCount];
+    BOOLEAN ChannelHasLevel[LogChannelCount]; // FALSE if the channel uses each sink's level
     LOG_CALLBACK Callbacks[LOG_MAX_CALLBACKS];
+    LOG_QUEUE Queue;
+    FILE *BinaryFile;
+    LOG_LEVEL BinaryLevel;
+    UINT64 BinaryStrings[LOG_BINARY_STRING_TABLE_SIZE];
+    BOOLEAN Coalesce;
+    LOG_REPEAT Last;
+    UINT64 RateInterval; // Nanoseconds per message, 0 if there's no limit
+    UINT64 RateTolerance;
+    LOG_RATE_LIMIT_SLOT RateLimits[LOG_RATE_LIMIT_SLOTS];
 } LogState;
 
+// What an argument is packed as
+typedef enum LOG_ARGUMENT_TYPE
+{
+    LogArgumentNone, // %%
+    LogArgumentSigned,
+    LogArgumentUnsigned,
+    LogArgumentFloat,
+    LogArgumentCharacter,
+    LogArgumentString, // UINT16 length, UINT16_MAX for NULL, then the characters
+    LogArgumentPointer,
+    LogArgumentUnsupported // %n and wide characters
+} LOG_ARGUMENT_TYPE;
+
+// The parts of a printf conversion that matter for packing its argument
+typedef struct LOG_CONVERSION
+{
+    CHAR Flags[8];
+    INT32 Width;     // -1 if there isn't one
+    INT32 Precision; // -1 if there isn't one
+    BOOLEAN WidthArgument;
+    BOOLEAN PrecisionArgument;
+    CHAR Length[3];
+    CHAR Type;
+} LOG_CONVERSION;
+
+LOG_LEVEL LogWantedLevels[LogChannelCount];
+
+// localtime takes a lock in most libcs, so each thread only redoes it when the
+// second changes
+typedef struct LOG_TIME_CACHE
+{
+    time_t WallTime;
+    struct tm Time;
+    CHAR TimeString[16];
+    CHAR DateTimeString[32];
+} LOG_TIME_CACHE;
+
+static _Thread_local LOG_TIME_CACHE TimeCache = {.WallTime = -1};
+
 static PCSTR LevelStrings[] = {"TRACE", "DEBUG", "INFO", "WARN", "ERROR", "FATAL"};
 
+static PCSTR ChannelNames[] = {"general", "platform", "async", "video", "config", "fs", "pack"};
+
 #if !(defined PURPL_SWITCH && !defined PURPL_CONSOLE_HOMEBREW)
 #ifdef LOG_USE_COLOR
 static PCSTR LevelColours[] = {"\x1b[38;5;197m", "\x1b[36m", "\x1b[32m", "\x1b[33m", "\x1b[31m", "\x1b[35m"};
@@ -52,17 +179,16 @@ static PCSTR LevelColours[] = {"\x1b[38;5;197m", "\x1b[36m", "\x1b[32m", "\x1b[3
 
 static VOID StdoutCallback(LOG_EVENT *Event)
 {
-    char Buffer[64] = {0};
-    Buffer[strftime(Buffer, sizeof(Buffer), "%H:%M:%S", Event->Time)] = '\0';
 #ifdef LOG_USE_COLOR
-    fprintf(Event->Data, "%s \x1b[38;5;213m%s\x1b[0m %s%-5s\x1b[0m \x1b[90m%s:", Buffer, AsCurrentThread->Name,
+    fprintf(Event->Data, "%s \x1b[38;5;213m%s\x1b[0m %s%-5s\x1b[0m \x1b[90m%s:", Event->TimeString, Event->ThreadName,
             LevelColours[Event->Level], LevelStrings[Event->Level], Event->File);
     if (Event->HexLine)
         fprintf(Event->Data, "0x%llX:\x1b[0m ", (UINT64)Event->Line);
     else
         fprintf(Event->Data, "%lld:\x1b[0m ", (INT64)Event->Line);
 #else
-    fprintf(Event->Data, "%s %s %-5s %s:", Buffer, AsCurrentThread->Name, LevelStrings[Event->Level], Event->File);
+    fprintf(Event->Data, "%s %s %-5s %s:", Event->TimeString, Event->ThreadName, LevelStrings[Event->Level],
+            Event->File);
     if (Event->HexLine)
         fprintf(Event->Data, "0x%llX: ", (UINT64)Event->Line);
     else
@@ -93,18 +219,15 @@ Return Value:
 
 --*/
 {
-    char Time[64] = {0};
     char Message[1024] = {0};
     char All[1024] = {0};
 
-    Time[strftime(Time, sizeof(Time), "%H:%M:%S", Event->Time)] = 0;
-
     vsnprintf(Message, sizeof(Message), Event->Format, Event->ArgList);
     if (Event->HexLine)
-        snprintf(All, sizeof(All), "%s %s %-5s %s:0x%llX: %s\n", Time, AsCurrentThread->Name,
+        snprintf(All, sizeof(All), "%s %s %-5s %s:0x%llX: %s\n", Event->TimeString, Event->ThreadName,
                  LogGetLevelString(Event->Level), Event->File, (UINT64)Event->Line, Message);
     else
-        snprintf(All, sizeof(All), "%s %s %-5s %s:%lld: %s\n", Time, AsCurrentThread->Name,
+        snprintf(All, sizeof(All), "%s %s %-5s %s:%lld: %s\n", Event->TimeString, Event->ThreadName,
                  LogGetLevelString(Event->Level), Event->File, (INT64)Event->Line, Message);
 
     PlatPrint(All);
@@ -113,9 +236,8 @@ Return Value:
 
 static VOID FileCallback(LOG_EVENT *Event)
 {
-    char Buffer[64] = {0};
-    Buffer[strftime(Buffer, sizeof(Buffer), "%Y-%m-%d %H:%M:%S", Event->Time)] = '\0';
-    fprintf(Event->Data, "%s %s %-5s %s:", Buffer, AsCurrentThread->Name, LevelStrings[Event->Level], Event->File);
+    fprintf(Event->Data, "%s %s %-5s %s:", Event->DateTimeString, Event->ThreadName, LevelStrings[Event->Level],
+            Event->File);
     if (Event->HexLine)
         fprintf(Event->Data, "0x%llX: ", (UINT64)Event->Line);
     else
@@ -125,6 +247,78 @@ static VOID FileCallback(LOG_EVENT *Event)
     fflush(Event->Data);
 }
 
+// Writes String as a JSON string, escaping quotes, backslashes and control
+// characters
+static VOID WriteJsonString(FILE *File, PCSTR String)
+{
+    fputc('"', File);
+    while (*String)
+    {
+        PCSTR End = String;
+        while (*End && *End != '"' && *End != '\\' && (UINT8)*End >= ' ')
+        {
+            End++;
+        }
+        fwrite(String, 1, End - String, File);
+        if (!*End)
+        {
+            break;
+        }
+
+        switch (*End)
+        {
+        case '"':
+            fputs("\\\"", File);
+            break;
+        case '\\':
+            fputs("\\\\", File);
+            break;
+        case '\n':
+            fputs("\\n", File);
+            break;
+        case '\r':
+            fputs("\\r", File);
+            break;
+        case '\t':
+            fputs("\\t", File);
+            break;
+        default:
+            fprintf(File, "\\u%04X", (UINT8)*End);
+            break;
+        }
+        String = End + 1;
+    }
+    fputc('"', File);
+}
+
+static VOID JsonCallback(LOG_EVENT *Event)
+{
+    CHAR Message[4096];
+
+    vsnprintf(Message, sizeof(Message), Event->Format, Event->ArgList);
+
+    fprintf(Event->Data, "{\"time\":%lld,\"monotonic_ns\":%llu,\"thread\":", (INT64)Event->WallTime,
+            Event->Nanoseconds);
+    WriteJsonString(Event->Data, Event->ThreadName ? Event->ThreadName : "");
+    fprintf(Event->Data, ",\"channel\":\"%s\",\"level\":\"%s\",\"file\":", ChannelNames[Event->Channel],
+            LevelStrings[Event->Level]);
+    WriteJsonString(Event->Data, Event->File ? Event->File : "");
+    if (Event->HexLine)
+        fprintf(Event->Data, ",\"address\":\"0x%llX\"", (UINT64)Event->Line);
+    else
+        fprintf(Event->Data, ",\"line\":%lld", (INT64)Event->Line);
+    fprintf(Event->Data, ",\"message\":");
+    WriteJsonString(Event->Data, Message);
+    fprintf(Event->Data, "}\n");
+
+    // Like the binary file, this is meant for a lot of messages, so it's only
+    // flushed for ones that might be the last
+    if (Event->Level >= LogLevelError)
+    {
+        fflush(Event->Data);
+    }
+}
+
 static VOID LogLock(VOID)
 {
     if (LogState.Lock)
@@ -147,6 +341,65 @@ char *LogGetLevelString(LOG_LEVEL Level)
     return LevelStrings[Level];
 }
 
+BOOLEAN LogParseLevel(PCSTR String, LOG_LEVEL *Level)
+{
+    if (isdigit(String[0]) && !String[1] && String[0] - '0' <= LogLevelFatal)
+    {
+        *Level = (LOG_LEVEL)(String[0] - '0');
+        return TRUE;
+    }
+
+    for (UINT32 i = 0; i < PURPL_ARRAYSIZE(LevelStrings); i++)
+    {
+        UINT32 j = 0;
+        while (String[j] && LevelStrings[i][j] && tolower(String[j]) == tolower(LevelStrings[i][j]))
+        {
+            j++;
+        }
+        if (!LevelStrings[i][j] && (!String[j] || (i == LogLevelWarning && strcmp(String + j, "ing") == 0)))
+        {
+            *Level = (LOG_LEVEL)i;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+PCSTR LogGetChannelName(LOG_CHANNEL Channel)
+{
+    return (UINT32)Channel < LogChannelCount ? ChannelNames[Channel] : "?";
+}
+
+// Gets the level a sink uses for a channel
+static LOG_LEVEL GetSinkLevel(LOG_CHANNEL Channel, LOG_LEVEL Level)
+{
+    return LogState.ChannelHasLevel[Channel] ? LogState.ChannelLevels[Channel] : Level;
+}
+
+static VOID UpdateWantedLevel(VOID)
+{
+    for (UINT32 Channel = 0; Channel < LogChannelCount; Channel++)
+    {
+        LOG_LEVEL Level = LogLevelFatal + 1;
+
+        if (!LogState.Quiet)
+        {
+            Level = GetSinkLevel(Channel, LogState.Level);
+        }
+        for (int i = 0; i < LOG_MAX_CALLBACKS && LogState.Callbacks[i].Log; i++)
+        {
+            Level = PURPL_MIN(Level, GetSinkLevel(Channel, LogState.Callbacks[i].Level));
+        }
+        if (LogState.BinaryFile)
+        {
+            Level = PURPL_MIN(Level, GetSinkLevel(Channel, LogState.BinaryLevel));
+        }
+
+        LogWantedLevels[Channel] = Level;
+    }
+}
+
 VOID LogSetLock(PFN_LOG_LOCK Lock, PVOID Data)
 {
     LogState.Lock = Lock;
@@ -156,6 +409,7 @@ VOID LogSetLock(PFN_LOG_LOCK Lock, PVOID Data)
 VOID LogSetLevel(LOG_LEVEL Level)
 {
     LogState.Level = Level;
+    UpdateWantedLevel();
 }
 
 LOG_LEVEL
@@ -167,6 +421,7 @@ LogGetLevel(VOID)
 VOID LogSetQuiet(BOOLEAN Quiet)
 {
     LogState.Quiet = Quiet;
+    UpdateWantedLevel();
 }
 
 int LogAddCallback(PFN_LOG_LOG Callback, PVOID Data, LOG_LEVEL Level)
@@ -176,6 +431,7 @@ int LogAddCallback(PFN_LOG_LOG Callback, PVOID Data, LOG_LEVEL Level)
         if (!LogState.Callbacks[i].Log)
         {
             LogState.Callbacks[i] = (LOG_CALLBACK){Callback, Data, Level};
+            UpdateWantedLevel();
             return 0;
         }
     }
@@ -187,67 +443,1216 @@ int LogAddFile(FILE *File, LOG_LEVEL Level)
     return LogAddCallback(FileCallback, File, Level);
 }
 
+int LogAddJsonFile(FILE *File, LOG_LEVEL Level)
+{
+    return LogAddCallback(JsonCallback, File, Level);
+}
+
+VOID LogSetChannelLevel(LOG_CHANNEL Channel, LOG_LEVEL Level)
+{
+    LogState.ChannelLevels[Channel] = Level;
+    LogState.ChannelHasLevel[Channel] = TRUE;
+    UpdateWantedLevel();
+}
+
+VOID LogResetChannelLevel(LOG_CHANNEL Channel)
+{
+    LogState.ChannelHasLevel[Channel] = FALSE;
+    UpdateWantedLevel();
+}
+
 static VOID InitEvent(LOG_EVENT *Event, PVOID Data)
 {
     if (!Event->Time)
     {
-        time_t t = time(NULL);
-        Event->Time = localtime(&t);
+        LOG_TIME_CACHE *Cache = &TimeCache;
+        if (Event->WallTime != Cache->WallTime)
+        {
+#ifdef PURPL_WIN32
+            localtime_s(&Cache->Time, &Event->WallTime);
+#else
+            localtime_r(&Event->WallTime, &Cache->Time);
+#endif
+            strftime(Cache->TimeString, sizeof(Cache->TimeString), "%H:%M:%S", &Cache->Time);
+            strftime(Cache->DateTimeString, sizeof(Cache->DateTimeString), "%Y-%m-%d %H:%M:%S", &Cache->Time);
+            Cache->WallTime = Event->WallTime;
+        }
+
+        Event->Time = &Cache->Time;
+        Event->TimeString = Cache->TimeString;
+        Event->DateTimeString = Cache->DateTimeString;
     }
     Event->Data = Data;
 }
 
-VOID LogMessage(LOG_LEVEL Level, PCSTR File, uint64_t Line, BOOLEAN HexLine, PCSTR Format, ...)
+static PCSTR ParseNumber(PCSTR String, INT32 *Value)
 {
-    LOG_EVENT Event = {
-        .Format = Format,
-        .File = File,
-        .Line = Line,
-        .HexLine = HexLine,
-        .Level = Level,
-    };
+    if (isdigit(*String))
+    {
+        *Value = 0;
+        while (isdigit(*String))
+        {
+            *Value = PURPL_MIN(*Value * 10 + (*String - '0'), 99999);
+            String++;
+        }
+    }
+
+    return String;
+}
+
+// Format points after the %, returns where the conversion ends
+static PCSTR ParseConversion(PCSTR Format, LOG_CONVERSION *Conversion)
+{
+    memset(Conversion, 0, sizeof(LOG_CONVERSION));
+    Conversion->Width = -1;
+    Conversion->Precision = -1;
+
+    UINT32 FlagCount = 0;
+    while (*Format && strchr("-+ #0'", *Format))
+    {
+        if (FlagCount < sizeof(Conversion->Flags) - 1)
+        {
+            Conversion->Flags[FlagCount++] = *Format;
+        }
+        Format++;
+    }
+
+    if (*Format == '*')
+    {
+        Conversion->WidthArgument = TRUE;
+        Format++;
+    }
+    else
+    {
+        Format = ParseNumber(Format, &Conversion->Width);
+    }
+
+    if (*Format == '.')
+    {
+        Format++;
+        if (*Format == '*')
+        {
+            Conversion->PrecisionArgument = TRUE;
+            Format++;
+        }
+        else
+        {
+            Conversion->Precision = 0;
+            Format = ParseNumber(Format, &Conversion->Precision);
+        }
+    }
 
-    if (Event.File)
+    UINT32 LengthSize = 0;
+    while (*Format && strchr("hljztLq", *Format) && LengthSize < sizeof(Conversion->Length) - 1)
     {
-        while (strstr(Event.File, "purpl-engine"))
+        Conversion->Length[LengthSize++] = *Format++;
+    }
+
+    Conversion->Type = *Format;
+    return *Format ? Format + 1 : Format;
+}
+
+static LOG_ARGUMENT_TYPE GetArgumentType(LOG_CONVERSION *Conversion)
+{
+    switch (Conversion->Type)
+    {
+    case '%':
+        return LogArgumentNone;
+    case 'd':
+    case 'i':
+        return LogArgumentSigned;
+    case 'o':
+    case 'u':
+    case 'x':
+    case 'X':
+        return LogArgumentUnsigned;
+    case 'f':
+    case 'F':
+    case 'e':
+    case 'E':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+        return LogArgumentFloat;
+    case 'c':
+        return Conversion->Length[0] ? LogArgumentUnsupported : LogArgumentCharacter;
+    case 's':
+        return Conversion->Length[0] ? LogArgumentUnsupported : LogArgumentString;
+    case 'p':
+        return LogArgumentPointer;
+    default:
+        return LogArgumentUnsupported;
+    }
+}
+
+static BOOLEAN PackBytes(PBYTE Buffer, UINT32 Size, PUINT32 Offset, CONST VOID *Data, UINT32 DataSize)
+{
+    if (DataSize > Size - *Offset)
+    {
+        return FALSE;
+    }
+
+    memcpy(Buffer + *Offset, Data, DataSize);
+    *Offset += DataSize;
+    return TRUE;
+}
+
+static BOOLEAN UnpackBytes(CONST BYTE *Buffer, UINT32 Size, PUINT32 Offset, PVOID Data, UINT32 DataSize)
+{
+    if (DataSize > Size - *Offset)
+    {
+        return FALSE;
+    }
+
+    memcpy(Data, Buffer + *Offset, DataSize);
+    *Offset += DataSize;
+    return TRUE;
+}
+
+// Copies the arguments for Format into Buffer, so it can be formatted later
+// without the caller's stack. Returns the size, or -1 if they don't fit or
+// can't be packed.
+static INT32 PackArguments(PCSTR Format, va_list Arguments, PBYTE Buffer, UINT32 Size)
+{
+    LOG_CONVERSION Conversion;
+    UINT32 Offset = 0;
+
+    while ((Format = strchr(Format, '%')))
+    {
+        Format = ParseConversion(Format + 1, &Conversion);
+
+        LOG_ARGUMENT_TYPE Type = GetArgumentType(&Conversion);
+        if (Type == LogArgumentNone)
+        {
+            continue;
+        }
+        else if (Type == LogArgumentUnsupported)
+        {
+            return -1;
+        }
+
+        INT64 Precision = Conversion.Precision;
+        if (Conversion.WidthArgument)
+        {
+            INT64 Width = va_arg(Arguments, int);
+            if (!PackBytes(Buffer, Size, &Offset, &Width, sizeof(Width)))
+            {
+                return -1;
+            }
+        }
+        if (Conversion.PrecisionArgument)
+        {
+            Precision = va_arg(Arguments, int);
+            if (!PackBytes(Buffer, Size, &Offset, &Precision, sizeof(Precision)))
+            {
+                return -1;
+            }
+        }
+
+        PCSTR Length = Conversion.Length;
+        INT64 Integer = 0;
+        DOUBLE Float = 0.0;
+        BOOLEAN Packed = FALSE;
+        switch (Type)
         {
-            Event.File = strstr(Event.File, "purpl-engine") + 12 + 1; // also skip the slash
-            if (Event.File > File + strlen(File))
+        case LogArgumentSigned:
+            if (strcmp(Length, "hh") == 0)
+                Integer = (signed char)va_arg(Arguments, int);
+            else if (strcmp(Length, "h") == 0)
+                Integer = (short)va_arg(Arguments, int);
+            else if (strcmp(Length, "ll") == 0 || strcmp(Length, "q") == 0)
+                Integer = va_arg(Arguments, long long);
+            else if (strcmp(Length, "l") == 0)
+                Integer = va_arg(Arguments, long);
+            else if (strcmp(Length, "j") == 0)
+                Integer = va_arg(Arguments, intmax_t);
+            else if (strcmp(Length, "z") == 0)
+                Integer = (INT64)va_arg(Arguments, size_t);
+            else if (strcmp(Length, "t") == 0)
+                Integer = va_arg(Arguments, ptrdiff_t);
+            else
+                Integer = va_arg(Arguments, int);
+            Packed = PackBytes(Buffer, Size, &Offset, &Integer, sizeof(Integer));
+            break;
+        case LogArgumentUnsigned:
+            if (strcmp(Length, "hh") == 0)
+                Integer = (unsigned char)va_arg(Arguments, unsigned int);
+            else if (strcmp(Length, "h") == 0)
+                Integer = (unsigned short)va_arg(Arguments, unsigned int);
+            else if (strcmp(Length, "ll") == 0 || strcmp(Length, "q") == 0)
+                Integer = (INT64)va_arg(Arguments, unsigned long long);
+            else if (strcmp(Length, "l") == 0)
+                Integer = (INT64)va_arg(Arguments, unsigned long);
+            else if (strcmp(Length, "j") == 0)
+                Integer = (INT64)va_arg(Arguments, uintmax_t);
+            else if (strcmp(Length, "z") == 0)
+                Integer = (INT64)va_arg(Arguments, size_t);
+            else if (strcmp(Length, "t") == 0)
+                Integer = (INT64)(UINT64)va_arg(Arguments, ptrdiff_t);
+            else
+                Integer = va_arg(Arguments, unsigned int);
+            Packed = PackBytes(Buffer, Size, &Offset, &Integer, sizeof(Integer));
+            break;
+        case LogArgumentFloat:
+            if (strcmp(Length, "L") == 0)
+                Float = (DOUBLE)va_arg(Arguments, long double);
+            else
+                Float = va_arg(Arguments, double);
+            Packed = PackBytes(Buffer, Size, &Offset, &Float, sizeof(Float));
+            break;
+        case LogArgumentCharacter:
+            Integer = va_arg(Arguments, int);
+            Packed = PackBytes(Buffer, Size, &Offset, &Integer, sizeof(Integer));
+            break;
+        case LogArgumentString: {
+            PCSTR String = va_arg(Arguments, PCSTR);
+            UINT16 StringLength = UINT16_MAX;
+            UINT64 RealLength = 0;
+            if (String)
             {
-                Event.File = File;
+                // With a precision, the string doesn't have to be terminated
+                RealLength = Precision >= 0 ? strnlen(String, Precision) : strlen(String);
+                if (RealLength >= UINT16_MAX)
+                {
+                    return -1;
+                }
+                StringLength = (UINT16)RealLength;
             }
+            Packed = PackBytes(Buffer, Size, &Offset, &StringLength, sizeof(StringLength)) &&
+                     (!String || PackBytes(Buffer, Size, &Offset, String, (UINT32)RealLength));
+            break;
+        }
+        case LogArgumentPointer:
+            Integer = (INT64)(UINT_PTR)va_arg(Arguments, PVOID);
+            Packed = PackBytes(Buffer, Size, &Offset, &Integer, sizeof(Integer));
+            break;
+        default:
+            break;
+        }
+
+        if (!Packed)
+        {
+            return -1;
         }
     }
 
-    LogLock();
+    return (INT32)Offset;
+}
+
+static INT32 PackArgumentsEx(PBYTE Buffer, UINT32 Size, PCSTR Format, ...)
+{
+    va_list Arguments;
+
+    va_start(Arguments, Format);
+    INT32 PackedSize = PackArguments(Format, Arguments, Buffer, Size);
+    va_end(Arguments);
 
-    if (!LogState.Quiet && Level >= LogState.Level)
+    return PackedSize;
+}
+
+static VOID AppendFormatted(PCHAR Buffer, UINT64 Size, PUINT64 Written, PCSTR Format, ...)
+{
+    va_list Arguments;
+
+    va_start(Arguments, Format);
+    int Length = vsnprintf(Buffer + *Written, Size - *Written, Format, Arguments);
+    va_end(Arguments);
+
+    if (Length > 0)
     {
-        InitEvent(&Event, stderr);
-        va_start(Event.ArgList, Format);
+        *Written = PURPL_MIN(*Written + Length, Size - 1);
+    }
+}
 
-#if !(defined PURPL_SWITCH && !defined PURPL_CONSOLE_HOMEBREW)
-        StdoutCallback(&Event);
-#endif
+BOOLEAN LogFormatPacked(PCSTR Format, CONST VOID *Arguments, UINT32 ArgumentsSize, PCHAR Buffer, UINT64 Size)
+{
+    LOG_CONVERSION Conversion;
+    UINT32 Offset = 0;
+    UINT64 Written = 0;
 
-#ifdef PURPL_HAVE_PLATPRINT
-        PlatPrintCallback(&Event);
-#endif
+    if (!Size)
+    {
+        return FALSE;
+    }
+    Buffer[0] = 0;
+
+    while (*Format)
+    {
+        PCSTR Next = strchr(Format, '%');
+        if (!Next)
+        {
+            AppendFormatted(Buffer, Size, &Written, "%s", Format);
+            break;
+        }
+        AppendFormatted(Buffer, Size, &Written, "%.*s", (int)(Next - Format), Format);
+
+        Format = ParseConversion(Next + 1, &Conversion);
+
+        LOG_ARGUMENT_TYPE Type = GetArgumentType(&Conversion);
+        if (Type == LogArgumentNone)
+        {
+            AppendFormatted(Buffer, Size, &Written, "%%");
+            continue;
+        }
+        else if (Type == LogArgumentUnsupported)
+        {
+            return FALSE;
+        }
+
+        INT64 Width = Conversion.Width;
+        INT64 Precision = Conversion.Precision;
+        BOOLEAN LeftAlign = FALSE;
+        if (Conversion.WidthArgument)
+        {
+            if (!UnpackBytes(Arguments, ArgumentsSize, &Offset, &Width, sizeof(Width)))
+            {
+                return FALSE;
+            }
+            LeftAlign = Width < 0;
+            Width = PURPL_MIN(LeftAlign ? -Width : Width, 99999);
+        }
+        if (Conversion.PrecisionArgument)
+        {
+            if (!UnpackBytes(Arguments, ArgumentsSize, &Offset, &Precision, sizeof(Precision)))
+            {
+                return FALSE;
+            }
+            Precision = Precision < 0 ? -1 : PURPL_MIN(Precision, 99999);
+        }
+
+        INT64 Integer = 0;
+        DOUBLE Float = 0.0;
+        UINT16 StringLength = 0;
+        PCSTR String = NULL;
+        BOOLEAN Unpacked = FALSE;
+        switch (Type)
+        {
+        case LogArgumentSigned:
+        case LogArgumentUnsigned:
+        case LogArgumentCharacter:
+        case LogArgumentPointer:
+            Unpacked = UnpackBytes(Arguments, ArgumentsSize, &Offset, &Integer, sizeof(Integer));
+            break;
+        case LogArgumentFloat:
+            Unpacked = UnpackBytes(Arguments, ArgumentsSize, &Offset, &Float, sizeof(Float));
+            break;
+        case LogArgumentString:
+            Unpacked = UnpackBytes(Arguments, ArgumentsSize, &Offset, &StringLength, sizeof(StringLength));
+            if (Unpacked && StringLength == UINT16_MAX)
+            {
+                String = "(null)";
+            }
+            else if (Unpacked && StringLength <= ArgumentsSize - Offset)
+            {
+                // The packed string isn't terminated, so the precision keeps it from being overread
+                String = (PCSTR)Arguments + Offset;
+                Offset += StringLength;
+                Precision = Precision >= 0 ? PURPL_MIN(Precision, StringLength) : StringLength;
+            }
+            else
+            {
+                Unpacked = FALSE;
+            }
+            break;
+        default:
+            break;
+        }
+        if (!Unpacked)
+        {
+            return FALSE;
+        }
+
+        // Integers are all packed as 64-bit, so the length modifier is replaced
+        CHAR Specification[32];
+        UINT64 SpecificationLength = 0;
+        AppendFormatted(Specification, sizeof(Specification), &SpecificationLength, "%%%s%s", Conversion.Flags,
+                        LeftAlign ? "-" : "");
+        if (Width >= 0)
+        {
+            AppendFormatted(Specification, sizeof(Specification), &SpecificationLength, "%lld", Width);
+        }
+        if (Precision >= 0)
+        {
+            AppendFormatted(Specification, sizeof(Specification), &SpecificationLength, ".%lld", Precision);
+        }
+        AppendFormatted(Specification, sizeof(Specification), &SpecificationLength, "%s%c",
+                        Type == LogArgumentSigned || Type == LogArgumentUnsigned ? "ll" : "", Conversion.Type);
 
-        va_end(Event.ArgList);
+        switch (Type)
+        {
+        case LogArgumentSigned:
+        case LogArgumentUnsigned:
+            AppendFormatted(Buffer, Size, &Written, Specification, Integer);
+            break;
+        case LogArgumentCharacter:
+            AppendFormatted(Buffer, Size, &Written, Specification, (int)Integer);
+            break;
+        case LogArgumentPointer:
+            AppendFormatted(Buffer, Size, &Written, Specification, (PVOID)(UINT_PTR)Integer);
+            break;
+        case LogArgumentFloat:
+            AppendFormatted(Buffer, Size, &Written, Specification, Float);
+            break;
+        case LogArgumentString:
+            AppendFormatted(Buffer, Size, &Written, Specification, String);
+            break;
+        default:
+            break;
+        }
     }
 
-    for (int i = 0; i < LOG_MAX_CALLBACKS && LogState.Callbacks[i].Log; i++)
+    return Offset == ArgumentsSize;
+}
+
+static VOID WriteBinaryString(PCSTR String)
+{
+    UINT64 Id = (UINT64)(UINT_PTR)String;
+
+    if (!String)
     {
-        LOG_CALLBACK *cb = &LogState.Callbacks[i];
-        if (Level >= cb->Level)
+        return;
+    }
+
+    // Strings are remembered by address, if there's no room they just get
+    // written again
+    UINT64 Hash = (Id >> 3) * 0x9E3779B97F4A7C15ull;
+    for (UINT32 i = 0; i < 8; i++)
+    {
+        UINT64 *Slot = &LogState.BinaryStrings[(Hash + i) & (LOG_BINARY_STRING_TABLE_SIZE - 1)];
+        if (*Slot == Id)
         {
-            InitEvent(&Event, cb->Data);
-            va_start(Event.ArgList, Format);
-            cb->Log(&Event);
-            va_end(Event.ArgList);
+            return;
+        }
+        else if (!*Slot)
+        {
+            *Slot = Id;
+            break;
         }
     }
 
-    LogUnlock();
+    LOG_BINARY_STRING Entry = {
+        .Type = LogBinaryEntryString,
+        .Id = Id,
+        .Length = (UINT16)PURPL_MIN(strlen(String), UINT16_MAX),
+    };
+    fwrite(&Entry, sizeof(Entry), 1, LogState.BinaryFile);
+    fwrite(String, 1, Entry.Length, LogState.BinaryFile);
+}
+
+static VOID WriteBinaryRecord(LOG_EVENT *Event, CONST VOID *Arguments, UINT16 ArgumentsSize)
+{
+    if (!LogState.BinaryFile || Event->Level < GetSinkLevel(Event->Channel, LogState.BinaryLevel))
+    {
+        return;
+    }
+
+    WriteBinaryString(Event->Format);
+    WriteBinaryString(Event->File);
+
+    LOG_BINARY_RECORD Record = {
+        .Type = LogBinaryEntryRecord,
+        .Nanoseconds = Event->Nanoseconds,
+        .Format = (UINT64)(UINT_PTR)Event->Format,
+        .File = (UINT64)(UINT_PTR)Event->File,
+        .Line = Event->Line,
+        .Level = (UINT8)Event->Level,
+        .HexLine = Event->HexLine,
+        .ThreadNameLength = Event->ThreadName ? (UINT8)PURPL_MIN(strlen(Event->ThreadName), UINT8_MAX) : 0,
+        .ArgumentsSize = ArgumentsSize,
+    };
+    fwrite(&Record, sizeof(Record), 1, LogState.BinaryFile);
+    fwrite(Event->ThreadName, 1, Record.ThreadNameLength, LogState.BinaryFile);
+    fwrite(Arguments, 1, ArgumentsSize, LogState.BinaryFile);
+
+    // Anything after an error might not get written
+    if (Event->Level >= LogLevelError)
+    {
+        fflush(LogState.BinaryFile);
+    }
+}
+
+static BOOLEAN IsTextWanted(LOG_CHANNEL Channel, LOG_LEVEL Level)
+{
+    if (!LogState.Quiet && Level >= GetSinkLevel(Channel, LogState.Level))
+    {
+        return TRUE;
+    }
+
+    for (int i = 0; i < LOG_MAX_CALLBACKS && LogState.Callbacks[i].Log; i++)
+    {
+        if (Level >= GetSinkLevel(Channel, LogState.Callbacks[i].Level))
+        {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static VOID WriteTextEvent(LOG_EVENT *Event, va_list Arguments)
+{
+    if (!LogState.Quiet && Event->Level >= GetSinkLevel(Event->Channel, LogState.Level))
+    {
+        InitEvent(Event, stderr);
+        va_copy(Event->ArgList, Arguments);
+
+#if !(defined PURPL_SWITCH && !defined PURPL_CONSOLE_HOMEBREW)
+        StdoutCallback(Event);
+#endif
+
+#ifdef PURPL_HAVE_PLATPRINT
+        va_end(Event->ArgList);
+        va_copy(Event->ArgList, Arguments);
+        PlatPrintCallback(Event);
+#endif
+
+        va_end(Event->ArgList);
+    }
+
+    for (int i = 0; i < LOG_MAX_CALLBACKS && LogState.Callbacks[i].Log; i++)
+    {
+        LOG_CALLBACK *cb = &LogState.Callbacks[i];
+        if (Event->Level >= GetSinkLevel(Event->Channel, cb->Level))
+        {
+            InitEvent(Event, cb->Data);
+            va_copy(Event->ArgList, Arguments);
+            cb->Log(Event);
+            va_end(Event->ArgList);
+        }
+    }
+}
+
+// Packed has room for LOG_MAX_PACKED_ARGUMENTS bytes, PackedSize is -1 if the arguments couldn't be packed
+static VOID WritePackedEvent(LOG_EVENT *Event, va_list Arguments, PBYTE Packed, INT32 PackedSize)
+{
+    va_list CopiedArguments;
+
+    WriteTextEvent(Event, Arguments);
+
+    if (LogState.BinaryFile && Event->Level >= GetSinkLevel(Event->Channel, LogState.BinaryLevel))
+    {
+        if (PackedSize < 0)
+        {
+            // Store what fits of the formatted message instead
+            CHAR Message[LOG_MAX_PACKED_ARGUMENTS - sizeof(UINT16)];
+            va_copy(CopiedArguments, Arguments);
+            vsnprintf(Message, sizeof(Message), Event->Format, CopiedArguments);
+            va_end(CopiedArguments);
+
+            LOG_EVENT MessageEvent = *Event;
+            MessageEvent.Format = "%s";
+            PackedSize = PackArgumentsEx(Packed, LOG_MAX_PACKED_ARGUMENTS, MessageEvent.Format, Message);
+            WriteBinaryRecord(&MessageEvent, Packed, (UINT16)PackedSize);
+        }
+        else
+        {
+            WriteBinaryRecord(Event, Packed, (UINT16)PackedSize);
+        }
+    }
+}
+
+static VOID WritePackedQueuedEvent(LOG_EVENT *Event, ...)
+{
+    BYTE Packed[LOG_MAX_PACKED_ARGUMENTS];
+    va_list Arguments;
+    va_list CopiedArguments;
+
+    va_start(Arguments, Event);
+    va_copy(CopiedArguments, Arguments);
+    INT32 PackedSize = PackArguments(Event->Format, CopiedArguments, Packed, sizeof(Packed));
+    va_end(CopiedArguments);
+    WritePackedEvent(Event, Arguments, Packed, PackedSize);
+    va_end(Arguments);
+}
+
+// Writes how many times the last message was repeated, if it was
+static VOID WriteRepeatCount(VOID)
+{
+    LOG_REPEAT *Last = &LogState.Last;
+
+    if (Last->Count > 0)
+    {
+        LOG_EVENT Event = {
+            .Format = "Last message repeated %llu more time(s)",
+            .File = Last->File,
+            .ThreadName = Last->ThreadName,
+            .WallTime = Last->WallTime,
+            .Nanoseconds = Last->Nanoseconds,
+            .Line = Last->Line,
+            .HexLine = Last->HexLine,
+            .Level = Last->Level,
+            .Channel = Last->Channel,
+        };
+        WritePackedQueuedEvent(&Event, Last->Count);
+        Last->Count = 0;
+        AsAtomicStore64(&Last->PendingTime, 0);
+    }
+}
+
+// Checks if a message is the same as the last one, and counts it instead of
+// having it written if it is. Has to be called with the lock held.
+static BOOLEAN IsRepeat(LOG_EVENT *Event, CONST VOID *Arguments, INT32 ArgumentsSize)
+{
+    LOG_REPEAT *Last = &LogState.Last;
+
+    if (!LogState.Coalesce)
+    {
+        return FALSE;
+    }
+
+    PCSTR ThreadName = Event->ThreadName ? Event->ThreadName : "";
+    if (Last->Valid && ArgumentsSize >= 0 && Event->Format == Last->Format && Event->File == Last->File &&
+        Event->Line == Last->Line && Event->Level == Last->Level && Event->Channel == Last->Channel &&
+        ArgumentsSize == Last->ArgumentsSize &&
+        memcmp(Arguments, Last->Arguments, ArgumentsSize) == 0 &&
+        strncmp(ThreadName, Last->ThreadName, sizeof(Last->ThreadName) - 1) == 0)
+    {
+        Last->Count++;
+        Last->WallTime = Event->WallTime;
+        Last->Nanoseconds = Event->Nanoseconds;
+        AsAtomicStore64(&Last->PendingTime, Event->Nanoseconds);
+        return TRUE;
+    }
+
+    WriteRepeatCount();
+
+    // Messages that couldn't be packed can't be compared
+    Last->Valid = ArgumentsSize >= 0;
+    if (Last->Valid)
+    {
+        Last->Format = Event->Format;
+        Last->File = Event->File;
+        Last->Line = Event->Line;
+        Last->HexLine = Event->HexLine;
+        Last->Level = Event->Level;
+        Last->Channel = Event->Channel;
+        strncpy(Last->ThreadName, ThreadName, sizeof(Last->ThreadName) - 1);
+        Last->ThreadName[sizeof(Last->ThreadName) - 1] = 0;
+        Last->ArgumentsSize = (UINT16)ArgumentsSize;
+        memcpy(Last->Arguments, Arguments, ArgumentsSize);
+    }
+
+    return FALSE;
+}
+
+// Writes the repeat count now instead of waiting for a different message
+static VOID FlushRepeats(VOID)
+{
+    LogLock();
+    WriteRepeatCount();
+    LogState.Last.Valid = FALSE;
+    LogUnlock();
+}
+
+static VOID WriteEvent(LOG_EVENT *Event, va_list Arguments)
+{
+    BYTE Packed[LOG_MAX_PACKED_ARGUMENTS];
+    INT32 PackedSize = -1;
+    va_list CopiedArguments;
+
+    // Packing is how repeats are found, and what goes in the binary file
+    if (LogState.Coalesce || (LogState.BinaryFile && Event->Level >= GetSinkLevel(Event->Channel, LogState.BinaryLevel)))
+    {
+        va_copy(CopiedArguments, Arguments);
+        PackedSize = PackArguments(Event->Format, CopiedArguments, Packed, sizeof(Packed));
+        va_end(CopiedArguments);
+    }
+
+    if (IsRepeat(Event, Packed, PackedSize))
+    {
+        return;
+    }
+
+    WritePackedEvent(Event, Arguments, Packed, PackedSize);
+}
+
+static VOID WriteQueuedEvent(LOG_EVENT *Event, ...)
+{
+    va_list Arguments;
+
+    va_start(Arguments, Event);
+    WriteEvent(Event, Arguments);
+    va_end(Arguments);
+}
+
+static VOID WriteTextQueuedEvent(LOG_EVENT *Event, ...)
+{
+    va_list Arguments;
+
+    va_start(Arguments, Event);
+    WriteTextEvent(Event, Arguments);
+    va_end(Arguments);
+}
+
+static BOOLEAN ReadQueue(VOID)
+{
+    LOG_QUEUE *Queue = &LogState.Queue;
+    BOOLEAN Read = FALSE;
+
+    // Checked before taking the lock, so the writer thread doesn't contend
+    // with threads that are logging when there's nothing to write
+    if (AsAtomicLoad64(&Queue->DroppedCount) == 0 &&
+        AsAtomicLoad64(&Queue->Records[Queue->Tail & (LOG_QUEUE_SIZE - 1)].Sequence) != Queue->Tail + 1)
+    {
+        return FALSE;
+    }
+
+    LogLock();
+
+    UINT64 DroppedCount = AsAtomicLoad64(&Queue->DroppedCount);
+    if (DroppedCount > 0)
+    {
+        AsAtomicAdd64(&Queue->DroppedCount, (UINT64)-(INT64)DroppedCount);
+        LOG_EVENT Event = {
+            .Format = "Dropped %llu message(s) because the log queue was full",
+            .File = __FILE__,
+            .ThreadName = AsCurrentThread->Name,
+            .WallTime = time(NULL),
+            .Nanoseconds = PlatGetNanoseconds(),
+            .Line = __LINE__,
+            .Level = LogLevelWarning,
+        };
+        WriteQueuedEvent(&Event, DroppedCount);
+        Read = TRUE;
+    }
+
+    while (TRUE)
+    {
+        LOG_RECORD *Record = &Queue->Records[Queue->Tail & (LOG_QUEUE_SIZE - 1)];
+        if (AsAtomicLoad64(&Record->Sequence) != Queue->Tail + 1)
+        {
+            break;
+        }
+
+        LOG_EVENT Event = {
+            .Format = Record->Format,
+            .File = Record->File,
+            .ThreadName = Record->ThreadName,
+            .WallTime = Record->WallTime,
+            .Nanoseconds = Record->Nanoseconds,
+            .Line = Record->Line,
+            .HexLine = Record->HexLine,
+            .Level = Record->Level,
+            .Channel = Record->Channel,
+        };
+
+        // This is the only place queued messages get formatted, and the
+        // binary file doesn't need them to be
+        if (!IsRepeat(&Event, Record->Arguments, Record->ArgumentsSize))
+        {
+            if (IsTextWanted(Record->Channel, Record->Level))
+            {
+                CHAR Message[4096];
+                LogFormatPacked(Record->Format, Record->Arguments, Record->ArgumentsSize, Message, sizeof(Message));
+                LOG_EVENT TextEvent = Event;
+                TextEvent.Format = "%s";
+                WriteTextQueuedEvent(&TextEvent, Message);
+            }
+            WriteBinaryRecord(&Event, Record->Arguments, Record->ArgumentsSize);
+        }
+
+        AsAtomicStore64(&Record->Sequence, Queue->Tail + LOG_QUEUE_SIZE);
+        Queue->Tail++;
+        Read = TRUE;
+    }
+
+    LogUnlock();
+
+    return Read;
+}
+
+static UINT_PTR LogWriterThread(PVOID UserData)
+{
+    LOG_QUEUE *Queue = &LogState.Queue;
+
+    UNREFERENCED_PARAMETER(UserData);
+
+    // There's nothing to wait on, so it just checks every millisecond while
+    // the queue is empty
+    BOOLEAN Stopping = FALSE;
+    while (!Stopping)
+    {
+        Stopping = AsAtomicLoad8(&Queue->Stop);
+        AsLockMutex(Queue->ReadLock, TRUE);
+        BOOLEAN Read = ReadQueue();
+        AsUnlockMutex(Queue->ReadLock);
+        if (!Read && !Stopping)
+        {
+            // Repeats get written once the message stops repeating for a bit,
+            // instead of whenever the next message comes along
+            UINT64 PendingTime = AsAtomicLoad64(&LogState.Last.PendingTime);
+            if (PendingTime && PlatGetNanoseconds() - PendingTime > LOG_REPEAT_FLUSH_DELAY)
+            {
+                LogLock();
+                if (LogState.Last.Count > 0 &&
+                    PlatGetNanoseconds() - LogState.Last.Nanoseconds > LOG_REPEAT_FLUSH_DELAY)
+                {
+                    WriteRepeatCount();
+                    LogState.Last.Valid = FALSE;
+                }
+                LogUnlock();
+            }
+            PlatSleep(1);
+        }
+    }
+
+    return 0;
+}
+
+static BOOLEAN QueueMessage(LOG_EVENT *Event, va_list Arguments)
+{
+    LOG_QUEUE *Queue = &LogState.Queue;
+    BYTE Packed[LOG_MAX_PACKED_ARGUMENTS];
+    va_list CopiedArguments;
+
+    // Copying the arguments is a lot cheaper than formatting them, the writer
+    // thread does that
+    va_copy(CopiedArguments, Arguments);
+    INT32 PackedSize = PackArguments(Event->Format, CopiedArguments, Packed, sizeof(Packed));
+    va_end(CopiedArguments);
+    if (PackedSize < 0)
+    {
+        return FALSE;
+    }
+
+    LOG_RECORD *Record = NULL;
+    UINT64 Position = AsAtomicLoad64(&Queue->Head);
+    while (TRUE)
+    {
+        Record = &Queue->Records[Position & (LOG_QUEUE_SIZE - 1)];
+        INT64 Difference = (INT64)(AsAtomicLoad64(&Record->Sequence) - Position);
+        if (Difference == 0)
+        {
+            UINT64 Previous = AsAtomicCompareExchange64(&Queue->Head, Position, Position + 1);
+            if (Previous == Position)
+            {
+                break;
+            }
+            Position = Previous;
+        }
+        else if (Difference < 0)
+        {
+            // The writer hasn't read this record since the last time around,
+            // errors always wait for it since they matter more than the rest
+            BOOLEAN Drop = Queue->Policy != LogQueueBlock && Event->Level < LogLevelError;
+            if (Drop && Queue->Policy == LogQueueDropCounted)
+            {
+                AsAtomicAdd64(&Queue->DroppedCount, 1);
+            }
+            if (Drop)
+            {
+                return TRUE;
+            }
+            PlatSleep(1);
+            Position = AsAtomicLoad64(&Queue->Head);
+        }
+        else
+        {
+            Position = AsAtomicLoad64(&Queue->Head);
+        }
+    }
+
+    Record->WallTime = Event->WallTime;
+    Record->Nanoseconds = Event->Nanoseconds;
+    Record->Format = Event->Format;
+    Record->File = Event->File;
+    Record->Line = Event->Line;
+    Record->HexLine = Event->HexLine;
+    Record->Level = Event->Level;
+    Record->Channel = Event->Channel;
+    strncpy(Record->ThreadName, Event->ThreadName, sizeof(Record->ThreadName) - 1);
+    Record->ThreadName[sizeof(Record->ThreadName) - 1] = 0;
+    Record->ArgumentsSize = (UINT16)PackedSize;
+    memcpy(Record->Arguments, Packed, PackedSize);
+    AsAtomicStore64(&Record->Sequence, Position + 1);
+
+    return TRUE;
+}
+
+BOOLEAN LogStartAsync(LOG_QUEUE_POLICY Policy)
+{
+    LOG_QUEUE *Queue = &LogState.Queue;
+
+    if (Queue->Records)
+    {
+        return TRUE;
+    }
+
+    Queue->ReadLock = AsCreateMutex();
+    LOG_RECORD *Records = CmnAllocType(LOG_QUEUE_SIZE, LOG_RECORD);
+    if (!Queue->ReadLock || !Records)
+    {
+        LogError("Failed to allocate log queue");
+        if (Queue->ReadLock)
+        {
+            AsDestroyMutex(Queue->ReadLock);
+        }
+        CmnFree(Records);
+        return FALSE;
+    }
+
+    for (UINT64 i = 0; i < LOG_QUEUE_SIZE; i++)
+    {
+        Records[i].Sequence = i;
+    }
+    Queue->Head = 0;
+    Queue->Tail = 0;
+    Queue->DroppedCount = 0;
+    Queue->Policy = Policy;
+    Queue->Stop = FALSE;
+
+    // Some platforms start threads right away, so the queue has to be ready first
+    Queue->Records = Records;
+    Queue->Thread = AsCreateThread("log writer", LOG_WRITER_STACK_SIZE, LogWriterThread, NULL);
+    if (!Queue->Thread)
+    {
+        LogFlush();
+        CmnFree(Queue->Records);
+        AsDestroyMutex(Queue->ReadLock);
+        Queue->ReadLock = NULL;
+        LogError("Failed to create log writer thread");
+        return FALSE;
+    }
+    AsResumeThread(Queue->Thread);
+
+    LogDebug("Logging asynchronously, %s messages when the queue is full",
+             Policy == LogQueueBlock ? "waiting to queue" : "dropping");
+
+    return TRUE;
+}
+
+VOID LogStopAsync(VOID)
+{
+    LOG_QUEUE *Queue = &LogState.Queue;
+
+    if (Queue->Records)
+    {
+        // The writer reads everything that's left before it stops
+        AsAtomicOr8(&Queue->Stop, TRUE);
+        AsJoinThread(Queue->Thread);
+        Queue->Thread = NULL;
+
+        CmnFree(Queue->Records);
+        AsDestroyMutex(Queue->ReadLock);
+        Queue->ReadLock = NULL;
+    }
+
+    FlushRepeats();
+}
+
+static VOID DrainQueue(VOID)
+{
+    LOG_QUEUE *Queue = &LogState.Queue;
+
+    // The writer thread can't wait for itself
+    if (Queue->Records && AsCurrentThread != Queue->Thread)
+    {
+        AsLockMutex(Queue->ReadLock, TRUE);
+        ReadQueue();
+        AsUnlockMutex(Queue->ReadLock);
+    }
+}
+
+VOID LogFlush(VOID)
+{
+    DrainQueue();
+    FlushRepeats();
+}
+
+static VOID SubmitEvent(LOG_EVENT *Event, va_list Arguments)
+{
+    // Fatal messages have to be out before the process stops
+    if (LogState.Queue.Records && Event->Level < LogLevelFatal && AsCurrentThread != LogState.Queue.Thread &&
+        QueueMessage(Event, Arguments))
+    {
+        return;
+    }
+
+    DrainQueue();
+
+    LogLock();
+    WriteEvent(Event, Arguments);
+    LogUnlock();
+}
+
+static VOID SubmitEventEx(LOG_EVENT *Event, ...)
+{
+    va_list Arguments;
+
+    va_start(Arguments, Event);
+    SubmitEvent(Event, Arguments);
+    va_end(Arguments);
+}
+
+// Takes a token from the bucket for the place the message is from, and gets
+// how many messages from there were suppressed since the last one that wasn't
+static BOOLEAN IsRateLimited(LOG_EVENT *Event, PUINT64 SuppressedCount)
+{
+    UINT64 Key = ((UINT64)(UINT_PTR)Event->File * 0x9E3779B97F4A7C15ull) ^ ((UINT64)Event->Line * 0xC2B2AE3D27D4EB4Full);
+    Key |= 1; // 0 is a free slot
+
+    LOG_RATE_LIMIT_SLOT *Slot = NULL;
+    for (UINT32 i = 0; i < 8 && !Slot; i++)
+    {
+        LOG_RATE_LIMIT_SLOT *Candidate = &LogState.RateLimits[((Key >> 32) + i) & (LOG_RATE_LIMIT_SLOTS - 1)];
+        UINT64 CandidateKey = AsAtomicLoad64(&Candidate->Key);
+        if (!CandidateKey)
+        {
+            UINT64 Previous = AsAtomicCompareExchange64(&Candidate->Key, 0, Key);
+            CandidateKey = Previous ? Previous : Key;
+        }
+        if (CandidateKey == Key)
+        {
+            Slot = Candidate;
+        }
+    }
+    if (!Slot)
+    {
+        return FALSE;
+    }
+
+    UINT64 Now = Event->Nanoseconds;
+    while (TRUE)
+    {
+        UINT64 NextTime = AsAtomicLoad64(&Slot->NextTime);
+        UINT64 Start = PURPL_MAX(NextTime, Now);
+        if (Start - Now > LogState.RateTolerance)
+        {
+            AsAtomicAdd64(&Slot->SuppressedCount, 1);
+            return TRUE;
+        }
+        if (AsAtomicCompareExchange64(&Slot->NextTime, NextTime, Start + LogState.RateInterval) == NextTime)
+        {
+            break;
+        }
+    }
+
+    *SuppressedCount = AsAtomicLoad64(&Slot->SuppressedCount);
+    if (*SuppressedCount > 0)
+    {
+        AsAtomicAdd64(&Slot->SuppressedCount, (UINT64)-(INT64)*SuppressedCount);
+    }
+
+    return FALSE;
+}
+
+static VOID LogChannelMessageV(LOG_CHANNEL Channel, LOG_LEVEL Level, PCSTR File, uint64_t Line, BOOLEAN HexLine,
+                               PCSTR Format, va_list Arguments)
+{
+    LOG_EVENT Event = {
+        .Format = Format,
+        .File = File,
+        .Line = Line,
+        .HexLine = HexLine,
+        .Level = Level,
+        .Channel = (UINT32)Channel < LogChannelCount ? Channel : LogChannelGeneral,
+    };
+
+    // The macros already check this, but LogMessage can be called directly
+    if (Level < LogWantedLevels[Event.Channel])
+    {
+        return;
+    }
+
+    Event.ThreadName = AsCurrentThread->Name;
+    Event.WallTime = time(NULL);
+    Event.Nanoseconds = PlatGetNanoseconds();
+
+    UINT64 SuppressedCount = 0;
+    if (LogState.RateInterval && Level < LogLevelFatal && IsRateLimited(&Event, &SuppressedCount))
+    {
+        return;
+    }
+    if (SuppressedCount > 0)
+    {
+        LOG_EVENT SuppressedEvent = Event;
+        SuppressedEvent.Format = "Suppressed %llu message(s) from here";
+        SubmitEventEx(&SuppressedEvent, SuppressedCount);
+    }
+
+    SubmitEvent(&Event, Arguments);
+}
+
+VOID LogMessage(LOG_LEVEL Level, PCSTR File, uint64_t Line, BOOLEAN HexLine, PCSTR Format, ...)
+{
+    va_list Arguments;
+
+    va_start(Arguments, Format);
+    LogChannelMessageV(LogChannelGeneral, Level, File, Line, HexLine, Format, Arguments);
+    va_end(Arguments);
+}
+
+VOID LogChannelMessage(LOG_CHANNEL Channel, LOG_LEVEL Level, PCSTR File, uint64_t Line, BOOLEAN HexLine, PCSTR Format,
+                       ...)
+{
+    va_list Arguments;
+
+    va_start(Arguments, Format);
+    LogChannelMessageV(Channel, Level, File, Line, HexLine, Format, Arguments);
+    va_end(Arguments);
+}
+
+VOID LogSetBinaryFile(FILE *File, LOG_LEVEL Level)
+{
+    // Queued messages go to the file they were logged for
+    LogFlush();
+
+    LogLock();
+    if (LogState.BinaryFile)
+    {
+        fflush(LogState.BinaryFile);
+    }
+
+    LogState.BinaryFile = File;
+    LogState.BinaryLevel = Level;
+    memset(LogState.BinaryStrings, 0, sizeof(LogState.BinaryStrings));
+    UpdateWantedLevel();
+
+    if (File)
+    {
+        LOG_BINARY_HEADER Header = {
+            .Signature = LOG_BINARY_SIGNATURE,
+            .Version = LOG_BINARY_VERSION,
+            .StartTime = (INT64)time(NULL),
+            .StartNanoseconds = PlatGetNanoseconds(),
+        };
+        fwrite(&Header, sizeof(Header), 1, File);
+    }
+    LogUnlock();
+}
+
+VOID LogSetCoalescing(BOOLEAN Coalesce)
+{
+    LogFlush();
+    LogState.Coalesce = Coalesce;
+}
+
+VOID LogSetRateLimit(UINT32 Rate, UINT32 Burst)
+{
+    LogState.RateInterval = Rate ? 1000000000ull / Rate : 0;
+    LogState.RateTolerance = LogState.RateInterval * (PURPL_MAX(Burst, 1) - 1);
+    memset(LogState.RateLimits, 0, sizeof(LogState.RateLimits));
+}
+
+VOID LogRemoveFile(FILE *File)
+{
+    // Queued messages go to the file they were logged for
+    LogFlush();
+
+    LogLock();
+    int Count = 0;
+    for (int i = 0; i < LOG_MAX_CALLBACKS && LogState.Callbacks[i].Log; i++)
+    {
+        LOG_CALLBACK *cb = &LogState.Callbacks[i];
+        if ((cb->Log != FileCallback && cb->Log != JsonCallback) || cb->Data != File)
+        {
+            LogState.Callbacks[Count++] = *cb;
+        }
+    }
+    memset(&LogState.Callbacks[Count], 0, (LOG_MAX_CALLBACKS - Count) * sizeof(LOG_CALLBACK));
+    UpdateWantedLevel();
+    LogUnlock();
+
+    fflush(File);
 }
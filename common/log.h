@@ -9,6 +9,12 @@
  * - Add option to display line number in hex (for callbacks where you get an
  * address)
  * - Add thread name to messages
+ * - Add asynchronous mode with a writer thread
+ * - Add binary log files that are formatted later
+ * - Check levels in the macros, and allow compiling out low levels
+ * - Cache formatted times, and give events a monotonic timestamp
+ * - Add rate limiting and coalescing of repeated messages
+ * - Add channels with their own levels, and a JSON lines sink
  */
 
 #ifndef LOG_H
@@ -36,36 +42,145 @@ typedef enum LOG_LEVEL
     LogLevelFatal
 } LOG_LEVEL;
 
+// Parts of the engine that log, each one can be given its own level
+typedef enum LOG_CHANNEL
+{
+    LogChannelGeneral,
+    LogChannelPlatform,
+    LogChannelAsync,
+    LogChannelVideo,
+    LogChannelConfig,
+    LogChannelFs,
+    LogChannelPack,
+    LogChannelCount
+} LOG_CHANNEL;
+
+// What happens to messages logged while the async queue is full
+typedef enum LOG_QUEUE_POLICY
+{
+    LogQueueBlock,       // Wait for the writer thread to make room
+    LogQueueDrop,        // Drop the message, unless it's an error
+    LogQueueDropCounted, // Like LogQueueDrop, and have the writer thread say how many were dropped
+    LogQueuePolicyCount
+} LOG_QUEUE_POLICY;
+
+// Most argument bytes a packed message can have, strings are copied in
+#define LOG_MAX_PACKED_ARGUMENTS 512
+
+// Binary log files are a LOG_BINARY_HEADER followed by entries that start with
+// a LOG_BINARY_ENTRY_TYPE. They're in the byte order of the machine that wrote
+// them, devtools/logtool.c turns them into text.
+#define LOG_BINARY_SIGNATURE 0x474F4C50 // PLOG
+#define LOG_BINARY_VERSION 1
+
+typedef enum LOG_BINARY_ENTRY_TYPE
+{
+    LogBinaryEntryString = 1, // LOG_BINARY_STRING, then Length bytes
+    LogBinaryEntryRecord,     // LOG_BINARY_RECORD, then the thread name and the arguments
+} LOG_BINARY_ENTRY_TYPE;
+
+#pragma pack(push, 1)
+typedef struct LOG_BINARY_HEADER
+{
+    UINT32 Signature;
+    UINT32 Version;
+    INT64 StartTime;         // time() when the file was started
+    UINT64 StartNanoseconds; // PlatGetNanoseconds() at the same point
+} LOG_BINARY_HEADER;
+
+// Format strings and file names are written once, records refer to them by
+// their address in the process that wrote the file
+typedef struct LOG_BINARY_STRING
+{
+    UINT8 Type;
+    UINT64 Id;
+    UINT16 Length;
+} LOG_BINARY_STRING;
+
+typedef struct LOG_BINARY_RECORD
+{
+    UINT8 Type;
+    UINT64 Nanoseconds; // From PlatGetNanoseconds
+    UINT64 Format;      // String ID
+    UINT64 File;        // String ID, 0 if there isn't one
+    INT64 Line;
+    UINT8 Level;
+    UINT8 HexLine;
+    UINT8 ThreadNameLength;
+    UINT16 ArgumentsSize; // Packed the way LogFormatPacked reads them
+} LOG_BINARY_RECORD;
+#pragma pack(pop)
+
 typedef struct LOG_EVENT
 {
     va_list ArgList;
     PCSTR Format;
     PCSTR File;
+    PCSTR ThreadName;
+    time_t WallTime;
+    UINT64 Nanoseconds; // PlatGetNanoseconds when the message was logged
     struct tm *Time;
+    PCSTR TimeString;     // Time as %H:%M:%S
+    PCSTR DateTimeString; // Time as %Y-%m-%d %H:%M:%S
     PVOID Data;
     int64_t Line;
     BOOLEAN HexLine;
     LOG_LEVEL Level;
+    LOG_CHANNEL Channel;
 } LOG_EVENT;
 
 typedef VOID (*PFN_LOG_LOG)(LOG_EVENT *Event);
 typedef VOID (*PFN_LOG_LOCK)(BOOLEAN Lock, PVOID Data);
 
-#define LogTrace(...)                                                          \
-    LogMessage(LogLevelTrace, __FILE__, __LINE__, false, __VA_ARGS__)
-#define LogDebug(...)                                                          \
-    LogMessage(LogLevelDebug, __FILE__, __LINE__, false, __VA_ARGS__)
-#define LogInfo(...)                                                           \
-    LogMessage(LogLevelInfo, __FILE__, __LINE__, false, __VA_ARGS__)
-#define LogWarning(...)                                                        \
-    LogMessage(LogLevelWarning, __FILE__, __LINE__, false, __VA_ARGS__)
-#define LogError(...)                                                          \
-    LogMessage(LogLevelError, __FILE__, __LINE__, false, __VA_ARGS__)
-#define LogFatal(...)                                                          \
-    LogMessage(LogLevelFatal, __FILE__, __LINE__, false, __VA_ARGS__)
+// Messages below this level are compiled out
+#ifndef LOG_MINIMUM_LEVEL
+#define LOG_MINIMUM_LEVEL LogLevelTrace
+#endif
+
+// The build takes the project directory out of __FILE__ (see support.lua), so
+// file names don't have to be trimmed when messages are logged
+#ifndef LOG_FILE
+#define LOG_FILE __FILE__
+#endif
+
+// The channel the macros log to, files that aren't general define it before
+// including anything
+#ifndef LOG_FILE_CHANNEL
+#define LOG_FILE_CHANNEL LogChannelGeneral
+#endif
+
+// The lowest level that anything will write for each channel, the macros check
+// it so messages that won't be written don't evaluate their arguments or call
+// anything
+extern LOG_LEVEL LogWantedLevels[LogChannelCount];
+
+#define LogIsWanted(Channel, Level)                                            \
+    ((Level) >= LOG_MINIMUM_LEVEL && (Level) >= LogWantedLevels[Channel])
+
+#define LOG_CHANNEL_MESSAGE(Channel, Level, ...)                               \
+    (LogIsWanted(Channel, Level)                                               \
+         ? LogChannelMessage((Channel), (Level), LOG_FILE, __LINE__, false,    \
+                             __VA_ARGS__)                                      \
+         : (VOID)0)
+
+#define LOG_MESSAGE(Level, ...)                                                \
+    LOG_CHANNEL_MESSAGE(LOG_FILE_CHANNEL, Level, __VA_ARGS__)
+
+#define LogTrace(...) LOG_MESSAGE(LogLevelTrace, __VA_ARGS__)
+#define LogDebug(...) LOG_MESSAGE(LogLevelDebug, __VA_ARGS__)
+#define LogInfo(...) LOG_MESSAGE(LogLevelInfo, __VA_ARGS__)
+#define LogWarning(...) LOG_MESSAGE(LogLevelWarning, __VA_ARGS__)
+#define LogError(...) LOG_MESSAGE(LogLevelError, __VA_ARGS__)
+#define LogFatal(...) LOG_MESSAGE(LogLevelFatal, __VA_ARGS__)
 
 extern PCSTR LogGetLevelString(LOG_LEVEL Level);
 
+// Reads a level name like "trace" or "warning", or its number
+extern BOOLEAN LogParseLevel(PCSTR String, LOG_LEVEL *Level);
+
+// Gets the lowercase name of a channel, like "pack"
+extern PCSTR LogGetChannelName(LOG_CHANNEL Channel);
+
 extern VOID LogSetLock(PFN_LOG_LOCK Lock, PVOID Data);
 
 extern VOID LogSetLevel(LOG_LEVEL Level);
@@ -78,7 +193,64 @@ extern int LogAddCallback(PFN_LOG_LOG Callback, PVOID Data, LOG_LEVEL Level);
 
 extern int LogAddFile(FILE *File, LOG_LEVEL Level);
 
+// Write messages to File as one JSON object per line, with the wall clock
+// time, PlatGetNanoseconds, thread, channel, level, file, line (or address if
+// it's in hex) and message
+extern int LogAddJsonFile(FILE *File, LOG_LEVEL Level);
+
+// Stop writing to a file added with LogAddFile or LogAddJsonFile, so it can be
+// closed
+extern VOID LogRemoveFile(FILE *File);
+
+// Give a channel its own level, which every sink uses instead of its level for
+// messages in that channel, so one part of the engine can be traced without
+// the rest
+extern VOID LogSetChannelLevel(LOG_CHANNEL Channel, LOG_LEVEL Level);
+
+// Go back to using each sink's level for a channel
+extern VOID LogResetChannelLevel(LOG_CHANNEL Channel);
+
+// Logs to the general channel
 extern VOID LogMessage(LOG_LEVEL Level, PCSTR File, uint64_t Line,
                        BOOLEAN HexLine, PCSTR Format, ...);
 
+extern VOID LogChannelMessage(LOG_CHANNEL Channel, LOG_LEVEL Level,
+                              PCSTR File, uint64_t Line, BOOLEAN HexLine,
+                              PCSTR Format, ...);
+
+// Copy the arguments of messages into a lock-free queue, and have a writer
+// thread format them and pass them to the callbacks, so logging threads don't
+// wait on formatting or I/O. Format strings have to outlive the message, which
+// literals do. Fatal messages and ones with too many argument bytes are still
+// written right away, after the queue is flushed.
+extern BOOLEAN LogStartAsync(LOG_QUEUE_POLICY Policy);
+
+// Write what's left in the queue and go back to writing messages right away,
+// nothing else can be logging
+extern VOID LogStopAsync(VOID);
+
+// Write everything in the queue on the calling thread
+extern VOID LogFlush(VOID);
+
+// Write messages to File as binary records holding the format string's
+// address and the arguments' bytes instead of formatting them, NULL stops.
+// Format strings have to be literals.
+extern VOID LogSetBinaryFile(FILE *File, LOG_LEVEL Level);
+
+// Write "Last message repeated N more time(s)" instead of messages that are
+// the same as the one before, from the same place and thread
+extern VOID LogSetCoalescing(BOOLEAN Coalesce);
+
+// Let each place that logs write Rate messages a second on average, in bursts
+// of up to Burst, and drop the rest. The next message from there says how many
+// were dropped. Fatal messages aren't limited, and 0 turns it off. Call it
+// before anything else is logging.
+extern VOID LogSetRateLimit(UINT32 Rate, UINT32 Burst);
+
+// Format the arguments of a binary record like snprintf, returns FALSE if
+// they don't match the format string
+extern BOOLEAN LogFormatPacked(PCSTR Format, CONST VOID *Arguments,
+                               UINT32 ArgumentsSize, PCHAR Buffer,
+                               UINT64 Size);
+
 #endif
@@ -1,5 +1,10 @@
+#define LOG_FILE_CHANNEL LogChannelPack
+
+#include "compression.h"
 #include "packfile.h"
 
+#include "zstd_errors.h"
+
 static PCHAR GetDirectoryPath(_In_z_ PCSTR BasePath)
 {
     PCSTR Extension = strrchr(BasePath, '.');
@@ -26,6 +31,138 @@ static PCHAR GetArchivePath(_In_z_ PCSTR BasePath, _In_ UINT16 Index)
     }
 }
 
+static VOID SetDefaultOptions(_Out_ PPACKFILE_WRITE_OPTIONS Options)
+{
+    Options->CompressionLevel = PACKFILE_DEFAULT_COMPRESSION_LEVEL;
+    Options->FastCompressionLevel = PACKFILE_DEFAULT_FAST_COMPRESSION_LEVEL;
+    Options->StoreThreshold = PACKFILE_DEFAULT_STORE_THRESHOLD;
+    Options->FastThreshold = PACKFILE_DEFAULT_FAST_THRESHOLD;
+    Options->WindowLog = PACKFILE_DEFAULT_WINDOW_LOG;
+    Options->WorkerCount = PlatGetProcessorCount();
+    Options->LargeEntrySize = PACKFILE_LARGE_ENTRY_SIZE;
+}
+
+// Bits in PACKFILE::Verified
+#define PACKFILE_VERIFIED_COMPRESSED 0b01
+#define PACKFILE_VERIFIED_FULL 0b10
+
+static UINT64 HashPath(_In_z_ PCSTR Path)
+{
+    return XXH3_64bits(Path, strlen(Path));
+}
+
+static UINT64 GetPathHash(_In_ PPACKFILE Pack, _In_z_ PCSTR Path)
+{
+    // Keys of packs with hashed paths are already hashes, and can be looked up too, like from access traces
+    UINT64 PathHash = 0;
+    if ((Pack->Header.Flags & PACKFILE_FLAG_HASHED_PATHS) && Path[0] == '#' &&
+        strlen(Path) == PACKFILE_HASHED_PATH_LENGTH && sscanf(Path, PACKFILE_HASHED_PATH_FORMAT, &PathHash) == 1)
+    {
+        return PathHash;
+    }
+
+    return HashPath(Path);
+}
+
+static PCHAR CreateKey(_In_ PPACKFILE Pack, _In_z_ PCSTR Path)
+{
+    if (Pack->Header.Flags & PACKFILE_FLAG_HASHED_PATHS)
+    {
+        return CmnFormatString(PACKFILE_HASHED_PATH_FORMAT, GetPathHash(Pack, Path));
+    }
+
+    return CmnDuplicateString(Path, 0);
+}
+
+static VOID InsertLookup(_Inout_ PPACKFILE Pack, _In_ UINT64 Index)
+{
+    UINT64 PathHash = GetPathHash(Pack, Pack->Entries[Index].key);
+    UINT64 Slot = PathHash & (Pack->LookupSize - 1);
+    while (Pack->Lookup[Slot].Index)
+    {
+        Slot = (Slot + 1) & (Pack->LookupSize - 1);
+    }
+
+    Pack->Lookup[Slot].PathHash = PathHash;
+    Pack->Lookup[Slot].Index = Index + 1;
+}
+
+static BOOLEAN RebuildLookup(_Inout_ PPACKFILE Pack)
+{
+    // Kept at most half full so probes stay short
+    UINT64 Size = 16;
+    while (Size < stbds_shlenu(Pack->Entries) * 2)
+    {
+        Size *= 2;
+    }
+
+    PPACKFILE_LOOKUP_SLOT Lookup = CmnAllocType(Size, PACKFILE_LOOKUP_SLOT);
+    if (!Lookup)
+    {
+        LogError("Failed to allocate pack file lookup table: %s", strerror(errno));
+        return FALSE;
+    }
+
+    CmnFree(Pack->Lookup);
+    Pack->Lookup = Lookup;
+    Pack->LookupSize = Size;
+
+    // Entries only get added, so anything already verified stays that way
+    UINT64 VerifiedCount = stbds_arrlenu(Pack->Verified);
+    if (VerifiedCount < stbds_shlenu(Pack->Entries))
+    {
+        stbds_arrsetlen(Pack->Verified, stbds_shlenu(Pack->Entries));
+        memset(Pack->Verified + VerifiedCount, 0, stbds_shlenu(Pack->Entries) - VerifiedCount);
+    }
+
+    for (UINT64 i = 0; i < stbds_shlenu(Pack->Entries); i++)
+    {
+        InsertLookup(Pack, i);
+    }
+
+    return TRUE;
+}
+
+static BOOLEAN AddLookup(_Inout_ PPACKFILE Pack, _In_ UINT64 Index)
+{
+    if ((Index + 1) * 2 > Pack->LookupSize)
+    {
+        return RebuildLookup(Pack);
+    }
+
+    InsertLookup(Pack, Index);
+    stbds_arrput(Pack->Verified, 0);
+    return TRUE;
+}
+
+static PPACKFILE_ENTRY FindEntry(_In_ PPACKFILE Pack, _In_z_ PCSTR Path, _Out_opt_ PUINT64 Index)
+{
+    if (!Pack->Lookup)
+    {
+        return NULL;
+    }
+
+    // Without the paths, the hash is all there is to go on
+    BOOLEAN Hashed = (Pack->Header.Flags & PACKFILE_FLAG_HASHED_PATHS) != 0;
+    UINT64 PathHash = GetPathHash(Pack, Path);
+    UINT64 Slot = PathHash & (Pack->LookupSize - 1);
+    while (Pack->Lookup[Slot].Index)
+    {
+        PPACKFILE_ENTRY_MAP Pair = &Pack->Entries[Pack->Lookup[Slot].Index - 1];
+        if (Pack->Lookup[Slot].PathHash == PathHash && (Hashed || strcmp(Pair->key, Path) == 0))
+        {
+            if (Index)
+            {
+                *Index = Pack->Lookup[Slot].Index - 1;
+            }
+            return &Pair->value;
+        }
+        Slot = (Slot + 1) & (Pack->LookupSize - 1);
+    }
+
+    return NULL;
+}
+
 PPACKFILE PackCreate(_In_z_ PCSTR Path)
 {
     PPACKFILE Pack = CmnAllocType(1, PACKFILE);
@@ -45,10 +182,82 @@ PPACKFILE PackCreate(_In_z_ PCSTR Path)
     Pack->Path = CmnDuplicateString(Path, Length);
     Pack->Header.Signature = PACKFILE_SIGNATURE;
     Pack->Header.Version = PACKFILE_FORMAT_VERSION;
+    SetDefaultOptions(&Pack->Options);
+    Pack->VerifyMode = PACKFILE_DEFAULT_VERIFY_MODE;
+    Pack->DirectReadSize = PACKFILE_DEFAULT_DIRECT_READ_SIZE;
+    Pack->BlockCache.MaxSize = PACKFILE_DEFAULT_BLOCK_CACHE_SIZE;
+    Pack->Writer.Lock = AsCreateMutex();
+    Pack->BlockCache.Lock = AsCreateMutex();
+    Pack->MappingLock = AsCreateMutex();
+    if (!Pack->Writer.Lock || !Pack->BlockCache.Lock || !Pack->MappingLock)
+    {
+        LogError("Failed to create pack locks");
+        PackFree(Pack);
+        return NULL;
+    }
 
     return Pack;
 }
 
+static VOID AppendData(_Inout_ PBYTE *Buffer, _In_reads_bytes_(Size) CONST VOID *Data, _In_ UINT64 Size)
+{
+    memcpy(stbds_arraddnptr(*Buffer, Size), Data, Size);
+}
+
+static INT CompareEntryPaths(_In_ const VOID *First, _In_ const VOID *Second)
+{
+    return strcmp((*(PPACKFILE_ENTRY_MAP *)First)->key, (*(PPACKFILE_ENTRY_MAP *)Second)->key);
+}
+
+static VOID AppendEntries(_In_ PPACKFILE Pack, _Inout_ PBYTE *Buffer)
+{
+    // Sorted paths share more with the one before them
+    PPACKFILE_ENTRY_MAP *Pairs = NULL;
+    for (UINT64 i = 0; i < stbds_shlenu(Pack->Entries); i++)
+    {
+        stbds_arrput(Pairs, &Pack->Entries[i]);
+    }
+    if (Pairs && (Pack->Header.Flags & PACKFILE_FLAG_COMPRESSED_DIRECTORY))
+    {
+        qsort(Pairs, stbds_arrlenu(Pairs), sizeof(PPACKFILE_ENTRY_MAP), CompareEntryPaths);
+    }
+
+    PCSTR PreviousPath = "";
+    for (UINT64 i = 0; i < stbds_arrlenu(Pairs); i++)
+    {
+        PCSTR Path = Pairs[i]->key;
+        PACKFILE_ENTRY Entry = Pairs[i]->value;
+        if (Pack->Header.Flags & PACKFILE_FLAG_HASHED_PATHS)
+        {
+            UINT64 PathHash = GetPathHash(Pack, Path);
+            Entry.PathLength = sizeof(UINT64);
+            AppendData(Buffer, &Entry, sizeof(PACKFILE_ENTRY));
+            AppendData(Buffer, &PathHash, sizeof(UINT64));
+        }
+        else if (Pack->Header.Flags & PACKFILE_FLAG_COMPRESSED_DIRECTORY)
+        {
+            UINT16 SharedLength = 0;
+            while (Path[SharedLength] && Path[SharedLength] == PreviousPath[SharedLength])
+            {
+                SharedLength++;
+            }
+            Entry.PathLength = (UINT16)strlen(Path);
+            AppendData(Buffer, &Entry, sizeof(PACKFILE_ENTRY));
+            AppendData(Buffer, &SharedLength, sizeof(UINT16));
+            AppendData(Buffer, Path + SharedLength, Entry.PathLength - SharedLength);
+            PreviousPath = Path;
+        }
+        else
+        {
+            Entry.PathLength = (UINT16)strlen(Path);
+            AppendData(Buffer, &Entry, sizeof(PACKFILE_ENTRY));
+            AppendData(Buffer, Path, Entry.PathLength);
+        }
+    }
+
+    stbds_arrfree(Pairs);
+}
+
 BOOLEAN PackSave(_Inout_ PVOID Handle, _In_opt_z_ PCSTR Path)
 {
     if (!Handle)
@@ -66,29 +275,213 @@ BOOLEAN PackSave(_Inout_ PVOID Handle, _In_opt_z_ PCSTR Path)
     PCHAR DirectoryPath = GetDirectoryPath(Pack->Path);
     LogInfo("Saving pack file directory to %s", DirectoryPath);
 
-    Pack->Header.ArchiveCount = Pack->CurrentArchive + 1;
-    Pack->Header.TreeSize = 0;
-    for (UINT64 i = 0; i < stbds_shlenu(Pack->Entries); i++)
+    // Everything after the header is put together first, so it can be compressed
+    PBYTE Tree = NULL;
+    for (UINT64 i = 0; i < stbds_arrlenu(Pack->Dictionaries); i++)
     {
-        // Update just in case it changed somehow
-        Pack->Entries[i].value.PathLength = (UINT16)strlen(Pack->Entries[i].key);
-        Pack->Header.TreeSize += sizeof(PACKFILE_ENTRY) + Pack->Entries[i].value.PathLength;
+        PPACKFILE_DICTIONARY Dictionary = &Pack->Dictionaries[i];
+        PACKFILE_DICTIONARY_HEADER DictionaryHeader = {0};
+        DictionaryHeader.Size = Dictionary->Size;
+        DictionaryHeader.GroupLength = (UINT16)strlen(Dictionary->Group);
+        AppendData(&Tree, &DictionaryHeader, sizeof(PACKFILE_DICTIONARY_HEADER));
+        AppendData(&Tree, Dictionary->Group, DictionaryHeader.GroupLength);
+        AppendData(&Tree, Dictionary->Data, Dictionary->Size);
     }
+    AppendEntries(Pack, &Tree);
 
-    Pack->Header.ArchiveCount = Pack->CurrentArchive + 1;
-    Pack->Header.LastArchiveLength = Pack->CurrentOffset;
-    FsWriteFile(DirectoryPath, &Pack->Header, sizeof(PACKFILE_HEADER), FALSE);
-    for (UINT64 i = 0; i < stbds_shlenu(Pack->Entries); i++)
+    Pack->Header.ArchiveCount = Pack->Writer.CurrentArchive + 1;
+    Pack->Header.LastArchiveLength = Pack->Writer.CurrentOffset;
+    Pack->Header.DictionaryCount = (UINT16)stbds_arrlenu(Pack->Dictionaries);
+    Pack->Header.TreeSize = (UINT32)stbds_arrlenu(Tree);
+
+    PVOID Data = Tree;
+    UINT64 Size = stbds_arrlenu(Tree);
+    PBYTE CompressedTree = NULL;
+    if (Pack->Header.Flags & PACKFILE_FLAG_COMPRESSED_DIRECTORY)
+    {
+        SIZE_T CompressedSize = ZSTD_compressBound(Size);
+        CompressedTree = CmnAlloc(CompressedSize, 1);
+        if (!CompressedTree)
+        {
+            LogError("Failed to allocate %s for compressed directory: %s", CmnFormatSize(CompressedSize),
+                     strerror(errno));
+            stbds_arrfree(Tree);
+            CmnFree(DirectoryPath);
+            return FALSE;
+        }
+
+        CompressedSize =
+            CmnCompress(CompressedTree, CompressedSize, Tree, Size, PACKFILE_DIRECTORY_COMPRESSION_LEVEL);
+        if (ZSTD_isError(CompressedSize))
+        {
+            LogError("Failed to compress directory: %s", ZSTD_getErrorName(CompressedSize));
+            CmnFree(CompressedTree);
+            stbds_arrfree(Tree);
+            CmnFree(DirectoryPath);
+            return FALSE;
+        }
+
+        LogDebug("Compressed %s directory to %s", CmnFormatSize(Size),
+                 CmnFormatTempString("%s", CmnFormatSize(CompressedSize)));
+        Data = CompressedTree;
+        Size = CompressedSize;
+    }
+
+    BOOLEAN Success = FsWriteFile(DirectoryPath, &Pack->Header, sizeof(PACKFILE_HEADER), FALSE) &&
+                      FsWriteFile(DirectoryPath, Data, Size, TRUE);
+    if (!Success)
     {
-        FsWriteFile(DirectoryPath, &Pack->Entries[i].value, sizeof(PACKFILE_ENTRY), TRUE);
-        FsWriteFile(DirectoryPath, Pack->Entries[i].key, Pack->Entries[i].value.PathLength, TRUE);
+        LogError("Failed to write pack file directory %s", DirectoryPath);
     }
 
+    CmnFree(CompressedTree);
+    stbds_arrfree(Tree);
     CmnFree(DirectoryPath);
 
+    return Success;
+}
+
+static BOOLEAN ParseDirectory(_Inout_ PPACKFILE Pack, _In_reads_bytes_(Size) PBYTE Data, _In_ UINT64 Size)
+{
+    PBYTE End = Data + Size;
+    PBYTE Current = Data;
+
+    for (UINT16 i = 0; i < Pack->Header.DictionaryCount; i++)
+    {
+        PPACKFILE_DICTIONARY_HEADER DictionaryHeader = (PPACKFILE_DICTIONARY_HEADER)Current;
+        if ((UINT64)(End - Current) < sizeof(PACKFILE_DICTIONARY_HEADER) ||
+            (UINT64)(End - Current) < sizeof(PACKFILE_DICTIONARY_HEADER) + DictionaryHeader->GroupLength +
+                                          DictionaryHeader->Size)
+        {
+            return FALSE;
+        }
+
+        PACKFILE_DICTIONARY Dictionary = {0};
+        Dictionary.Group = CmnFormatString("%.*s", DictionaryHeader->GroupLength, (PCSTR)(DictionaryHeader + 1));
+        Dictionary.Size = DictionaryHeader->Size;
+        Dictionary.Data = CmnAlloc(Dictionary.Size, 1);
+        if (!Dictionary.Group || !Dictionary.Data)
+        {
+            LogError("Failed to allocate dictionary: %s", strerror(errno));
+            CmnFree(Dictionary.Group);
+            CmnFree(Dictionary.Data);
+            return FALSE;
+        }
+        memcpy(Dictionary.Data, (PBYTE)(DictionaryHeader + 1) + DictionaryHeader->GroupLength, Dictionary.Size);
+
+        // Digested once here and shared by every read
+        Dictionary.DecompressionDictionary = ZSTD_createDDict(Dictionary.Data, Dictionary.Size);
+        if (!Dictionary.DecompressionDictionary)
+        {
+            LogError("Failed to load dictionary for %s", Dictionary.Group);
+            CmnFree(Dictionary.Group);
+            CmnFree(Dictionary.Data);
+            return FALSE;
+        }
+
+        LogDebug("Loaded %s dictionary for %s", CmnFormatSize(Dictionary.Size), Dictionary.Group);
+        stbds_arrput(Pack->Dictionaries, Dictionary);
+        Current = (PBYTE)(DictionaryHeader + 1) + DictionaryHeader->GroupLength + DictionaryHeader->Size;
+    }
+
+    BOOLEAN Hashed = (Pack->Header.Flags & PACKFILE_FLAG_HASHED_PATHS) != 0;
+    BOOLEAN FrontCoded = !Hashed && (Pack->Header.Flags & PACKFILE_FLAG_COMPRESSED_DIRECTORY);
+    PCSTR PreviousPath = "";
+    while (Current < End)
+    {
+        PPACKFILE_ENTRY Entry = (PPACKFILE_ENTRY)Current;
+        UINT64 EntrySize = sizeof(PACKFILE_ENTRY) + (FrontCoded ? sizeof(UINT16) : 0);
+        if ((UINT64)(End - Current) < EntrySize)
+        {
+            return FALSE;
+        }
+
+        PCSTR StoredPath = (PCSTR)Current + EntrySize;
+        UINT16 SharedLength = FrontCoded ? *(PUINT16)(Entry + 1) : 0;
+        UINT64 StoredLength = Entry->PathLength - PURPL_MIN(SharedLength, Entry->PathLength);
+        if (SharedLength > Entry->PathLength || SharedLength > strlen(PreviousPath) ||
+            (UINT64)(End - (PBYTE)StoredPath) < StoredLength || (Hashed && Entry->PathLength != sizeof(UINT64)) ||
+            Entry->Dictionary > stbds_arrlenu(Pack->Dictionaries) || Entry->Method >= PackMethodCount ||
+            (Entry->Method == PackMethodZstdDictionary) != (Entry->Dictionary != 0) ||
+            (Entry->Method == PackMethodStored && Entry->CompressedSize != Entry->Size) ||
+            (Entry->Method != PackMethodZstdSolid && Entry->BlockOffset != 0))
+        {
+            return FALSE;
+        }
+
+        PCHAR EntryPath = NULL;
+        if (Hashed)
+        {
+            UINT64 PathHash = 0;
+            memcpy(&PathHash, StoredPath, sizeof(UINT64));
+            EntryPath = CmnFormatString(PACKFILE_HASHED_PATH_FORMAT, PathHash);
+        }
+        else
+        {
+            EntryPath = CmnFormatString("%.*s%.*s", SharedLength, PreviousPath, (INT)StoredLength, StoredPath);
+        }
+        stbds_shput(Pack->Entries, EntryPath, *Entry);
+        PreviousPath = EntryPath;
+        Current = (PBYTE)StoredPath + StoredLength;
+    }
+
+    return TRUE;
+}
+
+static PPLAT_FILE OpenArchive(_In_ PPACKFILE Pack, _In_ UINT64 Index, _In_ BOOLEAN Direct)
+{
+    PCHAR ArchivePath = GetArchivePath(Pack->Path, (UINT16)Index);
+    PPLAT_FILE Archive = Direct ? PlatOpenFileDirect(ArchivePath) : PlatOpenFile(ArchivePath);
+    CmnFree(ArchivePath);
+    if (!Archive)
+    {
+        LogError("Failed to open archive %llu of pack file", Index);
+    }
+
+    return Archive;
+}
+
+static BOOLEAN OpenArchives(_Inout_ PPACKFILE Pack)
+{
+    for (UINT64 i = stbds_arrlenu(Pack->Archives); i <= Pack->Writer.CurrentArchive; i++)
+    {
+        // The last archive doesn't exist until something is written to it
+        if (i == Pack->Writer.CurrentArchive && Pack->Writer.CurrentOffset == 0)
+        {
+            break;
+        }
+
+        PPLAT_FILE Archive = OpenArchive(Pack, i, FALSE);
+        if (!Archive)
+        {
+            return FALSE;
+        }
+        stbds_arrput(Pack->Archives, Archive);
+    }
+
+    for (UINT64 i = stbds_arrlenu(Pack->DirectArchives); Pack->DirectReadSize && i < stbds_arrlenu(Pack->Archives);
+         i++)
+    {
+        PPLAT_FILE Archive = OpenArchive(Pack, i, TRUE);
+        if (!Archive)
+        {
+            return FALSE;
+        }
+        stbds_arrput(Pack->DirectArchives, Archive);
+    }
+
     return TRUE;
 }
 
+static VOID CloseArchives(_Inout_ PPLAT_FILE **Archives)
+{
+    for (UINT64 i = 0; i < stbds_arrlenu(*Archives); i++)
+    {
+        PlatCloseFile((*Archives)[i]);
+    }
+    stbds_arrfree(*Archives);
+}
+
 PPACKFILE PackLoad(_In_z_ PCSTR DirectoryPath)
 {
     if (!DirectoryPath)
@@ -96,6 +489,7 @@ PPACKFILE PackLoad(_In_z_ PCSTR DirectoryPath)
         return NULL;
     }
 
+    PPACKFILE Pack = NULL;
     PCHAR FixedPath = PlatFixPath(DirectoryPath);
     PCHAR Dir = strstr(FixedPath, "_dir");
     PCHAR Path;
@@ -128,7 +522,7 @@ PPACKFILE PackLoad(_In_z_ PCSTR DirectoryPath)
         goto Error;
     }
 
-    PPACKFILE Pack = CmnAllocType(1, PACKFILE);
+    Pack = CmnAllocType(1, PACKFILE);
     if (!Pack)
     {
         LogError("Failed to allocate pack file structure");
@@ -136,23 +530,89 @@ PPACKFILE PackLoad(_In_z_ PCSTR DirectoryPath)
     }
 
     Pack->Header = *(PPACKFILE_HEADER)DirectoryRaw;
-    if (Pack->Header.Signature != PACKFILE_SIGNATURE || Pack->Header.Version != PACKFILE_FORMAT_VERSION)
+    if (Pack->Header.Signature != PACKFILE_SIGNATURE || Pack->Header.Version != PACKFILE_FORMAT_VERSION ||
+        (Pack->Header.Flags & ~PACKFILE_KNOWN_FLAGS) != 0)
     {
         LogError("Pack file is invalid");
         goto Error;
     }
 
-    PPACKFILE_ENTRY Entry = (PPACKFILE_ENTRY)(DirectoryRaw + sizeof(PACKFILE_HEADER));
-    while ((PBYTE)Entry + Entry->PathLength < DirectoryRaw + DirectorySize)
+    PBYTE Tree = DirectoryRaw + sizeof(PACKFILE_HEADER);
+    UINT64 TreeSize = DirectorySize - sizeof(PACKFILE_HEADER);
+    if (Pack->Header.Flags & PACKFILE_FLAG_COMPRESSED_DIRECTORY)
     {
-        PCHAR EntryPath = CmnFormatString("%.*s", Entry->PathLength, (PCSTR)(Entry + 1));
-        stbds_shput(Pack->Entries, EntryPath, *Entry);
-        Entry = (PPACKFILE_ENTRY)((PBYTE)(Entry + 1) + Entry->PathLength);
+        Tree = CmnAlloc(PURPL_MAX(Pack->Header.TreeSize, 1), 1);
+        if (!Tree)
+        {
+            LogError("Failed to allocate %s for pack file directory: %s", CmnFormatSize(Pack->Header.TreeSize),
+                     strerror(errno));
+            goto Error;
+        }
+
+        SIZE_T Result = CmnDecompress(Tree, Pack->Header.TreeSize, DirectoryRaw + sizeof(PACKFILE_HEADER), TreeSize);
+        if (ZSTD_isError(Result) || Result != Pack->Header.TreeSize)
+        {
+            LogError("Failed to decompress pack file directory: %s",
+                     ZSTD_isError(Result) ? ZSTD_getErrorName(Result) : "wrong size");
+            CmnFree(Tree);
+            goto Error;
+        }
+
+        // The compressed data isn't needed anymore
+        CmnFree(DirectoryRaw);
+        DirectoryRaw = Tree;
+        TreeSize = Pack->Header.TreeSize;
+    }
+
+    if (!ParseDirectory(Pack, Tree, TreeSize))
+    {
+        LogError("Pack file directory is corrupt");
+        goto Error;
+    }
+
+    if (!RebuildLookup(Pack))
+    {
+        goto Error;
     }
 
-    Pack->CurrentArchive = Pack->Header.ArchiveCount - 1;
-    Pack->CurrentOffset = Pack->Header.LastArchiveLength;
+    Pack->Writer.CurrentArchive = Pack->Header.ArchiveCount - 1;
+    Pack->Writer.CurrentOffset = Pack->Header.LastArchiveLength;
     Pack->Path = Path;
+    Path = NULL;
+    SetDefaultOptions(&Pack->Options);
+    Pack->VerifyMode = PACKFILE_DEFAULT_VERIFY_MODE;
+    Pack->DirectReadSize = PACKFILE_DEFAULT_DIRECT_READ_SIZE;
+    Pack->BlockCache.MaxSize = PACKFILE_DEFAULT_BLOCK_CACHE_SIZE;
+    Pack->Writer.Lock = AsCreateMutex();
+    Pack->BlockCache.Lock = AsCreateMutex();
+    Pack->MappingLock = AsCreateMutex();
+    if (!Pack->Writer.Lock || !Pack->BlockCache.Lock || !Pack->MappingLock)
+    {
+        LogError("Failed to create pack locks");
+        goto Error;
+    }
+
+    // Data from a write that was interrupted before the directory was saved is left as dead space, since files get
+    // appended to the end of the archive
+    PCHAR LastArchivePath = GetArchivePath(Pack->Path, Pack->Writer.CurrentArchive);
+    UINT64 LastArchiveSize = PlatGetFileSize(LastArchivePath);
+    CmnFree(LastArchivePath);
+    if (LastArchiveSize > Pack->Writer.CurrentOffset && LastArchiveSize <= PACKFILE_MAX_CHUNK_SIZE)
+    {
+        LogWarning("Archive %hu of pack file has %s of data that isn't in the directory", Pack->Writer.CurrentArchive,
+                   CmnFormatSize(LastArchiveSize - Pack->Writer.CurrentOffset));
+        Pack->Writer.CurrentOffset = LastArchiveSize;
+        if (Pack->Writer.CurrentOffset >= PACKFILE_MAX_CHUNK_SIZE)
+        {
+            Pack->Writer.CurrentArchive++;
+            Pack->Writer.CurrentOffset = 0;
+        }
+    }
+
+    if (!OpenArchives(Pack))
+    {
+        goto Error;
+    }
 
     CmnFree(DirectoryRaw);
     CmnFree(RealDirectoryPath);
@@ -160,6 +620,7 @@ PPACKFILE PackLoad(_In_z_ PCSTR DirectoryPath)
     return Pack;
 
 Error:
+    PackFree(Pack);
     CmnFree(RealDirectoryPath);
     CmnFree(DirectoryRaw);
     CmnFree(Path);
@@ -167,233 +628,3095 @@ Error:
     return NULL;
 }
 
+static VOID ClearBlockCache(_Inout_ PPACKFILE Pack)
+{
+    for (UINT64 i = 0; i < stbds_arrlenu(Pack->BlockCache.Blocks); i++)
+    {
+        CmnFree(Pack->BlockCache.Blocks[i].Data);
+    }
+    stbds_arrsetlen(Pack->BlockCache.Blocks, 0);
+    Pack->BlockCache.Size = 0;
+}
+
+static VOID EvictBlocks(_Inout_ PPACKFILE_BLOCK_CACHE Cache, _In_ UINT64 Size)
+{
+    // There's only ever a handful of blocks, so finding the least recently used one by looking at all of them is fine
+    while (stbds_arrlenu(Cache->Blocks) && Cache->Size + Size > Cache->MaxSize)
+    {
+        UINT64 Oldest = 0;
+        for (UINT64 i = 1; i < stbds_arrlenu(Cache->Blocks); i++)
+        {
+            if (Cache->Blocks[i].LastUse < Cache->Blocks[Oldest].LastUse)
+            {
+                Oldest = i;
+            }
+        }
+        Cache->Size -= Cache->Blocks[Oldest].Size;
+        CmnFree(Cache->Blocks[Oldest].Data);
+        stbds_arrdel(Cache->Blocks, Oldest);
+    }
+}
+
 VOID PackFree(_Inout_ PVOID Handle)
 {
     if (Handle)
     {
         PPACKFILE Pack = Handle;
+        PackStopScrubber(Pack);
+        PackStopTrace(Pack, NULL);
+        while (stbds_arrlenu(Pack->Mappings) > 0)
+        {
+            LogWarning("Unmapping %s from pack %s", Pack->Entries[Pack->Mappings[0]->Index].key, Pack->Path);
+            PackUnmapFile(Pack, PlatGetLazyMappingAddress(Pack->Mappings[0]->Region));
+        }
+        stbds_arrfree(Pack->Mappings);
+        if (Pack->MappingLock)
+        {
+            AsDestroyMutex(Pack->MappingLock);
+        }
         for (UINT64 i = 0; i < stbds_shlenu(Pack->Entries); i++)
         {
             CmnFree(Pack->Entries[i].key);
         }
         stbds_shfree(Pack->Entries);
+        CmnFree(Pack->Lookup);
+        stbds_arrfree(Pack->Verified);
+        for (UINT64 i = 0; i < stbds_arrlenu(Pack->Dictionaries); i++)
+        {
+            CmnFree(Pack->Dictionaries[i].Group);
+            CmnFree(Pack->Dictionaries[i].Data);
+            ZSTD_freeCDict(Pack->Dictionaries[i].CompressionDictionary);
+            ZSTD_freeDDict(Pack->Dictionaries[i].DecompressionDictionary);
+        }
+        stbds_arrfree(Pack->Dictionaries);
+        CloseArchives(&Pack->Archives);
+        CloseArchives(&Pack->DirectArchives);
+        stbds_hmfree(Pack->Writer.Contents);
+        if (Pack->Writer.Lock)
+        {
+            AsDestroyMutex(Pack->Writer.Lock);
+        }
+        ClearBlockCache(Pack);
+        stbds_arrfree(Pack->BlockCache.Blocks);
+        if (Pack->BlockCache.Lock)
+        {
+            AsDestroyMutex(Pack->BlockCache.Lock);
+        }
         CmnFree(Pack->Path);
+        CmnFree(Pack);
     }
 }
 
-BOOLEAN PackHasFile(_In_ PVOID Handle, _In_z_ PCSTR Path)
+BOOLEAN PackSetAlignment(_Inout_ PVOID Handle, _In_ UINT32 Alignment)
 {
     PPACKFILE Pack = Handle;
-    if (Pack && Path)
+    if (!Pack)
     {
-        return stbds_shgetp_null(Pack->Entries, Path) != NULL;
+        return FALSE;
     }
 
-    return FALSE;
-}
-
-UINT64 PackGetFileSize(_In_ PVOID Handle, _In_z_ PCSTR Path)
-{
-    PPACKFILE Pack = Handle;
-    if (Pack && Path)
+    if (Alignment > PACKFILE_MAX_ALIGNMENT || (Alignment & (Alignment - 1)) != 0)
     {
-        // "Default" return value is just zero initialized, so this works either way
-        return stbds_shget(Pack->Entries, Path).Size;
+        LogError("Invalid alignment %u, it has to be a power of 2 up to %s", Alignment,
+                 CmnFormatSize(PACKFILE_MAX_ALIGNMENT));
+        return FALSE;
     }
 
-    return 0;
+    AsLockMutex(Pack->Writer.Lock, TRUE);
+    Pack->Header.Alignment = Alignment > 1 ? Alignment : 0;
+    AsUnlockMutex(Pack->Writer.Lock);
+
+    return TRUE;
 }
 
-PVOID PackReadFile(_In_ PVOID Handle, _In_z_ PCSTR Path, _In_ UINT64 Offset, _In_ UINT64 MaxAmount,
-                   _Out_ PUINT64 ReadAmount, _In_ UINT64 Extra)
+BOOLEAN PackSetFlags(_Inout_ PVOID Handle, _In_ UINT32 Flags)
 {
     PPACKFILE Pack = Handle;
     if (!Pack)
     {
-        return NULL;
+        return FALSE;
     }
 
-    LogInfo("Reading file %s from pack %s", Path, Pack->Path);
-
-    PPACKFILE_ENTRY_MAP Pair = stbds_shgetp_null(Pack->Entries, Path);
-    if (!Pair)
+    if (Flags & ~PACKFILE_KNOWN_FLAGS)
     {
-        LogError("File does not exist");
-        return NULL;
+        LogError("Unknown pack flags 0x%X", Flags & ~PACKFILE_KNOWN_FLAGS);
+        return FALSE;
     }
-
-    PPACKFILE_ENTRY Entry = &Pair->value;
-
-    PBYTE CompressedData = CmnAlloc(Entry->CompressedSize, 1);
-    if (!CompressedData)
+    else if ((Pack->Header.Flags & PACKFILE_FLAG_HASHED_PATHS) && !(Flags & PACKFILE_FLAG_HASHED_PATHS))
     {
-        LogError("Failed to allocate %zu bytes: %s", Entry->CompressedSize, strerror(errno));
-        return NULL;
+        LogError("The paths in pack %s are already hashed", Pack->Path);
+        return FALSE;
     }
 
-    UINT64 TotalOffset = 0;
-    UINT64 CurrentOffset = 0;
-    UINT64 SizeToRead = Entry->CompressedSize;
-    UINT16 CurrentArchive = Entry->ArchiveIndex;
-    PCHAR ArchivePath = GetArchivePath(Pack->Path, CurrentArchive);
-    Pack->CurrentOffset = Entry->Offset;
-    while (SizeToRead > 0)
+    AsLockMutex(Pack->Writer.Lock, TRUE);
+
+    BOOLEAN Success = TRUE;
+    if ((Flags & PACKFILE_FLAG_HASHED_PATHS) && !(Pack->Header.Flags & PACKFILE_FLAG_HASHED_PATHS))
     {
-        UINT64 Read = PURPL_MIN(PACKFILE_MAX_CHUNK_SIZE - Pack->CurrentOffset, SizeToRead);
-        PVOID Data = FsReadFile(TRUE, ArchivePath, Pack->CurrentOffset, Read, &Read, 0);
-        if (!Data)
+        // Every key gets replaced, and the entries stay in the same order so the other tables don't change
+        PPACKFILE_ENTRY_MAP Entries = NULL;
+        Pack->Header.Flags |= PACKFILE_FLAG_HASHED_PATHS;
+        for (UINT64 i = 0; i < stbds_shlenu(Pack->Entries); i++)
         {
-            LogError("Failed to read file from pack");
-            CmnFree(CompressedData);
+            PCHAR Key = CreateKey(Pack, Pack->Entries[i].key);
+            if (stbds_shgeti(Entries, Key) >= 0)
+            {
+                LogError("Path %s in pack %s has the same hash as another one", Pack->Entries[i].key, Pack->Path);
+                CmnFree(Key);
+                Success = FALSE;
+                break;
+            }
+            stbds_shput(Entries, Key, Pack->Entries[i].value);
+        }
+
+        PPACKFILE_ENTRY_MAP Discarded = Success ? Pack->Entries : Entries;
+        for (UINT64 i = 0; i < stbds_shlenu(Discarded); i++)
+        {
+            CmnFree(Discarded[i].key);
+        }
+        stbds_shfree(Discarded);
+        if (Success)
+        {
+            Pack->Entries = Entries;
+            Success = RebuildLookup(Pack);
+        }
+        else
+        {
+            Pack->Header.Flags &= ~PACKFILE_FLAG_HASHED_PATHS;
+        }
+    }
+
+    if (Success)
+    {
+        Pack->Header.Flags = Flags;
+    }
+
+    AsUnlockMutex(Pack->Writer.Lock);
+
+    return Success;
+}
+
+BOOLEAN PackSetDirectReadSize(_Inout_ PVOID Handle, _In_ UINT64 Size)
+{
+    PPACKFILE Pack = Handle;
+    if (!Pack)
+    {
+        return FALSE;
+    }
+
+    Pack->DirectReadSize = Size;
+    if (!Size)
+    {
+        CloseArchives(&Pack->DirectArchives);
+        return TRUE;
+    }
+
+    return OpenArchives(Pack);
+}
+
+VOID PackSetBlockCacheSize(_Inout_ PVOID Handle, _In_ UINT64 Size)
+{
+    PPACKFILE Pack = Handle;
+    if (!Pack)
+    {
+        return;
+    }
+
+    AsLockMutex(Pack->BlockCache.Lock, TRUE);
+    Pack->BlockCache.MaxSize = Size;
+    EvictBlocks(&Pack->BlockCache, 0);
+    AsUnlockMutex(Pack->BlockCache.Lock);
+}
+
+BOOLEAN PackHasFile(_In_ PVOID Handle, _In_z_ PCSTR Path)
+{
+    PPACKFILE Pack = Handle;
+    if (Pack && Path)
+    {
+        return FindEntry(Pack, Path, NULL) != NULL;
+    }
+
+    return FALSE;
+}
+
+UINT64 PackGetFileSize(_In_ PVOID Handle, _In_z_ PCSTR Path)
+{
+    PPACKFILE Pack = Handle;
+    if (Pack && Path)
+    {
+        PPACKFILE_ENTRY Entry = FindEntry(Pack, Path, NULL);
+        return Entry ? Entry->Size : 0;
+    }
+
+    return 0;
+}
+
+static UINT64 GetEntryPosition(_In_ PPACKFILE_ENTRY Entry)
+{
+    return Entry->ArchiveIndex * (UINT64)PACKFILE_MAX_CHUNK_SIZE + Entry->Offset;
+}
+
+static BOOLEAN ReadArchiveData(_In_ PPACKFILE Pack, _In_ UINT16 ArchiveIndex, _In_ UINT64 Offset,
+                               _Out_writes_bytes_(Size) PVOID Buffer, _In_ UINT64 Size)
+{
+    // Entries continue at the start of the next archive once one is full, so the offset can be past the end of the
+    // first one
+    ArchiveIndex += (UINT16)(Offset / PACKFILE_MAX_CHUNK_SIZE);
+    Offset %= PACKFILE_MAX_CHUNK_SIZE;
+
+    // Big reads are probably only done once, so they're kept out of the file cache
+    PPLAT_FILE *Archives = Pack->DirectArchives && Size >= Pack->DirectReadSize ? Pack->DirectArchives : Pack->Archives;
+
+    UINT64 TotalRead = 0;
+    while (TotalRead < Size)
+    {
+        if (ArchiveIndex >= stbds_arrlenu(Archives) || !Archives[ArchiveIndex])
+        {
+            LogError("Archive %hu of pack %s is not open", ArchiveIndex, Pack->Path);
+            return FALSE;
+        }
+
+        UINT64 Read = PURPL_MIN(PACKFILE_MAX_CHUNK_SIZE - Offset, Size - TotalRead);
+        if (!PlatReadFileAt(Archives[ArchiveIndex], Offset, (PBYTE)Buffer + TotalRead, Read))
+        {
+            LogError("Failed to read file from pack");
+            return FALSE;
+        }
+        TotalRead += Read;
+        ArchiveIndex++;
+        Offset = 0;
+    }
+
+    return TRUE;
+}
+
+static BOOLEAN CheckHash(_In_z_ PCSTR Path, _In_z_ PCSTR Name, _In_ XXH128_hash_t Hash, _In_ XXH128_hash_t Expected)
+{
+    if (!XXH128_isEqual(Hash, Expected))
+    {
+        LogError("%s hash of %s does not match: got %llX%llX, expected %llX%llX", Name, Path, Hash.high64, Hash.low64,
+                 Expected.high64, Expected.low64);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static BOOLEAN CopyCachedBlock(_In_ PPACKFILE Pack, _In_ UINT64 Position, _In_ UINT64 Offset,
+                               _Out_writes_bytes_(Size) PVOID Data, _In_ UINT64 Size)
+{
+    PPACKFILE_BLOCK_CACHE Cache = &Pack->BlockCache;
+    BOOLEAN Found = FALSE;
+
+    AsLockMutex(Cache->Lock, TRUE);
+    for (UINT64 i = 0; i < stbds_arrlenu(Cache->Blocks); i++)
+    {
+        PPACKFILE_CACHED_BLOCK Block = &Cache->Blocks[i];
+        if (Block->Position == Position && Offset + Size <= Block->Size)
+        {
+            memcpy(Data, Block->Data + Offset, Size);
+            Block->LastUse = ++Cache->UseCount;
+            Found = TRUE;
+            break;
+        }
+    }
+    if (Found)
+    {
+        Cache->HitCount++;
+    }
+    else
+    {
+        Cache->MissCount++;
+    }
+    AsUnlockMutex(Cache->Lock);
+
+    return Found;
+}
+
+static VOID CacheBlock(_Inout_ PPACKFILE Pack, _In_ UINT64 Position, _In_ PBYTE Data,
+                       _In_ UINT64 Size)
+{
+    PPACKFILE_BLOCK_CACHE Cache = &Pack->BlockCache;
+
+    AsLockMutex(Cache->Lock, TRUE);
+
+    // Another thread could have decompressed the same block in the meantime
+    BOOLEAN Cached = Size > Cache->MaxSize;
+    for (UINT64 i = 0; !Cached && i < stbds_arrlenu(Cache->Blocks); i++)
+    {
+        Cached = Cache->Blocks[i].Position == Position;
+    }
+
+    if (Cached)
+    {
+        CmnFree(Data);
+    }
+    else
+    {
+        EvictBlocks(Cache, Size);
+        PACKFILE_CACHED_BLOCK Block = {Position, Data, Size, ++Cache->UseCount};
+        stbds_arrput(Cache->Blocks, Block);
+        Cache->Size += Size;
+    }
+
+    AsUnlockMutex(Cache->Lock);
+}
+
+static BOOLEAN ReadSolidEntry(_In_ PPACKFILE Pack, _In_ UINT64 Index, _In_opt_ PBYTE CompressedData,
+                              _In_ UINT64 Offset, _Out_writes_bytes_(Size) PVOID Data, _In_ UINT64 Size,
+                              _In_ BOOLEAN CheckCompressed)
+{
+    PCSTR Path = Pack->Entries[Index].key;
+    PPACKFILE_ENTRY Entry = &Pack->Entries[Index].value;
+    UINT64 Position = GetEntryPosition(Entry);
+
+    // Neighbouring small files are usually read together, so the whole block is kept around for them
+    if (CopyCachedBlock(Pack, Position, Entry->BlockOffset + Offset, Data, Size))
+    {
+        return TRUE;
+    }
+
+    PBYTE ReadData = NULL;
+    if (!CompressedData)
+    {
+        ReadData = CmnAlloc(Entry->CompressedSize, 1);
+        if (!ReadData)
+        {
+            LogError("Failed to allocate %zu bytes: %s", Entry->CompressedSize, strerror(errno));
+            return FALSE;
+        }
+        if (!ReadArchiveData(Pack, Entry->ArchiveIndex, Entry->Offset, ReadData, Entry->CompressedSize))
+        {
+            CmnFree(ReadData);
+            return FALSE;
+        }
+        CompressedData = ReadData;
+    }
+
+    PBYTE Block = NULL;
+    BOOLEAN Success = FALSE;
+    if (CheckCompressed &&
+        !CheckHash(Path, "Compressed", XXH3_128bits(CompressedData, Entry->CompressedSize), Entry->CompressedHash))
+    {
+        goto Done;
+    }
+
+    UINT64 BlockSize = ZSTD_getFrameContentSize(CompressedData, Entry->CompressedSize);
+    if (BlockSize == ZSTD_CONTENTSIZE_UNKNOWN || BlockSize == ZSTD_CONTENTSIZE_ERROR ||
+        BlockSize > PACKFILE_MAX_SOLID_BLOCK_SIZE || Entry->BlockOffset + Entry->Size > BlockSize)
+    {
+        LogError("Solid block containing %s is invalid", Path);
+        goto Done;
+    }
+
+    ZSTD_DCtx *Context = CmnGetDecompressionContext();
+    Block = CmnAlloc(BlockSize, 1);
+    if (!Context || !Block)
+    {
+        LogError("Failed to allocate %s for the solid block containing %s: %s", CmnFormatSize(BlockSize), Path,
+                 strerror(errno));
+        goto Done;
+    }
+
+    SIZE_T Result = ZSTD_decompressDCtx(Context, Block, BlockSize, CompressedData, Entry->CompressedSize);
+    if (ZSTD_isError(Result) || Result != BlockSize)
+    {
+        LogError("Failed to decompress the solid block containing %s: %s", Path,
+                 ZSTD_isError(Result) ? ZSTD_getErrorName(Result) : "wrong size");
+        goto Done;
+    }
+    if (CheckCompressed)
+    {
+        AsAtomicOr8(&Pack->Verified[Index], PACKFILE_VERIFIED_COMPRESSED);
+    }
+
+    memcpy(Data, Block + Entry->BlockOffset + Offset, Size);
+    CacheBlock(Pack, Position, Block, BlockSize);
+    Block = NULL;
+    Success = TRUE;
+
+Done:
+    CmnFree(Block);
+    CmnFree(ReadData);
+
+    return Success;
+}
+
+static BOOLEAN DecompressEntry(_In_ PPACKFILE Pack, _In_ UINT64 Index, _In_ PBYTE CompressedData, _In_ UINT64 Offset,
+                               _Out_writes_bytes_(Size) PVOID Data, _In_ UINT64 Size, _In_ UINT64 BufferSize,
+                               _In_ BOOLEAN CheckCompressed)
+{
+    PPACKFILE_ENTRY Entry = &Pack->Entries[Index].value;
+
+    if (CheckCompressed)
+    {
+        if (!CheckHash(Pack->Entries[Index].key, "Compressed",
+                       XXH3_128bits(CompressedData, Entry->CompressedSize), Entry->CompressedHash))
+        {
+            return FALSE;
+        }
+        AsAtomicOr8(&Pack->Verified[Index], PACKFILE_VERIFIED_COMPRESSED);
+    }
+
+    ZSTD_DCtx *Context = CmnGetDecompressionContext();
+    if (!Context)
+    {
+        return FALSE;
+    }
+
+    ZSTD_DDict *Dictionary = NULL;
+    if (Entry->Method == PackMethodZstdDictionary)
+    {
+        Dictionary = Pack->Dictionaries[Entry->Dictionary - 1].DecompressionDictionary;
+    }
+
+    SIZE_T Result;
+    UINT64 DecompressedSize = 0;
+    if (Offset == 0 && Size == Entry->Size)
+    {
+        Result = Dictionary ? ZSTD_decompress_usingDDict(Context, Data, Size, CompressedData, Entry->CompressedSize,
+                                                         Dictionary)
+                            : ZSTD_decompressDCtx(Context, Data, Size, CompressedData, Entry->CompressedSize);
+        DecompressedSize = Result;
+    }
+    else
+    {
+        // Only decompress up to the end of the requested range, and use the output buffer as scratch space for the
+        // part before it, since the context keeps its own window
+        Result = Dictionary ? ZSTD_DCtx_refDDict(Context, Dictionary) : 0;
+        ZSTD_inBuffer Input = {CompressedData, Entry->CompressedSize, 0};
+        UINT64 Skipped = 0;
+        while (!ZSTD_isError(Result) && DecompressedSize < Size)
+        {
+            ZSTD_outBuffer Output = {0};
+            if (Skipped < Offset)
+            {
+                Output.dst = Data;
+                Output.size = PURPL_MIN(BufferSize, Offset - Skipped);
+            }
+            else
+            {
+                Output.dst = (PBYTE)Data + DecompressedSize;
+                Output.size = Size - DecompressedSize;
+            }
+
+            Result = ZSTD_decompressStream(Context, &Output, &Input);
+            if (Skipped < Offset)
+            {
+                Skipped += Output.pos;
+            }
+            else
+            {
+                DecompressedSize += Output.pos;
+            }
+
+            if (!ZSTD_isError(Result) && Output.pos == 0 && Input.pos == Input.size)
+            {
+                break;
+            }
+        }
+    }
+
+    if (ZSTD_isError(Result) || DecompressedSize != Size)
+    {
+        if (ZSTD_isError(Result))
+        {
+            LogError("Decompression failed: %s", ZSTD_getErrorName(Result));
+        }
+        else
+        {
+            LogError("Decompressed size does not match: got %s, expected %s", CmnFormatSize(DecompressedSize),
+                     CmnFormatTempString("%s", CmnFormatSize(Size)));
+        }
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static VOID GetChecks(_In_ PPACKFILE Pack, _In_ UINT64 Index, _In_ UINT64 Offset, _In_ UINT64 Size,
+                      _Out_ PBOOLEAN CheckCompressed, _Out_ PBOOLEAN CheckFull)
+{
+    PPACKFILE_ENTRY Entry = &Pack->Entries[Index].value;
+
+    UINT8 Verified = Pack->VerifyMode == PackVerifyFirstRead ? AsAtomicLoad8(&Pack->Verified[Index]) : 0;
+    *CheckCompressed =
+        Pack->VerifyMode != PackVerifyNone && !(Verified & PACKFILE_VERIFIED_COMPRESSED) && Entry->Method != PackMethodStored;
+    // Only the whole file can be checked, and stored entries only have the one hash
+    *CheckFull = (Pack->VerifyMode == PackVerifyFull || Pack->VerifyMode == PackVerifyFirstRead ||
+                  (Pack->VerifyMode == PackVerifyCompressed && Entry->Method == PackMethodStored)) &&
+                 !(Verified & PACKFILE_VERIFIED_FULL) && Offset == 0 && Size == Entry->Size;
+}
+
+static BOOLEAN CheckDecompressed(_In_ PPACKFILE Pack, _In_ UINT64 Index, _In_ PVOID Data)
+{
+    PPACKFILE_ENTRY Entry = &Pack->Entries[Index].value;
+    if (!CheckHash(Pack->Entries[Index].key, "Decompressed", XXH3_128bits(Data, Entry->Size), Entry->Hash))
+    {
+        return FALSE;
+    }
+
+    AsAtomicOr8(&Pack->Verified[Index], PACKFILE_VERIFIED_COMPRESSED | PACKFILE_VERIFIED_FULL);
+    return TRUE;
+}
+
+static VOID RecordRead(_In_ PPACKFILE_TRACE Trace, _In_ UINT64 Index, _In_ UINT64 Offset, _In_ UINT64 Size)
+{
+    PACKFILE_TRACE_EVENT Event = {0};
+    Event.Time = PlatGetMilliseconds() - Trace->StartTime;
+    Event.Index = Index;
+    Event.Offset = Offset;
+    Event.Size = Size;
+
+    AsLockMutex(Trace->Lock, TRUE);
+    stbds_arrput(Trace->Events, Event);
+    AsUnlockMutex(Trace->Lock);
+}
+
+PVOID PackReadFile(_In_ PVOID Handle, _In_z_ PCSTR Path, _In_ UINT64 Offset, _In_ UINT64 MaxAmount,
+                   _Out_ PUINT64 ReadAmount, _In_ UINT64 Extra)
+{
+    PPACKFILE Pack = Handle;
+    if (!Pack)
+    {
+        return NULL;
+    }
+
+    LogDebug("Reading file %s from pack %s", Path, Pack->Path);
+
+    UINT64 Index = 0;
+    PPACKFILE_ENTRY Entry = FindEntry(Pack, Path, &Index);
+    if (!Entry)
+    {
+        LogError("File does not exist");
+        return NULL;
+    }
+    if (Offset > Entry->Size)
+    {
+        LogError("Offset %llu is past the end of %s", Offset, Path);
+        return NULL;
+    }
+
+    UINT64 Size = Entry->Size - Offset;
+    if (MaxAmount > 0)
+    {
+        Size = PURPL_MIN(Size, MaxAmount);
+    }
+
+    PPACKFILE_TRACE Trace = Pack->Trace;
+    if (Trace)
+    {
+        RecordRead(Trace, Index, Offset, Size);
+    }
+
+    // Skipping the start of a compressed entry needs somewhere to put it, a small buffer would take a lot of calls
+    UINT64 BufferSize = Size + Extra;
+    if (Entry->Method != PackMethodStored && Entry->Method != PackMethodZstdSolid && Offset > 0)
+    {
+        BufferSize = PURPL_MAX(BufferSize, ZSTD_DStreamOutSize());
+    }
+
+    // Everything is read or decompressed straight into the returned buffer
+    PBYTE Data = CmnAlloc(BufferSize, 1);
+    if (!Data)
+    {
+        LogError("Failed to allocate %zu bytes: %s", BufferSize, strerror(errno));
+        return NULL;
+    }
+
+    BOOLEAN CheckCompressed = FALSE;
+    BOOLEAN CheckFull = FALSE;
+    GetChecks(Pack, Index, Offset, Size, &CheckCompressed, &CheckFull);
+
+    BOOLEAN Success = FALSE;
+    if (Entry->Method == PackMethodStored)
+    {
+        Success = ReadArchiveData(Pack, Entry->ArchiveIndex, Entry->Offset + Offset, Data, Size);
+    }
+    else if (Entry->Method == PackMethodZstdSolid)
+    {
+        Success = ReadSolidEntry(Pack, Index, NULL, Offset, Data, Size, CheckCompressed);
+    }
+    else
+    {
+        PBYTE CompressedData = CmnAlloc(Entry->CompressedSize, 1);
+        if (!CompressedData)
+        {
+            LogError("Failed to allocate %zu bytes: %s", Entry->CompressedSize, strerror(errno));
+        }
+        else
+        {
+            Success =
+                ReadArchiveData(Pack, Entry->ArchiveIndex, Entry->Offset, CompressedData, Entry->CompressedSize) &&
+                DecompressEntry(Pack, Index, CompressedData, Offset, Data, Size, BufferSize, CheckCompressed);
+            CmnFree(CompressedData);
+        }
+    }
+
+    if (!Success || (CheckFull && !CheckDecompressed(Pack, Index, Data)))
+    {
+        CmnFree(Data);
+        return NULL;
+    }
+
+    *ReadAmount = Size;
+    return Data;
+}
+
+static UINT64 GetSeekTableSize(_In_ UINT64 FrameCount)
+{
+    // The skippable frame's magic and size, the frames, then the footer
+    return 2 * sizeof(UINT32) + FrameCount * sizeof(PACKFILE_SEEK_TABLE_ENTRY) + sizeof(PACKFILE_SEEK_TABLE_FOOTER);
+}
+
+static BOOLEAN LoadSeekTable(_In_ PPACKFILE Pack, _Inout_ PPACKFILE_MAPPING Mapping)
+{
+    PCSTR Path = Pack->Entries[Mapping->Index].key;
+    PPACKFILE_ENTRY Entry = &Pack->Entries[Mapping->Index].value;
+
+    // Entries without a seek table just end in a normal frame
+    PACKFILE_SEEK_TABLE_FOOTER Footer = {0};
+    if (Entry->CompressedSize < GetSeekTableSize(1) ||
+        !ReadArchiveData(Pack, Entry->ArchiveIndex, Entry->Offset + Entry->CompressedSize - sizeof(Footer), &Footer,
+                         sizeof(Footer)) ||
+        Footer.Magic != PACKFILE_SEEK_TABLE_MAGIC || Footer.FrameCount == 0)
+    {
+        return FALSE;
+    }
+
+    UINT64 TableSize = GetSeekTableSize(Footer.FrameCount);
+    if (TableSize > Entry->CompressedSize)
+    {
+        LogError("Seek table of %s is invalid", Path);
+        return FALSE;
+    }
+
+    PBYTE Table = CmnAlloc(TableSize, 1);
+    Mapping->Frames = CmnAllocType(Footer.FrameCount, PACKFILE_SEEK_TABLE_ENTRY);
+    Mapping->FrameOffsets = CmnAllocType(Footer.FrameCount, UINT64);
+    if (!Table || !Mapping->Frames || !Mapping->FrameOffsets)
+    {
+        LogError("Failed to allocate seek table of %s: %s", Path, strerror(errno));
+        CmnFree(Table);
+        return FALSE;
+    }
+    if (!ReadArchiveData(Pack, Entry->ArchiveIndex, Entry->Offset + Entry->CompressedSize - TableSize, Table,
+                         TableSize))
+    {
+        CmnFree(Table);
+        return FALSE;
+    }
+
+    UINT32 Header[2] = {0};
+    memcpy(Header, Table, sizeof(Header));
+    memcpy(Mapping->Frames, Table + sizeof(Header), Footer.FrameCount * sizeof(PACKFILE_SEEK_TABLE_ENTRY));
+    CmnFree(Table);
+
+    // Every frame but the last has to be the same size to find the one an offset is in
+    UINT64 CompressedSize = 0;
+    UINT64 Size = 0;
+    BOOLEAN Valid = Header[0] == PACKFILE_SEEK_TABLE_FRAME_MAGIC && Header[1] == TableSize - sizeof(Header);
+    for (UINT32 i = 0; Valid && i < Footer.FrameCount; i++)
+    {
+        Mapping->FrameOffsets[i] = CompressedSize;
+        CompressedSize += Mapping->Frames[i].CompressedSize;
+        Size += Mapping->Frames[i].Size;
+        Valid = Mapping->Frames[i].Size > 0 && (i + 1 == Footer.FrameCount
+                                                    ? Mapping->Frames[i].Size <= Mapping->Frames[0].Size
+                                                    : Mapping->Frames[i].Size == Mapping->Frames[0].Size);
+    }
+    if (!Valid || CompressedSize + TableSize != Entry->CompressedSize || Size != Entry->Size)
+    {
+        LogError("Seek table of %s is invalid", Path);
+        return FALSE;
+    }
+
+    Mapping->FrameSize = Mapping->Frames[0].Size;
+    Mapping->CheckFrames = (Footer.Descriptor & PACKFILE_SEEK_TABLE_CHECKSUMS) && Pack->VerifyMode != PackVerifyNone;
+    return TRUE;
+}
+
+static BOOLEAN FillMapping(_In_opt_ PVOID UserData, _In_ UINT64 Offset, _Out_writes_bytes_(Size) PVOID Buffer,
+                           _In_ UINT64 Size)
+{
+    PPACKFILE_MAPPING Mapping = UserData;
+    PPACKFILE Pack = Mapping->Pack;
+    PCSTR Path = Pack->Entries[Mapping->Index].key;
+    PPACKFILE_ENTRY Entry = &Pack->Entries[Mapping->Index].value;
+
+    // Pages get filled whenever they're first touched, which can be while the trace is being stopped, so the trace is
+    // only used with the mapping lock held
+    AsLockMutex(Pack->MappingLock, TRUE);
+    PPACKFILE_TRACE Trace = Pack->Trace;
+    if (Trace)
+    {
+        RecordRead(Trace, Mapping->Index, Offset, Size);
+    }
+    AsUnlockMutex(Pack->MappingLock);
+
+    if (Entry->Method == PackMethodStored)
+    {
+        return ReadArchiveData(Pack, Entry->ArchiveIndex, Entry->Offset + Offset, Buffer, Size);
+    }
+
+    UINT64 Frame = Offset / Mapping->FrameSize;
+    PPACKFILE_SEEK_TABLE_ENTRY Info = &Mapping->Frames[Frame];
+    PBYTE CompressedData = CmnAlloc(Info->CompressedSize, 1);
+    ZSTD_DCtx *Context = CmnGetDecompressionContext();
+    if (!CompressedData || !Context)
+    {
+        LogError("Failed to allocate %u bytes: %s", Info->CompressedSize, strerror(errno));
+        CmnFree(CompressedData);
+        return FALSE;
+    }
+
+    BOOLEAN Success = FALSE;
+    if (ReadArchiveData(Pack, Entry->ArchiveIndex, Entry->Offset + Mapping->FrameOffsets[Frame], CompressedData,
+                        Info->CompressedSize))
+    {
+        SIZE_T Result = ZSTD_decompressDCtx(Context, Buffer, Size, CompressedData, Info->CompressedSize);
+        if (ZSTD_isError(Result) || Result != Size)
+        {
+            LogError("Failed to decompress frame %llu of %s: %s", Frame, Path,
+                     ZSTD_isError(Result) ? ZSTD_getErrorName(Result) : "wrong size");
+        }
+        else if (Mapping->CheckFrames && (UINT32)XXH64(Buffer, Size, 0) != Info->Checksum)
+        {
+            LogError("Checksum of frame %llu of %s does not match", Frame, Path);
+        }
+        else
+        {
+            Success = TRUE;
+        }
+    }
+
+    CmnFree(CompressedData);
+    return Success;
+}
+
+static VOID FreeMapping(_In_opt_ PPACKFILE_MAPPING Mapping)
+{
+    if (Mapping)
+    {
+        PlatDestroyLazyMapping(Mapping->Region);
+        CmnFree(Mapping->Frames);
+        CmnFree(Mapping->FrameOffsets);
+        CmnFree(Mapping);
+    }
+}
+
+PVOID PackMapFile(_In_ PVOID Handle, _In_z_ PCSTR Path, _Out_ PUINT64 Size)
+{
+    PPACKFILE Pack = Handle;
+    *Size = 0;
+    if (!Pack)
+    {
+        return NULL;
+    }
+
+    UINT64 Index = 0;
+    PPACKFILE_ENTRY Entry = FindEntry(Pack, Path, &Index);
+    if (!Entry)
+    {
+        LogError("File does not exist");
+        return NULL;
+    }
+
+    // Compressed entries can only be filled in a piece at a time if they were written as independent frames
+    PPACKFILE_MAPPING Mapping = NULL;
+    if (Entry->Size >= PACKFILE_MIN_LAZY_MAP_SIZE &&
+        (Entry->Method == PackMethodStored || Entry->Method == PackMethodZstdFast ||
+         Entry->Method == PackMethodZstdHigh))
+    {
+        Mapping = CmnAllocType(1, PACKFILE_MAPPING);
+        if (!Mapping)
+        {
+            LogError("Failed to allocate mapping of %s: %s", Path, strerror(errno));
+            return NULL;
+        }
+        Mapping->Pack = Pack;
+        Mapping->Index = Index;
+
+        if (Entry->Method == PackMethodStored || LoadSeekTable(Pack, Mapping))
+        {
+            UINT64 ChunkSize = Entry->Method == PackMethodStored ? PACKFILE_MAP_STORED_CHUNK_SIZE : Mapping->FrameSize;
+            Mapping->Region = PlatCreateLazyMapping(Entry->Size, ChunkSize, FillMapping, Mapping);
+        }
+        if (!Mapping->Region)
+        {
+            FreeMapping(Mapping);
+            Mapping = NULL;
+        }
+    }
+
+    if (!Mapping)
+    {
+        return PackReadFile(Pack, Path, 0, 0, Size, 0);
+    }
+
+    AsLockMutex(Pack->MappingLock, TRUE);
+    stbds_arrput(Pack->Mappings, Mapping);
+    AsUnlockMutex(Pack->MappingLock);
+
+    LogDebug("Mapped %s file %s from pack %s in %s chunks", CmnFormatSize(Entry->Size), Path, Pack->Path,
+             CmnFormatTempString("%s", CmnFormatSize(Entry->Method == PackMethodStored ? PACKFILE_MAP_STORED_CHUNK_SIZE
+                                                                                       : Mapping->FrameSize)));
+
+    *Size = Entry->Size;
+    return PlatGetLazyMappingAddress(Mapping->Region);
+}
+
+VOID PackUnmapFile(_In_ PVOID Handle, _In_opt_ PVOID Data)
+{
+    PPACKFILE Pack = Handle;
+    if (!Pack || !Data)
+    {
+        return;
+    }
+
+    PPACKFILE_MAPPING Mapping = NULL;
+    AsLockMutex(Pack->MappingLock, TRUE);
+    for (UINT64 i = 0; i < stbds_arrlenu(Pack->Mappings); i++)
+    {
+        if (PlatGetLazyMappingAddress(Pack->Mappings[i]->Region) == Data)
+        {
+            Mapping = Pack->Mappings[i];
+            stbds_arrdel(Pack->Mappings, i);
+            break;
+        }
+    }
+    AsUnlockMutex(Pack->MappingLock);
+
+    // Anything else came from PackReadFile
+    if (Mapping)
+    {
+        FreeMapping(Mapping);
+    }
+    else
+    {
+        CmnFree(Data);
+    }
+}
+
+PURPL_MAKE_TAG(struct, PACKFILE_BATCH_READ, {
+    UINT64 Request;
+    UINT64 Index;
+    UINT64 Position;
+})
+
+PURPL_MAKE_TAG(struct, PACKFILE_BATCH_GROUP, {
+    UINT64 Position;
+    UINT64 Size;
+    UINT64 FirstRead; // Reads are sorted, so a group's reads are next to each other
+    UINT64 ReadCount;
+})
+
+PURPL_MAKE_TAG(struct, PACKFILE_BATCH, {
+    PPACKFILE Pack;
+    PFILESYSTEM_READ_REQUEST Requests;
+    PPACKFILE_BATCH_READ Reads;
+    PPACKFILE_BATCH_GROUP Groups;
+    UINT64 FailedCount;
+})
+
+static INT CompareBatchReads(_In_ const VOID *First, _In_ const VOID *Second)
+{
+    UINT64 FirstPosition = ((PPACKFILE_BATCH_READ)First)->Position;
+    UINT64 SecondPosition = ((PPACKFILE_BATCH_READ)Second)->Position;
+    return FirstPosition < SecondPosition ? -1 : FirstPosition > SecondPosition;
+}
+
+static VOID ExtractBatchRead(_In_ PPACKFILE_BATCH Batch, _In_ PPACKFILE_BATCH_READ Read, _In_opt_ PBYTE GroupData,
+                             _In_ UINT64 GroupPosition)
+{
+    PFILESYSTEM_READ_REQUEST Request = &Batch->Requests[Read->Request];
+    PPACKFILE_ENTRY Entry = &Batch->Pack->Entries[Read->Index].value;
+
+    PBYTE Data = GroupData ? CmnAlloc(Entry->Size + Request->Extra, 1) : NULL;
+    if (!Data)
+    {
+        AsAtomicAdd64(&Batch->FailedCount, 1);
+        return;
+    }
+
+    BOOLEAN CheckCompressed = FALSE;
+    BOOLEAN CheckFull = FALSE;
+    GetChecks(Batch->Pack, Read->Index, 0, Entry->Size, &CheckCompressed, &CheckFull);
+
+    PBYTE Source = GroupData + (Read->Position - GroupPosition);
+    BOOLEAN Success = TRUE;
+    if (Entry->Method == PackMethodStored)
+    {
+        memcpy(Data, Source, Entry->Size);
+    }
+    else if (Entry->Method == PackMethodZstdSolid)
+    {
+        Success = ReadSolidEntry(Batch->Pack, Read->Index, Source, 0, Data, Entry->Size, CheckCompressed);
+    }
+    else
+    {
+        Success = DecompressEntry(Batch->Pack, Read->Index, Source, 0, Data, Entry->Size, Entry->Size + Request->Extra,
+                                  CheckCompressed);
+    }
+
+    if (!Success || (CheckFull && !CheckDecompressed(Batch->Pack, Read->Index, Data)))
+    {
+        CmnFree(Data);
+        AsAtomicAdd64(&Batch->FailedCount, 1);
+        return;
+    }
+
+    Request->Data = Data;
+    Request->Size = Entry->Size;
+}
+
+static VOID ReadBatchGroup(_In_ UINT64 Index, _In_opt_ PVOID UserData)
+{
+    PPACKFILE_BATCH Batch = UserData;
+    PPACKFILE_BATCH_GROUP Group = &Batch->Groups[Index];
+
+    PBYTE Data = CmnAlloc(Group->Size, 1);
+    if (!Data)
+    {
+        LogError("Failed to allocate %zu bytes: %s", Group->Size, strerror(errno));
+    }
+    else if (!ReadArchiveData(Batch->Pack, 0, Group->Position, Data, Group->Size)) // The position includes the archive
+    {
+        CmnFree(Data);
+        Data = NULL;
+    }
+
+    // The thread that read the group decompresses its entries, so each batch only needs one set of threads and the
+    // group's data can be freed right away
+    for (UINT64 i = 0; i < Group->ReadCount; i++)
+    {
+        ExtractBatchRead(Batch, &Batch->Reads[Group->FirstRead + i], Data, Group->Position);
+    }
+    CmnFree(Data);
+}
+
+BOOLEAN PackReadFiles(_In_ PVOID Handle, _Inout_updates_(Count) PFILESYSTEM_READ_REQUEST Requests, _In_ UINT64 Count)
+{
+    PPACKFILE Pack = Handle;
+    if (!Pack)
+    {
+        return FALSE;
+    }
+
+    PACKFILE_BATCH Batch = {0};
+    Batch.Pack = Pack;
+    Batch.Requests = Requests;
+
+    PPACKFILE_TRACE Trace = Pack->Trace;
+    for (UINT64 i = 0; i < Count; i++)
+    {
+        Requests[i].Data = NULL;
+        Requests[i].Size = 0;
+
+        PACKFILE_BATCH_READ Read = {0};
+        PPACKFILE_ENTRY Entry = FindEntry(Pack, Requests[i].Path, &Read.Index);
+        if (!Entry)
+        {
+            LogError("File %s does not exist in pack %s", Requests[i].Path, Pack->Path);
+            Batch.FailedCount++;
+            continue;
+        }
+
+        if (Trace)
+        {
+            RecordRead(Trace, Read.Index, 0, Entry->Size);
+        }
+
+        Read.Request = i;
+        Read.Position = GetEntryPosition(Entry);
+        stbds_arrput(Batch.Reads, Read);
+    }
+
+    // Entries close enough to each other are read at once, including what's between them, which also means
+    // duplicates only get read once
+    if (Batch.Reads)
+    {
+        qsort(Batch.Reads, stbds_arrlenu(Batch.Reads), sizeof(PACKFILE_BATCH_READ), CompareBatchReads);
+    }
+    for (UINT64 i = 0; i < stbds_arrlenu(Batch.Reads); i++)
+    {
+        PPACKFILE_BATCH_READ Read = &Batch.Reads[i];
+        UINT64 End = Read->Position + Pack->Entries[Read->Index].value.CompressedSize;
+        PPACKFILE_BATCH_GROUP Group = stbds_arrlenu(Batch.Groups) ? &stbds_arrlast(Batch.Groups) : NULL;
+        if (Group && Read->Position <= Group->Position + Group->Size + PACKFILE_BATCH_MERGE_GAP &&
+            End - Group->Position <= PACKFILE_BATCH_MAX_READ_SIZE)
+        {
+            Group->Size = PURPL_MAX(Group->Size, End - Group->Position);
+            Group->ReadCount++;
+        }
+        else
+        {
+            PACKFILE_BATCH_GROUP NewGroup = {Read->Position, End - Read->Position, i, 1};
+            stbds_arrput(Batch.Groups, NewGroup);
+        }
+    }
+
+    LogDebug("Reading %llu file(s) from pack %s in %llu read(s)", stbds_arrlenu(Batch.Reads), Pack->Path,
+             stbds_arrlenu(Batch.Groups));
+
+    // Starting threads would take longer than a small batch does, and a single group always stays on this thread
+    UINT64 TotalSize = 0;
+    for (UINT64 i = 0; i < stbds_arrlenu(Batch.Groups); i++)
+    {
+        TotalSize += Batch.Groups[i].Size;
+    }
+    UINT32 ThreadCount = TotalSize >= PACKFILE_BATCH_PARALLEL_SIZE ? PlatGetProcessorCount() : 1;
+    AsRunParallel("pack read", stbds_arrlenu(Batch.Groups), ThreadCount, ReadBatchGroup, &Batch);
+
+    stbds_arrfree(Batch.Groups);
+    stbds_arrfree(Batch.Reads);
+
+    return Batch.FailedCount == 0;
+}
+
+static BOOLEAN VerifyEntry(_In_ PPACKFILE Pack, _In_ UINT64 Index)
+{
+    PCSTR Path = Pack->Entries[Index].key;
+    PPACKFILE_ENTRY Entry = &Pack->Entries[Index].value;
+
+    SIZE_T InputSize = ZSTD_DStreamInSize();
+    SIZE_T OutputSize = ZSTD_DStreamOutSize();
+    PBYTE Input = CmnAlloc(InputSize, 1);
+    PBYTE Output = CmnAlloc(OutputSize, 1);
+    XXH3_state_t *CompressedState = XXH3_createState();
+    XXH3_state_t *State = XXH3_createState();
+    ZSTD_DCtx *Context = CmnGetDecompressionContext();
+    BOOLEAN Intact = FALSE;
+    if (!Input || !Output || !CompressedState || !State || !Context)
+    {
+        LogError("Failed to allocate memory to verify %s: %s", Path, strerror(errno));
+        goto Done;
+    }
+
+    XXH3_128bits_reset(CompressedState);
+    XXH3_128bits_reset(State);
+    if (Entry->Method == PackMethodZstdDictionary)
+    {
+        ZSTD_DCtx_refDDict(Context, Pack->Dictionaries[Entry->Dictionary - 1].DecompressionDictionary);
+    }
+
+    // Entries in a solid block only get the part of it that's theirs hashed
+    UINT64 Start = Entry->Method == PackMethodZstdSolid ? Entry->BlockOffset : 0;
+    UINT64 End = Entry->Method == PackMethodZstdSolid ? Start + Entry->Size : UINT64_MAX;
+    UINT64 Produced = 0;
+    UINT64 DecompressedSize = 0;
+    for (UINT64 Done = 0; Done < Entry->CompressedSize;)
+    {
+        UINT64 Size = PURPL_MIN(InputSize, Entry->CompressedSize - Done);
+        if (!ReadArchiveData(Pack, Entry->ArchiveIndex, Entry->Offset + Done, Input, Size))
+        {
+            goto Done;
+        }
+        Done += Size;
+        XXH3_128bits_update(CompressedState, Input, Size);
+
+        if (Entry->Method == PackMethodStored)
+        {
+            XXH3_128bits_update(State, Input, Size);
+            DecompressedSize += Size;
+            continue;
+        }
+
+        // A full output buffer can mean there's more to flush even once the input is used up
+        ZSTD_inBuffer InputBuffer = {Input, Size, 0};
+        ZSTD_outBuffer OutputBuffer = {0};
+        do
+        {
+            OutputBuffer = (ZSTD_outBuffer){Output, OutputSize, 0};
+            SIZE_T Result = ZSTD_decompressStream(Context, &OutputBuffer, &InputBuffer);
+            if (ZSTD_isError(Result))
+            {
+                LogError("Failed to decompress %s: %s", Path, ZSTD_getErrorName(Result));
+                goto Done;
+            }
+            UINT64 First = PURPL_MAX(Produced, Start);
+            UINT64 Last = PURPL_MIN(Produced + OutputBuffer.pos, End);
+            if (First < Last)
+            {
+                XXH3_128bits_update(State, Output + (First - Produced), Last - First);
+                DecompressedSize += Last - First;
+            }
+            Produced += OutputBuffer.pos;
+        } while (InputBuffer.pos < InputBuffer.size || OutputBuffer.pos == OutputBuffer.size);
+    }
+
+    if (DecompressedSize != Entry->Size)
+    {
+        LogError("Decompressed size of %s does not match: got %s, expected %s", Path, CmnFormatSize(DecompressedSize),
+                 CmnFormatTempString("%s", CmnFormatSize(Entry->Size)));
+        goto Done;
+    }
+
+    Intact = CheckHash(Path, "Compressed", XXH3_128bits_digest(CompressedState), Entry->CompressedHash) &&
+             CheckHash(Path, "Decompressed", XXH3_128bits_digest(State), Entry->Hash);
+    if (Intact)
+    {
+        AsAtomicOr8(&Pack->Verified[Index], PACKFILE_VERIFIED_COMPRESSED | PACKFILE_VERIFIED_FULL);
+    }
+
+Done:
+    XXH3_freeState(State);
+    XXH3_freeState(CompressedState);
+    CmnFree(Output);
+    CmnFree(Input);
+
+    return Intact;
+}
+
+BOOLEAN PackVerifyFile(_In_ PVOID Handle, _In_z_ PCSTR Path)
+{
+    PPACKFILE Pack = Handle;
+    if (!Pack || !Path)
+    {
+        return FALSE;
+    }
+
+    UINT64 Index = 0;
+    if (!FindEntry(Pack, Path, &Index))
+    {
+        LogError("File %s does not exist in pack %s", Path, Pack->Path);
+        return FALSE;
+    }
+
+    return VerifyEntry(Pack, Index);
+}
+
+static UINT_PTR ScrubberThread(_In_opt_ PVOID UserData)
+{
+    PPACKFILE Pack = UserData;
+    PPACKFILE_SCRUBBER Scrubber = Pack->Scrubber;
+
+    AsSetCurrentThreadPriority(AsThreadPriorityIdle);
+
+    LogInfo("Scrubbing %zu file(s) in pack %s", stbds_shlenu(Pack->Entries), Pack->Path);
+    UINT64 Start = PlatGetMilliseconds();
+    for (UINT64 i = 0; i < stbds_shlenu(Pack->Entries) && !AsAtomicLoad8(&Scrubber->Stop); i++)
+    {
+        if (!VerifyEntry(Pack, i))
+        {
+            LogError("File %s in pack %s is corrupt", Pack->Entries[i].key, Pack->Path);
+            Scrubber->CorruptCount++;
+            if (Scrubber->Callback)
+            {
+                Scrubber->Callback(Pack, Pack->Entries[i].key, Scrubber->UserData);
+            }
+        }
+        Scrubber->CheckedCount++;
+    }
+
+    LogInfo("Scrubbed %llu of %zu file(s) in pack %s in %llu ms, %llu corrupt", Scrubber->CheckedCount,
+            stbds_shlenu(Pack->Entries), Pack->Path, PlatGetMilliseconds() - Start, Scrubber->CorruptCount);
+
+    return 0;
+}
+
+BOOLEAN PackStartScrubber(_Inout_ PVOID Handle, _In_opt_ PFN_PACKFILE_CORRUPTION_CALLBACK Callback,
+                          _In_opt_ PVOID UserData)
+{
+    PPACKFILE Pack = Handle;
+    if (!Pack || Pack->Scrubber)
+    {
+        return FALSE;
+    }
+
+    Pack->Scrubber = CmnAllocType(1, PACKFILE_SCRUBBER);
+    if (!Pack->Scrubber)
+    {
+        LogError("Failed to allocate scrubber: %s", strerror(errno));
+        return FALSE;
+    }
+
+    Pack->Scrubber->Callback = Callback;
+    Pack->Scrubber->UserData = UserData;
+    Pack->Scrubber->Thread = AsCreateThread("pack scrubber", PACKFILE_SCRUBBER_STACK_SIZE, ScrubberThread, Pack);
+    if (!Pack->Scrubber->Thread)
+    {
+        LogError("Failed to create scrubber thread");
+        CmnFree(Pack->Scrubber);
+        return FALSE;
+    }
+    AsResumeThread(Pack->Scrubber->Thread);
+
+    return TRUE;
+}
+
+UINT64 PackStopScrubber(_Inout_ PVOID Handle)
+{
+    PPACKFILE Pack = Handle;
+    if (!Pack || !Pack->Scrubber)
+    {
+        return 0;
+    }
+
+    AsAtomicOr8(&Pack->Scrubber->Stop, TRUE);
+    AsJoinThread(Pack->Scrubber->Thread);
+    UINT64 CorruptCount = Pack->Scrubber->CorruptCount;
+    CmnFree(Pack->Scrubber);
+
+    return CorruptCount;
+}
+
+PCSTR PackGetDictionaryGroup(_In_z_ PCSTR Path, _In_ BOOLEAN Directory)
+{
+    // Per-thread because files are added from several threads at once
+    static _Thread_local CHAR Group[256];
+
+    PCSTR Name = strrchr(Path, '/');
+    if (Directory)
+    {
+        if (!Name)
+        {
+            return "./";
+        }
+        snprintf(Group, PURPL_ARRAYSIZE(Group), "%.*s", (INT)(Name - Path + 1), Path);
+        return Group;
+    }
+
+    PCSTR Extension = strrchr(Name ? Name : Path, '.');
+    return Extension;
+}
+
+static PPACKFILE_DICTIONARY FindGroupDictionary(_In_ PPACKFILE Pack, _In_opt_z_ PCSTR Group)
+{
+    for (UINT64 i = 0; Group && i < stbds_arrlenu(Pack->Dictionaries); i++)
+    {
+        if (strcmp(Pack->Dictionaries[i].Group, Group) == 0)
+        {
+            return &Pack->Dictionaries[i];
+        }
+    }
+
+    return NULL;
+}
+
+static PPACKFILE_DICTIONARY FindDictionary(_In_ PPACKFILE Pack, _In_z_ PCSTR Path)
+{
+    // Directory groups are more specific, so they win
+    PPACKFILE_DICTIONARY Dictionary = FindGroupDictionary(Pack, PackGetDictionaryGroup(Path, TRUE));
+    if (!Dictionary)
+    {
+        Dictionary = FindGroupDictionary(Pack, PackGetDictionaryGroup(Path, FALSE));
+    }
+
+    return Dictionary;
+}
+
+BOOLEAN PackAddDictionary(_Inout_ PVOID Handle, _In_z_ PCSTR Group, _In_reads_bytes_(Size) PVOID Data,
+                          _In_ UINT32 Size)
+{
+    PPACKFILE Pack = Handle;
+    if (!Pack || !Group || !Data || stbds_arrlenu(Pack->Dictionaries) >= UINT16_MAX)
+    {
+        return FALSE;
+    }
+
+    PACKFILE_DICTIONARY Dictionary = {0};
+    Dictionary.Group = CmnDuplicateString(Group, 0);
+    Dictionary.Size = Size;
+    Dictionary.Data = CmnAlloc(Size, 1);
+    if (!Dictionary.Group || !Dictionary.Data)
+    {
+        LogError("Failed to allocate dictionary: %s", strerror(errno));
+        CmnFree(Dictionary.Group);
+        CmnFree(Dictionary.Data);
+        return FALSE;
+    }
+    memcpy(Dictionary.Data, Data, Size);
+
+    LogDebug("Adding %s dictionary for %s to pack %s", CmnFormatSize(Size), Group, Pack->Path);
+    stbds_arrput(Pack->Dictionaries, Dictionary);
+
+    return TRUE;
+}
+
+static SIZE_T SetCompressionParameters(_In_ PPACKFILE Pack, _Inout_ ZSTD_CCtx *Context, _In_ INT32 Level,
+                                       _In_ UINT64 Size)
+{
+    PPACKFILE_WRITE_OPTIONS Options = &Pack->Options;
+
+    // The context is reused by whatever this thread compresses next, so nothing from the last entry can stick around
+    SIZE_T Result = ZSTD_CCtx_reset(Context, ZSTD_reset_session_and_parameters);
+    if (!ZSTD_isError(Result))
+    {
+        Result = ZSTD_CCtx_setParameter(Context, ZSTD_c_compressionLevel, Level);
+    }
+    if (ZSTD_isError(Result) || Size < Options->LargeEntrySize)
+    {
+        return Result;
+    }
+
+    Result = ZSTD_CCtx_setParameter(Context, ZSTD_c_enableLongDistanceMatching, 1);
+    if (!ZSTD_isError(Result) && Options->WindowLog)
+    {
+        Result = ZSTD_CCtx_setParameter(Context, ZSTD_c_windowLog, Options->WindowLog);
+    }
+    if (!ZSTD_isError(Result) && Options->WorkerCount)
+    {
+        // Fails if zstd was built without ZSTD_MULTITHREAD, which isn't fatal
+        SIZE_T WorkerResult = ZSTD_CCtx_setParameter(Context, ZSTD_c_nbWorkers, Options->WorkerCount);
+        if (ZSTD_isError(WorkerResult))
+        {
+            LogWarning("Failed to use %u compression workers: %s", Options->WorkerCount,
+                       ZSTD_getErrorName(WorkerResult));
+        }
+    }
+
+    if (!ZSTD_isError(Result))
+    {
+        LogDebug("Compressing large entry with %u worker(s) and window log %u", Options->WorkerCount,
+                 Options->WindowLog);
+    }
+
+    return Result;
+}
+
+static SIZE_T CompressData(_In_ PPACKFILE Pack, _In_ PACKFILE_METHOD Method, _In_opt_ PPACKFILE_DICTIONARY Dictionary,
+                           _Out_writes_bytes_(CompressedSize) PVOID CompressedData, _In_ SIZE_T CompressedSize,
+                           _In_reads_bytes_(Size) PVOID Data, _In_ UINT64 Size)
+{
+    PPACKFILE_WRITE_OPTIONS Options = &Pack->Options;
+    INT32 Level = Method == PackMethodZstdFast ? Options->FastCompressionLevel : Options->CompressionLevel;
+    if (Method == PackMethodZstdDictionary)
+    {
+        AsLockMutex(Pack->Writer.Lock, TRUE);
+        if (!Dictionary->CompressionDictionary)
+        {
+            Dictionary->CompressionDictionary =
+                ZSTD_createCDict(Dictionary->Data, Dictionary->Size, Options->CompressionLevel);
+        }
+        AsUnlockMutex(Pack->Writer.Lock);
+        if (!Dictionary->CompressionDictionary)
+        {
+            return (SIZE_T)-ZSTD_error_dictionaryCreation_failed;
+        }
+
+        ZSTD_CCtx *Context = CmnGetCompressionContext();
+        if (!Context)
+        {
+            return (SIZE_T)-ZSTD_error_memory_allocation;
+        }
+        return ZSTD_compress_usingCDict(Context, CompressedData, CompressedSize, Data, Size,
+                                        Dictionary->CompressionDictionary);
+    }
+    else if (Size < Options->LargeEntrySize)
+    {
+        return CmnCompress(CompressedData, CompressedSize, Data, Size, Level);
+    }
+
+    ZSTD_CCtx *Context = CmnGetCompressionContext();
+    if (!Context)
+    {
+        return (SIZE_T)-ZSTD_error_memory_allocation;
+    }
+
+    SIZE_T Result = SetCompressionParameters(Pack, Context, Level, Size);
+    if (!ZSTD_isError(Result))
+    {
+        Result = ZSTD_compress2(Context, CompressedData, CompressedSize, Data, Size);
+    }
+
+    return Result;
+}
+
+static BOOLEAN IsWorthCompressing(_In_ UINT64 CompressedSize, _In_ UINT64 Size, _In_ UINT8 Threshold)
+{
+    return !Threshold || CompressedSize * 100 < Size * Threshold;
+}
+
+static BOOLEAN IsSeekable(_In_ PPACKFILE Pack, _In_ PACKFILE_METHOD Method, _In_ UINT64 Size)
+{
+    // Frames have to be whole pages for PackMapFile, and divide PACKFILE_STREAM_CHUNK_SIZE for PackAddFileStream
+    UINT32 FrameSize = Pack->Options.SeekableFrameSize;
+    return FrameSize >= PACKFILE_MIN_SEEKABLE_FRAME_SIZE && FrameSize <= PACKFILE_STREAM_CHUNK_SIZE &&
+           (FrameSize & (FrameSize - 1)) == 0 && Size > FrameSize &&
+           (Method == PackMethodZstdFast || Method == PackMethodZstdHigh);
+}
+
+static VOID WriteSeekTable(_In_reads_(FrameCount) PPACKFILE_SEEK_TABLE_ENTRY Frames, _In_ UINT64 FrameCount,
+                           _Out_writes_bytes_(GetSeekTableSize(FrameCount)) PBYTE Buffer)
+{
+    UINT32 Header[2] = {PACKFILE_SEEK_TABLE_FRAME_MAGIC, (UINT32)(GetSeekTableSize(FrameCount) - sizeof(Header))};
+    PACKFILE_SEEK_TABLE_FOOTER Footer = {(UINT32)FrameCount, PACKFILE_SEEK_TABLE_CHECKSUMS, PACKFILE_SEEK_TABLE_MAGIC};
+
+    memcpy(Buffer, Header, sizeof(Header));
+    memcpy(Buffer + sizeof(Header), Frames, FrameCount * sizeof(PACKFILE_SEEK_TABLE_ENTRY));
+    memcpy(Buffer + sizeof(Header) + FrameCount * sizeof(PACKFILE_SEEK_TABLE_ENTRY), &Footer, sizeof(Footer));
+}
+
+static SIZE_T GetCompressedBound(_In_ PPACKFILE Pack, _In_ PACKFILE_METHOD Method, _In_ UINT64 Size)
+{
+    if (!IsSeekable(Pack, Method, Size))
+    {
+        return ZSTD_compressBound(Size);
+    }
+
+    UINT32 FrameSize = Pack->Options.SeekableFrameSize;
+    UINT64 FrameCount = (Size + FrameSize - 1) / FrameSize;
+    return FrameCount * ZSTD_compressBound(FrameSize) + GetSeekTableSize(FrameCount);
+}
+
+static SIZE_T CompressSeekable(_In_ PPACKFILE Pack, _In_ PACKFILE_METHOD Method,
+                               _Out_writes_bytes_(CompressedSize) PBYTE CompressedData, _In_ SIZE_T CompressedSize,
+                               _In_reads_bytes_(Size) PBYTE Data, _In_ UINT64 Size)
+{
+    INT32 Level =
+        Method == PackMethodZstdFast ? Pack->Options.FastCompressionLevel : Pack->Options.CompressionLevel;
+    UINT32 FrameSize = Pack->Options.SeekableFrameSize;
+    UINT64 FrameCount = (Size + FrameSize - 1) / FrameSize;
+    PPACKFILE_SEEK_TABLE_ENTRY Frames = CmnAllocType(FrameCount, PACKFILE_SEEK_TABLE_ENTRY);
+    if (!Frames)
+    {
+        return (SIZE_T)-ZSTD_error_memory_allocation;
+    }
+
+    SIZE_T Result = 0;
+    SIZE_T Offset = 0;
+    for (UINT64 i = 0; i < FrameCount; i++)
+    {
+        PBYTE Frame = Data + i * FrameSize;
+        UINT64 Remaining = PURPL_MIN(FrameSize, Size - i * FrameSize);
+        Result = CmnCompress(CompressedData + Offset, CompressedSize - Offset, Frame, Remaining, Level);
+        if (ZSTD_isError(Result))
+        {
+            break;
+        }
+
+        Frames[i].CompressedSize = (UINT32)Result;
+        Frames[i].Size = (UINT32)Remaining;
+        Frames[i].Checksum = (UINT32)XXH64(Frame, Remaining, 0);
+        Offset += Result;
+    }
+
+    if (!ZSTD_isError(Result))
+    {
+        if (CompressedSize - Offset < GetSeekTableSize(FrameCount))
+        {
+            Result = (SIZE_T)-ZSTD_error_dstSize_tooSmall;
+        }
+        else
+        {
+            WriteSeekTable(Frames, FrameCount, CompressedData + Offset);
+            Result = Offset + GetSeekTableSize(FrameCount);
+        }
+    }
+
+    CmnFree(Frames);
+    return Result;
+}
+
+static PACKFILE_METHOD PickMethod(_In_ PPACKFILE Pack, _In_reads_bytes_(Size) PVOID Data, _In_ UINT64 Size)
+{
+    PPACKFILE_WRITE_OPTIONS Options = &Pack->Options;
+    if (!Options->StoreThreshold && !Options->FastThreshold)
+    {
+        return PackMethodZstdHigh;
+    }
+
+    // Compressing the start of the entry at the fast level is cheap, and says enough about how compressible media or
+    // tiny files are
+    UINT64 ProbeSize = PURPL_MIN(Size, PACKFILE_PROBE_SIZE);
+    SIZE_T ProbeBufferSize = ZSTD_compressBound(ProbeSize);
+    PVOID ProbeBuffer = CmnAlloc(ProbeBufferSize, 1);
+    if (!ProbeBuffer)
+    {
+        return PackMethodZstdHigh;
+    }
+
+    SIZE_T ProbedSize = CmnCompress(ProbeBuffer, ProbeBufferSize, Data, ProbeSize, Options->FastCompressionLevel);
+    CmnFree(ProbeBuffer);
+    if (ZSTD_isError(ProbedSize))
+    {
+        return PackMethodZstdHigh;
+    }
+
+    if (!IsWorthCompressing(ProbedSize, ProbeSize, Options->StoreThreshold))
+    {
+        return PackMethodStored;
+    }
+    else if (!IsWorthCompressing(ProbedSize, ProbeSize, Options->FastThreshold))
+    {
+        return PackMethodZstdFast;
+    }
+
+    return PackMethodZstdHigh;
+}
+
+PCSTR PackGetMethodName(_In_ PACKFILE_METHOD Method)
+{
+    static CONST PCSTR Names[] = {
+        "stored",
+        "zstd fast",
+        "zstd high",
+        "zstd dictionary",
+        "zstd solid",
+    };
+
+    return Method < PURPL_ARRAYSIZE(Names) ? Names[Method] : "unknown";
+}
+
+static VOID IndexContents(_Inout_ PPACKFILE Pack)
+{
+    // Only needed for adding files, so loading a pack to read from it doesn't pay for this
+    if (!Pack->Writer.ContentsIndexed)
+    {
+        for (UINT64 i = 0; i < stbds_shlenu(Pack->Entries); i++)
+        {
+            stbds_hmput(Pack->Writer.Contents, Pack->Entries[i].value.Hash, i);
+        }
+        Pack->Writer.ContentsIndexed = TRUE;
+    }
+}
+
+static BOOLEAN InsertEntry(_Inout_ PPACKFILE Pack, _In_z_ PCSTR Path, _In_ PPACKFILE_ENTRY Entry)
+{
+    UINT64 Index = 0;
+    PPACKFILE_ENTRY Existing = FindEntry(Pack, Path, &Index);
+    if (Existing)
+    {
+        *Existing = *Entry;
+        Pack->Verified[Index] = 0;
+    }
+    else
+    {
+        stbds_shput(Pack->Entries, CreateKey(Pack, Path), *Entry);
+        Index = stbds_shlenu(Pack->Entries) - 1;
+        if (!AddLookup(Pack, Index))
+        {
+            return FALSE;
+        }
+    }
+
+    stbds_hmput(Pack->Writer.Contents, Entry->Hash, Index);
+    return TRUE;
+}
+
+static BOOLEAN AddDuplicate(_Inout_ PPACKFILE Pack, _In_z_ PCSTR Path, _In_ XXH128_hash_t Hash, _In_ UINT64 Size,
+                            _Out_ PBOOLEAN Added)
+{
+    *Added = FALSE;
+
+    INT64 ContentIndex = stbds_hmgeti(Pack->Writer.Contents, Hash);
+    if (ContentIndex < 0)
+    {
+        return TRUE;
+    }
+
+    // The entry could have been replaced since
+    PACKFILE_ENTRY Entry = Pack->Entries[Pack->Writer.Contents[ContentIndex].value].value;
+    if (!XXH128_isEqual(Entry.Hash, Hash) || Entry.Size != Size)
+    {
+        return TRUE;
+    }
+
+    LogDebug("Adding %s file as %s to pack %s, using the data of %s", CmnFormatSize(Size), Path, Pack->Path,
+             Pack->Entries[Pack->Writer.Contents[ContentIndex].value].key);
+
+    Entry.PathLength = (UINT16)strlen(Path);
+    if (!InsertEntry(Pack, Path, &Entry))
+    {
+        return FALSE;
+    }
+
+    Pack->Writer.DuplicateCount++;
+    Pack->Writer.DuplicateSize += Entry.CompressedSize;
+    *Added = TRUE;
+    return TRUE;
+}
+
+static BOOLEAN WriteArchiveData(_In_z_ PCSTR BasePath, _Inout_ PPACKFILE_WRITE_STATE State,
+                                _In_reads_bytes_(Size) PVOID Data, _In_ UINT64 Size)
+{
+    UINT64 DataOffset = 0;
+    UINT64 SizeToWrite = Size;
+    while (SizeToWrite > 0)
+    {
+        PCHAR ArchivePath = GetArchivePath(BasePath, State->CurrentArchive);
+        UINT64 Written = PURPL_MIN(PACKFILE_MAX_CHUNK_SIZE - State->CurrentOffset, SizeToWrite);
+        if (!FsWriteFile(ArchivePath, (PBYTE)Data + DataOffset, Written, TRUE))
+        {
+            LogError("Failed to add file to pack");
             CmnFree(ArchivePath);
-            CmnFree(Data);
-            return NULL;
+            return FALSE;
+        }
+        CmnFree(ArchivePath);
+        SizeToWrite -= Written;
+        DataOffset += Written;
+        State->CurrentOffset += Written;
+        if (State->CurrentOffset >= PACKFILE_MAX_CHUNK_SIZE)
+        {
+            State->CurrentArchive++;
+            State->CurrentOffset = 0;
+        }
+    }
+
+    return TRUE;
+}
+
+static UINT64 AlignSize(_In_ UINT64 Size, _In_ UINT32 Alignment)
+{
+    return Alignment ? (Size + Alignment - 1) & ~(UINT64)(Alignment - 1) : Size;
+}
+
+static BOOLEAN AlignArchiveData(_In_z_ PCSTR BasePath, _Inout_ PPACKFILE_WRITE_STATE State, _In_ UINT32 Alignment)
+{
+    UINT64 PaddingSize = AlignSize(State->CurrentOffset, Alignment) - State->CurrentOffset;
+    if (PaddingSize == 0)
+    {
+        return TRUE;
+    }
+
+    PVOID Padding = CmnAlloc(PaddingSize, 1);
+    if (!Padding)
+    {
+        LogError("Failed to allocate %llu bytes of padding: %s", PaddingSize, strerror(errno));
+        return FALSE;
+    }
+
+    BOOLEAN Success = WriteArchiveData(BasePath, State, Padding, PaddingSize);
+    CmnFree(Padding);
+
+    return Success;
+}
+
+BOOLEAN PackAddFile(_Inout_ PVOID Handle, _In_z_ PCSTR Path, _In_reads_bytes_(Size) PVOID Data, _In_ UINT64 Size)
+{
+    PPACKFILE Pack = Handle;
+    if (!Pack)
+    {
+        return FALSE;
+    }
+
+    // Files with the same contents as one that's already in the pack just point at its data
+    XXH128_hash_t Hash = XXH3_128bits(Data, Size);
+    BOOLEAN Added = FALSE;
+    AsLockMutex(Pack->Writer.Lock, TRUE);
+    IndexContents(Pack);
+    BOOLEAN Success = AddDuplicate(Pack, Path, Hash, Size, &Added);
+    AsUnlockMutex(Pack->Writer.Lock);
+    if (!Success || Added)
+    {
+        return Success;
+    }
+
+    PPACKFILE_DICTIONARY Dictionary = Size <= PACKFILE_DICTIONARY_MAX_ENTRY_SIZE ? FindDictionary(Pack, Path) : NULL;
+    PACKFILE_METHOD Method = Dictionary ? PackMethodZstdDictionary : PickMethod(Pack, Data, Size);
+
+    SIZE_T CompressedSize = GetCompressedBound(Pack, Method, Size);
+    PBYTE CompressedData = CmnAlloc(CompressedSize, 1);
+    if (!CompressedData)
+    {
+        LogError("Failed to add %s file as %s to pack %s: %s", CmnFormatSize(Size), Path, Pack->Path, strerror(errno));
+        return FALSE;
+    }
+
+    if (Method != PackMethodStored)
+    {
+        CompressedSize = IsSeekable(Pack, Method, Size)
+                             ? CompressSeekable(Pack, Method, CompressedData, CompressedSize, Data, Size)
+                             : CompressData(Pack, Method, Dictionary, CompressedData, CompressedSize, Data, Size);
+        if (ZSTD_isError(CompressedSize))
+        {
+            LogError("Failed to compress data: %s", ZSTD_getErrorName(CompressedSize));
+            CmnFree(CompressedData);
+            return FALSE;
+        }
+
+        // The probe only sees the start of the entry, and dictionaries aren't probed at all
+        if (!IsWorthCompressing(CompressedSize, Size, Pack->Options.StoreThreshold))
+        {
+            Method = PackMethodStored;
+        }
+    }
+
+    PVOID StoredData = CompressedData;
+    if (Method == PackMethodStored)
+    {
+        StoredData = Data;
+        CompressedSize = Size;
+        Dictionary = NULL;
+    }
+
+    PACKFILE_ENTRY Entry = {0};
+    Entry.Hash = Hash;
+    Entry.CompressedHash = Method == PackMethodStored ? Entry.Hash : XXH3_128bits(CompressedData, CompressedSize);
+    Entry.Size = Size;
+    Entry.CompressedSize = CompressedSize;
+    Entry.Method = (UINT8)Method;
+    Entry.Dictionary = Dictionary ? (UINT16)(Dictionary - Pack->Dictionaries + 1) : 0;
+    Entry.PathLength = (UINT16)strlen(Path);
+
+    AsLockMutex(Pack->Writer.Lock, TRUE);
+
+    // Another thread could have added the same contents while this one was compressing
+    Success = AddDuplicate(Pack, Path, Hash, Size, &Added);
+    if (Success && !Added)
+    {
+        LogDebug("Adding %s (%s %s) file as %s to pack %s", CmnFormatSize(Size),
+                 CmnFormatTempString("%s", CmnFormatSize(CompressedSize)), PackGetMethodName(Method), Path,
+                 Pack->Path); // TODO: there has to be a better way of dealing with static buffers
+
+        Success = AlignArchiveData(Pack->Path, &Pack->Writer, Pack->Header.Alignment);
+        Entry.ArchiveIndex = Pack->Writer.CurrentArchive;
+        Entry.Offset = Pack->Writer.CurrentOffset;
+        Success = Success && WriteArchiveData(Pack->Path, &Pack->Writer, StoredData, CompressedSize) &&
+                  InsertEntry(Pack, Path, &Entry);
+    }
+
+    AsUnlockMutex(Pack->Writer.Lock);
+
+    CmnFree(CompressedData);
+
+    return Success;
+}
+
+static BOOLEAN HasEntryOfSize(_In_ PPACKFILE Pack, _In_ UINT64 Size)
+{
+    for (UINT64 i = 0; i < stbds_shlenu(Pack->Entries); i++)
+    {
+        if (Pack->Entries[i].value.Size == Size)
+        {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static BOOLEAN HashStream(_In_ PFN_PACKFILE_READ_CALLBACK Read, _In_opt_ PVOID UserData, _In_ UINT64 Size,
+                          _Inout_updates_bytes_(PACKFILE_STREAM_CHUNK_SIZE) PBYTE Buffer, _Out_ XXH128_hash_t *Hash)
+{
+    XXH3_state_t *State = XXH3_createState();
+    if (!State)
+    {
+        LogError("Failed to allocate hash state: %s", strerror(errno));
+        return FALSE;
+    }
+
+    XXH3_128bits_reset(State);
+    BOOLEAN Success = TRUE;
+    for (UINT64 Offset = 0; Offset < Size; Offset += PACKFILE_STREAM_CHUNK_SIZE)
+    {
+        UINT64 ChunkSize = PURPL_MIN(Size - Offset, PACKFILE_STREAM_CHUNK_SIZE);
+        if (!Read(UserData, Offset, Buffer, ChunkSize))
+        {
+            Success = FALSE;
+            break;
+        }
+        XXH3_128bits_update(State, Buffer, ChunkSize);
+    }
+
+    *Hash = XXH3_128bits_digest(State);
+    XXH3_freeState(State);
+
+    return Success;
+}
+
+BOOLEAN PackAddFileStream(_Inout_ PVOID Handle, _In_z_ PCSTR Path, _In_ PFN_PACKFILE_READ_CALLBACK Read,
+                          _In_opt_ PVOID UserData, _In_ UINT64 Size)
+{
+    PPACKFILE Pack = Handle;
+    if (!Pack || !Read)
+    {
+        return FALSE;
+    }
+
+    PBYTE Input = CmnAlloc(PURPL_MIN(Size, PACKFILE_STREAM_CHUNK_SIZE), 1);
+    if (!Input)
+    {
+        LogError("Failed to allocate input buffer for %s: %s", Path, strerror(errno));
+        return FALSE;
+    }
+
+    // The first chunk is enough to pick the method, and if it's the whole file there's no point streaming it
+    UINT64 ChunkSize = PURPL_MIN(Size, PACKFILE_STREAM_CHUNK_SIZE);
+    if (!Read(UserData, 0, Input, ChunkSize))
+    {
+        LogError("Failed to read the start of %s", Path);
+        CmnFree(Input);
+        return FALSE;
+    }
+    if (Size <= PACKFILE_STREAM_CHUNK_SIZE)
+    {
+        BOOLEAN Success = PackAddFile(Pack, Path, Input, Size);
+        CmnFree(Input);
+        return Success;
+    }
+
+    PBYTE Output = CmnAlloc(PACKFILE_STREAM_CHUNK_SIZE, 1);
+    XXH3_state_t *State = XXH3_createState();
+    XXH3_state_t *CompressedState = XXH3_createState();
+    ZSTD_CCtx *Context = CmnGetCompressionContext();
+    PPACKFILE_SEEK_TABLE_ENTRY Frames = NULL;
+    BOOLEAN Locked = FALSE;
+    BOOLEAN Success = FALSE;
+    if (!Output || !State || !CompressedState || !Context)
+    {
+        LogError("Failed to allocate memory to add %s: %s", Path, strerror(errno));
+        goto Done;
+    }
+
+    // Hashing the whole file first would mean reading it twice, which is only worth it if it could be a duplicate
+    AsLockMutex(Pack->Writer.Lock, TRUE);
+    IndexContents(Pack);
+    BOOLEAN CheckDuplicate = HasEntryOfSize(Pack, Size);
+    AsUnlockMutex(Pack->Writer.Lock);
+    if (CheckDuplicate)
+    {
+        XXH128_hash_t Hash = {0};
+        BOOLEAN Added = FALSE;
+        if (!HashStream(Read, UserData, Size, Output, &Hash))
+        {
+            LogError("Failed to read %s", Path);
+            goto Done;
         }
-        memcpy(CompressedData + TotalOffset, Data, Read);
-        CmnFree(Data);
-        SizeToRead -= Read;
-        TotalOffset += Read;
-        CurrentOffset += Read;
-        Pack->CurrentOffset += Read;
-        if (Pack->CurrentOffset > PACKFILE_MAX_CHUNK_SIZE)
-        {
-            CurrentArchive++;
-            CurrentOffset = 0;
+
+        AsLockMutex(Pack->Writer.Lock, TRUE);
+        Success = AddDuplicate(Pack, Path, Hash, Size, &Added);
+        AsUnlockMutex(Pack->Writer.Lock);
+        if (!Success || Added)
+        {
+            goto Done;
+        }
+        Success = FALSE;
+    }
+
+    // Seekable entries are compressed as one frame per Options.SeekableFrameSize bytes, which divides the chunk size
+    PACKFILE_METHOD Method = PickMethod(Pack, Input, ChunkSize);
+    BOOLEAN Seekable = IsSeekable(Pack, Method, Size);
+    UINT64 FrameSize = Seekable ? Pack->Options.SeekableFrameSize : PACKFILE_STREAM_CHUNK_SIZE;
+    if (Method != PackMethodStored)
+    {
+        INT32 Level =
+            Method == PackMethodZstdFast ? Pack->Options.FastCompressionLevel : Pack->Options.CompressionLevel;
+        SIZE_T Result = SetCompressionParameters(Pack, Context, Level, Seekable ? FrameSize : Size);
+        if (!ZSTD_isError(Result) && !Seekable)
+        {
+            Result = ZSTD_CCtx_setPledgedSrcSize(Context, Size);
+        }
+        if (ZSTD_isError(Result))
+        {
+            LogError("Failed to set up compression for %s: %s", Path, ZSTD_getErrorName(Result));
+            goto Done;
+        }
+    }
+
+    XXH3_128bits_reset(State);
+    XXH3_128bits_reset(CompressedState);
+
+    PACKFILE_ENTRY Entry = {0};
+    Entry.Size = Size;
+    Entry.Method = (UINT8)Method;
+    Entry.PathLength = (UINT16)strlen(Path);
+
+    // Everything is written as it's compressed, so nothing else can be written until this is done
+    AsLockMutex(Pack->Writer.Lock, TRUE);
+    Locked = TRUE;
+
+    LogDebug("Streaming %s file as %s (%s) to pack %s", CmnFormatSize(Size), Path, PackGetMethodName(Method),
+             Pack->Path);
+
+    if (!AlignArchiveData(Pack->Path, &Pack->Writer, Pack->Header.Alignment))
+    {
+        goto Done;
+    }
+    Entry.ArchiveIndex = Pack->Writer.CurrentArchive;
+    Entry.Offset = Pack->Writer.CurrentOffset;
+
+    ZSTD_outBuffer OutputBuffer = {Output, PACKFILE_STREAM_CHUNK_SIZE, 0};
+    for (UINT64 Offset = 0; Offset < Size; Offset += ChunkSize)
+    {
+        ChunkSize = PURPL_MIN(Size - Offset, PACKFILE_STREAM_CHUNK_SIZE);
+        if (Offset > 0 && !Read(UserData, Offset, Input, ChunkSize))
+        {
+            LogError("Failed to read %s at offset %llu", Path, Offset);
+            goto Done;
+        }
+        XXH3_128bits_update(State, Input, ChunkSize);
+
+        if (Method == PackMethodStored)
+        {
+            if (!WriteArchiveData(Pack->Path, &Pack->Writer, Input, ChunkSize))
+            {
+                goto Done;
+            }
+            XXH3_128bits_update(CompressedState, Input, ChunkSize);
+            Entry.CompressedSize += ChunkSize;
+            continue;
+        }
+
+        for (UINT64 FrameOffset = 0; FrameOffset < ChunkSize; FrameOffset += FrameSize)
+        {
+            // The output is only written once it's full, or once the frame is done
+            PBYTE Frame = Input + FrameOffset;
+            UINT64 FrameDataSize = PURPL_MIN(ChunkSize - FrameOffset, FrameSize);
+            ZSTD_inBuffer InputBuffer = {Frame, FrameDataSize, 0};
+            ZSTD_EndDirective Directive = Seekable || Offset + ChunkSize >= Size ? ZSTD_e_end : ZSTD_e_continue;
+            UINT64 FrameStart = Entry.CompressedSize;
+            SIZE_T Remaining = Seekable ? ZSTD_CCtx_setPledgedSrcSize(Context, FrameDataSize) : 0;
+            if (ZSTD_isError(Remaining))
+            {
+                LogError("Failed to compress %s: %s", Path, ZSTD_getErrorName(Remaining));
+                goto Done;
+            }
+            do
+            {
+                Remaining = ZSTD_compressStream2(Context, &OutputBuffer, &InputBuffer, Directive);
+                if (ZSTD_isError(Remaining))
+                {
+                    LogError("Failed to compress %s: %s", Path, ZSTD_getErrorName(Remaining));
+                    goto Done;
+                }
+
+                BOOLEAN Finished = Directive == ZSTD_e_end && Remaining == 0;
+                if (OutputBuffer.pos == OutputBuffer.size || (Finished && OutputBuffer.pos > 0))
+                {
+                    if (!WriteArchiveData(Pack->Path, &Pack->Writer, Output, OutputBuffer.pos))
+                    {
+                        goto Done;
+                    }
+                    XXH3_128bits_update(CompressedState, Output, OutputBuffer.pos);
+                    Entry.CompressedSize += OutputBuffer.pos;
+                    OutputBuffer.pos = 0;
+                }
+            } while (Directive == ZSTD_e_end ? Remaining != 0 : InputBuffer.pos < InputBuffer.size);
+
+            if (Seekable)
+            {
+                PACKFILE_SEEK_TABLE_ENTRY FrameEntry = {(UINT32)(Entry.CompressedSize - FrameStart),
+                                                        (UINT32)FrameDataSize, (UINT32)XXH64(Frame, FrameDataSize, 0)};
+                stbds_arrput(Frames, FrameEntry);
+            }
+        }
+    }
+
+    if (Seekable)
+    {
+        UINT64 TableSize = GetSeekTableSize(stbds_arrlenu(Frames));
+        PBYTE Table = CmnAlloc(TableSize, 1);
+        if (!Table)
+        {
+            LogError("Failed to allocate seek table for %s: %s", Path, strerror(errno));
+            goto Done;
+        }
+        WriteSeekTable(Frames, stbds_arrlenu(Frames), Table);
+        BOOLEAN Written = WriteArchiveData(Pack->Path, &Pack->Writer, Table, TableSize);
+        XXH3_128bits_update(CompressedState, Table, TableSize);
+        Entry.CompressedSize += TableSize;
+        CmnFree(Table);
+        if (!Written)
+        {
+            goto Done;
+        }
+    }
+
+    Entry.Hash = XXH3_128bits_digest(State);
+    Entry.CompressedHash = XXH3_128bits_digest(CompressedState);
+    LogDebug("Streamed %s file as %s (%s %s) to pack %s", CmnFormatSize(Size), Path,
+             CmnFormatTempString("%s", CmnFormatSize(Entry.CompressedSize)), PackGetMethodName(Method), Pack->Path);
+    Success = InsertEntry(Pack, Path, &Entry);
+
+Done:
+    if (Locked)
+    {
+        AsUnlockMutex(Pack->Writer.Lock);
+    }
+    if (Locked && !Success)
+    {
+        LogError("Failed to stream %s to pack %s, what was written of it is dead space", Path, Pack->Path);
+    }
+    if (Context && !Success)
+    {
+        ZSTD_CCtx_reset(Context, ZSTD_reset_session_only);
+    }
+    stbds_arrfree(Frames);
+    XXH3_freeState(CompressedState);
+    XXH3_freeState(State);
+    CmnFree(Output);
+    CmnFree(Input);
+
+    return Success;
+}
+
+BOOLEAN PackAddSolidBlock(_Inout_ PVOID Handle, _In_reads_(Count) PCSTR *Paths, _In_reads_(Count) PVOID *Data,
+                          _In_reads_(Count) PUINT64 Sizes, _In_ UINT64 Count)
+{
+    PPACKFILE Pack = Handle;
+    if (!Pack || !Paths || !Data || !Sizes)
+    {
+        return FALSE;
+    }
+
+    XXH128_hash_t *Hashes = CmnAllocType(Count, XXH128_hash_t);
+    PUINT64 BlockOffsets = CmnAllocType(Count, UINT64);
+    if (!Hashes || !BlockOffsets)
+    {
+        LogError("Failed to allocate solid block state: %s", strerror(errno));
+        CmnFree(Hashes);
+        CmnFree(BlockOffsets);
+        return FALSE;
+    }
+
+    UINT64 TotalSize = 0;
+    for (UINT64 i = 0; i < Count; i++)
+    {
+        Hashes[i] = XXH3_128bits(Data[i], Sizes[i]);
+        TotalSize += Sizes[i];
+    }
+
+    // Files that are already in the pack don't go in the block, UINT64_MAX marks them
+    BOOLEAN Success = TRUE;
+    AsLockMutex(Pack->Writer.Lock, TRUE);
+    IndexContents(Pack);
+    for (UINT64 i = 0; Success && i < Count; i++)
+    {
+        BOOLEAN Added = FALSE;
+        Success = AddDuplicate(Pack, Paths[i], Hashes[i], Sizes[i], &Added);
+        BlockOffsets[i] = Added ? UINT64_MAX : 0;
+    }
+    AsUnlockMutex(Pack->Writer.Lock);
+
+    PPACKFILE_CONTENT_MAP BlockContents = NULL;
+    PBYTE Block = NULL;
+    PBYTE CompressedData = NULL;
+    UINT64 BlockSize = 0;
+    UINT64 UniqueCount = 0;
+    if (!Success)
+    {
+        goto Done;
+    }
+
+    Block = CmnAlloc(PURPL_MAX(TotalSize, 1), 1);
+    if (!Block)
+    {
+        LogError("Failed to allocate %s solid block: %s", CmnFormatSize(TotalSize), strerror(errno));
+        Success = FALSE;
+        goto Done;
+    }
+
+    // Files with the same contents in the block share them too
+    for (UINT64 i = 0; i < Count; i++)
+    {
+        if (BlockOffsets[i] == UINT64_MAX)
+        {
+            continue;
+        }
+
+        INT64 ContentIndex = stbds_hmgeti(BlockContents, Hashes[i]);
+        if (ContentIndex >= 0)
+        {
+            BlockOffsets[i] = BlockContents[ContentIndex].value;
+            continue;
+        }
+
+        memcpy(Block + BlockSize, Data[i], Sizes[i]);
+        BlockOffsets[i] = BlockSize;
+        stbds_hmput(BlockContents, Hashes[i], BlockSize);
+        BlockSize += Sizes[i];
+        UniqueCount++;
+    }
+
+    if (UniqueCount == 0)
+    {
+        goto Done;
+    }
+    if (BlockSize > PACKFILE_MAX_SOLID_BLOCK_SIZE)
+    {
+        LogError("Solid block of %s is too big", CmnFormatSize(BlockSize));
+        Success = FALSE;
+        goto Done;
+    }
+
+    SIZE_T CompressedSize = ZSTD_compressBound(BlockSize);
+    CompressedData = CmnAlloc(CompressedSize, 1);
+    if (!CompressedData)
+    {
+        LogError("Failed to allocate %s for compressed solid block: %s", CmnFormatSize(CompressedSize),
+                 strerror(errno));
+        Success = FALSE;
+        goto Done;
+    }
+
+    CompressedSize = CompressData(Pack, PackMethodZstdHigh, NULL, CompressedData, CompressedSize, Block, BlockSize);
+    if (ZSTD_isError(CompressedSize) || UniqueCount < 2 ||
+        !IsWorthCompressing(CompressedSize, BlockSize, Pack->Options.StoreThreshold))
+    {
+        // A block of one file is just a worse compressed entry, and incompressible files might as well be stored
+        // individually
+        for (UINT64 i = 0; Success && i < Count; i++)
+        {
+            if (BlockOffsets[i] != UINT64_MAX)
+            {
+                Success = PackAddFile(Pack, Paths[i], Data[i], Sizes[i]);
+            }
+        }
+        goto Done;
+    }
+
+    PACKFILE_ENTRY Entry = {0};
+    Entry.CompressedHash = XXH3_128bits(CompressedData, CompressedSize);
+    Entry.CompressedSize = CompressedSize;
+    Entry.Method = PackMethodZstdSolid;
+
+    AsLockMutex(Pack->Writer.Lock, TRUE);
+
+    LogDebug("Adding %llu file(s) as a %s solid block (%s compressed) to pack %s", UniqueCount,
+             CmnFormatSize(BlockSize), CmnFormatTempString("%s", CmnFormatSize(CompressedSize)), Pack->Path);
+
+    Success = AlignArchiveData(Pack->Path, &Pack->Writer, Pack->Header.Alignment);
+    Entry.ArchiveIndex = Pack->Writer.CurrentArchive;
+    Entry.Offset = Pack->Writer.CurrentOffset;
+    Success = Success && WriteArchiveData(Pack->Path, &Pack->Writer, CompressedData, CompressedSize);
+    for (UINT64 i = 0; Success && i < Count; i++)
+    {
+        if (BlockOffsets[i] != UINT64_MAX)
+        {
+            Entry.Hash = Hashes[i];
+            Entry.Size = Sizes[i];
+            Entry.BlockOffset = (UINT32)BlockOffsets[i];
+            Entry.PathLength = (UINT16)strlen(Paths[i]);
+            Success = InsertEntry(Pack, Paths[i], &Entry);
+        }
+    }
+
+    AsUnlockMutex(Pack->Writer.Lock);
+
+Done:
+    stbds_hmfree(BlockContents);
+    CmnFree(CompressedData);
+    CmnFree(Block);
+    CmnFree(BlockOffsets);
+    CmnFree(Hashes);
+
+    return Success;
+}
+
+BOOLEAN PackRemoveFile(_Inout_ PVOID Handle, _In_z_ PCSTR Path)
+{
+    PPACKFILE Pack = Handle;
+    if (!Pack)
+    {
+        return FALSE;
+    }
+
+    AsLockMutex(Pack->Writer.Lock, TRUE);
+
+    UINT64 Index = 0;
+    if (!FindEntry(Pack, Path, &Index))
+    {
+        AsUnlockMutex(Pack->Writer.Lock);
+        return FALSE;
+    }
+
+    LogDebug("Removing %s from pack %s", Path, Pack->Path);
+
+    // stb_ds moves the last entry into the removed one's place, so the other tables have to follow it
+    PCHAR Key = Pack->Entries[Index].key;
+    stbds_shdel(Pack->Entries, Key);
+    CmnFree(Key);
+    Pack->Verified[Index] = stbds_arrlast(Pack->Verified);
+    stbds_arrpop(Pack->Verified);
+    stbds_hmfree(Pack->Writer.Contents);
+    Pack->Writer.ContentsIndexed = FALSE;
+    BOOLEAN Success = RebuildLookup(Pack);
+
+    AsUnlockMutex(Pack->Writer.Lock);
+
+    return Success;
+}
+
+PURPL_MAKE_HASHMAP_ENTRY(PACKFILE_POSITION_MAP, UINT64, UINT64);
+
+static PPACKFILE_POSITION_MAP GetLivePositions(_In_ PPACKFILE Pack)
+{
+    // Duplicate entries share their data, so it's only counted once
+    PPACKFILE_POSITION_MAP Positions = NULL;
+    for (UINT64 i = 0; i < stbds_shlenu(Pack->Entries); i++)
+    {
+        stbds_hmput(Positions, GetEntryPosition(&Pack->Entries[i].value), Pack->Entries[i].value.CompressedSize);
+    }
+
+    return Positions;
+}
+
+VOID PackGetSpaceUsage(_In_ PVOID Handle, _Out_ PUINT64 TotalSize, _Out_ PUINT64 DeadSize)
+{
+    PPACKFILE Pack = Handle;
+    *TotalSize = 0;
+    *DeadSize = 0;
+    if (!Pack)
+    {
+        return;
+    }
+
+    AsLockMutex(Pack->Writer.Lock, TRUE);
+
+    // Padding that compacting would put back isn't dead
+    PPACKFILE_POSITION_MAP Positions = GetLivePositions(Pack);
+    UINT64 LiveSize = 0;
+    for (UINT64 i = 0; i < stbds_hmlenu(Positions); i++)
+    {
+        LiveSize += AlignSize(Positions[i].value, Pack->Header.Alignment);
+    }
+    stbds_hmfree(Positions);
+
+    *TotalSize = Pack->Writer.CurrentArchive * (UINT64)PACKFILE_MAX_CHUNK_SIZE + Pack->Writer.CurrentOffset;
+    *DeadSize = *TotalSize - PURPL_MIN(LiveSize, *TotalSize);
+
+    AsUnlockMutex(Pack->Writer.Lock);
+}
+
+static PCHAR GetCompactPath(_In_z_ PCSTR BasePath)
+{
+    PCSTR Extension = strrchr(BasePath, '.');
+    if (!Extension)
+    {
+        return CmnAppendString(BasePath, "_compact");
+    }
+    else
+    {
+        return CmnInsertString(BasePath, "_compact", Extension - BasePath);
+    }
+}
+
+static INT CompareLivePositions(_In_ const VOID *First, _In_ const VOID *Second)
+{
+    UINT64 FirstPosition = ((PPACKFILE_POSITION_MAP)First)->key;
+    UINT64 SecondPosition = ((PPACKFILE_POSITION_MAP)Second)->key;
+    return FirstPosition < SecondPosition ? -1 : FirstPosition > SecondPosition;
+}
+
+static BOOLEAN CopyLiveData(_In_ PPACKFILE Pack, _In_z_ PCSTR CompactPath,
+                            _In_reads_(PositionCount) PPACKFILE_POSITION_MAP Positions, _In_ UINT64 PositionCount,
+                            _Inout_ PPACKFILE_POSITION_MAP *NewPositions, _Out_ PPACKFILE_WRITE_STATE State)
+/*++
+
+Routine Description:
+
+    Copies each live range of the pack's archives to the compacted
+    archives in the given order, checking it against the compressed
+    hash of an entry that uses it.
+
+Arguments:
+
+    Pack - The pack file.
+
+    CompactPath - The base path of the compacted archives.
+
+    Positions - The live ranges, in the order to copy them. Only
+                iterated, so this can be a plain array.
+
+    PositionCount - The number of ranges.
+
+    NewPositions - Receives the new position of each range.
+
+    State - Receives the end of the compacted archives.
+
+Return Value:
+
+    TRUE - All the data was copied.
+
+    FALSE - The data couldn't be read or written, or it was corrupt.
+
+--*/
+{
+    memset(State, 0, sizeof(PACKFILE_WRITE_STATE));
+
+    // Any entry at a position has the same compressed data, so one is enough to check it
+    PPACKFILE_POSITION_MAP Owners = NULL;
+    for (UINT64 i = 0; i < stbds_shlenu(Pack->Entries); i++)
+    {
+        stbds_hmput(Owners, GetEntryPosition(&Pack->Entries[i].value), i);
+    }
+
+    PBYTE Buffer = CmnAlloc(PACKFILE_COMPACT_BUFFER_SIZE, 1);
+    if (!Buffer)
+    {
+        LogError("Failed to allocate compaction buffer: %s", strerror(errno));
+        stbds_hmfree(Owners);
+        return FALSE;
+    }
+
+    BOOLEAN Success = TRUE;
+    for (UINT64 i = 0; Success && i < PositionCount; i++)
+    {
+        UINT64 Position = Positions[i].key;
+        UINT64 Index = stbds_hmget(Owners, Position);
+        PPACKFILE_ENTRY Entry = &Pack->Entries[Index].value;
+
+        Success = AlignArchiveData(CompactPath, State, Pack->Header.Alignment);
+        stbds_hmput(*NewPositions, Position,
+                    State->CurrentArchive * (UINT64)PACKFILE_MAX_CHUNK_SIZE + State->CurrentOffset);
+
+        XXH3_state_t HashState;
+        XXH3_128bits_reset(&HashState);
+        for (UINT64 Copied = 0; Success && Copied < Entry->CompressedSize;)
+        {
+            UINT64 Size = PURPL_MIN(Entry->CompressedSize - Copied, PACKFILE_COMPACT_BUFFER_SIZE);
+            Success = ReadArchiveData(Pack, Entry->ArchiveIndex, Entry->Offset + Copied, Buffer, Size) &&
+                      WriteArchiveData(CompactPath, State, Buffer, Size);
+            XXH3_128bits_update(&HashState, Buffer, Size);
+            Copied += Size;
+        }
+
+        if (Success)
+        {
+            Success = CheckHash(Pack->Entries[Index].key, "Compressed", XXH3_128bits_digest(&HashState),
+                                Entry->CompressedHash);
+        }
+    }
+
+    CmnFree(Buffer);
+    stbds_hmfree(Owners);
+
+    return Success;
+}
+
+static BOOLEAN RewriteArchives(_Inout_ PPACKFILE Pack, _In_reads_(PositionCount) PPACKFILE_POSITION_MAP Positions,
+                               _In_ UINT64 PositionCount)
+{
+    PCHAR CompactPath = GetCompactPath(Pack->Path);
+    LogInfo("Rewriting pack %s into %s", Pack->Path, CompactPath);
+
+    PPACKFILE_POSITION_MAP NewPositions = NULL;
+    PACKFILE_WRITE_STATE State = {0};
+    BOOLEAN Success = CopyLiveData(Pack, CompactPath, Positions, PositionCount, &NewPositions, &State);
+    UINT16 OldArchiveCount = Pack->Writer.CurrentArchive + 1;
+    UINT16 NewArchiveCount = State.CurrentArchive + (State.CurrentOffset > 0);
+    if (!Success)
+    {
+        LogError("Failed to rewrite pack %s, leaving it as it was", Pack->Path);
+        for (UINT16 i = 0; i < NewArchiveCount; i++)
+        {
+            PCHAR ArchivePath = GetArchivePath(CompactPath, i);
+            remove(ArchivePath);
             CmnFree(ArchivePath);
-            ArchivePath = GetArchivePath(Pack->Path, CurrentArchive);
+        }
+        goto Done;
+    }
+
+    // Nothing can go back to the old archives after this
+    CloseArchives(&Pack->Archives);
+    CloseArchives(&Pack->DirectArchives);
+
+    for (UINT16 i = 0; i < PURPL_MAX(OldArchiveCount, NewArchiveCount); i++)
+    {
+        PCHAR ArchivePath = GetArchivePath(Pack->Path, i);
+        remove(ArchivePath);
+        if (i < NewArchiveCount)
+        {
+            PCHAR NewArchivePath = GetArchivePath(CompactPath, i);
+            if (rename(NewArchivePath, ArchivePath) != 0)
+            {
+                LogError("Failed to rename %s to %s: %s", NewArchivePath, ArchivePath, strerror(errno));
+                Success = FALSE;
+            }
+            CmnFree(NewArchivePath);
+        }
+        CmnFree(ArchivePath);
+    }
+
+    // The cached blocks are keyed by where they were
+    ClearBlockCache(Pack);
+    for (UINT64 i = 0; i < stbds_shlenu(Pack->Entries); i++)
+    {
+        PPACKFILE_ENTRY Entry = &Pack->Entries[i].value;
+        UINT64 Position = stbds_hmget(NewPositions, GetEntryPosition(Entry));
+        Entry->ArchiveIndex = (UINT16)(Position / PACKFILE_MAX_CHUNK_SIZE);
+        Entry->Offset = Position % PACKFILE_MAX_CHUNK_SIZE;
+    }
+
+    UINT64 OldSize = Pack->Writer.CurrentArchive * (UINT64)PACKFILE_MAX_CHUNK_SIZE + Pack->Writer.CurrentOffset;
+    UINT64 NewSize = State.CurrentArchive * (UINT64)PACKFILE_MAX_CHUNK_SIZE + State.CurrentOffset;
+    LogInfo("Rewrote pack %s from %s to %s", Pack->Path, CmnFormatSize(OldSize),
+            CmnFormatTempString("%s", CmnFormatSize(NewSize)));
+
+    Pack->Writer.CurrentArchive = State.CurrentArchive;
+    Pack->Writer.CurrentOffset = State.CurrentOffset;
+    Success = OpenArchives(Pack) && PackSave(Pack, NULL) && Success;
+
+Done:
+    stbds_hmfree(NewPositions);
+    CmnFree(CompactPath);
+
+    return Success;
+}
+
+BOOLEAN PackCompact(_Inout_ PVOID Handle)
+{
+    PPACKFILE Pack = Handle;
+    if (!Pack)
+    {
+        return FALSE;
+    }
+
+    AsLockMutex(Pack->Writer.Lock, TRUE);
+
+    // Copied in the order they were in, so files that were next to each other stay that way. Sorting breaks the map's
+    // hash table, but it's only iterated after this.
+    PPACKFILE_POSITION_MAP Positions = GetLivePositions(Pack);
+    if (Positions)
+    {
+        qsort(Positions, stbds_hmlenu(Positions), sizeof(PACKFILE_POSITION_MAP), CompareLivePositions);
+    }
+    BOOLEAN Success = RewriteArchives(Pack, Positions, stbds_hmlenu(Positions));
+    stbds_hmfree(Positions);
+
+    AsUnlockMutex(Pack->Writer.Lock);
+
+    return Success;
+}
+
+BOOLEAN PackReorder(_Inout_ PVOID Handle, _In_reads_(PathCount) PCSTR *Paths, _In_ UINT64 PathCount)
+{
+    PPACKFILE Pack = Handle;
+    if (!Pack)
+    {
+        return FALSE;
+    }
+
+    AsLockMutex(Pack->Writer.Lock, TRUE);
+
+    PPACKFILE_POSITION_MAP Positions = GetLivePositions(Pack);
+    PPACKFILE_POSITION_MAP Order = NULL;
+    UINT64 OrderedCount = 0;
+    for (UINT64 i = 0; i < PathCount; i++)
+    {
+        PPACKFILE_ENTRY Entry = FindEntry(Pack, Paths[i], NULL);
+        if (!Entry)
+        {
+            continue;
+        }
+
+        // Removed from the live positions as they're used, so duplicates and paths that come up again are skipped
+        UINT64 Position = GetEntryPosition(Entry);
+        if (stbds_hmgeti(Positions, Position) >= 0)
+        {
+            PACKFILE_POSITION_MAP Range = {Position, Entry->CompressedSize};
+            stbds_arrput(Order, Range);
+            stbds_hmdel(Positions, Position);
+            OrderedCount++;
         }
     }
 
-    XXH128_hash_t CompressedHash = XXH3_128bits(CompressedData, Entry->CompressedSize);
-    if (memcmp(&CompressedHash, &Entry->CompressedHash, sizeof(XXH128_hash_t)) != 0)
+    // Anything that wasn't read stays in the order it was in after the rest
+    if (Positions)
+    {
+        qsort(Positions, stbds_hmlenu(Positions), sizeof(PACKFILE_POSITION_MAP), CompareLivePositions);
+    }
+    for (UINT64 i = 0; i < stbds_hmlenu(Positions); i++)
     {
-        LogWarning("Compressed data hash does not match: got %llX%llX, expected %llX%llX", CompressedHash.high64,
-                   CompressedHash.low64, Entry->CompressedHash.high64, Entry->CompressedHash.low64);
+        stbds_arrput(Order, Positions[i]);
     }
+    stbds_hmfree(Positions);
 
-    PBYTE Data = CmnAlloc(Entry->Size + Extra, 1);
-    if (!Data)
+    LogInfo("Putting %llu of %llu file(s) in pack %s first", OrderedCount, stbds_arrlenu(Order), Pack->Path);
+    BOOLEAN Success = RewriteArchives(Pack, Order, stbds_arrlenu(Order));
+    stbds_arrfree(Order);
+
+    AsUnlockMutex(Pack->Writer.Lock);
+
+    return Success;
+}
+
+BOOLEAN PackStartTrace(_Inout_ PVOID Handle)
+{
+    PPACKFILE Pack = Handle;
+    if (!Pack)
     {
-        LogError("Failed to allocate %zu bytes: %s", Entry->Size, strerror(errno));
-        CmnFree(CompressedData);
+        return FALSE;
+    }
+    if (Pack->Trace)
+    {
+        return TRUE;
+    }
+
+    PPACKFILE_TRACE Trace = CmnAllocType(1, PACKFILE_TRACE);
+    if (!Trace)
+    {
+        LogError("Failed to allocate access trace: %s", strerror(errno));
+        return FALSE;
+    }
+
+    Trace->Lock = AsCreateMutex();
+    if (!Trace->Lock)
+    {
+        LogError("Failed to create access trace lock");
+        CmnFree(Trace);
+        return FALSE;
+    }
+
+    LogInfo("Recording reads from pack %s", Pack->Path);
+    Trace->StartTime = PlatGetMilliseconds();
+    AsLockMutex(Pack->MappingLock, TRUE);
+    Pack->Trace = Trace;
+    AsUnlockMutex(Pack->MappingLock);
+
+    return TRUE;
+}
+
+BOOLEAN PackStopTrace(_Inout_ PVOID Handle, _In_opt_z_ PCSTR Path)
+{
+    PPACKFILE Pack = Handle;
+    if (!Pack || !Pack->Trace)
+    {
+        return FALSE;
     }
 
-    SIZE_T DecompressedSize = ZSTD_decompress(Data, Entry->Size, CompressedData, Entry->CompressedSize);
-    if (ZSTD_isError(DecompressedSize) || DecompressedSize != Entry->Size)
+    // Once this is done, no mapped pages are being filled with the trace
+    AsLockMutex(Pack->MappingLock, TRUE);
+    PPACKFILE_TRACE Trace = Pack->Trace;
+    Pack->Trace = NULL;
+    AsUnlockMutex(Pack->MappingLock);
+
+    BOOLEAN Success = TRUE;
+    if (Path)
     {
-        if (ZSTD_isError(DecompressedSize))
+        LogInfo("Writing %llu read(s) from pack %s to %s", stbds_arrlenu(Trace->Events), Pack->Path, Path);
+
+        PCHAR Text = NULL;
+        PCSTR Line = CmnFormatTempString("# pack %s\n", Pack->Path);
+        memcpy(stbds_arraddnptr(Text, strlen(Line)), Line, strlen(Line));
+        for (UINT64 i = 0; i < stbds_arrlenu(Trace->Events); i++)
         {
-            LogError("Decompression failed: %s", ZSTD_getErrorName(DecompressedSize));
+            PPACKFILE_TRACE_EVENT Event = &Trace->Events[i];
+            Line = CmnFormatTempString("%llu %llu %llu %s\n", Event->Time, Event->Offset, Event->Size,
+                                       Pack->Entries[Event->Index].key);
+            memcpy(stbds_arraddnptr(Text, strlen(Line)), Line, strlen(Line));
         }
-        else
+
+        Success = FsWriteFile(Path, Text, stbds_arrlenu(Text), FALSE);
+        if (!Success)
         {
-            LogError("Decompressed size does not match: got %s, expected %s", CmnFormatSize(DecompressedSize),
-                     CmnFormatTempString("%s", CmnFormatSize(Entry->Size)));
+            LogError("Failed to write access trace of pack %s to %s", Pack->Path, Path);
         }
-        CmnFree(CompressedData);
-        CmnFree(Data);
+        stbds_arrfree(Text);
     }
 
-    CmnFree(CompressedData);
+    stbds_arrfree(Trace->Events);
+    AsDestroyMutex(Trace->Lock);
+    CmnFree(Trace);
 
-    XXH128_hash_t Hash = XXH3_128bits(Data, Entry->Size);
-    if (memcmp(&Hash, &Entry->Hash, sizeof(XXH128_hash_t)) != 0)
+    return Success;
+}
+
+static SIZE_T CompressPatchData(_Out_writes_bytes_(CompressedSize) PVOID CompressedData, _In_ SIZE_T CompressedSize,
+                                _In_reads_bytes_(Size) PVOID Data, _In_ UINT64 Size,
+                                _In_reads_bytes_opt_(BaseSize) PVOID BaseData, _In_ UINT64 BaseSize)
+{
+    ZSTD_CCtx *Context = CmnGetCompressionContext();
+    if (!Context)
     {
-        LogError("Compressed hash does not match: got %llX%llX, expected %llX%llX", Hash.high64, Hash.low64,
-                 Entry->Hash.high64, Entry->Hash.low64);
-        CmnFree(Data);
-        return NULL;
+        return (SIZE_T)-ZSTD_error_memory_allocation;
     }
 
-    SIZE_T Size = 0;
-    if (MaxAmount > 0)
+    SIZE_T Result = ZSTD_CCtx_reset(Context, ZSTD_reset_session_and_parameters);
+    if (!ZSTD_isError(Result))
     {
-        Size = MaxAmount + Extra;
+        Result = ZSTD_CCtx_setParameter(Context, ZSTD_c_compressionLevel, PACKFILE_PATCH_COMPRESSION_LEVEL);
     }
-    else
+    if (!ZSTD_isError(Result) && Size + BaseSize >= PACKFILE_LARGE_ENTRY_SIZE)
+    {
+        Result = ZSTD_CCtx_setParameter(Context, ZSTD_c_enableLongDistanceMatching, 1);
+    }
+    if (!ZSTD_isError(Result) && BaseData)
+    {
+        // Like zstd --patch-from, the window has to reach back over the whole old version
+        ZSTD_bounds Bounds = ZSTD_cParam_getBounds(ZSTD_c_windowLog);
+        INT32 WindowLog = Bounds.lowerBound;
+        while (WindowLog < Bounds.upperBound && (1ull << WindowLog) < Size + BaseSize)
+        {
+            WindowLog++;
+        }
+        Result = ZSTD_CCtx_setParameter(Context, ZSTD_c_windowLog, WindowLog);
+        if (!ZSTD_isError(Result))
+        {
+            Result = ZSTD_CCtx_refPrefix(Context, BaseData, BaseSize);
+        }
+    }
+    if (!ZSTD_isError(Result))
+    {
+        Result = ZSTD_compress2(Context, CompressedData, CompressedSize, Data, Size);
+    }
+
+    // The parameters would stick around for whatever this thread compresses next
+    ZSTD_CCtx_reset(Context, ZSTD_reset_session_and_parameters);
+
+    return Result;
+}
+
+static SIZE_T DecompressPatchData(_Out_writes_bytes_(Size) PVOID Data, _In_ UINT64 Size,
+                                  _In_reads_bytes_(CompressedSize) PVOID CompressedData, _In_ UINT64 CompressedSize,
+                                  _In_reads_bytes_opt_(BaseSize) PVOID BaseData, _In_ UINT64 BaseSize)
+{
+    ZSTD_DCtx *Context = CmnGetDecompressionContext();
+    if (!Context)
+    {
+        return (SIZE_T)-ZSTD_error_memory_allocation;
+    }
+
+    SIZE_T Result = 0;
+    if (BaseData)
+    {
+        Result = ZSTD_DCtx_setParameter(Context, ZSTD_d_windowLogMax,
+                                        ZSTD_dParam_getBounds(ZSTD_d_windowLogMax).upperBound);
+        if (!ZSTD_isError(Result))
+        {
+            Result = ZSTD_DCtx_refPrefix(Context, BaseData, BaseSize);
+        }
+    }
+    if (!ZSTD_isError(Result))
+    {
+        Result = ZSTD_decompressDCtx(Context, Data, Size, CompressedData, CompressedSize);
+    }
+
+    ZSTD_DCtx_reset(Context, ZSTD_reset_session_and_parameters);
+
+    return Result;
+}
+
+static BOOLEAN IsZeroHash(_In_ XXH128_hash_t Hash)
+{
+    return Hash.low64 == 0 && Hash.high64 == 0;
+}
+
+/// @brief A file that's different between the packs given to PackCreatePatch
+PURPL_MAKE_TAG(struct, PACKFILE_DIFF_ITEM, {
+    PACKFILE_PATCH_OPERATION Operation;
+    PCSTR Path;       // Key in the new pack, or the old one for removed files
+    PCSTR SourcePath; // Key in the old pack of the file copies use
+    PBYTE Data;       // Compressed data of full files and deltas
+    BOOLEAN Failed;
+})
+
+/// @brief What CompressDiffItem needs from PackCreatePatch
+PURPL_MAKE_TAG(struct, PACKFILE_DIFF, {
+    PPACKFILE Base;
+    PPACKFILE Pack;
+    PPACKFILE_DIFF_ITEM Items;
+    UINT64 First; // Index in Items of the first item in the current batch
+})
+
+static VOID CompressDiffItem(_In_ UINT64 Index, _In_opt_ PVOID UserData)
+{
+    PPACKFILE_DIFF Diff = UserData;
+    PPACKFILE_DIFF_ITEM Item = &Diff->Items[Diff->First + Index];
+    PPACKFILE_PATCH_OPERATION Operation = &Item->Operation;
+    if (Operation->Type != PackPatchFull)
+    {
+        return;
+    }
+
+    UINT64 Size = 0;
+    PBYTE Data = PackReadFile(Diff->Pack, Item->Path, 0, 0, &Size, 0);
+    if (!Data)
     {
-        Size = Entry->Size + Extra;
+        Item->Failed = TRUE;
+        return;
     }
 
-    PBYTE RequestedData = CmnAlloc(Size, 1);
-    if (!RequestedData)
+    SIZE_T BufferSize = ZSTD_compressBound(Size);
+    Item->Data = CmnAlloc(BufferSize, 1);
+    if (!Item->Data)
     {
-        LogError("Failed to allocate memory for requested data: %s", strerror(errno));
+        LogError("Failed to allocate %s for %s: %s", CmnFormatSize(BufferSize), Item->Path, strerror(errno));
         CmnFree(Data);
-        return NULL;
+        Item->Failed = TRUE;
+        return;
     }
 
-    memcpy(RequestedData, Data + Offset, Entry->Size - Offset);
+    PPACKFILE_ENTRY BaseEntry = FindEntry(Diff->Base, Item->Path, NULL);
+    PPACKFILE_ENTRY Entry = FindEntry(Diff->Pack, Item->Path, NULL);
+    SIZE_T DataSize = (SIZE_T)-ZSTD_error_GENERIC;
+    if (BaseEntry && BaseEntry->Size <= PACKFILE_PATCH_MAX_DELTA_SIZE && Size <= PACKFILE_PATCH_MAX_DELTA_SIZE)
+    {
+        UINT64 BaseSize = 0;
+        PBYTE BaseData = PackReadFile(Diff->Base, Item->Path, 0, 0, &BaseSize, 0);
+        if (BaseData)
+        {
+            DataSize = CompressPatchData(Item->Data, BufferSize, Data, Size, BaseData, BaseSize);
+            CmnFree(BaseData);
+        }
+
+        // How big the file is in the new pack is a cheap stand-in for how big it would be without a delta
+        if (!ZSTD_isError(DataSize) && DataSize < Entry->CompressedSize)
+        {
+            Operation->Type = PackPatchDelta;
+        }
+    }
+    if (Operation->Type == PackPatchFull)
+    {
+        DataSize = CompressPatchData(Item->Data, BufferSize, Data, Size, NULL, 0);
+    }
     CmnFree(Data);
 
-    *ReadAmount = Size;
-    return RequestedData;
+    if (ZSTD_isError(DataSize))
+    {
+        LogError("Failed to compress %s: %s", Item->Path, ZSTD_getErrorName(DataSize));
+        Item->Failed = TRUE;
+        return;
+    }
+
+    LogDebug("Compressed %s file %s to %s%s", CmnFormatSize(Size), Item->Path,
+             CmnFormatTempString("%s", CmnFormatSize(DataSize)),
+             Operation->Type == PackPatchDelta ? " as a delta" : "");
+    Operation->DataSize = DataSize;
 }
 
-BOOLEAN PackAddFile(_Inout_ PVOID Handle, _In_z_ PCSTR Path, _In_reads_bytes_(Size) PVOID Data, _In_ UINT64 Size)
+static BOOLEAN WriteDiffItem(_In_z_ PCSTR Path, _In_ PPACKFILE_DIFF_ITEM Item)
 {
+    PVOID Data = Item->Operation.Type == PackPatchCopy ? (PVOID)Item->SourcePath : Item->Data;
+    return FsWriteFile(Path, &Item->Operation, sizeof(PACKFILE_PATCH_OPERATION), TRUE) &&
+           FsWriteFile(Path, (PVOID)Item->Path, Item->Operation.PathLength, TRUE) &&
+           (!Item->Operation.DataSize || FsWriteFile(Path, Data, Item->Operation.DataSize, TRUE));
+}
+
+BOOLEAN PackCreatePatch(_In_ PVOID BaseHandle, _In_ PVOID Handle, _In_z_ PCSTR Path)
+{
+    PPACKFILE Base = BaseHandle;
     PPACKFILE Pack = Handle;
-    if (!Pack)
+    if (!Base || !Pack)
     {
         return FALSE;
     }
 
-    SIZE_T CompressedSize = ZSTD_compressBound(Size);
-    PBYTE CompressedData = CmnAlloc(CompressedSize, 1);
-    if (!CompressedData)
+    // The keys are compared directly, and a hashed key means something else in a pack that isn't hashed
+    if ((Base->Header.Flags ^ Pack->Header.Flags) & PACKFILE_FLAG_HASHED_PATHS)
     {
-        LogError("Failed to add %s file as %s to pack %s: %s", CmnFormatSize(Size), Path, Pack->Path, strerror(errno));
+        LogError("Can't diff packs %s and %s, only one of them has hashed paths", Base->Path, Pack->Path);
         return FALSE;
     }
 
-    CompressedSize = ZSTD_compress(CompressedData, CompressedSize, Data, Size, PACKFILE_COMPRESSION_LEVEL);
-    if (ZSTD_isError(CompressedSize))
+    LogInfo("Comparing pack %s to pack %s", Pack->Path, Base->Path);
+
+    PPACKFILE_CONTENT_MAP Contents = NULL;
+    for (UINT64 i = 0; i < stbds_shlenu(Base->Entries); i++)
+    {
+        stbds_hmput(Contents, Base->Entries[i].value.Hash, i);
+    }
+
+    PACKFILE_DIFF Diff = {0};
+    Diff.Base = Base;
+    Diff.Pack = Pack;
+    UINT64 Counts[PackPatchCount] = {0};
+    for (UINT64 i = 0; i < stbds_shlenu(Pack->Entries); i++)
+    {
+        PPACKFILE_ENTRY Entry = &Pack->Entries[i].value;
+        PPACKFILE_ENTRY BaseEntry = FindEntry(Base, Pack->Entries[i].key, NULL);
+        if (BaseEntry && XXH128_isEqual(BaseEntry->Hash, Entry->Hash) && BaseEntry->Size == Entry->Size)
+        {
+            continue;
+        }
+
+        PACKFILE_DIFF_ITEM Item = {0};
+        Item.Path = Pack->Entries[i].key;
+        Item.Operation.BaseHash = BaseEntry ? BaseEntry->Hash : (XXH128_hash_t){0};
+        Item.Operation.Hash = Entry->Hash;
+        Item.Operation.Size = Entry->Size;
+        Item.Operation.Type = PackPatchFull;
+        Item.Operation.PathLength = (UINT16)strlen(Item.Path);
+
+        // Moved and duplicated files don't need any data
+        INT64 ContentIndex = stbds_hmgeti(Contents, Entry->Hash);
+        if (ContentIndex >= 0 && Base->Entries[Contents[ContentIndex].value].value.Size == Entry->Size)
+        {
+            Item.SourcePath = Base->Entries[Contents[ContentIndex].value].key;
+            Item.Operation.Type = PackPatchCopy;
+            Item.Operation.DataSize = strlen(Item.SourcePath);
+        }
+
+        stbds_arrput(Diff.Items, Item);
+    }
+    stbds_hmfree(Contents);
+
+    for (UINT64 i = 0; i < stbds_shlenu(Base->Entries); i++)
+    {
+        if (!FindEntry(Pack, Base->Entries[i].key, NULL))
+        {
+            PACKFILE_DIFF_ITEM Item = {0};
+            Item.Path = Base->Entries[i].key;
+            Item.Operation.BaseHash = Base->Entries[i].value.Hash;
+            Item.Operation.Type = PackPatchRemove;
+            Item.Operation.PathLength = (UINT16)strlen(Item.Path);
+            stbds_arrput(Diff.Items, Item);
+        }
+    }
+
+    PACKFILE_PATCH_HEADER Header = {0};
+    Header.Signature = PACKFILE_PATCH_SIGNATURE;
+    Header.Version = PACKFILE_PATCH_VERSION;
+    Header.Flags = Pack->Header.Flags & PACKFILE_FLAG_HASHED_PATHS;
+    Header.OperationCount = stbds_arrlenu(Diff.Items);
+
+    LogInfo("Writing %llu change(s) to patch %s", Header.OperationCount, Path);
+    BOOLEAN Success = FsWriteFile(Path, &Header, sizeof(PACKFILE_PATCH_HEADER), FALSE);
+
+    // A few files per thread at a time keeps every thread busy without having the whole patch in memory
+    UINT32 ThreadCount = PlatGetProcessorCount();
+    UINT64 BatchSize = ThreadCount * 4;
+    UINT64 PatchSize = sizeof(PACKFILE_PATCH_HEADER);
+    for (Diff.First = 0; Success && Diff.First < stbds_arrlenu(Diff.Items); Diff.First += BatchSize)
+    {
+        UINT64 Count = PURPL_MIN(BatchSize, stbds_arrlenu(Diff.Items) - Diff.First);
+        AsRunParallel("Diff", Count, ThreadCount, CompressDiffItem, &Diff);
+
+        for (UINT64 i = Diff.First; i < Diff.First + Count; i++)
+        {
+            PPACKFILE_DIFF_ITEM Item = &Diff.Items[i];
+            Success = Success && !Item->Failed && WriteDiffItem(Path, Item);
+            CmnFree(Item->Data);
+
+            Counts[Item->Operation.Type]++;
+            PatchSize += sizeof(PACKFILE_PATCH_OPERATION) + Item->Operation.PathLength + Item->Operation.DataSize;
+        }
+    }
+
+    if (Success)
+    {
+        LogInfo("Wrote %s patch with %llu full file(s), %llu delta(s), %llu copied file(s), and %llu removed file(s)",
+                CmnFormatSize(PatchSize), Counts[PackPatchFull], Counts[PackPatchDelta], Counts[PackPatchCopy],
+                Counts[PackPatchRemove]);
+    }
+    else
+    {
+        LogError("Failed to write patch %s", Path);
+    }
+
+    // Anything after a failure wasn't compressed or freed
+    for (UINT64 i = 0; i < stbds_arrlenu(Diff.Items); i++)
+    {
+        CmnFree(Diff.Items[i].Data);
+    }
+    stbds_arrfree(Diff.Items);
+
+    return Success;
+}
+
+/// @brief An operation read from a patch by PackApplyPatch
+PURPL_MAKE_TAG(struct, PACKFILE_PATCH_STEP, {
+    PACKFILE_PATCH_OPERATION Operation;
+    PCHAR Path;
+    UINT64 DataOffset;    // Where the data is in the patch
+    PACKFILE_ENTRY Source; // Entry copies use, from before anything was changed
+})
+
+static BOOLEAN ReadPatchData(_In_ PPLAT_FILE File, _In_ UINT64 FileSize, _Inout_ PUINT64 Offset,
+                             _Out_writes_bytes_opt_(Size) PVOID Buffer, _In_ UINT64 Size)
+{
+    if (Size > FileSize - *Offset)
+    {
+        LogError("Patch is truncated, %llu bytes at offset %llu are past its end", Size, *Offset);
+        return FALSE;
+    }
+    if (Buffer && Size && !PlatReadFileAt(File, *Offset, Buffer, Size))
     {
-        LogError("Failed to compress data: %s", ZSTD_getErrorName(CompressedSize));
-        CmnFree(CompressedData);
         return FALSE;
     }
 
-    LogDebug("Adding %s (%s compressed) file as %s to pack %s", CmnFormatSize(Size),
-             CmnFormatTempString("%s", CmnFormatSize(CompressedSize)), Path,
-             Pack->Path); // TODO: there has to be a better way of dealing with static buffers
+    *Offset += Size;
+    return TRUE;
+}
 
-    PACKFILE_ENTRY Entry = {0};
-    Entry.Hash = XXH3_128bits(Data, Size);
-    Entry.CompressedHash = XXH3_128bits(CompressedData, CompressedSize);
-    Entry.ArchiveIndex = Pack->CurrentArchive;
-    Entry.Offset = Pack->CurrentOffset;
-    Entry.Size = Size;
-    Entry.CompressedSize = CompressedSize;
-    Entry.PathLength = (UINT16)strlen(Path);
+static BOOLEAN CheckPatchStep(_In_ PPACKFILE Pack, _In_ PPLAT_FILE File, _In_ UINT64 FileSize,
+                              _Inout_ PPACKFILE_PATCH_STEP Step)
+{
+    PPACKFILE_PATCH_OPERATION Operation = &Step->Operation;
+    if (Operation->Type >= PackPatchCount)
+    {
+        LogError("Patch has an invalid operation %u for %s", Operation->Type, Step->Path);
+        return FALSE;
+    }
 
-    stbds_shput(Pack->Entries, CmnDuplicateString(Path, Entry.PathLength), Entry);
+    PPACKFILE_ENTRY Entry = FindEntry(Pack, Step->Path, NULL);
+    if (IsZeroHash(Operation->BaseHash) ? Entry != NULL
+                                        : !Entry || !XXH128_isEqual(Entry->Hash, Operation->BaseHash))
+    {
+        LogError("%s in pack %s isn't the version the patch was made for", Step->Path, Pack->Path);
+        return FALSE;
+    }
+    if (Operation->Type == PackPatchDelta && !Entry)
+    {
+        LogError("Patch has a delta for %s, which isn't in pack %s", Step->Path, Pack->Path);
+        return FALSE;
+    }
 
-    UINT64 DataOffset = 0;
-    UINT64 SizeToWrite = CompressedSize;
-    while (SizeToWrite > 0)
+    if (Operation->Type == PackPatchCopy)
     {
-        PCHAR ArchivePath = GetArchivePath(Pack->Path, Pack->CurrentArchive);
-        UINT64 Written = PURPL_MIN(PACKFILE_MAX_CHUNK_SIZE - Pack->CurrentOffset, SizeToWrite);
-        if (!FsWriteFile(ArchivePath, CompressedData + DataOffset, Written, TRUE))
+        PCHAR SourcePath = CmnAlloc(Operation->DataSize + 1, 1);
+        if (!SourcePath)
         {
-            LogError("Failed to add file to pack");
-            CmnFree(CompressedData);
-            CmnFree(ArchivePath);
+            LogError("Failed to allocate source path of %s: %s", Step->Path, strerror(errno));
             return FALSE;
         }
-        CmnFree(ArchivePath);
-        SizeToWrite -= Written;
-        DataOffset += Written;
-        Pack->CurrentOffset += Written;
-        if (Pack->CurrentOffset > PACKFILE_MAX_CHUNK_SIZE)
+
+        UINT64 Offset = Step->DataOffset;
+        PPACKFILE_ENTRY Source = NULL;
+        if (ReadPatchData(File, FileSize, &Offset, SourcePath, Operation->DataSize))
+        {
+            Source = FindEntry(Pack, SourcePath, NULL);
+            if (!Source || !XXH128_isEqual(Source->Hash, Operation->Hash) || Source->Size != Operation->Size)
+            {
+                LogError("Patch copies %s to %s, but it isn't in pack %s", SourcePath, Step->Path, Pack->Path);
+                Source = NULL;
+            }
+        }
+        CmnFree(SourcePath);
+        if (!Source)
+        {
+            return FALSE;
+        }
+
+        Step->Source = *Source;
+        Step->Source.PathLength = Operation->PathLength;
+    }
+
+    return TRUE;
+}
+
+static BOOLEAN ApplyPatchStep(_Inout_ PPACKFILE Pack, _In_ PPLAT_FILE File, _In_ UINT64 FileSize,
+                              _In_ PPACKFILE_PATCH_STEP Step)
+{
+    PPACKFILE_PATCH_OPERATION Operation = &Step->Operation;
+    if (Operation->Type == PackPatchRemove)
+    {
+        return PackRemoveFile(Pack, Step->Path);
+    }
+    else if (Operation->Type == PackPatchCopy)
+    {
+        LogDebug("Copying %s file to %s", CmnFormatSize(Operation->Size), Step->Path);
+        AsLockMutex(Pack->Writer.Lock, TRUE);
+        BOOLEAN Success = InsertEntry(Pack, Step->Path, &Step->Source);
+        AsUnlockMutex(Pack->Writer.Lock);
+        return Success;
+    }
+
+    PBYTE CompressedData = CmnAlloc(Operation->DataSize, 1);
+    PBYTE Data = CmnAlloc(Operation->Size + 1, 1);
+    if (!CompressedData || !Data)
+    {
+        LogError("Failed to allocate %s for %s: %s", CmnFormatSize(Operation->DataSize + Operation->Size), Step->Path,
+                 strerror(errno));
+        CmnFree(CompressedData);
+        CmnFree(Data);
+        return FALSE;
+    }
+
+    UINT64 Offset = Step->DataOffset;
+    BOOLEAN Success = ReadPatchData(File, FileSize, &Offset, CompressedData, Operation->DataSize);
+
+    UINT64 BaseSize = 0;
+    PBYTE BaseData = NULL;
+    if (Success && Operation->Type == PackPatchDelta)
+    {
+        BaseData = PackReadFile(Pack, Step->Path, 0, 0, &BaseSize, 0);
+        Success = BaseData != NULL;
+    }
+
+    if (Success)
+    {
+        LogDebug("Applying %s%s to %s", CmnFormatSize(Operation->DataSize),
+                 Operation->Type == PackPatchDelta ? " delta" : "", Step->Path);
+        SIZE_T Size = DecompressPatchData(Data, Operation->Size, CompressedData, Operation->DataSize, BaseData, BaseSize);
+        if (ZSTD_isError(Size) || Size != Operation->Size)
         {
-            Pack->CurrentArchive++;
-            Pack->CurrentOffset = 0;
+            LogError("Failed to decompress %s: %s", Step->Path,
+                     ZSTD_isError(Size) ? ZSTD_getErrorName(Size) : "wrong size");
+            Success = FALSE;
         }
     }
 
+    Success = Success && CheckHash(Step->Path, "Patched", XXH3_128bits(Data, Operation->Size), Operation->Hash) &&
+              PackAddFile(Pack, Step->Path, Data, Operation->Size);
+
+    CmnFree(BaseData);
+    CmnFree(Data);
     CmnFree(CompressedData);
 
-    return TRUE;
+    return Success;
+}
+
+BOOLEAN PackApplyPatch(_Inout_ PVOID Handle, _In_z_ PCSTR Path)
+{
+    PPACKFILE Pack = Handle;
+    if (!Pack)
+    {
+        return FALSE;
+    }
+
+    UINT64 FileSize = PlatGetFileSize(Path);
+    PPLAT_FILE File = PlatOpenFile(Path);
+    if (!File)
+    {
+        LogError("Failed to open patch %s", Path);
+        return FALSE;
+    }
+
+    UINT64 Offset = 0;
+    PACKFILE_PATCH_HEADER Header = {0};
+    if (!ReadPatchData(File, FileSize, &Offset, &Header, sizeof(PACKFILE_PATCH_HEADER)))
+    {
+        PlatCloseFile(File);
+        return FALSE;
+    }
+    if (Header.Signature != PACKFILE_PATCH_SIGNATURE || Header.Version != PACKFILE_PATCH_VERSION)
+    {
+        LogError("Patch %s has an invalid signature 0x%X or version %u (expected 0x%X and %u)", Path,
+                 Header.Signature, Header.Version, PACKFILE_PATCH_SIGNATURE, PACKFILE_PATCH_VERSION);
+        PlatCloseFile(File);
+        return FALSE;
+    }
+    if (Header.Flags != (Pack->Header.Flags & PACKFILE_FLAG_HASHED_PATHS))
+    {
+        LogError("Patch %s and pack %s don't both have hashed paths", Path, Pack->Path);
+        PlatCloseFile(File);
+        return FALSE;
+    }
+
+    LogInfo("Checking %llu change(s) in patch %s against pack %s", Header.OperationCount, Path, Pack->Path);
+
+    // Everything is checked before anything is changed, so a patch for another version of the pack doesn't half apply
+    PPACKFILE_PATCH_STEP Steps = NULL;
+    BOOLEAN Success = TRUE;
+    for (UINT64 i = 0; Success && i < Header.OperationCount; i++)
+    {
+        PACKFILE_PATCH_STEP Step = {0};
+        Success = ReadPatchData(File, FileSize, &Offset, &Step.Operation, sizeof(PACKFILE_PATCH_OPERATION));
+        if (Success)
+        {
+            Step.Path = CmnAlloc(Step.Operation.PathLength + 1, 1);
+            Success = Step.Path && ReadPatchData(File, FileSize, &Offset, Step.Path, Step.Operation.PathLength);
+            Step.DataOffset = Offset;
+            Success = Success && ReadPatchData(File, FileSize, &Offset, NULL, Step.Operation.DataSize) &&
+                      CheckPatchStep(Pack, File, FileSize, &Step);
+            stbds_arrput(Steps, Step);
+        }
+    }
+
+    if (Success)
+    {
+        LogInfo("Applying patch %s to pack %s", Path, Pack->Path);
+        for (UINT64 i = 0; Success && i < stbds_arrlenu(Steps); i++)
+        {
+            Success = ApplyPatchStep(Pack, File, FileSize, &Steps[i]);
+        }
+    }
+
+    PlatCloseFile(File);
+    for (UINT64 i = 0; i < stbds_arrlenu(Steps); i++)
+    {
+        CmnFree(Steps[i].Path);
+    }
+    stbds_arrfree(Steps);
+
+    if (!Success)
+    {
+        LogError("Failed to apply patch %s to pack %s", Path, Pack->Path);
+        return FALSE;
+    }
+
+    return PackSave(Pack, NULL);
 }
@@ -15,6 +15,7 @@
 
 #include "purpl/purpl.h"
 
+#include "platform/async.h"
 #include "platform/platform.h"
 
 #include "alloc.h"
@@ -25,26 +26,189 @@
 /// @brief Pack file magic number (little endian)
 #define PACKFILE_SIGNATURE 0x55AA1234
 
-/// @brief Pack file format version (4, because 3 is used by some engines)
-#define PACKFILE_FORMAT_VERSION 4
+/// @brief Pack file format version (started at 4, because 3 is used by some engines, 5 added dictionaries, 6 added
+/// per-entry methods, 7 added entry alignment, 8 added solid blocks, 9 added compressed directories and hashed paths)
+#define PACKFILE_FORMAT_VERSION 9
 
 /// @brief Maximum chunk size
 #define PACKFILE_MAX_CHUNK_SIZE 209715200
 
+/// @brief Largest alignment entries can have in their archives
+#define PACKFILE_MAX_ALIGNMENT 1048576
+
+/// @brief Reads from the archives at least this big skip the OS file cache by default, so huge assets that are
+/// streamed in once don't push everything else out of it
+#define PACKFILE_DEFAULT_DIRECT_READ_SIZE 67108864
+
 /// @brief Extension of a pack file
 #define PACKFILE_EXTENSION ".pak"
 
-/// @brief ZSTD compression level of data in pack files
-#define PACKFILE_COMPRESSION_LEVEL 9
+/// @brief Default ZSTD compression level of data in pack files
+#define PACKFILE_DEFAULT_COMPRESSION_LEVEL 9
+
+/// @brief Default ZSTD compression level of entries that don't compress well enough to be worth a high level
+#define PACKFILE_DEFAULT_FAST_COMPRESSION_LEVEL 1
+
+/// @brief Entries that don't compress to less than this percentage of their size are stored uncompressed
+#define PACKFILE_DEFAULT_STORE_THRESHOLD 95
+
+/// @brief Entries that don't compress to less than this percentage of their size at the fast level stay at it
+#define PACKFILE_DEFAULT_FAST_THRESHOLD 80
+
+/// @brief How much of an entry is compressed at the fast level to decide its method
+#define PACKFILE_PROBE_SIZE 1048576
+
+/// @brief Default window log for large entries (same as zstd --long)
+#define PACKFILE_DEFAULT_WINDOW_LOG 27
+
+/// @brief Entries at least this big are compressed with long distance matching and worker threads
+#define PACKFILE_LARGE_ENTRY_SIZE 67108864
+
+/// @brief How much of a file PackAddFileStream reads, compresses and writes at a time
+#define PACKFILE_STREAM_CHUNK_SIZE 4194304
+
+/// @brief Maximum size of a trained dictionary (same as zstd --train)
+#define PACKFILE_DICTIONARY_SIZE 112640
+
+/// @brief Only entries up to this size are compressed with a dictionary
+#define PACKFILE_DICTIONARY_MAX_ENTRY_SIZE 131072
+
+/// @brief Solid blocks can't be bigger than this, because entries store their offset in the block in 32 bits
+#define PACKFILE_MAX_SOLID_BLOCK_SIZE 0xFFFFFFFF
+
+/// @brief Default size of the cache of decompressed solid blocks each pack keeps
+#define PACKFILE_DEFAULT_BLOCK_CACHE_SIZE 16777216
+
+/// @brief Smallest frame size for entries compressed as independent frames (see PACKFILE_WRITE_OPTIONS)
+#define PACKFILE_MIN_SEEKABLE_FRAME_SIZE 65536
+
+/// @brief Magic number of the skippable frame holding the seek table of an entry compressed as independent frames
+#define PACKFILE_SEEK_TABLE_FRAME_MAGIC 0x184D2A5E
+
+/// @brief Magic number at the end of a seek table, from the zstd seekable format
+#define PACKFILE_SEEK_TABLE_MAGIC 0x8F92EAB1
+
+/// @brief Bit in a seek table's descriptor that means the frames have checksums
+#define PACKFILE_SEEK_TABLE_CHECKSUMS 0x80
+
+/// @brief PackMapFile reads entries smaller than this instead of filling them in as they're touched
+#define PACKFILE_MIN_LAZY_MAP_SIZE 16777216
+
+/// @brief How much of a stored entry PackMapFile fills in at once
+#define PACKFILE_MAP_STORED_CHUNK_SIZE 1048576
+
+/// @brief How an entry is stored
+typedef enum PACKFILE_METHOD
+{
+    PackMethodStored,         // Uncompressed, read straight from the archive
+    PackMethodZstdFast,       // zstd at Options.FastCompressionLevel
+    PackMethodZstdHigh,       // zstd at Options.CompressionLevel
+    PackMethodZstdDictionary, // zstd at Options.CompressionLevel with the entry's dictionary
+    PackMethodZstdSolid,      // Part of a block of entries compressed together with zstd at Options.CompressionLevel
+    PackMethodCount
+} PACKFILE_METHOD, *PPACKFILE_METHOD;
+
+/// @brief How much of the data read from a pack is checked against the hashes in its directory
+typedef enum PACKFILE_VERIFY_MODE
+{
+    PackVerifyNone,       // Nothing is checked
+    PackVerifyCompressed, // The data read from the archive is checked on every read
+    PackVerifyFull,       // The data read from the archive and the decompressed data are checked on every read
+    PackVerifyFirstRead,  // Like full, but only until an entry has passed once
+    PackVerifyCount
+} PACKFILE_VERIFY_MODE, *PPACKFILE_VERIFY_MODE;
+
+/// @brief Verification mode of newly loaded packs, dev builds check everything but shipping builds can't pay for two
+/// hashes on every read
+#ifdef PURPL_DEBUG
+#define PACKFILE_DEFAULT_VERIFY_MODE PackVerifyFull
+#else
+#define PACKFILE_DEFAULT_VERIFY_MODE PackVerifyFirstRead
+#endif
+
+/// @brief packtool compact only rewrites packs with at least this percentage of dead space
+#define PACKFILE_DEFAULT_COMPACT_THRESHOLD 25
+
+/// @brief How much data PackCompact copies at once
+#define PACKFILE_COMPACT_BUFFER_SIZE 16777216
+
+/// @brief PackReadFiles reads entries at most this far apart at once, along with the data between them
+#define PACKFILE_BATCH_MERGE_GAP 65536
+
+/// @brief PackReadFiles doesn't merge entries into reads bigger than this, but bigger entries are still read at once
+#define PACKFILE_BATCH_MAX_READ_SIZE 16777216
+
+/// @brief PackReadFiles only uses threads when it reads at least this much in more than one read
+#define PACKFILE_BATCH_PARALLEL_SIZE 1048576
+
+/// @brief Extension added to a pack source's path for the access trace written when fs_trace_packs is set
+#define PACKFILE_TRACE_EXTENSION ".trace"
+
+/// @brief Stack size of the scrubber thread
+#define PACKFILE_SCRUBBER_STACK_SIZE 0x100000
+
+/// @brief Everything in the directory after the header is one zstd frame, and paths are front coded (entries are
+/// sorted by path, and each one only stores what's different from the previous path)
+#define PACKFILE_FLAG_COMPRESSED_DIRECTORY 0b01
+
+/// @brief Entries store a 64-bit hash of their path instead of the path, and their keys are the hash formatted like
+/// PACKFILE_HASHED_PATH_FORMAT. Files can still be found by their real paths.
+#define PACKFILE_FLAG_HASHED_PATHS 0b10
+
+/// @brief Every flag this version knows about
+#define PACKFILE_KNOWN_FLAGS (PACKFILE_FLAG_COMPRESSED_DIRECTORY | PACKFILE_FLAG_HASHED_PATHS)
+
+/// @brief Format of the keys of entries in packs with hashed paths
+#define PACKFILE_HASHED_PATH_FORMAT "#%016llX"
+
+/// @brief Length of a hashed path key
+#define PACKFILE_HASHED_PATH_LENGTH 17
+
+/// @brief Compression level for compressed directories, they're small and read at startup so this is worth it
+#define PACKFILE_DIRECTORY_COMPRESSION_LEVEL 19
+
+/// @brief Patch file magic number (little endian)
+#define PACKFILE_PATCH_SIGNATURE 0x55AA4321
+
+/// @brief Patch file format version
+#define PACKFILE_PATCH_VERSION 1
+
+/// @brief zstd compression level of the data in patches, they're made once and downloaded by everyone
+#define PACKFILE_PATCH_COMPRESSION_LEVEL 19
+
+/// @brief Files bigger than this are put in patches whole instead of as deltas, because zstd's window has to reach
+/// back over both versions of a file
+#define PACKFILE_PATCH_MAX_DELTA_SIZE 1073741824
+
+/// @brief What a patch does to a file
+typedef enum PACKFILE_PATCH_OPERATION_TYPE
+{
+    PackPatchFull,   // The data is the whole new version, compressed
+    PackPatchDelta,  // The data is the new version compressed with the old one as a prefix, like zstd --patch-from
+    PackPatchCopy,   // The data is the path of a file in the old pack with the same contents as the new version
+    PackPatchRemove, // The file was removed, and there's no data
+    PackPatchCount
+} PACKFILE_PATCH_OPERATION_TYPE, *PPACKFILE_PATCH_OPERATION_TYPE;
 
 #pragma pack(push, 1)
 /// @brief Pack file directory header
 PURPL_MAKE_TAG(struct, PACKFILE_HEADER, {
     UINT32 Signature;
     UINT32 Version;
-    UINT32 TreeSize;
+    UINT32 TreeSize; // Size of everything after the header, before it's compressed
     UINT16 ArchiveCount;
     UINT64 LastArchiveLength;
+    UINT16 DictionaryCount;
+    UINT32 Alignment; // Entries added to the pack start at a multiple of this in their archive, 0 if they don't
+    UINT32 Flags;     // PACKFILE_FLAG_*
+    // on-disk: the dictionaries, then the entries, all compressed if PACKFILE_FLAG_COMPRESSED_DIRECTORY is set
+})
+
+/// @brief Pack file dictionary header
+PURPL_MAKE_TAG(struct, PACKFILE_DICTIONARY_HEADER, {
+    UINT32 Size;
+    UINT16 GroupLength;
+    // on-disk: the group, then the dictionary
 })
 
 /// @brief Pack file directory entry
@@ -54,22 +218,182 @@ PURPL_MAKE_TAG(struct, PACKFILE_ENTRY, {
     UINT16 ArchiveIndex;
     UINT64 Offset;
     UINT64 Size;
-    UINT64 CompressedSize;
+    UINT64 CompressedSize; // Same as Size for stored entries, the size of the whole block for solid ones
+    UINT8 Method;          // PACKFILE_METHOD
+    UINT16 Dictionary;     // 1-based index of the dictionary, 0 if there isn't one
+    UINT32 BlockOffset;    // Offset in the decompressed solid block, 0 if the entry isn't in one
     UINT16 PathLength;
-    // on-disk: the path
+    // on-disk: the path, or its UINT64 hash if PACKFILE_FLAG_HASHED_PATHS is set, or if the directory is compressed a
+    // UINT16 of how much of the previous entry's path it starts with and the rest of it
+})
+
+/// @brief Patch file header
+PURPL_MAKE_TAG(struct, PACKFILE_PATCH_HEADER, {
+    UINT32 Signature;
+    UINT32 Version;
+    UINT32 Flags; // PACKFILE_FLAG_HASHED_PATHS if the paths are hashed, they have to match the pack's
+    UINT64 OperationCount;
+    // on-disk: the operations
+})
+
+/// @brief An operation in a patch file
+PURPL_MAKE_TAG(struct, PACKFILE_PATCH_OPERATION, {
+    XXH128_hash_t BaseHash; // Hash of the file in the old pack, all zero if it wasn't in it
+    XXH128_hash_t Hash;     // Hash of the file in the new pack, all zero if it was removed
+    UINT64 Size;            // Size of the file in the new pack
+    UINT64 DataSize;
+    UINT8 Type; // PACKFILE_PATCH_OPERATION_TYPE
+    UINT16 PathLength;
+    // on-disk: the path, then the data
+})
+
+/// @brief A frame in the seek table of an entry compressed as independent frames. The table is a skippable frame at
+/// the end of the entry's data, so anything that decompresses the whole entry skips it.
+PURPL_MAKE_TAG(struct, PACKFILE_SEEK_TABLE_ENTRY, {
+    UINT32 CompressedSize;
+    UINT32 Size;
+    UINT32 Checksum; // Low 32 bits of the XXH64 of the decompressed frame
+})
+
+/// @brief End of the seek table of an entry compressed as independent frames
+PURPL_MAKE_TAG(struct, PACKFILE_SEEK_TABLE_FOOTER, {
+    UINT32 FrameCount;
+    UINT8 Descriptor; // PACKFILE_SEEK_TABLE_CHECKSUMS
+    UINT32 Magic;     // PACKFILE_SEEK_TABLE_MAGIC
 })
 #pragma pack(pop)
 
+/// @brief A zstd dictionary shared by the entries in a group (an extension like ".json" or a directory like "a/b/")
+PURPL_MAKE_TAG(struct, PACKFILE_DICTIONARY, {
+    PCHAR Group;
+    PVOID Data;
+    UINT32 Size;
+    ZSTD_CDict *CompressionDictionary;
+    ZSTD_DDict *DecompressionDictionary;
+})
+
 PURPL_MAKE_STRING_HASHMAP_ENTRY(PACKFILE_ENTRY_MAP, PACKFILE_ENTRY);
 
-/// @brief A representation of a pack file
+/// @brief A slot in the lookup table used by reads, because stb_ds lookups write to the map and can't be done from
+/// multiple threads
+PURPL_MAKE_TAG(struct, PACKFILE_LOOKUP_SLOT, {
+    UINT64 PathHash;
+    UINT64 Index; // 1-based index in Entries, 0 if the slot is empty
+})
+
+/// @brief Options used when adding files to a pack, these aren't stored in the pack
+PURPL_MAKE_TAG(struct, PACKFILE_WRITE_OPTIONS, {
+    INT32 CompressionLevel;
+    INT32 FastCompressionLevel;
+    UINT8 StoreThreshold; // Percentage, 0 to never store entries uncompressed
+    UINT8 FastThreshold;  // Percentage, 0 to never use the fast level
+    UINT32 WindowLog;   // Window log for large entries, 0 for zstd's default
+    UINT32 WorkerCount; // zstd worker threads for large entries, 0 to compress on the calling thread
+    UINT64 LargeEntrySize;
+    UINT32 SeekableFrameSize; // Entries bigger than this are compressed as independent frames this big with a seek
+                              // table, so PackMapFile can decompress them a frame at a time, 0 to not do that
+})
+
+/// @brief A decompressed solid block in a pack's block cache
+PURPL_MAKE_TAG(struct, PACKFILE_CACHED_BLOCK, {
+    UINT64 Position; // Where the block is in the archives, like ArchiveIndex * PACKFILE_MAX_CHUNK_SIZE + Offset
+    PBYTE Data;
+    UINT64 Size;
+    UINT64 LastUse;
+})
+
+/// @brief Recently read solid blocks, so reading the other files in a block doesn't decompress it again. Lock protects
+/// everything in here, so any number of threads can use it.
+PURPL_MAKE_TAG(struct, PACKFILE_BLOCK_CACHE, {
+    PAS_MUTEX Lock;
+    PPACKFILE_CACHED_BLOCK Blocks; // Few enough to search through
+    UINT64 Size;                   // Total decompressed size of the blocks
+    UINT64 MaxSize;                // 0 to not cache blocks at all
+    UINT64 UseCount;
+    UINT64 HitCount;
+    UINT64 MissCount;
+})
+
+/// @brief Reads part of a file being added by PackAddFileStream, returns whether all of it could be read
+typedef BOOLEAN (*PFN_PACKFILE_READ_CALLBACK)(_In_opt_ PVOID UserData, _In_ UINT64 Offset,
+                                              _Out_writes_bytes_(Size) PVOID Buffer, _In_ UINT64 Size);
+
+/// @brief Called by the scrubber for each corrupt entry it finds
+typedef VOID (*PFN_PACKFILE_CORRUPTION_CALLBACK)(_In_ PVOID Handle, _In_z_ PCSTR Path, _In_opt_ PVOID UserData);
+
+/// @brief State of the background thread that verifies every entry in a pack
+PURPL_MAKE_TAG(struct, PACKFILE_SCRUBBER, {
+    PAS_THREAD Thread;
+    PFN_PACKFILE_CORRUPTION_CALLBACK Callback;
+    PVOID UserData;
+    UINT8 Stop;
+    UINT64 CheckedCount;
+    UINT64 CorruptCount;
+})
+
+/// @brief A read recorded by a pack's access trace
+PURPL_MAKE_TAG(struct, PACKFILE_TRACE_EVENT, {
+    UINT64 Time; // Milliseconds since the trace started
+    UINT64 Index;
+    UINT64 Offset;
+    UINT64 Size;
+})
+
+/// @brief Records which entries of a pack are read, in what order, so it can be laid out to match
+PURPL_MAKE_TAG(struct, PACKFILE_TRACE, {
+    PAS_MUTEX Lock;
+    UINT64 StartTime;
+    PPACKFILE_TRACE_EVENT Events;
+})
+
+/// @brief An entry mapped by PackMapFile
+PURPL_MAKE_TAG(struct, PACKFILE_MAPPING, {
+    struct PACKFILE *Pack;
+    UINT64 Index;
+    PPLAT_LAZY_MAPPING Region;
+    UINT32 FrameSize;                  // Decompressed size of every frame but the last, 0 for stored entries
+    PPACKFILE_SEEK_TABLE_ENTRY Frames; // The entry's seek table
+    PUINT64 FrameOffsets;              // Where each frame starts in the entry's data
+    BOOLEAN CheckFrames;
+})
+
+/// @brief Maps the hash of an entry's uncompressed data to its index, to find duplicate files
+PURPL_MAKE_HASHMAP_ENTRY(PACKFILE_CONTENT_MAP, XXH128_hash_t, UINT64);
+
+/// @brief Where the next entry added to a pack goes, only used by writes. Lock protects everything else in here, along
+/// with the entries and lookup table while adding, so files can be added from multiple threads.
+PURPL_MAKE_TAG(struct, PACKFILE_WRITE_STATE, {
+    PAS_MUTEX Lock;
+    UINT16 CurrentArchive;
+    UINT64 CurrentOffset;
+    PPACKFILE_CONTENT_MAP Contents;
+    BOOLEAN ContentsIndexed;
+    UINT64 DuplicateCount;
+    UINT64 DuplicateSize; // Bytes that didn't have to be written because of duplicates
+})
+
+/// @brief A representation of a pack file. Reads don't modify it, so any number of threads can read from a pack at
+/// once, as long as nothing is being added to it at the same time.
 PURPL_MAKE_TAG(struct, PACKFILE,
 {
     PCHAR Path;
     PACKFILE_HEADER Header;
     PPACKFILE_ENTRY_MAP Entries;
-    UINT16 CurrentArchive;
-    UINT64 CurrentOffset;
+    PPACKFILE_LOOKUP_SLOT Lookup;
+    UINT64 LookupSize; // Always a power of 2
+    PPACKFILE_DICTIONARY Dictionaries;
+    PPLAT_FILE *Archives;       // Opened by PackLoad and kept open for reads
+    PPLAT_FILE *DirectArchives; // The same archives opened with PlatOpenFileDirect, if DirectReadSize isn't 0
+    UINT64 DirectReadSize;      // Reads at least this big use DirectArchives
+    PACKFILE_VERIFY_MODE VerifyMode;
+    PUINT8 Verified; // Which hashes of each entry have passed, for PackVerifyFirstRead
+    PPACKFILE_SCRUBBER Scrubber;
+    PPACKFILE_TRACE Trace;
+    PACKFILE_BLOCK_CACHE BlockCache;
+    PAS_MUTEX MappingLock;
+    PPACKFILE_MAPPING *Mappings; // Few enough to search through
+    PACKFILE_WRITE_OPTIONS Options;
+    PACKFILE_WRITE_STATE Writer;
 })
 
 /// @brief Create a pack file
@@ -99,6 +423,42 @@ extern PPACKFILE PackLoad(_In_z_ PCSTR DirectoryPath);
 /// @param[in,out] Handle The pack file to free
 extern VOID PackFree(_Inout_ PVOID Handle);
 
+/// @brief Set the alignment of entries added to a pack from now on. It's saved in the pack, and PackCompact and
+/// PackReorder apply it to every entry. Aligned entries can be read with direct I/O without copying, and stored ones
+/// can be mapped.
+///
+/// @param[in,out] Handle The pack file
+/// @param[in] Alignment The alignment, a power of 2 up to PACKFILE_MAX_ALIGNMENT like 4096 for pages, or 0 to not align
+/// entries
+///
+/// @return Whether the alignment is valid
+extern BOOLEAN PackSetAlignment(_Inout_ PVOID Handle, _In_ UINT32 Alignment);
+
+/// @brief Set how a pack's directory is stored the next time it's saved. Hashing paths can't be undone, since the
+/// paths are gone once they're hashed, so it's meant for shipping builds. It fails if two paths have the same hash.
+///
+/// @param[in,out] Handle The pack file
+/// @param[in] Flags PACKFILE_FLAG_* values
+///
+/// @return Whether the flags could be applied
+extern BOOLEAN PackSetFlags(_Inout_ PVOID Handle, _In_ UINT32 Flags);
+
+/// @brief Set how big reads from a pack's archives have to be to skip the OS file cache. This opens or closes a second
+/// handle to each archive, so it can't be called while anything is reading from the pack.
+///
+/// @param[in,out] Handle The pack file
+/// @param[in] Size The minimum size, or 0 to always use the file cache
+///
+/// @return Whether the archives could be opened
+extern BOOLEAN PackSetDirectReadSize(_Inout_ PVOID Handle, _In_ UINT64 Size);
+
+/// @brief Set how much memory a pack can use for decompressed solid blocks. Blocks are dropped least recently used
+/// first to stay under it, and this can be called while other threads are reading.
+///
+/// @param[in,out] Handle The pack file
+/// @param[in] Size The maximum total size of the cached blocks, or 0 to decompress the block for every read
+extern VOID PackSetBlockCacheSize(_Inout_ PVOID Handle, _In_ UINT64 Size);
+
 /// @brief Whether a pack file has a file
 ///
 /// @param[in,out] Handle The pack file
@@ -127,7 +487,99 @@ extern UINT64 PackGetFileSize(_In_ PVOID Handle, _In_z_ PCSTR Path);
 extern PVOID PackReadFile(_In_ PVOID Handle, _In_z_ PCSTR Path, _In_ UINT64 Offset, _In_ UINT64 MaxAmount,
                           _Out_ PUINT64 ReadAmount, _In_ UINT64 Extra);
 
-/// @brief Add a file to a pack file
+/// @brief Map a whole file into memory that's filled in as it's touched, so only the parts of a huge file that are used
+/// get read and decompressed. This only works on platforms that support PlatCreateLazyMapping, for entries of at least
+/// PACKFILE_MIN_LAZY_MAP_SIZE bytes that are stored or were compressed with Options.SeekableFrameSize set. Otherwise,
+/// the file is read like PackReadFile does. Frames are checked against the checksums in their seek table unless the
+/// pack's verify mode is PackVerifyNone, but the entry's hashes can't be checked without reading all of it. A file
+/// that can't be read once it's touched stops the process.
+///
+/// @param[in] Handle The pack file
+/// @param[in] Path The path to the file
+/// @param[out] Size Receives the size of the file
+///
+/// @return The file's contents, which have to be given to PackUnmapFile, or NULL
+extern PVOID PackMapFile(_In_ PVOID Handle, _In_z_ PCSTR Path, _Out_ PUINT64 Size);
+
+/// @brief Unmap a file mapped with PackMapFile
+///
+/// @param[in] Handle The pack file
+/// @param[in] Data What PackMapFile returned
+extern VOID PackUnmapFile(_In_ PVOID Handle, _In_opt_ PVOID Data);
+
+/// @brief Read several whole files at once. The reads are sorted by where the files are in the archives and merged
+/// when they're close enough to each other, then the files are decompressed on multiple threads.
+///
+/// @param[in] Handle The pack file
+/// @param[in,out] Requests The files to read, each gets a buffer like PackReadFile returns, or NULL if it couldn't be
+/// read
+/// @param[in] Count The number of files
+///
+/// @return Whether every file was read
+extern BOOLEAN PackReadFiles(_In_ PVOID Handle, _Inout_updates_(Count) PFILESYSTEM_READ_REQUEST Requests,
+                             _In_ UINT64 Count);
+
+/// @brief Check both hashes of a file, regardless of the pack's verification mode. This reads the file in blocks, so it
+/// doesn't need memory for the whole file.
+///
+/// @param[in] Handle The pack file
+/// @param[in] Path The path to the file
+///
+/// @return Whether the file is intact
+extern BOOLEAN PackVerifyFile(_In_ PVOID Handle, _In_z_ PCSTR Path);
+
+/// @brief Start a thread at idle priority that goes through every file in a pack once with PackVerifyFile, and logs and
+/// reports the ones that are corrupt
+///
+/// @param[in,out] Handle The pack file
+/// @param[in] Callback Called from the scrubber thread for each corrupt file
+/// @param[in] UserData Passed to the callback
+///
+/// @return Whether the thread could be started
+extern BOOLEAN PackStartScrubber(_Inout_ PVOID Handle, _In_opt_ PFN_PACKFILE_CORRUPTION_CALLBACK Callback,
+                                 _In_opt_ PVOID UserData);
+
+/// @brief Stop the scrubber if it's still running and wait for it, PackFree does this too
+///
+/// @param[in,out] Handle The pack file
+///
+/// @return The number of corrupt files the scrubber found
+extern UINT64 PackStopScrubber(_Inout_ PVOID Handle);
+
+/// @brief Get the dictionary group of a path
+///
+/// @param[in] Path The path in the pack file
+/// @param[in] Directory Whether to get the directory group instead of the extension group
+///
+/// @return The group in a per-thread static buffer, or NULL if the path has no extension
+extern PCSTR PackGetDictionaryGroup(_In_z_ PCSTR Path, _In_ BOOLEAN Directory);
+
+/// @brief Add a dictionary to a pack file, files added after this that are in its group and no bigger than
+/// PACKFILE_DICTIONARY_MAX_ENTRY_SIZE will be compressed with it
+///
+/// @param[in,out] Handle The pack file
+/// @param[in] Group The group of files to use the dictionary for, from PackGetDictionaryGroup
+/// @param[in] Data The dictionary
+/// @param[in] Size The size of the dictionary
+///
+/// @return Whether the dictionary could be added
+extern BOOLEAN PackAddDictionary(_Inout_ PVOID Handle, _In_z_ PCSTR Group, _In_reads_bytes_(Size) PVOID Data,
+                                 _In_ UINT32 Size);
+
+/// @brief Get the name of an entry method
+///
+/// @param[in] Method The method
+///
+/// @return The name of the method
+extern PCSTR PackGetMethodName(_In_ PACKFILE_METHOD Method);
+
+/// @brief Add a file to a pack file, or replace it if it's already in the pack. The method is picked by compressing up
+/// to PACKFILE_PROBE_SIZE bytes at Options.FastCompressionLevel and comparing the result to Options.StoreThreshold and
+/// Options.FastThreshold, entries that don't end up smaller than Options.StoreThreshold are stored uncompressed. Files
+/// at least Options.LargeEntrySize bytes are compressed with long distance matching, Options.WindowLog and
+/// Options.WorkerCount threads, and if Options.SeekableFrameSize is set, compressed files bigger than it are split into
+/// independent frames with a seek table for PackMapFile. Files with the same contents as one already in the pack share
+/// its data. Any number of threads can add files at once.
 ///
 /// @param[in,out] Handle The pack file
 /// @param[in] Path The path to the file
@@ -137,3 +589,113 @@ extern PVOID PackReadFile(_In_ PVOID Handle, _In_z_ PCSTR Path, _In_ UINT64 Offs
 /// @return Whether adding the file succeeded
 extern BOOLEAN PackAddFile(_Inout_ PVOID Handle, _In_z_ PCSTR Path, _In_reads_bytes_(Size) PVOID Data,
                            _In_ UINT64 Size);
+
+/// @brief Add a file to a pack file without having all of it in memory at once. It's read, hashed, compressed and
+/// written PACKFILE_STREAM_CHUNK_SIZE bytes at a time, so memory use doesn't depend on its size. The method is picked
+/// like with PackAddFile, except that dictionaries aren't used. The pack's writer lock is held while the file is
+/// compressed, so other threads adding files have to wait for it to write theirs. If the pack already has a file of
+/// the same size, the file is read twice to check whether it's a duplicate before writing anything. Files that fit in
+/// one chunk are just passed to PackAddFile.
+///
+/// @param[in,out] Handle The pack file
+/// @param[in] Path The path to the file
+/// @param[in] Read Called to read each chunk of the file, in order, possibly twice
+/// @param[in] UserData Passed to Read
+/// @param[in] Size The size of the file
+///
+/// @return Whether adding the file succeeded. If it fails partway through, what was written is left as dead space.
+extern BOOLEAN PackAddFileStream(_Inout_ PVOID Handle, _In_z_ PCSTR Path, _In_ PFN_PACKFILE_READ_CALLBACK Read,
+                                 _In_opt_ PVOID UserData, _In_ UINT64 Size);
+
+/// @brief Add small files to a pack as one solid block. They're compressed together at Options.CompressionLevel, so
+/// what they have in common is only stored once, and reading one of them puts the whole block in the pack's block cache
+/// for the others. Files that are already in the pack are deduplicated like with PackAddFile, and this can be called
+/// from multiple threads at once too.
+///
+/// @param[in,out] Handle The pack file
+/// @param[in] Paths The paths of the files in the pack
+/// @param[in] Data The contents of each file
+/// @param[in] Sizes The size of each file
+/// @param[in] Count The number of files
+///
+/// @return Whether the files could be added
+extern BOOLEAN PackAddSolidBlock(_Inout_ PVOID Handle, _In_reads_(Count) PCSTR *Paths, _In_reads_(Count) PVOID *Data,
+                                 _In_reads_(Count) PUINT64 Sizes, _In_ UINT64 Count);
+
+/// @brief Remove a file from a pack file. Its data stays in the archives as dead space until the pack is compacted.
+///
+/// @param[in,out] Handle The pack file
+/// @param[in] Path The path to the file
+///
+/// @return Whether the file was in the pack
+extern BOOLEAN PackRemoveFile(_Inout_ PVOID Handle, _In_z_ PCSTR Path);
+
+/// @brief Get how much of a pack's archives is taken up by data that no entry uses anymore, because it was replaced,
+/// removed, or left behind by an interrupted write
+///
+/// @param[in] Handle The pack file
+/// @param[out] TotalSize The size of all the archives
+/// @param[out] DeadSize How much of that is unused
+extern VOID PackGetSpaceUsage(_In_ PVOID Handle, _Out_ PUINT64 TotalSize, _Out_ PUINT64 DeadSize);
+
+/// @brief Rewrite a pack's archives with only the data its entries use, in the order it was in, and save its
+/// directory. The new archives are written next to the old ones and only replace them once everything has been
+/// copied and checked against the compressed hashes, so a failure before then leaves the pack as it was.
+///
+/// @param[in,out] Handle The pack file
+///
+/// @return Whether the pack could be compacted
+extern BOOLEAN PackCompact(_Inout_ PVOID Handle);
+
+/// @brief Start recording the reads from a pack. This has to be done while nothing is reading from it.
+///
+/// @param[in,out] Handle The pack file
+///
+/// @return Whether the trace could be started
+extern BOOLEAN PackStartTrace(_Inout_ PVOID Handle);
+
+/// @brief Stop recording the reads from a pack and write them to a file, one line per read with the milliseconds since
+/// the trace started, the offset, the size, and the path. This has to be done while nothing is reading from it, but
+/// files mapped with PackMapFile can stay mapped.
+///
+/// @param[in,out] Handle The pack file
+/// @param[in] Path Where to write the trace, or NULL to throw it away
+///
+/// @return Whether the trace was written
+extern BOOLEAN PackStopTrace(_Inout_ PVOID Handle, _In_opt_z_ PCSTR Path);
+
+/// @brief Rewrite a pack's archives with the data of the given files first, in that order, followed by the rest in the
+/// order it was in, and save its directory. Dead space is left out, and failures leave the pack as it was, like
+/// PackCompact.
+///
+/// @param[in,out] Handle The pack file
+/// @param[in] Paths The files to put first, usually in the order they were first read in an access trace. Paths that
+/// aren't in the pack or come up again are skipped.
+/// @param[in] PathCount The number of paths
+///
+/// @return Whether the pack could be reordered
+extern BOOLEAN PackReorder(_Inout_ PVOID Handle, _In_reads_(PathCount) PCSTR *Paths, _In_ UINT64 PathCount);
+
+/// @brief Write a patch that turns one version of a pack into another. Files are compared by their hashes, and only the
+/// ones that changed, were added, or were removed go in the patch. Changed files are stored as deltas against their old
+/// versions when that's smaller, and files with the same contents as one in the old pack are just copied from it. The
+/// files are compressed on multiple threads.
+///
+/// @param[in] BaseHandle The old version of the pack
+/// @param[in] Handle The new version of the pack
+/// @param[in] Path Where to write the patch
+///
+/// @return Whether the patch could be written
+extern BOOLEAN PackCreatePatch(_In_ PVOID BaseHandle, _In_ PVOID Handle, _In_z_ PCSTR Path);
+
+/// @brief Apply a patch from PackCreatePatch to a pack in place, and save its directory. Every operation is checked
+/// against the hashes in the pack first, so a patch made for another version fails without changing anything. Files
+/// are added like with PackAddFile, so files that were in solid blocks end up in their own entries, and their old data
+/// is dead space until the pack is compacted. The directory is only saved once everything was applied, so a failure
+/// partway through leaves the pack on disk as it was, but the loaded pack has to be thrown away.
+///
+/// @param[in,out] Handle The pack file
+/// @param[in] Path The path to the patch
+///
+/// @return Whether the patch was applied
+extern BOOLEAN PackApplyPatch(_Inout_ PVOID Handle, _In_z_ PCSTR Path);
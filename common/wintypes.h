@@ -245,5 +245,5 @@ typedef GUID CLSID;
     } \
     /*lint -restore */
 #else
-#define UNREFERENCED_PARAMETER(P) (P)
+#define UNREFERENCED_PARAMETER(P) ((VOID)(P))
 #endif
@@ -0,0 +1,258 @@
+/*++
+
+Copyright (c) 2024 Randomcode Developers
+
+Module Name:
+
+    compressbench.c
+
+Abstract:
+
+    This file implements a benchmark that compares CmnCompress and
+    CmnDecompress, which reuse each thread's zstd contexts, to the
+    one-shot ZSTD_compress and ZSTD_decompress, which set up new
+    contexts for every call.
+
+--*/
+
+#include "purpl/purpl.h"
+
+#include "common/alloc.h"
+#include "common/common.h"
+#include "common/compression.h"
+#include "common/filesystem.h"
+
+#include "platform/platform.h"
+
+// The size of the data generated when no file is given, about as big as a small asset
+#define COMPRESSBENCH_GENERATED_SIZE 1024
+
+#define COMPRESSBENCH_DEFAULT_LEVEL 9
+#define COMPRESSBENCH_DEFAULT_ITERATIONS 10000
+
+_Noreturn VOID Usage(VOID)
+/*++
+
+Routine Description:
+
+    Prints instructions for using the program and exits.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    Does not return.
+
+--*/
+{
+    LogInfo("Usage:");
+    LogInfo("\t[level] [iterations] [file]\t- Compress and decompress a file (or %s of generated text) this many times "
+            "(default %u) at this level (default %d) with and without reusing contexts",
+            CmnFormatSize(COMPRESSBENCH_GENERATED_SIZE), COMPRESSBENCH_DEFAULT_ITERATIONS,
+            COMPRESSBENCH_DEFAULT_LEVEL);
+    exit(EINVAL);
+}
+
+static PVOID GenerateData(_Out_ PUINT64 Size)
+/*++
+
+Routine Description:
+
+    Generates text that compresses about as well as a small config
+    or script file.
+
+Arguments:
+
+    Size - Gets the size of the data.
+
+Return Value:
+
+    The data, or NULL if it couldn't be allocated.
+
+--*/
+{
+    static CONST CHAR Pattern[] = "{\"name\": \"value\", \"count\": 12345}\n";
+
+    PBYTE Data = CmnAlloc(COMPRESSBENCH_GENERATED_SIZE, 1);
+    if (!Data)
+    {
+        *Size = 0;
+        return NULL;
+    }
+
+    for (UINT64 i = 0; i < COMPRESSBENCH_GENERATED_SIZE; i++)
+    {
+        // Perturb some bytes so it isn't just one repeated string
+        Data[i] = Pattern[i % (sizeof(Pattern) - 1)] ^ (i % 7 == 0 ? i & 3 : 0);
+    }
+
+    *Size = COMPRESSBENCH_GENERATED_SIZE;
+    return Data;
+}
+
+static INT RunBenchmark(_In_reads_bytes_(Size) PVOID Data, _In_ UINT64 Size, _In_ INT32 Level,
+                        _In_ UINT64 Iterations)
+/*++
+
+Routine Description:
+
+    Times each way of compressing and decompressing the data and
+    checks that they round trip.
+
+Arguments:
+
+    Data - The data.
+
+    Size - The size of the data.
+
+    Level - The compression level.
+
+    Iterations - How many times to run each one.
+
+Return Value:
+
+    0 on success or an appropriate errno code.
+
+--*/
+{
+    SIZE_T Bound = ZSTD_compressBound(Size);
+    PVOID Compressed = CmnAlloc(Bound, 1);
+    PVOID Decompressed = CmnAlloc(PURPL_MAX(Size, 1), 1);
+    INT Result = 0;
+    if (!Compressed || !Decompressed)
+    {
+        LogError("Failed to allocate buffers: %s", strerror(errno));
+        Result = ENOMEM;
+        goto Done;
+    }
+
+    SIZE_T CompressedSize = 0;
+    UINT64 Start = PlatGetNanoseconds();
+    for (UINT64 i = 0; i < Iterations; i++)
+    {
+        CompressedSize = ZSTD_compress(Compressed, Bound, Data, Size, Level);
+    }
+    UINT64 OneShotCompressTime = PlatGetNanoseconds() - Start;
+
+    Start = PlatGetNanoseconds();
+    for (UINT64 i = 0; i < Iterations; i++)
+    {
+        CompressedSize = CmnCompress(Compressed, Bound, Data, Size, Level);
+    }
+    UINT64 ReusedCompressTime = PlatGetNanoseconds() - Start;
+
+    if (ZSTD_isError(CompressedSize))
+    {
+        LogError("Failed to compress data: %s", ZSTD_getErrorName(CompressedSize));
+        Result = EINVAL;
+        goto Done;
+    }
+
+    SIZE_T DecompressedSize = 0;
+    Start = PlatGetNanoseconds();
+    for (UINT64 i = 0; i < Iterations; i++)
+    {
+        DecompressedSize = ZSTD_decompress(Decompressed, Size, Compressed, CompressedSize);
+    }
+    UINT64 OneShotDecompressTime = PlatGetNanoseconds() - Start;
+
+    Start = PlatGetNanoseconds();
+    for (UINT64 i = 0; i < Iterations; i++)
+    {
+        DecompressedSize = CmnDecompress(Decompressed, Size, Compressed, CompressedSize);
+    }
+    UINT64 ReusedDecompressTime = PlatGetNanoseconds() - Start;
+
+    if (ZSTD_isError(DecompressedSize) || DecompressedSize != Size || memcmp(Decompressed, Data, Size) != 0)
+    {
+        LogError("Decompressed data doesn't match the original");
+        Result = EINVAL;
+        goto Done;
+    }
+
+    LogInfo("Compressed %s to %s at level %d, %llu time(s) each", CmnFormatSize(Size),
+            CmnFormatTempString("%s", CmnFormatSize(CompressedSize)), Level, Iterations);
+    LogInfo("Compress: %.3f us one-shot, %.3f us reused", OneShotCompressTime / 1000.0 / Iterations,
+            ReusedCompressTime / 1000.0 / Iterations);
+    LogInfo("Decompress: %.3f us one-shot, %.3f us reused", OneShotDecompressTime / 1000.0 / Iterations,
+            ReusedDecompressTime / 1000.0 / Iterations);
+
+Done:
+    CmnFree(Decompressed);
+    CmnFree(Compressed);
+    return Result;
+}
+
+INT main(INT argc, PCHAR *argv)
+/*++
+
+Routine Description:
+
+    Processes arguments and runs the benchmark.
+
+Arguments:
+
+    argc - Number of arguments.
+
+    argv - Array of arguments.
+
+Return Value:
+
+    EXIT_SUCCESS - Success.
+
+    errno value - Failure.
+
+--*/
+{
+    INT32 Level = COMPRESSBENCH_DEFAULT_LEVEL;
+    UINT64 Iterations = COMPRESSBENCH_DEFAULT_ITERATIONS;
+    PVOID Data;
+    UINT64 Size = 0;
+    INT Result;
+
+    CmnInitialize(NULL, 0);
+
+    LogInfo("Purpl Compression Benchmark v" PURPL_VERSION_STRING " (zstd %s) on %s", ZSTD_versionString(),
+            PlatGetDescription());
+
+    if (argc > 4)
+    {
+        Usage();
+    }
+    if (argc > 1)
+    {
+        Level = (INT32)strtol(argv[1], NULL, 10);
+    }
+    if (argc > 2)
+    {
+        Iterations = strtoull(argv[2], NULL, 10);
+        if (Iterations == 0)
+        {
+            Usage();
+        }
+    }
+
+    if (argc > 3)
+    {
+        Data = FsReadFile(TRUE, argv[3], 0, 0, &Size, 0);
+    }
+    else
+    {
+        Data = GenerateData(&Size);
+    }
+    if (!Data)
+    {
+        LogError("Failed to get data to compress");
+        CmnShutdown();
+        return EIO;
+    }
+
+    Result = RunBenchmark(Data, Size, Level, Iterations);
+
+    CmnFree(Data);
+    CmnShutdown();
+
+    return Result;
+}
@@ -0,0 +1,281 @@
+/*++
+
+Copyright (c) 2024 Randomcode Developers
+
+Module Name:
+
+    logtool.c
+
+Abstract:
+
+    This file implements a tool that turns binary logs into text.
+
+--*/
+
+#include "purpl/purpl.h"
+
+#include "common/alloc.h"
+#include "common/common.h"
+
+PURPL_MAKE_HASHMAP_ENTRY(LOG_STRING_MAP, UINT64, PCHAR);
+
+_Noreturn VOID Usage(VOID)
+/*++
+
+Routine Description:
+
+    Prints instructions for using the program and exits.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    Does not return.
+
+--*/
+{
+    LogInfo("Usage:");
+    LogInfo("\t<binary log> [output file]\t- Write the messages in a binary log as text, to stdout if there's no output");
+    exit(EINVAL);
+}
+
+static BOOLEAN ReadEntry(_In_ FILE *File, _Out_writes_bytes_(Size) PVOID Buffer, _In_ UINT64 Size)
+/*++
+
+Routine Description:
+
+    Reads part of an entry, complaining if the log ends first.
+
+Arguments:
+
+    File - The binary log.
+
+    Buffer - Where to put the data.
+
+    Size - The amount of data to read.
+
+Return Value:
+
+    TRUE - The data was read.
+
+    FALSE - The log was cut off.
+
+--*/
+{
+    if (Size > 0 && fread(Buffer, 1, Size, File) != Size)
+    {
+        LogWarning("Log ends in the middle of an entry, the program that wrote it probably crashed");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static INT DecodeLog(_In_ FILE *Input, _In_ FILE *Output)
+/*++
+
+Routine Description:
+
+    Formats every record in a binary log.
+
+Arguments:
+
+    Input - The binary log.
+
+    Output - Where to write the messages.
+
+Return Value:
+
+    0 on success or an appropriate errno code.
+
+--*/
+{
+    LOG_BINARY_HEADER Header = {0};
+    PLOG_STRING_MAP Strings = NULL;
+    CHAR ThreadName[UINT8_MAX + 1];
+    PBYTE Arguments = NULL;
+    CHAR Message[4096];
+    UINT64 RecordCount = 0;
+    INT Result = 0;
+
+    if (fread(&Header, sizeof(Header), 1, Input) != 1 || Header.Signature != LOG_BINARY_SIGNATURE)
+    {
+        LogError("Not a binary log");
+        return EINVAL;
+    }
+    if (Header.Version != LOG_BINARY_VERSION)
+    {
+        LogError("Binary log is version %u, expected %u", Header.Version, LOG_BINARY_VERSION);
+        return EINVAL;
+    }
+
+    Arguments = CmnAlloc(UINT16_MAX, 1);
+    if (!Arguments)
+    {
+        LogError("Failed to allocate argument buffer");
+        return ENOMEM;
+    }
+
+    UINT8 Type;
+    while (fread(&Type, sizeof(Type), 1, Input) == 1)
+    {
+        if (Type == LogBinaryEntryString)
+        {
+            LOG_BINARY_STRING Entry = {.Type = Type};
+            if (!ReadEntry(Input, (PBYTE)&Entry + 1, sizeof(Entry) - 1))
+            {
+                break;
+            }
+
+            PCHAR String = CmnAlloc(Entry.Length + 1, 1);
+            if (!String)
+            {
+                LogError("Failed to allocate string");
+                Result = ENOMEM;
+                break;
+            }
+            if (!ReadEntry(Input, String, Entry.Length))
+            {
+                CmnFree(String);
+                break;
+            }
+
+            // Strings get written again when the logging process forgets them
+            INT64 Index = stbds_hmgeti(Strings, Entry.Id);
+            if (Index >= 0)
+            {
+                CmnFree(Strings[Index].value);
+            }
+            stbds_hmput(Strings, Entry.Id, String);
+        }
+        else if (Type == LogBinaryEntryRecord)
+        {
+            LOG_BINARY_RECORD Record = {.Type = Type};
+            if (!ReadEntry(Input, (PBYTE)&Record + 1, sizeof(Record) - 1) ||
+                !ReadEntry(Input, ThreadName, Record.ThreadNameLength) ||
+                !ReadEntry(Input, Arguments, Record.ArgumentsSize))
+            {
+                break;
+            }
+            ThreadName[Record.ThreadNameLength] = 0;
+
+            PCSTR Format = stbds_hmget(Strings, Record.Format);
+            PCSTR File = Record.File ? stbds_hmget(Strings, Record.File) : "";
+            if (!Format)
+            {
+                snprintf(Message, sizeof(Message), "<unknown format string 0x%llX>", Record.Format);
+            }
+            else if (!LogFormatPacked(Format, Arguments, Record.ArgumentsSize, Message, sizeof(Message)))
+            {
+                // Still show what could be formatted
+                strncat(Message, " <arguments don't match>", sizeof(Message) - strlen(Message) - 1);
+            }
+
+            // The wall clock time is only known to the second, so the time since the log started is shown too
+            UINT64 Elapsed = Record.Nanoseconds - Header.StartNanoseconds;
+            time_t Seconds = (time_t)(Header.StartTime + Elapsed / 1000000000);
+            CHAR Time[64] = {0};
+            strftime(Time, sizeof(Time), "%Y-%m-%d %H:%M:%S", localtime(&Seconds));
+
+            fprintf(Output, "%s +%llu.%06llu %s %-5s %s:", Time, Elapsed / 1000000000, (Elapsed % 1000000000) / 1000,
+                    ThreadName, Record.Level <= LogLevelFatal ? LogGetLevelString(Record.Level) : "?",
+                    File ? File : "");
+            if (Record.HexLine)
+            {
+                fprintf(Output, "0x%llX: %s\n", (UINT64)Record.Line, Message);
+            }
+            else
+            {
+                fprintf(Output, "%lld: %s\n", Record.Line, Message);
+            }
+            RecordCount++;
+        }
+        else
+        {
+            LogError("Unknown entry type %u, the log is corrupt", Type);
+            Result = EINVAL;
+            break;
+        }
+    }
+
+    LogInfo("Decoded %llu message(s)", RecordCount);
+
+    for (UINT64 i = 0; i < stbds_hmlenu(Strings); i++)
+    {
+        CmnFree(Strings[i].value);
+    }
+    stbds_hmfree(Strings);
+    CmnFree(Arguments);
+
+    return Result;
+}
+
+INT main(INT argc, PCHAR *argv)
+/*++
+
+Routine Description:
+
+    Processes arguments and decodes the log.
+
+Arguments:
+
+    argc - Number of arguments.
+
+    argv - Array of arguments.
+
+Return Value:
+
+    EXIT_SUCCESS - Success.
+
+    errno value - Failure.
+
+--*/
+{
+    FILE *Input;
+    FILE *Output;
+    INT Result;
+
+    CmnInitialize(NULL, 0);
+
+    LogInfo("Purpl Log Tool v" PURPL_VERSION_STRING " (supports binary log v" PURPL_STRINGIZE_EXPAND(
+        LOG_BINARY_VERSION) ") on %s",
+            PlatGetDescription());
+
+    if (argc < 2)
+    {
+        Usage();
+    }
+
+    Input = fopen(argv[1], "rb");
+    if (!Input)
+    {
+        LogError("Failed to open %s: %s", argv[1], strerror(errno));
+        return errno;
+    }
+
+    Output = stdout;
+    if (argc > 2)
+    {
+        Output = fopen(argv[2], "wb");
+        if (!Output)
+        {
+            LogError("Failed to open %s: %s", argv[2], strerror(errno));
+            fclose(Input);
+            return errno;
+        }
+    }
+
+    Result = DecodeLog(Input, Output);
+
+    fclose(Input);
+    if (Output != stdout)
+    {
+        fclose(Output);
+    }
+
+    CmnShutdown();
+
+    return Result;
+}
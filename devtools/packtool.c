@@ -22,131 +22,1884 @@ Abstract:
 
 #include "common/alloc.h"
 #include "common/common.h"
+#include "common/compression.h"
 #include "common/packfile.h"
 
 #include "re.h"
+#include "zdict.h"
+
+//
+// Files to add to a pack
+//
+
+typedef struct PACKTOOL_INPUT
+{
+    PCHAR Path;
+    PCHAR InnerPath;
+    UINT64 Size;
+} PACKTOOL_INPUT, *PPACKTOOL_INPUT;
+
+//
+// How to group files for dictionary training
+//
+
+typedef enum PACKTOOL_DICTIONARY_MODE
+{
+    PackToolDictionaryModeNone,
+    PackToolDictionaryModeExtension,
+    PackToolDictionaryModeDirectory
+} PACKTOOL_DICTIONARY_MODE, *PPACKTOOL_DICTIONARY_MODE;
+
+static PACKTOOL_DICTIONARY_MODE DictionaryMode;
+
+//
+// How many files to add at once, 0 for one per processor
+//
+
+static UINT32 JobCount;
+
+//
+// Small files are grouped into solid blocks of about this size, 0 to add every file on its own
+//
+
+static UINT64 SolidBlockSize;
+
+//
+// Only files up to this size go in solid blocks
+//
+
+#define PACKTOOL_MAX_SOLID_FILE_SIZE 65536
+
+//
+// Files bigger than this are streamed into the pack instead of being read into memory first
+//
+
+#define PACKTOOL_MAX_IN_MEMORY_FILE_SIZE 268435456
+
+//
+// Percentage of dead space in a pack before compact rewrites it
+//
+
+static UINT8 CompactThreshold = PACKFILE_DEFAULT_COMPACT_THRESHOLD;
+
+//
+// Dictionaries aren't trained for groups with fewer samples than this
+//
+
+#define PACKTOOL_MIN_DICTIONARY_SAMPLES 8
+
+//
+// At most this much of each group is used to train its dictionary (zstd suggests 100 times the dictionary size)
+//
+
+#define PACKTOOL_MAX_DICTIONARY_SAMPLE_SIZE (100 * PACKFILE_DICTIONARY_SIZE)
+
+//
+// How many files bench reads in each pass, 0 for all of them
+//
+
+static UINT64 BenchReadCount;
+
+//
+// Levels analyze tries on each group of files
+//
+
+static CONST INT32 AnalyzeLevels[] = {1, 3, 9, 19};
+
+//
+// At most this much of each group is compressed at every level by analyze
+//
+
+#define PACKTOOL_MAX_ANALYZE_SAMPLE_SIZE 8388608
+
+//
+// analyze suggests the lowest level that gets within this many percent of the best size
+//
+
+#define PACKTOOL_ANALYZE_LEVEL_TOLERANCE 1
 
 _Noreturn VOID Usage(VOID)
 /*++
 
 Routine Description:
 
-    Prints instructions for using the program and exits.
+    Prints instructions for using the program and exits.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    Does not return.
+
+--*/
+{
+    LogInfo("Usage:");
+    LogInfo("\tcreate <directory base name> [<options>] <input> [<input...>]\t- Create a pack file");
+    LogInfo("\textract <pack directory> [<-jobs <count>>] [<folder>] [<regex>]\t\t- Extract a pack file (or the files "
+            "matching regex) in parallel");
+    LogInfo("\tlist <pack directory> [<regex>] [<-verbose>]\t\t\t- List a pack file's contents");
+    LogInfo("\tadd <pack directory> [<options>] <input> [<input...>]\t\t- Add files that aren't in a pack file yet");
+    LogInfo("\treplace <pack directory> [<options>] <input> [<input...>]\t- Replace files in a pack file");
+    LogInfo("\tremove <pack directory> <path> [<path...>]\t\t\t- Remove files from a pack file");
+    LogInfo("\tcompact <pack directory> [<options>]\t\t\t\t- Rewrite a pack file without its dead space");
+    LogInfo("\treorder <pack directory> <trace> [<trace...>]\t\t\t- Lay a pack file out in the order files were read in "
+            "access traces (recorded with -fs_trace_packs 1)");
+    LogInfo("\tverify <pack directory> [<-jobs <count>>] [<regex>]\t\t- Check the hashes of every file (or the files "
+            "matching regex) in parallel");
+    LogInfo("\tbench <pack directory> [<-count <reads>>]\t\t\t- Measure read latency through the filesystem, in order "
+            "and in random order");
+    LogInfo("\tanalyze <pack directory>\t\t\t\t\t- Break down compression by extension and suggest how to store each "
+            "one");
+    LogInfo("\tdiff <old pack directory> <new pack directory> <patch>\t- Write a patch with the files that changed, as "
+            "deltas where that's smaller");
+    LogInfo("\tpatch <pack directory> <patch>\t\t\t\t- Apply a patch from diff to a pack file in place");
+    LogInfo("Options for create, add and replace:");
+    LogInfo("\t-level <level>\t\t- zstd compression level (default %d)", PACKFILE_DEFAULT_COMPRESSION_LEVEL);
+    LogInfo("\t-fast-level <level>\t- zstd compression level for files that barely compress (default %d)",
+            PACKFILE_DEFAULT_FAST_COMPRESSION_LEVEL);
+    LogInfo("\t-store-threshold <percent>\t- Store files that don't compress below this (default %d, 0 to never store)",
+            PACKFILE_DEFAULT_STORE_THRESHOLD);
+    LogInfo("\t-fast-threshold <percent>\t- Use the fast level for files that don't compress below this (default %d, 0 "
+            "to never use it)",
+            PACKFILE_DEFAULT_FAST_THRESHOLD);
+    LogInfo("\t-window-log <log>\t- Window log for large files (default %d)", PACKFILE_DEFAULT_WINDOW_LOG);
+    LogInfo("\t-workers <count>\t- Compression threads for large files (default %u)", PlatGetProcessorCount());
+    LogInfo("\t-jobs <count>\t\t- Files to add at once (default %u, 1 for the same layout every time)",
+            PlatGetProcessorCount());
+    LogInfo("\t-dictionaries <extension|directory>\t- Train dictionaries for small files grouped by extension or "
+            "directory");
+    LogInfo("\t-align <bytes>\t\t- Start files at a multiple of this in the archives, like 4096 for direct I/O and "
+            "mapping (default 0, saved in the pack)");
+    LogInfo("\t-solid <bytes>\t\t- Compress files up to %s together in blocks of about this size, sorted by extension "
+            "(default 0, off)",
+            CmnFormatSize(PACKTOOL_MAX_SOLID_FILE_SIZE));
+    LogInfo("\t-directory <plain|compressed|hashed>\t- How to store the directory, hashed replaces paths with hashes for "
+            "shipping and can't be undone (default plain, saved in the pack)");
+    LogInfo("\t-seekable <bytes>\t- Compress bigger files as independent frames this big, so the engine can map them "
+            "and only decompress what's used (power of 2 from %s to %s, default 0, off)",
+            CmnFormatSize(PACKFILE_MIN_SEEKABLE_FRAME_SIZE),
+            CmnFormatTempString("%s", CmnFormatSize(PACKFILE_STREAM_CHUNK_SIZE)));
+    LogInfo("Options for compact:");
+    LogInfo("\t-threshold <percent>\t- Only compact packs with at least this much dead space (default %d, 0 to always "
+            "compact)",
+            PACKFILE_DEFAULT_COMPACT_THRESHOLD);
+    LogInfo("\t-align <bytes>\t\t- Change the alignment of every file, even if there isn't enough dead space");
+    LogInfo("\t-directory <plain|compressed|hashed>\t- Change how the directory is stored, even if there isn't enough "
+            "dead space");
+    LogInfo("Options for extract, verify, and analyze:");
+    LogInfo("\t-direct-read-size <bytes>\t- Reads at least this big skip the OS file cache (default %s, 0 to never)",
+            CmnFormatSize(PACKFILE_DEFAULT_DIRECT_READ_SIZE));
+    LogInfo("\t-block-cache-size <bytes>\t- Keep this much of the most recently read solid blocks decompressed (default "
+            "%s)",
+            CmnFormatSize(PACKFILE_DEFAULT_BLOCK_CACHE_SIZE));
+    exit(EINVAL);
+}
+
+static BOOLEAN ParseOption(_Inout_ PPACKFILE PackFile, _In_ PCHAR *Arguments, _In_ UINT32 ArgumentCount,
+                           _Inout_ PUINT32 Index)
+/*++
+
+Routine Description:
+
+    Applies the option at Arguments[*Index] to the pack file's write options.
+    Exits through Usage if it's the last argument, so it has no value.
+
+Arguments:
+
+    PackFile - The pack file to apply the option to.
+
+    Arguments - The arguments.
+
+    ArgumentCount - The number of arguments.
+
+    Index - The index of the option, updated to the last argument it used.
+
+Return Value:
+
+    TRUE - The argument was an option.
+
+    FALSE - The argument isn't an option.
+
+--*/
+{
+    PCSTR Option = Arguments[*Index];
+    if (Option[0] != '-')
+    {
+        return FALSE;
+    }
+
+    // Only known options need a value, so a missing one is checked for once the option is found
+    BOOLEAN HasValue = *Index + 1 < ArgumentCount;
+    PCSTR Value = HasValue ? Arguments[*Index + 1] : "";
+    if (strcmp(Option, "-level") == 0)
+    {
+        PackFile->Options.CompressionLevel = (INT32)strtol(Value, NULL, 10);
+    }
+    else if (strcmp(Option, "-fast-level") == 0)
+    {
+        PackFile->Options.FastCompressionLevel = (INT32)strtol(Value, NULL, 10);
+    }
+    else if (strcmp(Option, "-store-threshold") == 0)
+    {
+        PackFile->Options.StoreThreshold = (UINT8)PURPL_MIN(strtoul(Value, NULL, 10), 100);
+    }
+    else if (strcmp(Option, "-fast-threshold") == 0)
+    {
+        PackFile->Options.FastThreshold = (UINT8)PURPL_MIN(strtoul(Value, NULL, 10), 100);
+    }
+    else if (strcmp(Option, "-window-log") == 0)
+    {
+        PackFile->Options.WindowLog = (UINT32)strtoul(Value, NULL, 10);
+    }
+    else if (strcmp(Option, "-workers") == 0)
+    {
+        PackFile->Options.WorkerCount = (UINT32)strtoul(Value, NULL, 10);
+    }
+    else if (strcmp(Option, "-jobs") == 0)
+    {
+        JobCount = (UINT32)strtoul(Value, NULL, 10);
+    }
+    else if (strcmp(Option, "-threshold") == 0)
+    {
+        CompactThreshold = (UINT8)PURPL_MIN(strtoul(Value, NULL, 10), 100);
+    }
+    else if (strcmp(Option, "-align") == 0)
+    {
+        PackSetAlignment(PackFile, (UINT32)strtoul(Value, NULL, 10));
+    }
+    else if (strcmp(Option, "-directory") == 0)
+    {
+        UINT32 Flags = 0;
+        if (strcmp(Value, "compressed") == 0)
+        {
+            Flags = PACKFILE_FLAG_COMPRESSED_DIRECTORY;
+        }
+        else if (strcmp(Value, "hashed") == 0)
+        {
+            Flags = PACKFILE_FLAG_COMPRESSED_DIRECTORY | PACKFILE_FLAG_HASHED_PATHS;
+        }
+        PackSetFlags(PackFile, Flags);
+    }
+    else if (strcmp(Option, "-seekable") == 0)
+    {
+        UINT64 FrameSize = strtoull(Value, NULL, 10);
+        if (FrameSize && (FrameSize < PACKFILE_MIN_SEEKABLE_FRAME_SIZE || FrameSize > PACKFILE_STREAM_CHUNK_SIZE ||
+                          (FrameSize & (FrameSize - 1)) != 0))
+        {
+            LogWarning("Ignoring invalid seekable frame size %s", Value);
+            FrameSize = 0;
+        }
+        PackFile->Options.SeekableFrameSize = (UINT32)FrameSize;
+    }
+    else if (strcmp(Option, "-solid") == 0)
+    {
+        SolidBlockSize = PURPL_MIN(strtoull(Value, NULL, 10), PACKFILE_MAX_SOLID_BLOCK_SIZE);
+    }
+    else if (strcmp(Option, "-direct-read-size") == 0)
+    {
+        PackSetDirectReadSize(PackFile, strtoull(Value, NULL, 10));
+    }
+    else if (strcmp(Option, "-block-cache-size") == 0)
+    {
+        PackSetBlockCacheSize(PackFile, strtoull(Value, NULL, 10));
+    }
+    else if (strcmp(Option, "-count") == 0)
+    {
+        BenchReadCount = strtoull(Value, NULL, 10);
+    }
+    else if (strcmp(Option, "-dictionaries") == 0)
+    {
+        if (strcmp(Value, "extension") == 0)
+        {
+            DictionaryMode = PackToolDictionaryModeExtension;
+        }
+        else if (strcmp(Value, "directory") == 0)
+        {
+            DictionaryMode = PackToolDictionaryModeDirectory;
+        }
+        else
+        {
+            DictionaryMode = PackToolDictionaryModeNone;
+        }
+    }
+    else
+    {
+        return FALSE;
+    }
+
+    if (!HasValue)
+    {
+        LogError("Option %s needs a value", Option);
+        Usage();
+    }
+
+    (*Index)++;
+    return TRUE;
+}
+
+static VOID AddInput(_Inout_ PPACKTOOL_INPUT *Inputs, _In_z_ PCSTR Path, _In_z_ PCSTR InnerPath)
+{
+    PACKTOOL_INPUT Input = {0};
+    Input.Path = CmnDuplicateString(Path, 0);
+    PURPL_ASSERT(Input.Path != NULL);
+    Input.InnerPath = CmnDuplicateString(InnerPath, 0);
+    PURPL_ASSERT(Input.InnerPath != NULL);
+    Input.Size = FsGetFileSize(TRUE, Path);
+    stbds_arrput(*Inputs, Input);
+}
+
+static VOID FreeInput(_Inout_ PPACKTOOL_INPUT Input)
+{
+    CmnFree(Input->Path);
+    CmnFree(Input->InnerPath);
+}
+
+//
+// Inputs that get compressed together
+//
+
+typedef struct PACKTOOL_SOLID_BLOCK
+{
+    PPACKTOOL_INPUT *Inputs;
+    UINT64 Count;
+} PACKTOOL_SOLID_BLOCK, *PPACKTOOL_SOLID_BLOCK;
+
+//
+// What AddFile and AddBlock need from AddInputs
+//
+
+typedef struct PACKTOOL_ADD_WORK
+{
+    PPACKFILE PackFile;
+    PPACKTOOL_INPUT *Inputs;
+    PPACKTOOL_SOLID_BLOCK Blocks;
+    UINT64 FailureCount; // Inputs that couldn't be added, updated atomically
+} PACKTOOL_ADD_WORK, *PPACKTOOL_ADD_WORK;
+
+static BOOLEAN ReadInput(_In_opt_ PVOID UserData, _In_ UINT64 Offset, _Out_writes_bytes_(Size) PVOID Buffer,
+                         _In_ UINT64 Size)
+{
+    return PlatReadFileAt(UserData, Offset, Buffer, Size);
+}
+
+static VOID AddFile(_In_ UINT64 Index, _In_opt_ PVOID UserData)
+/*++
+
+Routine Description:
+
+    Reads an input and adds it to the pack file, or streams it
+    into the pack file if it's too big to read all of it at once.
+    Called from several threads at once by AsRunParallel.
+
+Arguments:
+
+    Index - The index of the input.
+
+    UserData - A PACKTOOL_ADD_WORK with the pack file and inputs.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PPACKTOOL_ADD_WORK Work = UserData;
+    PPACKTOOL_INPUT Input = Work->Inputs[Index];
+
+    BOOLEAN Added = FALSE;
+    if (Input->Size > PACKTOOL_MAX_IN_MEMORY_FILE_SIZE)
+    {
+        PPLAT_FILE File = PlatOpenFile(Input->Path);
+        if (File)
+        {
+            LogInfo("%s -> %s/%s (streamed)", Input->Path, Work->PackFile->Path, Input->InnerPath);
+            Added = PackAddFileStream(Work->PackFile, Input->InnerPath, ReadInput, File, Input->Size);
+            PlatCloseFile(File);
+        }
+    }
+    else
+    {
+        UINT64 Size = 0;
+        PVOID Data = FsReadFile(TRUE, Input->Path, 0, 0, &Size, 0);
+        if (Data)
+        {
+            LogInfo("%s -> %s/%s", Input->Path, Work->PackFile->Path, Input->InnerPath);
+            Added = PackAddFile(Work->PackFile, Input->InnerPath, Data, Size);
+            CmnFree(Data);
+        }
+    }
+
+    if (!Added)
+    {
+        AsAtomicAdd64(&Work->FailureCount, 1);
+    }
+}
+
+static VOID AddBlock(_In_ UINT64 Index, _In_opt_ PVOID UserData)
+/*++
+
+Routine Description:
+
+    Reads the inputs in a solid block and adds them to the pack
+    file together. Called from several threads at once by
+    AsRunParallel.
+
+Arguments:
+
+    Index - The index of the block.
+
+    UserData - A PACKTOOL_ADD_WORK with the pack file and blocks.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PPACKTOOL_ADD_WORK Work = UserData;
+    PPACKTOOL_SOLID_BLOCK Block = &Work->Blocks[Index];
+
+    PCSTR *Paths = CmnAllocType(Block->Count, PCSTR);
+    PVOID *Data = CmnAllocType(Block->Count, PVOID);
+    PUINT64 Sizes = CmnAllocType(Block->Count, UINT64);
+    if (!Paths || !Data || !Sizes)
+    {
+        LogError("Failed to allocate solid block %llu: %s", Index, strerror(errno));
+        AsAtomicAdd64(&Work->FailureCount, Block->Count);
+        goto Done;
+    }
+
+    UINT64 Count = 0;
+    for (UINT64 i = 0; i < Block->Count; i++)
+    {
+        PPACKTOOL_INPUT Input = Block->Inputs[i];
+        Data[Count] = FsReadFile(TRUE, Input->Path, 0, 0, &Sizes[Count], 0);
+        if (Data[Count])
+        {
+            LogInfo("%s -> %s/%s", Input->Path, Work->PackFile->Path, Input->InnerPath);
+            Paths[Count++] = Input->InnerPath;
+        }
+        else
+        {
+            AsAtomicAdd64(&Work->FailureCount, 1);
+        }
+    }
+
+    if (Count > 0 && !PackAddSolidBlock(Work->PackFile, Paths, Data, Sizes, Count))
+    {
+        AsAtomicAdd64(&Work->FailureCount, Count);
+    }
+    for (UINT64 i = 0; i < Count; i++)
+    {
+        CmnFree(Data[i]);
+    }
+
+Done:
+    CmnFree(Sizes);
+    CmnFree(Data);
+    CmnFree(Paths);
+}
+
+static VOID AddDirectory(_Inout_ PPACKTOOL_INPUT *Inputs, _In_ DIR *Directory, _In_z_ PCSTR Path,
+                         _In_opt_z_ PCSTR InnerBasePath)
+{
+    struct dirent *Entry;
+    while ((Entry = readdir(Directory)))
+    {
+        if (strcmp(Entry->d_name, ".") == 0 || strcmp(Entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+
+        PCHAR FullPath = CmnFormatString("%s/%s", Path, Entry->d_name);
+        PURPL_ASSERT(FullPath != NULL);
+        PCHAR InnerPath = CmnFormatString("%s%s%s", InnerBasePath ? InnerBasePath : "", InnerBasePath ? "/" : "",
+                                          Entry->d_name);
+        PURPL_ASSERT(InnerPath != NULL);
+
+        if (Entry->d_type == DT_DIR)
+        {
+            DIR *SubDirectory = opendir(FullPath);
+            if (SubDirectory)
+            {
+                AddDirectory(Inputs, SubDirectory, FullPath, InnerPath);
+                closedir(SubDirectory);
+            }
+        }
+        else if (Entry->d_type == DT_REG)
+        {
+            AddInput(Inputs, FullPath, InnerPath);
+        }
+        else
+        {
+            LogInfo("%d", Entry->d_type);
+        }
+
+        CmnFree(FullPath);
+        CmnFree(InnerPath);
+    }
+}
+
+PURPL_MAKE_STRING_HASHMAP_ENTRY(PACKTOOL_GROUP_MAP, PUINT64);
+
+static VOID TrainDictionary(_Inout_ PPACKFILE PackFile, _In_ PPACKTOOL_INPUT Inputs, _In_z_ PCSTR Group,
+                            _In_ PUINT64 Indices)
+/*++
+
+Routine Description:
+
+    Trains a dictionary on the given files and adds it to the pack.
+
+Arguments:
+
+    PackFile - The pack file to add the dictionary to.
+
+    Inputs - All the inputs.
+
+    Group - The dictionary group.
+
+    Indices - Indices of the inputs in the group.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PBYTE Samples = NULL;
+    SIZE_T *SampleSizes = NULL;
+
+    for (UINT64 i = 0; i < stbds_arrlenu(Indices); i++)
+    {
+        PPACKTOOL_INPUT Input = &Inputs[Indices[i]];
+        if (stbds_arrlenu(Samples) + Input->Size > PACKTOOL_MAX_DICTIONARY_SAMPLE_SIZE)
+        {
+            continue;
+        }
+
+        UINT64 Size = 0;
+        PVOID Data = FsReadFile(TRUE, Input->Path, 0, 0, &Size, 0);
+        if (Data)
+        {
+            memcpy(stbds_arraddnptr(Samples, Size), Data, Size);
+            stbds_arrput(SampleSizes, Size);
+            CmnFree(Data);
+        }
+    }
+
+    PVOID Dictionary = CmnAlloc(PACKFILE_DICTIONARY_SIZE, 1);
+    PURPL_ASSERT(Dictionary != NULL);
+
+    LogInfo("Training dictionary for %s on %zu file(s) (%s)", Group, stbds_arrlenu(SampleSizes),
+            CmnFormatSize(stbds_arrlenu(Samples)));
+    SIZE_T Size = ZDICT_trainFromBuffer(Dictionary, PACKFILE_DICTIONARY_SIZE, Samples, SampleSizes,
+                                        (UINT32)stbds_arrlenu(SampleSizes));
+    if (ZDICT_isError(Size))
+    {
+        LogWarning("Failed to train dictionary for %s: %s", Group, ZDICT_getErrorName(Size));
+    }
+    else
+    {
+        PackAddDictionary(PackFile, Group, Dictionary, (UINT32)Size);
+    }
+
+    CmnFree(Dictionary);
+    stbds_arrfree(SampleSizes);
+    stbds_arrfree(Samples);
+}
+
+static VOID TrainDictionaries(_Inout_ PPACKFILE PackFile, _In_ PPACKTOOL_INPUT Inputs)
+/*++
+
+Routine Description:
+
+    Groups the small inputs by extension or directory and trains a dictionary for each group.
+
+Arguments:
+
+    PackFile - The pack file to add the dictionaries to.
+
+    Inputs - The inputs.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PPACKTOOL_GROUP_MAP Groups = NULL;
+
+    for (UINT64 i = 0; i < stbds_arrlenu(Inputs); i++)
+    {
+        if (Inputs[i].Size == 0 || Inputs[i].Size > PACKFILE_DICTIONARY_MAX_ENTRY_SIZE)
+        {
+            continue;
+        }
+
+        PCSTR Group =
+            PackGetDictionaryGroup(Inputs[i].InnerPath, DictionaryMode == PackToolDictionaryModeDirectory);
+        if (!Group)
+        {
+            continue;
+        }
+
+        PPACKTOOL_GROUP_MAP Pair = stbds_shgetp_null(Groups, Group);
+        if (!Pair)
+        {
+            stbds_shput(Groups, CmnDuplicateString(Group, 0), NULL);
+            Pair = stbds_shgetp_null(Groups, Group);
+        }
+        stbds_arrput(Pair->value, i);
+    }
+
+    for (UINT64 i = 0; i < stbds_shlenu(Groups); i++)
+    {
+        if (stbds_arrlenu(Groups[i].value) >= PACKTOOL_MIN_DICTIONARY_SAMPLES)
+        {
+            TrainDictionary(PackFile, Inputs, Groups[i].key, Groups[i].value);
+        }
+        stbds_arrfree(Groups[i].value);
+        CmnFree(Groups[i].key);
+    }
+    stbds_shfree(Groups);
+}
+
+static PPACKTOOL_INPUT GatherInputs(_Inout_ PPACKFILE PackFile, _In_ PCHAR *Arguments, _In_ UINT32 ArgumentCount)
+/*++
+
+Routine Description:
+
+    Applies the options in the arguments and finds the files
+    the rest of them refer to.
+
+Arguments:
+
+    PackFile - The pack file the inputs will be added to.
+
+    Arguments - The arguments.
+
+    ArgumentCount - The number of arguments.
+
+Return Value:
+
+    An stb_ds array of inputs, which can be NULL if there are none.
+
+--*/
+{
+    // Options have to be set before anything is added
+    for (UINT32 i = 0; i < ArgumentCount; i++)
+    {
+        ParseOption(PackFile, Arguments, ArgumentCount, &i);
+    }
+
+    LogInfo("Compressing at level %d (level %d over %u%% of the original size, stored over %u%%), large files with window "
+            "log %u and %u worker(s)",
+            PackFile->Options.CompressionLevel, PackFile->Options.FastCompressionLevel, PackFile->Options.FastThreshold,
+            PackFile->Options.StoreThreshold, PackFile->Options.WindowLog, PackFile->Options.WorkerCount);
+    if (PackFile->Header.Alignment)
+    {
+        LogInfo("Aligning files to %s", CmnFormatSize(PackFile->Header.Alignment));
+    }
+    if (PackFile->Options.SeekableFrameSize)
+    {
+        LogInfo("Compressing files bigger than %s as seekable frames",
+                CmnFormatSize(PackFile->Options.SeekableFrameSize));
+    }
+
+    PPACKTOOL_INPUT Inputs = NULL;
+    for (UINT32 i = 0; i < ArgumentCount; i++)
+    {
+        if (ParseOption(PackFile, Arguments, ArgumentCount, &i))
+        {
+            continue;
+        }
+
+        PCHAR Path = PlatFixPath(Arguments[i]);
+        PURPL_ASSERT(Path != NULL);
+        DIR *Directory = opendir(Path);
+        if (Directory)
+        {
+            LogInfo("%s -> %s", Path, PackFile->Path);
+            AddDirectory(&Inputs, Directory, Path, NULL);
+            closedir(Directory);
+        }
+        else
+        {
+            AddInput(&Inputs, Path, Path);
+        }
+        CmnFree(Path);
+    }
+
+    return Inputs;
+}
+
+static PCSTR GetExtension(_In_z_ PCSTR Path)
+{
+    PCSTR Name = strrchr(Path, '/');
+    PCSTR Extension = strrchr(Name ? Name : Path, '.');
+    return Extension ? Extension : "";
+}
+
+static INT CompareSolidInputs(_In_ const VOID *First, _In_ const VOID *Second)
+{
+    PPACKTOOL_INPUT FirstInput = *(PPACKTOOL_INPUT *)First;
+    PPACKTOOL_INPUT SecondInput = *(PPACKTOOL_INPUT *)Second;
+
+    // Files of the same type have the most in common, and files next to each other are likely to be read together
+    INT Result = strcmp(GetExtension(FirstInput->InnerPath), GetExtension(SecondInput->InnerPath));
+    return Result ? Result : strcmp(FirstInput->InnerPath, SecondInput->InnerPath);
+}
+
+static BOOLEAN AddInputs(_Inout_ PPACKFILE PackFile, _In_ PPACKTOOL_INPUT Inputs)
+/*++
+
+Routine Description:
+
+    Adds the inputs to the pack file, small ones in solid blocks if
+    those are enabled, and frees them.
+
+Arguments:
+
+    PackFile - The pack file.
+
+    Inputs - The inputs.
+
+Return Value:
+
+    TRUE - All of the inputs were added.
+
+    FALSE - Some of them couldn't be read or added.
+
+--*/
+{
+    PPACKTOOL_INPUT *Files = NULL;
+    PPACKTOOL_INPUT *SolidFiles = NULL;
+    for (UINT64 i = 0; i < stbds_arrlenu(Inputs); i++)
+    {
+        if (SolidBlockSize && Inputs[i].Size <= PACKTOOL_MAX_SOLID_FILE_SIZE)
+        {
+            stbds_arrput(SolidFiles, &Inputs[i]);
+        }
+        else
+        {
+            stbds_arrput(Files, &Inputs[i]);
+        }
+    }
+
+    // The pointers into SolidFiles stay valid, since it isn't added to after this
+    PPACKTOOL_SOLID_BLOCK Blocks = NULL;
+    if (SolidFiles)
+    {
+        qsort(SolidFiles, stbds_arrlenu(SolidFiles), sizeof(PPACKTOOL_INPUT), CompareSolidInputs);
+    }
+    UINT64 BlockSize = 0;
+    for (UINT64 i = 0; i < stbds_arrlenu(SolidFiles); i++)
+    {
+        if (!stbds_arrlenu(Blocks) || BlockSize + SolidFiles[i]->Size > SolidBlockSize)
+        {
+            PACKTOOL_SOLID_BLOCK Block = {&SolidFiles[i], 0};
+            stbds_arrput(Blocks, Block);
+            BlockSize = 0;
+        }
+        stbds_arrlast(Blocks).Count++;
+        BlockSize += SolidFiles[i]->Size;
+    }
+    if (stbds_arrlenu(Blocks))
+    {
+        LogInfo("Grouping %llu small file(s) into %llu solid block(s)", stbds_arrlenu(SolidFiles),
+                stbds_arrlenu(Blocks));
+    }
+
+    UINT32 ThreadCount = JobCount ? JobCount : PlatGetProcessorCount();
+    PACKTOOL_ADD_WORK Work = {PackFile, Files, Blocks, 0};
+    AsRunParallel("packtool", stbds_arrlenu(Files), ThreadCount, AddFile, &Work);
+    AsRunParallel("packtool solid", stbds_arrlenu(Blocks), ThreadCount, AddBlock, &Work);
+    stbds_arrfree(Blocks);
+    stbds_arrfree(SolidFiles);
+    stbds_arrfree(Files);
+    for (UINT64 i = 0; i < stbds_arrlenu(Inputs); i++)
+    {
+        FreeInput(&Inputs[i]);
+    }
+    stbds_arrfree(Inputs);
+
+    if (PackFile->Writer.DuplicateCount > 0)
+    {
+        LogInfo("Deduplicated %llu file(s), saved %s", PackFile->Writer.DuplicateCount,
+                CmnFormatSize(PackFile->Writer.DuplicateSize));
+    }
+
+    UINT64 FailureCount = AsAtomicLoad64(&Work.FailureCount);
+    if (FailureCount > 0)
+    {
+        LogError("Failed to add %llu file(s) to %s", FailureCount, PackFile->Path);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static BOOLEAN ReportSpaceUsage(_In_ PPACKFILE PackFile)
+/*++
+
+Routine Description:
+
+    Logs how much of a pack file is dead space.
+
+Arguments:
+
+    PackFile - The pack file.
+
+Return Value:
+
+    TRUE - The pack has at least CompactThreshold percent dead space.
+
+    FALSE - The pack doesn't need to be compacted.
+
+--*/
+{
+    UINT64 TotalSize = 0;
+    UINT64 DeadSize = 0;
+    PackGetSpaceUsage(PackFile, &TotalSize, &DeadSize);
+
+    UINT64 Percentage = TotalSize ? DeadSize * 100 / TotalSize : 0;
+    LogInfo("%s of %s (%llu%%) in the pack file's archives is dead space", CmnFormatSize(DeadSize),
+            CmnFormatTempString("%s", CmnFormatSize(TotalSize)), Percentage);
+
+    return DeadSize > 0 && Percentage >= CompactThreshold;
+}
+
+static INT Create(_In_ PPACKFILE PackFile, _In_ PCHAR *Arguments, _In_ UINT32 ArgumentCount)
+{
+    PPACKTOOL_INPUT Inputs = GatherInputs(PackFile, Arguments, ArgumentCount);
+
+    if (DictionaryMode != PackToolDictionaryModeNone)
+    {
+        TrainDictionaries(PackFile, Inputs);
+    }
+
+    // Whatever could be added is still saved
+    BOOLEAN Added = AddInputs(PackFile, Inputs);
+    if (!PackSave(PackFile, NULL) || !Added)
+    {
+        return EIO;
+    }
+
+    return 0;
+}
+
+static INT Update(_In_ PPACKFILE PackFile, _In_ PCHAR *Arguments, _In_ UINT32 ArgumentCount, _In_ BOOLEAN Replace)
+/*++
+
+Routine Description:
+
+    Appends files to an existing pack file and saves its directory,
+    without touching anything else in it. The dictionaries it already
+    has are used, but no new ones are trained.
+
+Arguments:
+
+    PackFile - The pack file.
+
+    Arguments - The arguments.
+
+    ArgumentCount - The number of arguments.
+
+    Replace - Whether the files have to be in the pack already, instead
+              of having to not be in it.
+
+Return Value:
+
+    0 - Success.
+
+    errno value - Failure.
+
+--*/
+{
+    PPACKTOOL_INPUT Inputs = GatherInputs(PackFile, Arguments, ArgumentCount);
+    for (UINT64 i = 0; i < stbds_arrlenu(Inputs);)
+    {
+        if (PackHasFile(PackFile, Inputs[i].InnerPath) != Replace)
+        {
+            LogWarning("Skipping %s, it %s in the pack file", Inputs[i].InnerPath, Replace ? "isn't" : "is already");
+            FreeInput(&Inputs[i]);
+            stbds_arrdel(Inputs, i);
+        }
+        else
+        {
+            i++;
+        }
+    }
+
+    BOOLEAN Added = AddInputs(PackFile, Inputs);
+    if (!PackSave(PackFile, NULL) || !Added)
+    {
+        return EIO;
+    }
+
+    if (ReportSpaceUsage(PackFile))
+    {
+        LogInfo("Run compact to remove it");
+    }
+
+    return 0;
+}
+
+static INT Add(_In_ PPACKFILE PackFile, _In_ PCHAR *Arguments, _In_ UINT32 ArgumentCount)
+{
+    return Update(PackFile, Arguments, ArgumentCount, FALSE);
+}
+
+static INT Replace(_In_ PPACKFILE PackFile, _In_ PCHAR *Arguments, _In_ UINT32 ArgumentCount)
+{
+    return Update(PackFile, Arguments, ArgumentCount, TRUE);
+}
+
+static INT Remove(_In_ PPACKFILE PackFile, _In_ PCHAR *Arguments, _In_ UINT32 ArgumentCount)
+{
+    for (UINT32 i = 0; i < ArgumentCount; i++)
+    {
+        if (PackRemoveFile(PackFile, Arguments[i]))
+        {
+            LogInfo("Removed %s", Arguments[i]);
+        }
+        else
+        {
+            LogWarning("%s isn't in the pack file", Arguments[i]);
+        }
+    }
+
+    if (!PackSave(PackFile, NULL))
+    {
+        return EIO;
+    }
+
+    if (ReportSpaceUsage(PackFile))
+    {
+        LogInfo("Run compact to remove it");
+    }
+
+    return 0;
+}
+
+static INT Compact(_In_ PPACKFILE PackFile, _In_ PCHAR *Arguments, _In_ UINT32 ArgumentCount)
+{
+    UINT32 Alignment = PackFile->Header.Alignment;
+    UINT32 Flags = PackFile->Header.Flags;
+    for (UINT32 i = 0; i < ArgumentCount; i++)
+    {
+        ParseOption(PackFile, Arguments, ArgumentCount, &i);
+    }
+
+    // Changing the alignment moves every file, whether or not there's dead space
+    BOOLEAN Realign = PackFile->Header.Alignment != Alignment;
+    if (Realign)
+    {
+        LogInfo("Aligning files to %s", CmnFormatSize(PackFile->Header.Alignment));
+    }
+
+    if (!ReportSpaceUsage(PackFile) && !Realign)
+    {
+        LogInfo("Not compacting, the pack file has less than %u%% dead space", CompactThreshold);
+
+        // The directory is the only thing that changes with the flags
+        if (PackFile->Header.Flags != Flags && !PackSave(PackFile, NULL))
+        {
+            return EIO;
+        }
+        return 0;
+    }
+
+    if (!PackCompact(PackFile))
+    {
+        return EIO;
+    }
+
+    ReportSpaceUsage(PackFile);
+
+    return 0;
+}
+
+static BOOLEAN MatchesFilter(_In_opt_ re_t Filter, _In_z_ PCSTR Path)
+{
+    INT MatchLength = 0;
+    return !Filter || re_matchp(Filter, Path, &MatchLength) >= 0;
+}
+
+static BOOLEAN IsSafePath(_In_z_ PCSTR Path)
+{
+    // Entries can't be written outside of the output folder
+    if (Path[0] == '/' || Path[0] == '\\' || strchr(Path, ':'))
+    {
+        return FALSE;
+    }
+
+    for (PCSTR Component = Path; Component; Component = strpbrk(Component, "/\\"))
+    {
+        Component += Component != Path;
+        if (strncmp(Component, "..", 2) == 0 && (Component[2] == 0 || Component[2] == '/' || Component[2] == '\\'))
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+//
+// A file in the pack, sorted by where it is in the archives
+//
+
+typedef struct PACKTOOL_FILE
+{
+    UINT64 Position;
+    UINT64 Index;
+} PACKTOOL_FILE, *PPACKTOOL_FILE;
+
+static INT CompareFiles(_In_ const VOID *First, _In_ const VOID *Second)
+{
+    UINT64 FirstPosition = ((PPACKTOOL_FILE)First)->Position;
+    UINT64 SecondPosition = ((PPACKTOOL_FILE)Second)->Position;
+    return FirstPosition < SecondPosition ? -1 : FirstPosition > SecondPosition;
+}
+
+static VOID AddFileInOrder(_In_ PPACKFILE PackFile, _Inout_ PPACKTOOL_FILE *Files, _In_ UINT64 Index)
+{
+    PPACKFILE_ENTRY Entry = &PackFile->Entries[Index].value;
+    PACKTOOL_FILE File = {Entry->ArchiveIndex * (UINT64)PACKFILE_MAX_CHUNK_SIZE + Entry->Offset, Index};
+    stbds_arrput(*Files, File);
+}
+
+static VOID SortFiles(_Inout_ PPACKTOOL_FILE Files)
+{
+    // Going through the archives in order keeps the reads mostly sequential, even with a few threads at once
+    if (Files)
+    {
+        qsort(Files, stbds_arrlenu(Files), sizeof(PACKTOOL_FILE), CompareFiles);
+    }
+}
+
+//
+// What ExtractFile needs from Extract
+//
+
+typedef struct PACKTOOL_EXTRACT_WORK
+{
+    PPACKFILE PackFile;
+    PCSTR Folder;
+    PPACKTOOL_FILE Files;
+    UINT64 ExtractedCount;
+    UINT64 ExtractedSize;
+    UINT64 FailedCount;
+} PACKTOOL_EXTRACT_WORK, *PPACKTOOL_EXTRACT_WORK;
+
+static VOID ExtractFile(_In_ UINT64 Index, _In_opt_ PVOID UserData)
+/*++
+
+Routine Description:
+
+    Decompresses and verifies a file from the pack, and writes it
+    to the output folder as soon as it's done. Called from several
+    threads at once by AsRunParallel.
+
+Arguments:
+
+    Index - The index of the file in the work's files.
+
+    UserData - A PACKTOOL_EXTRACT_WORK.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PPACKTOOL_EXTRACT_WORK Work = UserData;
+    PCSTR Path = Work->PackFile->Entries[Work->Files[Index].Index].key;
+
+    UINT64 Size = 0;
+    PVOID Data = PackReadFile(Work->PackFile, Path, 0, 0, &Size, 0);
+    if (!Data)
+    {
+        LogError("Failed to extract %s", Path);
+        AsAtomicAdd64(&Work->FailedCount, 1);
+        return;
+    }
+
+    PCHAR OutputPath = CmnFormatString("%s/%s", Work->Folder, Path);
+    PCHAR Directory = CmnDuplicateString(OutputPath, 0);
+    PCHAR Separator = strrchr(Directory, '/');
+    if (Separator)
+    {
+        *Separator = 0;
+        FsCreateDirectory(Directory);
+    }
+
+    LogInfo("%s/%s -> %s", Work->PackFile->Path, Path, OutputPath);
+    if (FsWriteFile(OutputPath, Data, Size, FALSE))
+    {
+        AsAtomicAdd64(&Work->ExtractedCount, 1);
+        AsAtomicAdd64(&Work->ExtractedSize, Size);
+    }
+    else
+    {
+        LogError("Failed to write %s", OutputPath);
+        AsAtomicAdd64(&Work->FailedCount, 1);
+    }
+
+    CmnFree(Directory);
+    CmnFree(OutputPath);
+    CmnFree(Data);
+}
+
+static INT Extract(_In_ PPACKFILE PackFile, _In_ PCHAR *Arguments, _In_ UINT32 ArgumentCount)
+{
+    PCSTR Folder = NULL;
+    re_t Filter = NULL;
+    for (UINT32 i = 0; i < ArgumentCount; i++)
+    {
+        if (ParseOption(PackFile, Arguments, ArgumentCount, &i))
+        {
+            continue;
+        }
+        else if (!Folder)
+        {
+            Folder = Arguments[i];
+        }
+        else if (!Filter)
+        {
+            Filter = re_compile(Arguments[i]);
+            if (!Filter)
+            {
+                LogError("Invalid regex %s", Arguments[i]);
+                return EINVAL;
+            }
+        }
+    }
+
+    // Defaults to the pack's name without the extension
+    PCHAR OutputFolder = NULL;
+    if (Folder)
+    {
+        OutputFolder = PlatFixPath(Folder);
+    }
+    else
+    {
+        PCSTR Extension = strrchr(PackFile->Path, '.');
+        OutputFolder = CmnDuplicateString(PackFile->Path, Extension ? Extension - PackFile->Path : 0);
+    }
+
+    PACKTOOL_EXTRACT_WORK Work = {0};
+    Work.PackFile = PackFile;
+    Work.Folder = OutputFolder;
+    for (UINT64 i = 0; i < stbds_shlenu(PackFile->Entries); i++)
+    {
+        PCSTR Path = PackFile->Entries[i].key;
+        if (!MatchesFilter(Filter, Path))
+        {
+            continue;
+        }
+        else if (!IsSafePath(Path))
+        {
+            LogWarning("Skipping %s, it would be outside of %s", Path, OutputFolder);
+            Work.FailedCount++;
+            continue;
+        }
+
+        AddFileInOrder(PackFile, &Work.Files, i);
+    }
+    SortFiles(Work.Files);
+
+    UINT32 ThreadCount = JobCount ? JobCount : PlatGetProcessorCount();
+    LogInfo("Extracting %llu file(s) to %s with %u thread(s)", stbds_arrlenu(Work.Files), OutputFolder, ThreadCount);
+
+    // Everything gets checked on the way out
+    PackFile->VerifyMode = PackVerifyFull;
+    FsCreateDirectory(OutputFolder);
+
+    UINT64 Start = PlatGetMilliseconds();
+    AsRunParallel("packtool", stbds_arrlenu(Work.Files), ThreadCount, ExtractFile, &Work);
+    UINT64 Time = PURPL_MAX(PlatGetMilliseconds() - Start, 1);
+
+    LogInfo("Extracted %llu file(s) (%s) in %llu ms (%s/s), %llu failed", Work.ExtractedCount,
+            CmnFormatSize(Work.ExtractedSize), Time,
+            CmnFormatTempString("%s", CmnFormatSize(Work.ExtractedSize * 1000 / Time)), Work.FailedCount);
+
+    stbds_arrfree(Work.Files);
+    CmnFree(OutputFolder);
+
+    return Work.FailedCount ? EIO : 0;
+}
+
+static INT List(_In_ PPACKFILE PackFile, _In_ PCHAR *Arguments, _In_ UINT32 ArgumentCount)
+{
+    re_t Filter = NULL;
+    if (ArgumentCount > 0 && Arguments[0][0] != '-')
+    {
+        Filter = re_compile(Arguments[0]);
+        if (!Filter)
+        {
+            LogError("Invalid regex %s", Arguments[0]);
+            return EINVAL;
+        }
+    }
+
+    if (PackFile->Header.Alignment)
+    {
+        LogInfo("Files are aligned to %s", CmnFormatSize(PackFile->Header.Alignment));
+    }
+    if (PackFile->Header.Flags & PACKFILE_FLAG_HASHED_PATHS)
+    {
+        LogInfo("Paths are hashed, files are listed by their hash");
+    }
+    if (PackFile->Header.Flags & PACKFILE_FLAG_COMPRESSED_DIRECTORY)
+    {
+        LogInfo("Directory is compressed (%s uncompressed)", CmnFormatSize(PackFile->Header.TreeSize));
+    }
+
+    for (UINT64 i = 0; i < stbds_arrlenu(PackFile->Dictionaries); i++)
+    {
+        LogInfo("Dictionary %llu: %s (%s)", i + 1, PackFile->Dictionaries[i].Group,
+                CmnFormatSize(PackFile->Dictionaries[i].Size));
+    }
+
+    for (UINT64 i = 0; i < stbds_shlenu(PackFile->Entries); i++)
+    {
+        if (!MatchesFilter(Filter, PackFile->Entries[i].key))
+        {
+            continue;
+        }
+
+        PPACKFILE_ENTRY Entry = &PackFile->Entries[i].value;
+        LogInfo("%s", PackFile->Entries[i].key);
+        LogInfo("\tArchive: %hu", Entry->ArchiveIndex);
+        LogInfo("\tOffset: %s", CmnFormatSize(Entry->Offset));
+        LogInfo("\tSize: %s", CmnFormatSize(Entry->Size));
+        LogInfo("\tCompressed size: %s", CmnFormatSize(Entry->CompressedSize));
+        LogInfo("\tMethod: %s", PackGetMethodName(Entry->Method));
+        if (Entry->Method == PackMethodZstdSolid)
+        {
+            LogInfo("\tBlock offset: %s", CmnFormatSize(Entry->BlockOffset));
+        }
+        if (Entry->Dictionary)
+        {
+            LogInfo("\tDictionary: %hu (%s)", Entry->Dictionary, PackFile->Dictionaries[Entry->Dictionary - 1].Group);
+        }
+        LogInfo("\tHash: 0x%llX%llX", Entry->Hash.low64, Entry->Hash.high64);
+        LogInfo("\tCompressed hash: 0x%llX%llX", Entry->CompressedHash.low64, Entry->CompressedHash.high64);
+    }
+
+    return 0;
+}
+
+static VOID ReadTrace(_In_z_ PCSTR Path, _Inout_ PCHAR **Paths)
+/*++
+
+Routine Description:
+
+    Reads the paths from an access trace written by PackStopTrace.
+
+Arguments:
+
+    Path - The path to the trace.
+
+    Paths - An stb_ds array the paths are appended to, in the order
+            they were read.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    UINT64 Size = 0;
+    PCHAR Trace = FsReadFile(TRUE, Path, 0, 0, &Size, 1);
+    if (!Trace)
+    {
+        LogError("Failed to read access trace %s", Path);
+        return;
+    }
+
+    UINT64 ReadCount = 0;
+    PCHAR Line = Trace;
+    while (Line < Trace + Size)
+    {
+        PCHAR End = strchr(Line, '\n');
+        if (End)
+        {
+            *End = 0;
+        }
+
+        // Each line is the time, offset, size, and path
+        INT PathStart = 0;
+        UINT64 Time = 0;
+        UINT64 Offset = 0;
+        UINT64 ReadSize = 0;
+        if (Line[0] != '#' && sscanf(Line, "%llu %llu %llu %n", &Time, &Offset, &ReadSize, &PathStart) == 3 &&
+            Line[PathStart])
+        {
+            stbds_arrput(*Paths, CmnDuplicateString(Line + PathStart, 0));
+            ReadCount++;
+        }
+
+        if (!End)
+        {
+            break;
+        }
+        Line = End + 1;
+    }
+
+    LogInfo("Found %llu read(s) in access trace %s", ReadCount, Path);
+    CmnFree(Trace);
+}
+
+static INT Reorder(_In_ PPACKFILE PackFile, _In_ PCHAR *Arguments, _In_ UINT32 ArgumentCount)
+{
+    // The traces are combined in the order they're given, so the first one decides the most
+    PCHAR *Paths = NULL;
+    for (UINT32 i = 0; i < ArgumentCount; i++)
+    {
+        ReadTrace(Arguments[i], &Paths);
+    }
+
+    INT Result = 0;
+    if (!PackReorder(PackFile, (PCSTR *)Paths, stbds_arrlenu(Paths)))
+    {
+        Result = EIO;
+    }
+
+    for (UINT64 i = 0; i < stbds_arrlenu(Paths); i++)
+    {
+        CmnFree(Paths[i]);
+    }
+    stbds_arrfree(Paths);
+
+    return Result;
+}
+
+static INT Diff(_In_ PPACKFILE PackFile, _In_ PCHAR *Arguments, _In_ UINT32 ArgumentCount)
+{
+    if (ArgumentCount < 2)
+    {
+        Usage();
+    }
+
+    PPACKFILE NewPackFile = PackLoad(Arguments[0]);
+    if (!NewPackFile)
+    {
+        LogError("Failed to load pack file %s", Arguments[0]);
+        return EINVAL;
+    }
+
+    INT Result = 0;
+    if (!PackCreatePatch(PackFile, NewPackFile, Arguments[1]))
+    {
+        Result = EIO;
+    }
+
+    PackFree(NewPackFile);
+
+    return Result;
+}
+
+static INT Patch(_In_ PPACKFILE PackFile, _In_ PCHAR *Arguments, _In_ UINT32 ArgumentCount)
+{
+    if (ArgumentCount < 1)
+    {
+        Usage();
+    }
+
+    if (!PackApplyPatch(PackFile, Arguments[0]))
+    {
+        return EIO;
+    }
+
+    if (ReportSpaceUsage(PackFile))
+    {
+        LogInfo("Run compact to remove it");
+    }
+
+    return 0;
+}
+
+//
+// What VerifyFile needs from Verify
+//
+
+typedef struct PACKTOOL_VERIFY_WORK
+{
+    PPACKFILE PackFile;
+    PPACKTOOL_FILE Files;
+    UINT64 VerifiedCount;
+    UINT64 CorruptCount;
+    UINT64 ReadSize;
+    UINT64 DecompressedSize;
+} PACKTOOL_VERIFY_WORK, *PPACKTOOL_VERIFY_WORK;
+
+static VOID VerifyFile(_In_ UINT64 Index, _In_opt_ PVOID UserData)
+/*++
+
+Routine Description:
+
+    Checks the hashes of a file in the pack. Called from several
+    threads at once by AsRunParallel.
 
 Arguments:
 
-    None.
+    Index - The index of the file in the work's files.
+
+    UserData - A PACKTOOL_VERIFY_WORK.
 
 Return Value:
 
-    Does not return.
+    None.
 
 --*/
 {
-    LogInfo("Usage:");
-    LogInfo("\tcreate <directory base name> <input> [<input...>]\t\t- Create a pack file");
-    LogInfo("\textract <pack directory> [folder]\t\t\t\t\t\t- Extract a pack file");
-    LogInfo("\tlist <pack directory> [<regex>] [<-verbose>]\t\t\t- List a pack file's contents");
-    exit(EINVAL);
-}
+    PPACKTOOL_VERIFY_WORK Work = UserData;
+    PCSTR Path = Work->PackFile->Entries[Work->Files[Index].Index].key;
+    PPACKFILE_ENTRY Entry = &Work->PackFile->Entries[Work->Files[Index].Index].value;
 
-static VOID AddFile(_Inout_ PPACKFILE PackFile, _In_z_ PCSTR Path, _In_z_ PCSTR InnerPath)
-{
-    UINT64 Size = 0;
-    PVOID Data = FsReadFile(TRUE, Path, 0, 0, &Size, 0);
-    if (Data)
+    if (PackVerifyFile(Work->PackFile, Path))
     {
-        LogInfo("%s -> %s/%s", Path, PackFile->Path, InnerPath);
-        PackAddFile(PackFile, InnerPath, Data, Size);
+        AsAtomicAdd64(&Work->VerifiedCount, 1);
     }
-}
-
-static VOID AddDirectory(_Inout_ PPACKFILE PackFile, _In_ DIR *Directory, _In_z_ PCSTR Path,
-                         _In_opt_z_ PCSTR InnerBasePath)
-{
-    if (Path)
+    else
     {
-        LogInfo("%s -> %s%s%s", Path, PackFile->Path, InnerBasePath ? "/" : "", InnerBasePath ? InnerBasePath : "");
+        LogError("%s is corrupt", Path);
+        AsAtomicAdd64(&Work->CorruptCount, 1);
     }
 
-    struct dirent *Entry;
-    while ((Entry = readdir(Directory)))
+    AsAtomicAdd64(&Work->ReadSize, Entry->CompressedSize);
+    AsAtomicAdd64(&Work->DecompressedSize, Entry->Size);
+}
+
+static INT Verify(_In_ PPACKFILE PackFile, _In_ PCHAR *Arguments, _In_ UINT32 ArgumentCount)
+{
+    re_t Filter = NULL;
+    for (UINT32 i = 0; i < ArgumentCount; i++)
     {
-        if (strcmp(Entry->d_name, ".") == 0 || strcmp(Entry->d_name, "..") == 0)
+        if (ParseOption(PackFile, Arguments, ArgumentCount, &i))
         {
             continue;
         }
-
-        PCHAR FullPath = CmnFormatString("%s/%s", Path, Entry->d_name);
-        PURPL_ASSERT(FullPath != NULL);
-        PCHAR InnerPath = CmnFormatString("%s%s%s", InnerBasePath ? InnerBasePath : "", InnerBasePath ? "/" : "",
-                                          Entry->d_name);
-        PURPL_ASSERT(InnerPath != NULL);
-
-        if (Entry->d_type == DT_DIR)
+        else if (!Filter)
         {
-            DIR *SubDirectory = opendir(FullPath);
-            if (SubDirectory)
+            Filter = re_compile(Arguments[i]);
+            if (!Filter)
             {
-                AddDirectory(PackFile, SubDirectory, FullPath, InnerPath);
-                closedir(SubDirectory);
+                LogError("Invalid regex %s", Arguments[i]);
+                return EINVAL;
             }
         }
-        else if (Entry->d_type == DT_REG)
+    }
+
+    PACKTOOL_VERIFY_WORK Work = {0};
+    Work.PackFile = PackFile;
+    for (UINT64 i = 0; i < stbds_shlenu(PackFile->Entries); i++)
+    {
+        if (MatchesFilter(Filter, PackFile->Entries[i].key))
         {
-            AddFile(PackFile, FullPath, InnerPath);
+            AddFileInOrder(PackFile, &Work.Files, i);
         }
-        else
+    }
+    SortFiles(Work.Files);
+
+    UINT32 ThreadCount = JobCount ? JobCount : PlatGetProcessorCount();
+    LogInfo("Verifying %llu file(s) with %u thread(s)", stbds_arrlenu(Work.Files), ThreadCount);
+
+    UINT64 Start = PlatGetNanoseconds();
+    AsRunParallel("packtool", stbds_arrlenu(Work.Files), ThreadCount, VerifyFile, &Work);
+    DOUBLE Seconds = PURPL_MAX(PlatGetNanoseconds() - Start, 1) / 1e9;
+
+    LogInfo("Verified %llu file(s) in %.2f s, %.1f MB/s read, %.1f MB/s decompressed, %llu corrupt",
+            Work.VerifiedCount + Work.CorruptCount, Seconds, Work.ReadSize / 1e6 / Seconds,
+            Work.DecompressedSize / 1e6 / Seconds, Work.CorruptCount);
+
+    stbds_arrfree(Work.Files);
+
+    return Work.CorruptCount ? EIO : 0;
+}
+
+static INT CompareLatencies(_In_ const VOID *First, _In_ const VOID *Second)
+{
+    UINT64 FirstLatency = *(PUINT64)First;
+    UINT64 SecondLatency = *(PUINT64)Second;
+    return FirstLatency < SecondLatency ? -1 : FirstLatency > SecondLatency;
+}
+
+static VOID BenchPass(_In_z_ PCSTR Name, _In_reads_(Count) PCSTR *Paths, _In_ UINT64 Count)
+/*++
+
+Routine Description:
+
+    Reads each file once through FsReadFile, and logs the throughput
+    and the percentiles of how long each read took.
+
+Arguments:
+
+    Name - The name of the pass.
+
+    Paths - The files to read, in the order to read them.
+
+    Count - The number of files.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PUINT64 Latencies = CmnAllocType(Count, UINT64);
+    if (!Latencies)
+    {
+        LogError("Failed to allocate %llu latencies: %s", Count, strerror(errno));
+        return;
+    }
+
+    UINT64 TotalSize = 0;
+    UINT64 FailedCount = 0;
+    UINT64 Start = PlatGetNanoseconds();
+    for (UINT64 i = 0; i < Count; i++)
+    {
+        UINT64 ReadStart = PlatGetNanoseconds();
+        UINT64 Size = 0;
+        PVOID Data = FsReadFile(FALSE, Paths[i], 0, 0, &Size, 0);
+        Latencies[i] = PlatGetNanoseconds() - ReadStart;
+
+        if (!Data)
         {
-            LogInfo("%d", Entry->d_type);
+            FailedCount++;
         }
+        TotalSize += Size;
+        CmnFree(Data);
+    }
+    DOUBLE Seconds = PURPL_MAX(PlatGetNanoseconds() - Start, 1) / 1e9;
 
-        CmnFree(FullPath);
-        CmnFree(InnerPath);
+    qsort(Latencies, Count, sizeof(UINT64), CompareLatencies);
+    LogInfo("%s: %llu read(s) in %.2f s (%.1f MB/s), p50 %.1f us, p90 %.1f us, p99 %.1f us, max %.1f us", Name, Count,
+            Seconds, TotalSize / 1e6 / Seconds, Latencies[(Count - 1) * 50 / 100] / 1e3,
+            Latencies[(Count - 1) * 90 / 100] / 1e3, Latencies[(Count - 1) * 99 / 100] / 1e3,
+            Latencies[Count - 1] / 1e3);
+    if (FailedCount)
+    {
+        LogError("%llu read(s) failed", FailedCount);
     }
+
+    CmnFree(Latencies);
 }
 
-static INT Create(_In_ PPACKFILE PackFile, _In_ PCHAR *Arguments, _In_ UINT32 ArgumentCount)
+static INT Bench(_In_ PPACKFILE PackFile, _In_ PCHAR *Arguments, _In_ UINT32 ArgumentCount)
 {
     for (UINT32 i = 0; i < ArgumentCount; i++)
     {
-        PCHAR Path = PlatFixPath(Arguments[i]);
-        PURPL_ASSERT(Path != NULL);
-        DIR *Directory = opendir(Path);
-        if (Directory)
+        ParseOption(PackFile, Arguments, ArgumentCount, &i);
+    }
+
+    PPACKTOOL_FILE Files = NULL;
+    for (UINT64 i = 0; i < stbds_shlenu(PackFile->Entries); i++)
+    {
+        AddFileInOrder(PackFile, &Files, i);
+    }
+    SortFiles(Files);
+
+    UINT64 FileCount = stbds_arrlenu(Files);
+    UINT64 Count = BenchReadCount ? PURPL_MIN(BenchReadCount, FileCount) : FileCount;
+    if (Count == 0)
+    {
+        LogInfo("No files to read");
+        stbds_arrfree(Files);
+        return 0;
+    }
+
+    // When only some of the files are read, they're spread out over the whole pack
+    PCSTR *Paths = CmnAllocType(Count, PCSTR);
+    PURPL_ASSERT(Paths != NULL);
+    for (UINT64 i = 0; i < Count; i++)
+    {
+        Paths[i] = PackFile->Entries[Files[i * FileCount / Count].Index].key;
+    }
+    stbds_arrfree(Files);
+
+    // The reads go through a fresh copy of the pack added as a source, the same way the engine reads it. The OS file
+    // cache isn't dropped, so a cold pass is the first read of each file after the pack is loaded.
+    INT Result = 0;
+    LogInfo("Reading %llu of %llu file(s) in each pass", Count, FileCount);
+    if (!FsAddPackSource(PackFile->Path))
+    {
+        Result = EIO;
+        goto Done;
+    }
+    BenchPass("Cold sequential", Paths, Count);
+    BenchPass("Warm sequential", Paths, Count);
+    FsShutdown();
+
+    // xorshift64 with a fixed seed, so every run reads in the same order
+    UINT64 State = 0x9E3779B97F4A7C15;
+    for (UINT64 i = Count - 1; i > 0; i--)
+    {
+        State ^= State << 13;
+        State ^= State >> 7;
+        State ^= State << 17;
+
+        UINT64 Other = State % (i + 1);
+        PCSTR Path = Paths[i];
+        Paths[i] = Paths[Other];
+        Paths[Other] = Path;
+    }
+
+    if (!FsAddPackSource(PackFile->Path))
+    {
+        Result = EIO;
+        goto Done;
+    }
+    BenchPass("Cold random", Paths, Count);
+    BenchPass("Warm random", Paths, Count);
+    FsShutdown();
+
+Done:
+    CmnFree(Paths);
+
+    return Result;
+}
+
+//
+// What analyze found for one extension
+//
+
+typedef struct PACKTOOL_ANALYSIS
+{
+    UINT64 Count;
+    UINT64 SmallCount; // Files small enough to be compressed with a dictionary
+    UINT64 Size;
+    UINT64 CompressedSize;
+    UINT64 MethodCounts[PackMethodCount];
+    UINT64 ReadTime;
+    UINT64 SampleSize;
+    UINT64 LevelSizes[PURPL_ARRAYSIZE(AnalyzeLevels)];
+    UINT64 LevelTimes[PURPL_ARRAYSIZE(AnalyzeLevels)];
+} PACKTOOL_ANALYSIS, *PPACKTOOL_ANALYSIS;
+
+PURPL_MAKE_STRING_HASHMAP_ENTRY(PACKTOOL_ANALYSIS_MAP, PACKTOOL_ANALYSIS);
+
+static VOID AnalyzeFile(_In_ PPACKFILE PackFile, _In_z_ PCSTR Path, _Inout_ PPACKTOOL_ANALYSIS Analysis)
+/*++
+
+Routine Description:
+
+    Times reading a file from the pack, and compresses it at each
+    of AnalyzeLevels until the analysis has a big enough sample.
+
+Arguments:
+
+    PackFile - The pack file.
+
+    Path - The file to analyze.
+
+    Analysis - The analysis of the file's extension.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    UINT64 Start = PlatGetNanoseconds();
+    UINT64 Size = 0;
+    PVOID Data = PackReadFile(PackFile, Path, 0, 0, &Size, 0);
+    Analysis->ReadTime += PlatGetNanoseconds() - Start;
+    if (!Data)
+    {
+        LogError("Failed to read %s", Path);
+        return;
+    }
+
+    // Large files only contribute their start to the sample, compressing all of them at high levels takes forever
+    SIZE_T SampleSize = PURPL_MIN(Size, PACKTOOL_MAX_ANALYZE_SAMPLE_SIZE - PURPL_MIN(Analysis->SampleSize,
+                                                                                     PACKTOOL_MAX_ANALYZE_SAMPLE_SIZE));
+    SIZE_T BufferSize = ZSTD_compressBound(SampleSize);
+    PVOID Buffer = SampleSize ? CmnAlloc(BufferSize, 1) : NULL;
+    if (Buffer)
+    {
+        for (UINT8 i = 0; i < PURPL_ARRAYSIZE(AnalyzeLevels); i++)
         {
-            AddDirectory(PackFile, Directory, Path, NULL);
+            Start = PlatGetNanoseconds();
+            SIZE_T CompressedSize = CmnCompress(Buffer, BufferSize, Data, SampleSize, AnalyzeLevels[i]);
+            Analysis->LevelTimes[i] += PlatGetNanoseconds() - Start;
+            Analysis->LevelSizes[i] += ZSTD_isError(CompressedSize) ? SampleSize : CompressedSize;
         }
-        else
+        Analysis->SampleSize += SampleSize;
+        CmnFree(Buffer);
+    }
+
+    CmnFree(Data);
+}
+
+static VOID ReportAnalysis(_In_ PPACKFILE PackFile, _In_z_ PCSTR Extension, _In_ PPACKTOOL_ANALYSIS Analysis)
+/*++
+
+Routine Description:
+
+    Logs what analyze found for an extension, and suggests how to
+    store files with it.
+
+Arguments:
+
+    PackFile - The pack file, for its options.
+
+    Extension - The extension.
+
+    Analysis - The analysis of the extension.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    LogInfo("%s: %llu file(s)", Extension, Analysis->Count);
+    LogInfo("\tSize: %s", CmnFormatSize(Analysis->Size));
+    LogInfo("\tCompressed size: %s (%.1f%%)", CmnFormatSize(Analysis->CompressedSize),
+            Analysis->CompressedSize * 100.0 / PURPL_MAX(Analysis->Size, 1));
+    for (UINT8 i = 0; i < PackMethodCount; i++)
+    {
+        if (Analysis->MethodCounts[i])
         {
-            AddFile(PackFile, Path, Path);
+            LogInfo("\t%s: %llu file(s)", PackGetMethodName(i), Analysis->MethodCounts[i]);
         }
-        CmnFree(Path);
     }
+    LogInfo("\tRead and decompressed at %.1f MB/s", Analysis->Size / 1e6 / (PURPL_MAX(Analysis->ReadTime, 1) / 1e9));
 
-    PackSave(PackFile, NULL);
+    if (!Analysis->SampleSize)
+    {
+        return;
+    }
 
-    return 0;
+    UINT8 Best = 0;
+    for (UINT8 i = 0; i < PURPL_ARRAYSIZE(AnalyzeLevels); i++)
+    {
+        LogInfo("\tLevel %d: %.1f%% at %.1f MB/s", AnalyzeLevels[i],
+                Analysis->LevelSizes[i] * 100.0 / Analysis->SampleSize,
+                Analysis->SampleSize / 1e6 / (PURPL_MAX(Analysis->LevelTimes[i], 1) / 1e9));
+        if (Analysis->LevelSizes[i] < Analysis->LevelSizes[Best])
+        {
+            Best = i;
+        }
+    }
+
+    // Same rule PackAddFile uses for each file, but the samples are compressed without the dictionary
+    BOOLEAN HasDictionary = Analysis->MethodCounts[PackMethodZstdDictionary] > 0;
+    if (PackFile->Options.StoreThreshold && !HasDictionary &&
+        Analysis->LevelSizes[Best] * 100 >= Analysis->SampleSize * PackFile->Options.StoreThreshold)
+    {
+        LogInfo("\tSuggestion: store uncompressed, it doesn't get below %u%% at any level",
+                PackFile->Options.StoreThreshold);
+        return;
+    }
+
+    // Higher levels are only worth it if they actually make a difference
+    UINT8 Suggested = Best;
+    for (UINT8 i = 0; i < Best; i++)
+    {
+        if (Analysis->LevelSizes[i] * 100 <=
+            Analysis->LevelSizes[Best] * (100 + PACKTOOL_ANALYZE_LEVEL_TOLERANCE))
+        {
+            Suggested = i;
+            break;
+        }
+    }
+
+    if (HasDictionary ||
+        (Analysis->SmallCount >= PACKTOOL_MIN_DICTIONARY_SAMPLES && Analysis->SmallCount * 2 >= Analysis->Count))
+    {
+        LogInfo("\tSuggestion: zstd level %d with a dictionary%s", AnalyzeLevels[Suggested],
+                HasDictionary ? "" : " (-dictionaries extension), most of these files are small");
+    }
+    else
+    {
+        LogInfo("\tSuggestion: zstd level %d", AnalyzeLevels[Suggested]);
+    }
 }
 
-static INT Extract(_In_ PPACKFILE PackFile, _In_ PCHAR *Arguments, _In_ UINT32 ArgumentCount)
+static INT CompareAnalyses(_In_ const VOID *First, _In_ const VOID *Second)
 {
-    return 0;
+    // Biggest first
+    UINT64 FirstSize = ((PPACKTOOL_ANALYSIS_MAP)First)->value.Size;
+    UINT64 SecondSize = ((PPACKTOOL_ANALYSIS_MAP)Second)->value.Size;
+    return FirstSize > SecondSize ? -1 : FirstSize < SecondSize;
 }
 
-static INT List(_In_ PPACKFILE PackFile, _In_ PCHAR *Arguments, _In_ UINT32 ArgumentCount)
+static INT Analyze(_In_ PPACKFILE PackFile, _In_ PCHAR *Arguments, _In_ UINT32 ArgumentCount)
 {
+    for (UINT32 i = 0; i < ArgumentCount; i++)
+    {
+        ParseOption(PackFile, Arguments, ArgumentCount, &i);
+    }
+
+    PPACKTOOL_FILE Files = NULL;
     for (UINT64 i = 0; i < stbds_shlenu(PackFile->Entries); i++)
     {
-        PPACKFILE_ENTRY Entry = &PackFile->Entries[i].value;
-        LogInfo("%s", PackFile->Entries[i].key);
-        LogInfo("\tArchive: %hu", Entry->ArchiveIndex);
-        LogInfo("\tOffset: %s", CmnFormatSize(Entry->Offset));
-        LogInfo("\tSize: %s", CmnFormatSize(Entry->Size));
-        LogInfo("\tCompressed size: %s", CmnFormatSize(Entry->CompressedSize));
-        LogInfo("\tHash: 0x%llX%llX", Entry->Hash.low64, Entry->Hash.high64);
-        LogInfo("\tCompressed hash: 0x%llX%llX", Entry->CompressedHash.low64, Entry->CompressedHash.high64);
+        AddFileInOrder(PackFile, &Files, i);
+    }
+    SortFiles(Files);
+
+    // Only the decompression is timed, not the hashing
+    PackFile->VerifyMode = PackVerifyNone;
+
+    LogInfo("Analyzing %llu file(s)", stbds_arrlenu(Files));
+    PPACKTOOL_ANALYSIS_MAP Analyses = NULL;
+    UINT64 LastBlockPosition = UINT64_MAX;
+    for (UINT64 i = 0; i < stbds_arrlenu(Files); i++)
+    {
+        PCSTR Path = PackFile->Entries[Files[i].Index].key;
+        PPACKFILE_ENTRY Entry = &PackFile->Entries[Files[i].Index].value;
+
+        PCSTR Extension = PackGetDictionaryGroup(Path, FALSE);
+        if (!Extension)
+        {
+            Extension = "(none)";
+        }
+
+        PPACKTOOL_ANALYSIS_MAP Pair = stbds_shgetp_null(Analyses, Extension);
+        if (!Pair)
+        {
+            PACKTOOL_ANALYSIS Empty = {0};
+            stbds_shput(Analyses, CmnDuplicateString(Extension, 0), Empty);
+            Pair = stbds_shgetp_null(Analyses, Extension);
+        }
+
+        PPACKTOOL_ANALYSIS Analysis = &Pair->value;
+        Analysis->Count++;
+        Analysis->SmallCount += Entry->Size <= PACKFILE_DICTIONARY_MAX_ENTRY_SIZE;
+        Analysis->Size += Entry->Size;
+        // Every file in a solid block has the size of the whole block, so it only counts for the first one, which is
+        // usually the same type as the rest
+        if (Entry->Method != PackMethodZstdSolid || Files[i].Position != LastBlockPosition)
+        {
+            Analysis->CompressedSize += Entry->CompressedSize;
+        }
+        if (Entry->Method == PackMethodZstdSolid)
+        {
+            LastBlockPosition = Files[i].Position;
+        }
+        Analysis->MethodCounts[Entry->Method]++;
+        AnalyzeFile(PackFile, Path, Analysis);
+    }
+    stbds_arrfree(Files);
+
+    // The map can't be looked up in after this, only gone through
+    if (Analyses)
+    {
+        qsort(Analyses, stbds_shlenu(Analyses), sizeof(*Analyses), CompareAnalyses);
     }
+    for (UINT64 i = 0; i < stbds_shlenu(Analyses); i++)
+    {
+        ReportAnalysis(PackFile, Analyses[i].key, &Analyses[i].value);
+        CmnFree(Analyses[i].key);
+    }
+    stbds_shfree(Analyses);
 
     return 0;
 }
@@ -161,6 +1914,16 @@ typedef enum PACKTOOL_MODE
     PackToolModeCreate,
     PackToolModeExtract,
     PackToolModeList,
+    PackToolModeAdd,
+    PackToolModeReplace,
+    PackToolModeRemove,
+    PackToolModeCompact,
+    PackToolModeReorder,
+    PackToolModeVerify,
+    PackToolModeBench,
+    PackToolModeAnalyze,
+    PackToolModeDiff,
+    PackToolModePatch,
     PackToolModeCount
 } PACKTOOL_MODE, *PPACKTOOL_MODE;
 
@@ -174,6 +1937,16 @@ PFNPACKTOOL_OPERATION Operations[PackToolModeCount] = {
     Create,
     Extract,
     List,
+    Add,
+    Replace,
+    Remove,
+    Compact,
+    Reorder,
+    Verify,
+    Bench,
+    Analyze,
+    Diff,
+    Patch,
 };
 
 INT main(INT argc, PCHAR *argv)
@@ -201,7 +1974,7 @@ Return Value:
     INT Result;
 
     LogInfo("Purpl Pack Tool v" PURPL_VERSION_STRING
-            " (supports pack format v" PURPL_STRINGIZE_EXPAND(PACK_FORMAT_VERSION) ") on %s",
+            " (supports pack format v" PURPL_STRINGIZE_EXPAND(PACKFILE_FORMAT_VERSION) ") on %s",
             PlatGetDescription());
 
     CmnInitialize(NULL, 0);
@@ -222,6 +1995,46 @@ Return Value:
     {
         Mode = PackToolModeList;
     }
+    else if (strcmp(argv[1], "add") == 0)
+    {
+        Mode = PackToolModeAdd;
+    }
+    else if (strcmp(argv[1], "replace") == 0)
+    {
+        Mode = PackToolModeReplace;
+    }
+    else if (strcmp(argv[1], "remove") == 0)
+    {
+        Mode = PackToolModeRemove;
+    }
+    else if (strcmp(argv[1], "compact") == 0)
+    {
+        Mode = PackToolModeCompact;
+    }
+    else if (strcmp(argv[1], "reorder") == 0)
+    {
+        Mode = PackToolModeReorder;
+    }
+    else if (strcmp(argv[1], "verify") == 0)
+    {
+        Mode = PackToolModeVerify;
+    }
+    else if (strcmp(argv[1], "bench") == 0)
+    {
+        Mode = PackToolModeBench;
+    }
+    else if (strcmp(argv[1], "analyze") == 0)
+    {
+        Mode = PackToolModeAnalyze;
+    }
+    else if (strcmp(argv[1], "diff") == 0)
+    {
+        Mode = PackToolModeDiff;
+    }
+    else if (strcmp(argv[1], "patch") == 0)
+    {
+        Mode = PackToolModePatch;
+    }
     else
     {
         Mode = PackToolModeNone;
@@ -250,6 +2063,12 @@ Return Value:
     else if (Mode != PackToolModeNone)
     {
         PackFile = PackLoad(argv[2]);
+        if (!PackFile)
+        {
+            LogError("Failed to load pack file %s", argv[2]);
+            CmnShutdown();
+            return EINVAL;
+        }
     }
 
     Result = Operations[Mode](PackFile, argv + 3, argc - 3);
@@ -8,7 +8,7 @@ target_end()
 target("packtool")
     set_kind("binary")
     add_files("packtool.c")
-    add_deps("common", "platform")
+    add_deps("common", "platform", "regex")
     if is_plat("windows") then
         add_packages("dirent")
     end
@@ -19,3 +19,15 @@ target("texturetool")
     add_files("texturetool.c")
     add_deps("common", "platform", "util")
 target_end()
+
+target("logtool")
+    set_kind("binary")
+    add_files("logtool.c")
+    add_deps("common", "platform")
+target_end()
+
+target("compressbench")
+    set_kind("binary")
+    add_files("compressbench.c")
+    add_deps("common", "platform")
+target_end()
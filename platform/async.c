@@ -115,3 +115,58 @@ VOID AsSignalCondition(_In_ PAS_CONDITION_VARIABLE Condition)
 VOID AsBroadcastCondition(_In_ PAS_CONDITION_VARIABLE Condition)
 {
 }
+
+typedef struct AS_PARALLEL_WORK
+{
+    UINT64 NextIndex;
+    UINT64 Count;
+    PFN_PARALLEL_ROUTINE Routine;
+    PVOID UserData;
+} AS_PARALLEL_WORK, *PAS_PARALLEL_WORK;
+
+static UINT_PTR ParallelThread(_In_opt_ PVOID UserData)
+{
+    PAS_PARALLEL_WORK Work = UserData;
+
+    for (UINT64 i = AsAtomicAdd64(&Work->NextIndex, 1); i < Work->Count; i = AsAtomicAdd64(&Work->NextIndex, 1))
+    {
+        Work->Routine(i, Work->UserData);
+    }
+
+    return 0;
+}
+
+VOID AsRunParallel(_In_opt_ PCSTR Name, _In_ UINT64 Count, _In_ UINT32 ThreadCount, _In_ PFN_PARALLEL_ROUTINE Routine,
+                   _In_opt_ PVOID UserData)
+{
+    AS_PARALLEL_WORK Work = {0};
+    Work.Count = Count;
+    Work.Routine = Routine;
+    Work.UserData = UserData;
+
+    ThreadCount = (UINT32)PURPL_MIN(ThreadCount, Count);
+    PAS_THREAD *Threads = ThreadCount > 1 ? CmnAllocType(ThreadCount, PAS_THREAD) : NULL;
+    UINT32 StartedCount = 0;
+    for (UINT32 i = 0; Threads && i < ThreadCount; i++)
+    {
+        Threads[i] = AsCreateThread(Name ? Name : "parallel", PURPL_PARALLEL_THREAD_STACK_SIZE, ParallelThread, &Work);
+        if (!Threads[i])
+        {
+            break;
+        }
+        AsResumeThread(Threads[i]);
+        StartedCount++;
+    }
+
+    // If no threads could be started, or there's only supposed to be one, this does all the work
+    if (!StartedCount)
+    {
+        ParallelThread(&Work);
+    }
+
+    for (UINT32 i = 0; i < StartedCount; i++)
+    {
+        AsJoinThread(Threads[i]);
+    }
+    CmnFree(Threads);
+}
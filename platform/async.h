@@ -62,6 +62,76 @@ extern VOID AsSuspendThread(_In_ PAS_THREAD Thread);
 /// @param[in] Thread The thread to resume
 extern VOID AsResumeThread(_In_ PAS_THREAD Thread);
 
+/// @brief Thread priorities
+typedef enum AS_THREAD_PRIORITY
+{
+    AsThreadPriorityIdle, // Only runs when nothing else wants the CPU
+    AsThreadPriorityNormal
+} AS_THREAD_PRIORITY, *PAS_THREAD_PRIORITY;
+
+/// @brief Set the priority of the calling thread
+///
+/// @param[in] Priority The priority
+extern VOID AsSetCurrentThreadPriority(_In_ AS_THREAD_PRIORITY Priority);
+
+#ifdef _MSC_VER
+/// @brief Atomically read a byte
+#define AsAtomicLoad8(Target) ((UINT8)_InterlockedOr8((volatile CHAR *)(Target), 0))
+
+/// @brief Atomically OR a value into a byte
+#define AsAtomicOr8(Target, Value) ((VOID)_InterlockedOr8((volatile CHAR *)(Target), (CHAR)(Value)))
+
+/// @brief Atomically add to a 64-bit integer, evaluates to the old value
+#define AsAtomicAdd64(Target, Value)                                                                                   \
+    ((UINT64)_InterlockedExchangeAdd64((volatile LONG64 *)(Target), (LONG64)(Value)))
+
+/// @brief Atomically read a 64-bit integer
+#define AsAtomicLoad64(Target) ((UINT64)_InterlockedOr64((volatile LONG64 *)(Target), 0))
+
+/// @brief Atomically write a 64-bit integer
+#define AsAtomicStore64(Target, Value) ((VOID)_InterlockedExchange64((volatile LONG64 *)(Target), (LONG64)(Value)))
+
+/// @brief Atomically replace a 64-bit integer if it's equal to Expected, evaluates to the old value
+#define AsAtomicCompareExchange64(Target, Expected, Desired)                                                           \
+    ((UINT64)_InterlockedCompareExchange64((volatile LONG64 *)(Target), (LONG64)(Desired), (LONG64)(Expected)))
+#else
+/// @brief Atomically read a byte
+#define AsAtomicLoad8(Target) ((UINT8)__atomic_load_n((Target), __ATOMIC_ACQUIRE))
+
+/// @brief Atomically OR a value into a byte
+#define AsAtomicOr8(Target, Value) ((VOID)__atomic_fetch_or((Target), (Value), __ATOMIC_ACQ_REL))
+
+/// @brief Atomically add to a 64-bit integer, evaluates to the old value
+#define AsAtomicAdd64(Target, Value) ((UINT64)__atomic_fetch_add((Target), (Value), __ATOMIC_ACQ_REL))
+
+/// @brief Atomically read a 64-bit integer
+#define AsAtomicLoad64(Target) ((UINT64)__atomic_load_n((Target), __ATOMIC_ACQUIRE))
+
+/// @brief Atomically write a 64-bit integer
+#define AsAtomicStore64(Target, Value) __atomic_store_n((Target), (Value), __ATOMIC_RELEASE)
+
+/// @brief Atomically replace a 64-bit integer if it's equal to Expected, evaluates to the old value
+#define AsAtomicCompareExchange64(Target, Expected, Desired)                                                           \
+    ((UINT64)__sync_val_compare_and_swap((Target), (Expected), (Desired)))
+#endif
+
+/// @brief A function called for each index by AsRunParallel
+typedef VOID (*PFN_PARALLEL_ROUTINE)(_In_ UINT64 Index, _In_opt_ PVOID UserData);
+
+/// @brief Stack size of the threads used by AsRunParallel
+#define PURPL_PARALLEL_THREAD_STACK_SIZE 0x100000
+
+/// @brief Call a function for every index from 0 to Count - 1, spread across threads, and wait for all of them. Each
+/// thread takes the next index when it finishes one, so the calls don't have to take the same amount of time.
+///
+/// @param[in] Name The name of the threads
+/// @param[in] Count The number of indices
+/// @param[in] ThreadCount The number of threads to use, 0 or 1 to run everything on the calling thread
+/// @param[in] Routine The function to call
+/// @param[in] UserData Passed to the function
+extern VOID AsRunParallel(_In_opt_ PCSTR Name, _In_ UINT64 Count, _In_ UINT32 ThreadCount,
+                          _In_ PFN_PARALLEL_ROUTINE Routine, _In_opt_ PVOID UserData);
+
 /// @brief A mutex
 typedef PVOID PAS_MUTEX;
 
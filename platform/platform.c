@@ -1,3 +1,5 @@
+#define LOG_FILE_CHANNEL LogChannelPlatform
+
 #include "common/common.h"
 
 #include "platform.h"
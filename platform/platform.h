@@ -63,6 +63,12 @@ extern PCSTR PlatGetUserDataDirectory(VOID);
 /// @return A number of milliseconds.
 extern UINT64 PlatGetMilliseconds(VOID);
 
+/// @brief Gets the number of nanoseconds passed since an arbitrary point in time, from a monotonic clock with the best
+/// resolution the platform has. Meant for measuring short durations.
+///
+/// @return A number of nanoseconds.
+extern UINT64 PlatGetNanoseconds(VOID);
+
 /// @brief Sleep
 ///
 /// @param[in] Duration The amount of time to sleep for, in milliseconds
@@ -96,5 +102,86 @@ extern PCHAR PlatFixPath(_In_z_ PCSTR Path);
 /// @return The size of the file (returns zero if it doesn't exist)
 extern UINT64 PlatGetFileSize(_In_z_ PCSTR Path);
 
+/// @brief A file opened for positional reads
+typedef struct PLAT_FILE *PPLAT_FILE;
+
+/// @brief Open a file for reading. Reads don't share a file position, so any number of threads can read from the same
+/// file at once.
+///
+/// @param[in] Path The path to the file
+///
+/// @return The file, or NULL if it couldn't be opened
+extern PPLAT_FILE PlatOpenFile(_In_z_ PCSTR Path);
+
+/// @brief Open a file for reading without going through the OS's file cache (O_DIRECT, FILE_FLAG_NO_BUFFERING), so
+/// big reads that only happen once don't push everything else out of it. Reads can have any offset, size, and buffer,
+/// unaligned ones go through an aligned buffer. Platforms that can't do this open the file normally.
+///
+/// @param[in] Path The path to the file
+///
+/// @return The file, or NULL if it couldn't be opened
+extern PPLAT_FILE PlatOpenFileDirect(_In_z_ PCSTR Path);
+
+/// @brief Read from a file at an offset
+///
+/// @param[in] File The file to read from
+/// @param[in] Offset The offset to read from
+/// @param[out] Buffer The buffer to read into
+/// @param[in] Size The number of bytes to read
+///
+/// @return Whether all of the bytes could be read
+extern BOOLEAN PlatReadFileAt(_In_ PPLAT_FILE File, _In_ UINT64 Offset, _Out_writes_bytes_(Size) PVOID Buffer,
+                              _In_ UINT64 Size);
+
+/// @brief Close a file
+///
+/// @param[in] File The file to close
+extern VOID PlatCloseFile(_In_opt_ PPLAT_FILE File);
+
+/// @brief Fills part of a lazy mapping the first time it's touched, called from the mapping's own thread
+///
+/// @param[in] UserData The data given to PlatCreateLazyMapping
+/// @param[in] Offset The offset of the chunk in the mapping
+/// @param[out] Buffer The buffer to fill
+/// @param[in] Size The size of the chunk, only the last one can be smaller than the chunk size
+///
+/// @return Whether the chunk could be filled, the process is stopped if it couldn't be, like an I/O error in a mapped
+/// file
+typedef BOOLEAN (*PFN_PLAT_LAZY_FILL)(_In_opt_ PVOID UserData, _In_ UINT64 Offset, _Out_writes_bytes_(Size) PVOID Buffer,
+                                      _In_ UINT64 Size);
+
+/// @brief Read-only memory that's filled in a chunk at a time, the first time anything in each chunk is touched
+typedef struct PLAT_LAZY_MAPPING *PPLAT_LAZY_MAPPING;
+
+/// @brief Reserve memory that's filled on demand. This is experimental and only implemented on Linux with userfaultfd,
+/// every mapping has a thread that handles its page faults, so it's meant for a few huge things. If the process can't
+/// handle page faults from the kernel, system calls that are given memory that hasn't been touched yet fail.
+///
+/// @param[in] Size The size of the memory
+/// @param[in] ChunkSize How much is filled at once, a multiple of the page size, or 0 to fill all of it at once
+/// @param[in] Fill Called to fill each chunk
+/// @param[in] UserData Passed to Fill
+///
+/// @return The mapping, or NULL if the platform doesn't support this or it couldn't be created
+extern PPLAT_LAZY_MAPPING PlatCreateLazyMapping(_In_ UINT64 Size, _In_ UINT64 ChunkSize, _In_ PFN_PLAT_LAZY_FILL Fill,
+                                                _In_opt_ PVOID UserData);
+
+/// @brief Get the address of a lazy mapping's memory
+///
+/// @param[in] Mapping The mapping
+///
+/// @return The address of the memory
+extern PVOID PlatGetLazyMappingAddress(_In_ PPLAT_LAZY_MAPPING Mapping);
+
+/// @brief Stop a lazy mapping's thread and free its memory, nothing can be touching it
+///
+/// @param[in] Mapping The mapping
+extern VOID PlatDestroyLazyMapping(_In_opt_ PPLAT_LAZY_MAPPING Mapping);
+
 /// @brief Get a string representing the current CPU
 extern PCSTR PlatGetCpuName(VOID);
+
+/// @brief Get the number of logical processors available to the process
+///
+/// @return The number of logical processors, at least 1
+extern UINT32 PlatGetProcessorCount(VOID);
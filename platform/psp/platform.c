@@ -12,10 +12,15 @@ Abstract:
 
 --*/
 
+#define LOG_FILE_CHANNEL LogChannelPlatform
+
+#include "common/alloc.h"
 #include "common/common.h"
 
 #include "platform/platform.h"
 
+#include <fcntl.h>
+
 static INT32 NxLinkSocket;
 
 VOID PlatInitialize(VOID)
@@ -177,6 +182,15 @@ UINT64 PlatGetMilliseconds(VOID)
     return Time.tv_sec * 1000 + Time.tv_nsec / 1000000;
 }
 
+UINT64 PlatGetNanoseconds(VOID)
+{
+    struct timespec Time = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &Time);
+
+    return Time.tv_sec * 1000000000ull + Time.tv_nsec;
+}
+
 BOOLEAN PlatCreateDirectory(_In_ PCSTR Path)
 {
     // https://stackoverflow.com/questions/2336242/recursive-mkdir-system-call-on-unix
@@ -218,3 +232,94 @@ UINT64 PlatGetFileSize(_In_ PCSTR Path)
     stat64(Path, &StatBuffer);
     return StatBuffer.st_size;
 }
+
+UINT32 PlatGetProcessorCount(VOID)
+{
+    return 1;
+}
+
+struct PLAT_FILE
+{
+    INT Descriptor;
+};
+
+PPLAT_FILE PlatOpenFile(_In_z_ PCSTR Path)
+{
+    INT Descriptor = open(Path, O_RDONLY);
+    if (Descriptor < 0)
+    {
+        LogError("Failed to open file %s: %s", Path, strerror(errno));
+        return NULL;
+    }
+
+    PPLAT_FILE File = CmnAllocType(1, struct PLAT_FILE);
+    if (!File)
+    {
+        LogError("Failed to allocate file: %s", strerror(errno));
+        close(Descriptor);
+        return NULL;
+    }
+
+    File->Descriptor = Descriptor;
+    return File;
+}
+
+PPLAT_FILE PlatOpenFileDirect(_In_z_ PCSTR Path)
+{
+    // There's no file cache to skip
+    return PlatOpenFile(Path);
+}
+
+BOOLEAN PlatReadFileAt(_In_ PPLAT_FILE File, _In_ UINT64 Offset, _Out_writes_bytes_(Size) PVOID Buffer,
+                       _In_ UINT64 Size)
+{
+    UINT64 TotalRead = 0;
+    while (TotalRead < Size)
+    {
+        INT64 Read = pread(File->Descriptor, (PBYTE)Buffer + TotalRead, Size - TotalRead, Offset + TotalRead);
+        if (Read < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        else if (Read <= 0)
+        {
+            LogError("Failed to read %llu bytes at offset %llu: %s", Size - TotalRead, Offset + TotalRead,
+                     Read < 0 ? strerror(errno) : "unexpected end of file");
+            return FALSE;
+        }
+        TotalRead += Read;
+    }
+
+    return TRUE;
+}
+
+VOID PlatCloseFile(_In_opt_ PPLAT_FILE File)
+{
+    if (File)
+    {
+        close(File->Descriptor);
+        CmnFree(File);
+    }
+}
+
+PPLAT_LAZY_MAPPING PlatCreateLazyMapping(_In_ UINT64 Size, _In_ UINT64 ChunkSize, _In_ PFN_PLAT_LAZY_FILL Fill,
+                                         _In_opt_ PVOID UserData)
+{
+    // Not implemented, callers read the whole thing instead
+    UNREFERENCED_PARAMETER(Size);
+    UNREFERENCED_PARAMETER(ChunkSize);
+    UNREFERENCED_PARAMETER(Fill);
+    UNREFERENCED_PARAMETER(UserData);
+    return NULL;
+}
+
+PVOID PlatGetLazyMappingAddress(_In_ PPLAT_LAZY_MAPPING Mapping)
+{
+    UNREFERENCED_PARAMETER(Mapping);
+    return NULL;
+}
+
+VOID PlatDestroyLazyMapping(_In_opt_ PPLAT_LAZY_MAPPING Mapping)
+{
+    UNREFERENCED_PARAMETER(Mapping);
+}
@@ -12,6 +12,8 @@ Abstract:
 
 --*/
 
+#define LOG_FILE_CHANNEL LogChannelVideo
+
 #include "common/common.h"
 
 #undef eglGetProcAddress
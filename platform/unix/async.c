@@ -12,8 +12,11 @@ Abstract:
 
 --*/
 
+#define LOG_FILE_CHANNEL LogChannelAsync
+
 #include "common/alloc.h"
 #include "common/common.h"
+#include "common/compression.h"
 
 #include "platform/async.h"
 
@@ -24,6 +27,7 @@ static PVOID ThreadEntry(_In_ PVOID Thread)
     AsCurrentThread = Thread;
     AsCurrentThread->ReturnValue =
         AsCurrentThread->ThreadStart(AsCurrentThread->UserData);
+    CmnFreeCompressionContexts();
     return (PVOID)(UINT64)AsCurrentThread->ReturnValue;
 }
 
@@ -109,6 +113,27 @@ VOID AsDetachThread(_In_ PAS_THREAD Thread)
     pthread_detach((pthread_t)Thread->Handle);
 }
 
+VOID AsResumeThread(_In_ PAS_THREAD Thread)
+{
+    // pthreads start running as soon as they're created
+    UNREFERENCED_PARAMETER(Thread);
+}
+
+VOID AsSetCurrentThreadPriority(_In_ AS_THREAD_PRIORITY Priority)
+{
+#if defined PURPL_LINUX && defined SCHED_IDLE
+    struct sched_param Parameters = {0};
+    INT Error = pthread_setschedparam(pthread_self(), Priority == AsThreadPriorityIdle ? SCHED_IDLE : SCHED_OTHER,
+                                      &Parameters);
+    if (Error != 0)
+    {
+        LogWarning("Failed to set thread priority: %s", strerror(Error));
+    }
+#else
+    UNREFERENCED_PARAMETER(Priority);
+#endif
+}
+
 PAS_MUTEX AsCreateMutex(VOID)
 {
     pthread_mutex_t *Mutex;
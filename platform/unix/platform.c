@@ -12,10 +12,25 @@ Abstract:
 
 --*/
 
+#define LOG_FILE_CHANNEL LogChannelPlatform
+
+#include "common/alloc.h"
 #include "common/common.h"
 
+#include "platform/async.h"
 #include "platform/platform.h"
 
+#include <fcntl.h>
+
+#ifdef PURPL_LINUX
+#include <linux/userfaultfd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
 extern BOOLEAN WindowClosed;
 static VOID SignalHandler(_In_ INT Signal, _In_ siginfo_t *SignalInformation, _In_opt_ PVOID UserData)
 {
@@ -352,6 +367,15 @@ UINT64 PlatGetMilliseconds(VOID)
     return Time.tv_sec * 1000 + (Time.tv_nsec + 500000) / 1000000;
 }
 
+UINT64 PlatGetNanoseconds(VOID)
+{
+    struct timespec Time = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &Time);
+
+    return Time.tv_sec * 1000000000ull + Time.tv_nsec;
+}
+
 VOID PlatSleep(_In_ UINT64 Duration)
 {
     usleep((UINT32)(Duration * 1000));
@@ -398,3 +422,436 @@ UINT64 PlatGetFileSize(_In_ PCSTR Path)
     stat64(Path, &StatBuffer);
     return StatBuffer.st_size;
 }
+
+UINT32 PlatGetProcessorCount(VOID)
+{
+    LONG Count = sysconf(_SC_NPROCESSORS_ONLN);
+    return Count > 0 ? (UINT32)Count : 1;
+}
+
+struct PLAT_FILE
+{
+    INT Descriptor;
+    BOOLEAN Direct; // Reads have to be aligned to PLAT_DIRECT_ALIGNMENT
+};
+
+// Offsets, sizes, and buffers of direct reads have to be aligned to the logical block size, which is at most this
+#define PLAT_DIRECT_ALIGNMENT 4096
+
+// Unaligned direct reads go through a buffer of at most this size
+#define PLAT_DIRECT_BUFFER_SIZE 4194304
+
+static PPLAT_FILE OpenFile(_In_z_ PCSTR Path, _In_ INT Flags)
+{
+    INT Descriptor = open(Path, O_RDONLY | Flags);
+    if (Descriptor < 0)
+    {
+        LogError("Failed to open file %s: %s", Path, strerror(errno));
+        return NULL;
+    }
+
+    PPLAT_FILE File = CmnAllocType(1, struct PLAT_FILE);
+    if (!File)
+    {
+        LogError("Failed to allocate file: %s", strerror(errno));
+        close(Descriptor);
+        return NULL;
+    }
+
+    File->Descriptor = Descriptor;
+    return File;
+}
+
+PPLAT_FILE PlatOpenFile(_In_z_ PCSTR Path)
+{
+    return OpenFile(Path, 0);
+}
+
+PPLAT_FILE PlatOpenFileDirect(_In_z_ PCSTR Path)
+{
+#ifdef O_DIRECT
+    PPLAT_FILE File = OpenFile(Path, O_DIRECT);
+    if (File)
+    {
+        File->Direct = TRUE;
+        return File;
+    }
+
+    // Some filesystems (like tmpfs) don't support it
+    LogDebug("Opening %s without O_DIRECT", Path);
+    return OpenFile(Path, 0);
+#else
+    PPLAT_FILE File = OpenFile(Path, 0);
+#ifdef F_NOCACHE
+    // Doesn't need aligned reads
+    if (File)
+    {
+        fcntl(File->Descriptor, F_NOCACHE, 1);
+    }
+#endif
+    return File;
+#endif
+}
+
+static INT64 ReadAt(_In_ PPLAT_FILE File, _In_ UINT64 Offset, _Out_writes_bytes_(Size) PVOID Buffer, _In_ UINT64 Size)
+{
+    INT64 Read;
+    do
+    {
+        Read = pread(File->Descriptor, Buffer, Size, Offset);
+    } while (Read < 0 && errno == EINTR);
+
+    return Read;
+}
+
+static BOOLEAN ReadDirect(_In_ PPLAT_FILE File, _In_ UINT64 Offset, _Out_writes_bytes_(Size) PVOID Buffer,
+                          _In_ UINT64 Size)
+{
+    UINT64 TotalRead = 0;
+    UINT64 Start = Offset & ~(UINT64)(PLAT_DIRECT_ALIGNMENT - 1);
+    UINT64 BufferSize = PURPL_MIN((Offset + Size - Start + PLAT_DIRECT_ALIGNMENT - 1) &
+                                      ~(UINT64)(PLAT_DIRECT_ALIGNMENT - 1),
+                                  PLAT_DIRECT_BUFFER_SIZE);
+    PBYTE AlignedBuffer = CmnAlignedAlloc(PLAT_DIRECT_ALIGNMENT, BufferSize);
+    if (!AlignedBuffer)
+    {
+        LogError("Failed to allocate %llu byte direct read buffer: %s", BufferSize, strerror(errno));
+        return FALSE;
+    }
+
+    while (TotalRead < Size)
+    {
+        UINT64 Position = Offset + TotalRead;
+        UINT64 Skip = Position & (PLAT_DIRECT_ALIGNMENT - 1);
+        UINT64 ReadSize =
+            PURPL_MIN((Skip + Size - TotalRead + PLAT_DIRECT_ALIGNMENT - 1) & ~(UINT64)(PLAT_DIRECT_ALIGNMENT - 1),
+                      BufferSize);
+
+        // Reads that go past the end of the file come up short, which is fine as long as they cover what's needed
+        INT64 Read = ReadAt(File, Position - Skip, AlignedBuffer, ReadSize);
+        if (Read <= (INT64)Skip)
+        {
+            LogError("Failed to read %llu bytes at offset %llu: %s", Size - TotalRead, Position,
+                     Read < 0 ? strerror(errno) : "unexpected end of file");
+            CmnAlignedFree(AlignedBuffer);
+            return FALSE;
+        }
+
+        UINT64 Copied = PURPL_MIN(Read - Skip, Size - TotalRead);
+        memcpy((PBYTE)Buffer + TotalRead, AlignedBuffer + Skip, Copied);
+        TotalRead += Copied;
+    }
+
+    CmnAlignedFree(AlignedBuffer);
+    return TRUE;
+}
+
+BOOLEAN PlatReadFileAt(_In_ PPLAT_FILE File, _In_ UINT64 Offset, _Out_writes_bytes_(Size) PVOID Buffer,
+                       _In_ UINT64 Size)
+{
+    // Direct reads that aren't aligned can't go straight into the buffer
+    if (File->Direct && ((Offset | Size | (UINT_PTR)Buffer) & (PLAT_DIRECT_ALIGNMENT - 1)))
+    {
+        return ReadDirect(File, Offset, Buffer, Size);
+    }
+
+    UINT64 TotalRead = 0;
+    while (TotalRead < Size)
+    {
+        INT64 Read = ReadAt(File, Offset + TotalRead, (PBYTE)Buffer + TotalRead, Size - TotalRead);
+        if (Read <= 0)
+        {
+            LogError("Failed to read %llu bytes at offset %llu: %s", Size - TotalRead, Offset + TotalRead,
+                     Read < 0 ? strerror(errno) : "unexpected end of file");
+            return FALSE;
+        }
+        TotalRead += Read;
+    }
+
+    return TRUE;
+}
+
+VOID PlatCloseFile(_In_opt_ PPLAT_FILE File)
+{
+    if (File)
+    {
+        close(File->Descriptor);
+        CmnFree(File);
+    }
+}
+
+#ifdef PURPL_LINUX
+struct PLAT_LAZY_MAPPING
+{
+    PBYTE Address;
+    UINT64 Size;
+    UINT64 MappedSize; // Size rounded up to the page size
+    UINT64 ChunkSize;
+    PFN_PLAT_LAZY_FILL Fill;
+    PVOID UserData;
+    INT FaultDescriptor; // userfaultfd
+    INT StopDescriptor;  // eventfd written by PlatDestroyLazyMapping
+    PAS_THREAD Thread;
+};
+
+// Stack size of the threads that handle page faults in lazy mappings
+#define PLAT_LAZY_MAPPING_STACK_SIZE 0x100000
+
+static BOOLEAN FillChunk(_In_ PPLAT_LAZY_MAPPING Mapping, _In_ UINT64 Offset, _Inout_ PBYTE *Buffer)
+{
+    UINT64 PageSize = sysconf(_SC_PAGESIZE);
+    UINT64 Start = Offset - Offset % Mapping->ChunkSize;
+    UINT64 Size = PURPL_MIN(Mapping->ChunkSize, Mapping->Size - Start);
+    UINT64 CopySize = (Size + PageSize - 1) / PageSize * PageSize;
+
+    // The buffer is only needed while there are chunks left, which is never for mappings that are filled at once
+    if (!*Buffer)
+    {
+        *Buffer = mmap(NULL, Mapping->ChunkSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (*Buffer == MAP_FAILED)
+        {
+            *Buffer = NULL;
+            LogError("Failed to allocate %llu byte lazy mapping buffer: %s", Mapping->ChunkSize, strerror(errno));
+            return FALSE;
+        }
+    }
+
+    if (!Mapping->Fill(Mapping->UserData, Start, *Buffer, Size))
+    {
+        return FALSE;
+    }
+    memset(*Buffer + Size, 0, CopySize - Size);
+
+    struct uffdio_copy Copy = {0};
+    Copy.dst = (UINT64)(Mapping->Address + Start);
+    Copy.src = (UINT64)*Buffer;
+    Copy.len = CopySize;
+    if (ioctl(Mapping->FaultDescriptor, UFFDIO_COPY, &Copy) < 0)
+    {
+        LogError("Failed to fill %llu bytes at offset %llu of lazy mapping: %s", CopySize, Start, strerror(errno));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static UINT_PTR LazyMappingThread(_In_opt_ PVOID UserData)
+{
+    PPLAT_LAZY_MAPPING Mapping = UserData;
+    UINT64 ChunkCount = (Mapping->Size + Mapping->ChunkSize - 1) / Mapping->ChunkSize;
+    UINT64 FilledCount = 0;
+    PUINT8 Filled = CmnAllocType(ChunkCount, UINT8);
+    PBYTE Buffer = NULL;
+    if (!Filled)
+    {
+        CmnError("Failed to allocate lazy mapping state: %s", strerror(errno));
+    }
+
+    while (TRUE)
+    {
+        struct pollfd Descriptors[2] = {{Mapping->FaultDescriptor, POLLIN, 0}, {Mapping->StopDescriptor, POLLIN, 0}};
+        if (poll(Descriptors, PURPL_ARRAYSIZE(Descriptors), -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            CmnError("Failed to wait for page faults: %s", strerror(errno));
+        }
+        if (Descriptors[1].revents)
+        {
+            break;
+        }
+
+        struct uffd_msg Message = {0};
+        if (read(Mapping->FaultDescriptor, &Message, sizeof(Message)) != sizeof(Message) ||
+            Message.event != UFFD_EVENT_PAGEFAULT)
+        {
+            continue;
+        }
+
+        UINT64 Offset = Message.arg.pagefault.address - (UINT64)Mapping->Address;
+        UINT64 Chunk = Offset / Mapping->ChunkSize;
+        if (Filled[Chunk])
+        {
+            // Another thread touched the same chunk before it was filled, and only has to be woken up
+            struct uffdio_range Range = {0};
+            Range.start = Message.arg.pagefault.address & ~(UINT64)(sysconf(_SC_PAGESIZE) - 1);
+            Range.len = sysconf(_SC_PAGESIZE);
+            ioctl(Mapping->FaultDescriptor, UFFDIO_WAKE, &Range);
+            continue;
+        }
+
+        // Like an I/O error in a mapped file, there's no way to tell the code that touched the memory
+        if (!FillChunk(Mapping, Offset, &Buffer))
+        {
+            CmnError("Failed to fill lazy mapping at offset %llu", Offset);
+        }
+
+        Filled[Chunk] = TRUE;
+        if (++FilledCount == ChunkCount)
+        {
+            munmap(Buffer, Mapping->ChunkSize);
+            Buffer = NULL;
+        }
+    }
+
+    if (Buffer)
+    {
+        munmap(Buffer, Mapping->ChunkSize);
+    }
+    CmnFree(Filled);
+
+    return 0;
+}
+#endif
+
+PPLAT_LAZY_MAPPING PlatCreateLazyMapping(_In_ UINT64 Size, _In_ UINT64 ChunkSize, _In_ PFN_PLAT_LAZY_FILL Fill,
+                                         _In_opt_ PVOID UserData)
+{
+#ifdef PURPL_LINUX
+    UINT64 PageSize = sysconf(_SC_PAGESIZE);
+    if (Size == 0 || ChunkSize % PageSize != 0)
+    {
+        LogError("Invalid lazy mapping size %llu or chunk size %llu", Size, ChunkSize);
+        return NULL;
+    }
+
+    PPLAT_LAZY_MAPPING Mapping = CmnAllocType(1, struct PLAT_LAZY_MAPPING);
+    if (!Mapping)
+    {
+        LogError("Failed to allocate lazy mapping: %s", strerror(errno));
+        return NULL;
+    }
+
+    Mapping->Size = Size;
+    Mapping->MappedSize = (Size + PageSize - 1) / PageSize * PageSize;
+    Mapping->ChunkSize = ChunkSize ? ChunkSize : Mapping->MappedSize;
+    Mapping->Fill = Fill;
+    Mapping->UserData = UserData;
+    Mapping->Address = MAP_FAILED;
+    Mapping->StopDescriptor = -1;
+
+    // Handling faults from the kernel too needs CAP_SYS_PTRACE or vm.unprivileged_userfaultfd
+    Mapping->FaultDescriptor = (INT)syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+#ifdef UFFD_USER_MODE_ONLY
+    if (Mapping->FaultDescriptor < 0 && errno == EPERM)
+    {
+        LogDebug("Only handling page faults from user mode in lazy mappings");
+        Mapping->FaultDescriptor = (INT)syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+    }
+#endif
+    if (Mapping->FaultDescriptor < 0)
+    {
+        LogWarning("Failed to create userfaultfd: %s", strerror(errno));
+        PlatDestroyLazyMapping(Mapping);
+        return NULL;
+    }
+
+    struct uffdio_api Api = {0};
+    Api.api = UFFD_API;
+    if (ioctl(Mapping->FaultDescriptor, UFFDIO_API, &Api) < 0)
+    {
+        LogWarning("Failed to enable userfaultfd API: %s", strerror(errno));
+        PlatDestroyLazyMapping(Mapping);
+        return NULL;
+    }
+
+    Mapping->Address =
+        mmap(NULL, Mapping->MappedSize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (Mapping->Address == MAP_FAILED)
+    {
+        LogError("Failed to reserve %llu bytes for lazy mapping: %s", Mapping->MappedSize, strerror(errno));
+        PlatDestroyLazyMapping(Mapping);
+        return NULL;
+    }
+
+    struct uffdio_register Register = {0};
+    Register.range.start = (UINT64)Mapping->Address;
+    Register.range.len = Mapping->MappedSize;
+    Register.mode = UFFDIO_REGISTER_MODE_MISSING;
+    if (ioctl(Mapping->FaultDescriptor, UFFDIO_REGISTER, &Register) < 0)
+    {
+        LogError("Failed to register lazy mapping with userfaultfd: %s", strerror(errno));
+        PlatDestroyLazyMapping(Mapping);
+        return NULL;
+    }
+
+    Mapping->StopDescriptor = eventfd(0, EFD_CLOEXEC);
+    if (Mapping->StopDescriptor < 0)
+    {
+        LogError("Failed to create eventfd: %s", strerror(errno));
+        PlatDestroyLazyMapping(Mapping);
+        return NULL;
+    }
+
+    Mapping->Thread = AsCreateThread("lazy mapping", PLAT_LAZY_MAPPING_STACK_SIZE, LazyMappingThread, Mapping);
+    if (!Mapping->Thread)
+    {
+        LogError("Failed to create lazy mapping thread");
+        PlatDestroyLazyMapping(Mapping);
+        return NULL;
+    }
+    AsResumeThread(Mapping->Thread);
+
+    return Mapping;
+#else
+    UNREFERENCED_PARAMETER(Size);
+    UNREFERENCED_PARAMETER(ChunkSize);
+    UNREFERENCED_PARAMETER(Fill);
+    UNREFERENCED_PARAMETER(UserData);
+    return NULL;
+#endif
+}
+
+PVOID PlatGetLazyMappingAddress(_In_ PPLAT_LAZY_MAPPING Mapping)
+{
+#ifdef PURPL_LINUX
+    return Mapping->Address;
+#else
+    UNREFERENCED_PARAMETER(Mapping);
+    return NULL;
+#endif
+}
+
+VOID PlatDestroyLazyMapping(_In_opt_ PPLAT_LAZY_MAPPING Mapping)
+{
+#ifdef PURPL_LINUX
+    if (!Mapping)
+    {
+        return;
+    }
+
+    if (Mapping->Thread)
+    {
+        UINT64 Value = 1;
+        INT64 Written;
+        do
+        {
+            Written = write(Mapping->StopDescriptor, &Value, sizeof(Value));
+        } while (Written < 0 && errno == EINTR);
+        if (Written != sizeof(Value))
+        {
+            // The thread would never stop, so joining it would hang, and it still uses the mapping
+            LogError("Failed to stop lazy mapping thread, leaking the mapping: %s", strerror(errno));
+            return;
+        }
+        AsJoinThread(Mapping->Thread);
+    }
+    if (Mapping->StopDescriptor >= 0)
+    {
+        close(Mapping->StopDescriptor);
+    }
+    if (Mapping->FaultDescriptor >= 0)
+    {
+        close(Mapping->FaultDescriptor);
+    }
+    if (Mapping->Address != MAP_FAILED)
+    {
+        munmap(Mapping->Address, Mapping->MappedSize);
+    }
+    CmnFree(Mapping);
+#else
+    UNREFERENCED_PARAMETER(Mapping);
+#endif
+}
@@ -12,8 +12,11 @@ Abstract:
 
 --*/
 
+#define LOG_FILE_CHANNEL LogChannelAsync
+
 #include "common/alloc.h"
 #include "common/common.h"
+#include "common/compression.h"
 
 #include "platform/async.h"
 
@@ -23,6 +26,7 @@ static VOID ThreadEntry(_In_ PVOID Thread)
 {
     AsCurrentThread = Thread;
     AsCurrentThread->ReturnValue = AsCurrentThread->ThreadStart(AsCurrentThread->UserData);
+    CmnFreeCompressionContexts();
     ExitThread((DWORD)AsCurrentThread->ReturnValue);
 }
 
@@ -99,6 +103,16 @@ VOID AsResumeThread(_In_ PAS_THREAD Thread)
     ResumeThread(Thread->Handle);
 }
 
+VOID AsSetCurrentThreadPriority(_In_ AS_THREAD_PRIORITY Priority)
+{
+    if (!SetThreadPriority(GetCurrentThread(),
+                           Priority == AsThreadPriorityIdle ? THREAD_PRIORITY_IDLE : THREAD_PRIORITY_NORMAL))
+    {
+        DWORD Error = GetLastError();
+        LogWarning("Failed to set thread priority: error %d (0x%X)", Error, Error);
+    }
+}
+
 PAS_MUTEX AsCreateMutex(VOID)
 {
     return CreateMutexA(NULL, FALSE, NULL);
@@ -12,6 +12,8 @@ Abstract:
 
 --*/
 
+#define LOG_FILE_CHANNEL LogChannelPlatform
+
 #include "purpl/purpl.h"
 
 #ifdef PURPL_GDK
@@ -351,6 +353,22 @@ UINT64 PlatGetMilliseconds(VOID)
 #endif
 }
 
+UINT64 PlatGetNanoseconds(VOID)
+{
+    static LARGE_INTEGER Frequency;
+    LARGE_INTEGER Counter;
+
+    if (!Frequency.QuadPart)
+    {
+        QueryPerformanceFrequency(&Frequency);
+    }
+    QueryPerformanceCounter(&Counter);
+
+    // Split up so it doesn't overflow
+    return Counter.QuadPart / Frequency.QuadPart * 1000000000ull +
+           Counter.QuadPart % Frequency.QuadPart * 1000000000ull / Frequency.QuadPart;
+}
+
 VOID PlatSleep(_In_ UINT64 Duration)
 {
     Sleep((DWORD)Duration);
@@ -452,4 +470,172 @@ UINT64 PlatGetFileSize(_In_z_ PCSTR Path)
     return (UINT64)Size.QuadPart;
 }
 
+UINT32 PlatGetProcessorCount(VOID)
+{
+    SYSTEM_INFO SystemInfo = {};
+
+    GetSystemInfo(&SystemInfo);
+
+    return SystemInfo.dwNumberOfProcessors ? SystemInfo.dwNumberOfProcessors : 1;
+}
+
+struct PLAT_FILE
+{
+    HANDLE Handle;
+    BOOLEAN Direct; // Reads have to be aligned to PLAT_DIRECT_ALIGNMENT
+};
+
+// Offsets, sizes, and buffers of unbuffered reads have to be aligned to the sector size, which is at most this
+#define PLAT_DIRECT_ALIGNMENT 4096
+
+// Unaligned unbuffered reads go through a buffer of at most this size
+#define PLAT_DIRECT_BUFFER_SIZE 4194304
+
+static PPLAT_FILE OpenFile(_In_z_ PCSTR Path, _In_ DWORD Flags)
+{
+    HANDLE Handle = CreateFileA(Path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                                FILE_ATTRIBUTE_NORMAL | Flags, nullptr);
+    if (Handle == INVALID_HANDLE_VALUE)
+    {
+        DWORD Error = GetLastError();
+        LogError("Failed to open file %s: error %d (0x%X)", Path, Error, Error);
+        return nullptr;
+    }
+
+    PPLAT_FILE File = CmnAllocType(1, struct PLAT_FILE);
+    if (!File)
+    {
+        LogError("Failed to allocate file: %s", strerror(errno));
+        CloseHandle(Handle);
+        return nullptr;
+    }
+
+    File->Handle = Handle;
+    File->Direct = (Flags & FILE_FLAG_NO_BUFFERING) != 0;
+    return File;
+}
+
+PPLAT_FILE PlatOpenFile(_In_z_ PCSTR Path)
+{
+    return OpenFile(Path, 0);
+}
+
+PPLAT_FILE PlatOpenFileDirect(_In_z_ PCSTR Path)
+{
+    return OpenFile(Path, FILE_FLAG_NO_BUFFERING);
+}
+
+static BOOLEAN ReadAt(_In_ PPLAT_FILE File, _In_ UINT64 Offset, _Out_writes_bytes_(Size) PVOID Buffer, _In_ DWORD Size,
+                      _Out_ PDWORD Read)
+{
+    // The offset in the OVERLAPPED is used instead of the file pointer, so threads don't step on each other
+    OVERLAPPED Overlapped = {};
+    Overlapped.Offset = (DWORD)Offset;
+    Overlapped.OffsetHigh = (DWORD)(Offset >> 32);
+
+    *Read = 0;
+    return ReadFile(File->Handle, Buffer, Size, Read, &Overlapped) || GetLastError() == ERROR_HANDLE_EOF;
+}
+
+static BOOLEAN ReadDirect(_In_ PPLAT_FILE File, _In_ UINT64 Offset, _Out_writes_bytes_(Size) PVOID Buffer,
+                          _In_ UINT64 Size)
+{
+    UINT64 TotalRead = 0;
+    UINT64 Start = Offset & ~(UINT64)(PLAT_DIRECT_ALIGNMENT - 1);
+    UINT64 BufferSize = PURPL_MIN((Offset + Size - Start + PLAT_DIRECT_ALIGNMENT - 1) &
+                                      ~(UINT64)(PLAT_DIRECT_ALIGNMENT - 1),
+                                  PLAT_DIRECT_BUFFER_SIZE);
+    PBYTE AlignedBuffer = (PBYTE)CmnAlignedAlloc(PLAT_DIRECT_ALIGNMENT, BufferSize);
+    if (!AlignedBuffer)
+    {
+        LogError("Failed to allocate %llu byte direct read buffer: %s", BufferSize, strerror(errno));
+        return FALSE;
+    }
+
+    while (TotalRead < Size)
+    {
+        UINT64 Position = Offset + TotalRead;
+        UINT64 Skip = Position & (PLAT_DIRECT_ALIGNMENT - 1);
+        UINT64 ReadSize =
+            PURPL_MIN((Skip + Size - TotalRead + PLAT_DIRECT_ALIGNMENT - 1) & ~(UINT64)(PLAT_DIRECT_ALIGNMENT - 1),
+                      BufferSize);
+
+        // Reads that go past the end of the file come up short, which is fine as long as they cover what's needed
+        DWORD Read = 0;
+        if (!ReadAt(File, Position - Skip, AlignedBuffer, (DWORD)ReadSize, &Read) || Read <= Skip)
+        {
+            DWORD Error = GetLastError();
+            LogError("Failed to read %llu bytes at offset %llu: error %d (0x%X)", Size - TotalRead, Position, Error,
+                     Error);
+            CmnAlignedFree(AlignedBuffer);
+            return FALSE;
+        }
+
+        UINT64 Copied = PURPL_MIN(Read - Skip, Size - TotalRead);
+        memcpy((PBYTE)Buffer + TotalRead, AlignedBuffer + Skip, Copied);
+        TotalRead += Copied;
+    }
+
+    CmnAlignedFree(AlignedBuffer);
+    return TRUE;
+}
+
+BOOLEAN PlatReadFileAt(_In_ PPLAT_FILE File, _In_ UINT64 Offset, _Out_writes_bytes_(Size) PVOID Buffer,
+                       _In_ UINT64 Size)
+{
+    // Unbuffered reads that aren't aligned can't go straight into the buffer
+    if (File->Direct && ((Offset | Size | (UINT_PTR)Buffer) & (PLAT_DIRECT_ALIGNMENT - 1)))
+    {
+        return ReadDirect(File, Offset, Buffer, Size);
+    }
+
+    UINT64 TotalRead = 0;
+    while (TotalRead < Size)
+    {
+        DWORD Read = 0;
+        DWORD ToRead = (DWORD)PURPL_MIN(Size - TotalRead, 0x40000000);
+        if (!ReadAt(File, Offset + TotalRead, (PBYTE)Buffer + TotalRead, ToRead, &Read) || Read == 0)
+        {
+            DWORD Error = GetLastError();
+            LogError("Failed to read %llu bytes at offset %llu: error %d (0x%X)", Size - TotalRead,
+                     Offset + TotalRead, Error, Error);
+            return FALSE;
+        }
+        TotalRead += Read;
+    }
+
+    return TRUE;
+}
+
+VOID PlatCloseFile(_In_opt_ PPLAT_FILE File)
+{
+    if (File)
+    {
+        CloseHandle(File->Handle);
+        CmnFree(File);
+    }
+}
+
+PPLAT_LAZY_MAPPING PlatCreateLazyMapping(_In_ UINT64 Size, _In_ UINT64 ChunkSize, _In_ PFN_PLAT_LAZY_FILL Fill,
+                                         _In_opt_ PVOID UserData)
+{
+    // Not implemented, callers read the whole thing instead
+    UNREFERENCED_PARAMETER(Size);
+    UNREFERENCED_PARAMETER(ChunkSize);
+    UNREFERENCED_PARAMETER(Fill);
+    UNREFERENCED_PARAMETER(UserData);
+    return NULL;
+}
+
+PVOID PlatGetLazyMappingAddress(_In_ PPLAT_LAZY_MAPPING Mapping)
+{
+    UNREFERENCED_PARAMETER(Mapping);
+    return NULL;
+}
+
+VOID PlatDestroyLazyMapping(_In_opt_ PPLAT_LAZY_MAPPING Mapping)
+{
+    UNREFERENCED_PARAMETER(Mapping);
+}
+
 END_EXTERN_C
@@ -266,6 +266,14 @@ function setup_support(support_root, deps_root, use_mimalloc, directx, vulkan, o
     elseif is_mode("release") then
         add_defines("PURPL_RELEASE")
         add_defines('PURPL_BUILD_TYPE="Release"')
+        add_defines("LOG_MINIMUM_LEVEL=LogLevelInfo")
+    end
+
+    -- Log messages use __FILE__, this keeps it relative to the project without trimming it at runtime
+    if get_config("toolchain") == "msvc" then
+        add_cxflags("-d1trimfile:$(projectdir)\\", {force = true})
+    elseif not is_plat("ps3", "xbox360") then
+        add_cxflags("-fmacro-prefix-map=$(projectdir)/=", {force = true})
     end
 
     if is_plat("linux", "freebsd") then
@@ -430,6 +438,10 @@ function setup_support(support_root, deps_root, use_mimalloc, directx, vulkan, o
             add_files(path.join(deps_root, "zstd", "lib", "**", "*.S"))
         end
         remove_files(path.join(deps_root, "zstd", "lib", "legacy", "*.c"))
+        -- Pack files use worker threads to compress large entries
+        if is_plat("windows", "gdk", "gdkx", "linux", "freebsd") then
+            add_defines("ZSTD_MULTITHREAD")
+        end
         set_warnings("none")
         set_group("External")
         on_load(fix_target)
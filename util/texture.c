@@ -14,6 +14,8 @@ Abstract:
 
 #include "texture.h"
 
+#include "common/compression.h"
+
 static UINT8 FormatComponents[TextureFormatCount] = {
     0, // TextureFormatUndefined
     1, // TextureFormatDepth
@@ -149,7 +151,7 @@ Return Value:
     memcpy(RealTexture, Texture, sizeof(TEXTURE));
     RealTexture->DataSeparate = FALSE;
     RealTexture->Pixels = (PBYTE)RealTexture + sizeof(TEXTURE);
-    if (ZSTD_decompress(RealTexture->Pixels, GetTextureSize(*Texture), Data, Texture->CompressedSize) !=
+    if (CmnDecompress(RealTexture->Pixels, GetTextureSize(*Texture), Data, Texture->CompressedSize) !=
         GetTextureSize(*Texture))
     {
         LogError("Decompressed pixels are not the expected size");
@@ -202,8 +204,8 @@ Return Value:
     }
 
     LogDebug("Compressing texture");
-    Texture->CompressedSize = ZSTD_compress(Data, ZSTD_COMPRESSBOUND(GetTextureSize(*Texture)), Texture->Pixels,
-                                            GetTextureSize(*Texture), ZSTD_btultra2);
+    Texture->CompressedSize = CmnCompress(Data, ZSTD_COMPRESSBOUND(GetTextureSize(*Texture)), Texture->Pixels,
+                                          GetTextureSize(*Texture), ZSTD_btultra2);
     if (ZSTD_isError(Texture->CompressedSize))
     {
         LogError("Failed to compress texture");